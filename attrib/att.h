@@ -86,6 +86,7 @@
 
 #define ATT_CID					4
 #define ATT_PSM					31
+#define EATT_PSM				39
 
 /* Flags for Execute Write Request Operation */
 #define ATT_CANCEL_ALL_PREP_WRITES		0x00
@@ -0,0 +1,277 @@
+/*-*- mode: c; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+**
+**  Author: Dirk-Jan C. Binnema <dirk@morseproject.com>
+**
+** Copyright (c) 2013 Morse Project. All rights reserved.
+**
+** @file
+*/
+
+/*
+ * framing of ARC blurbs; this only needs glib, so the unit tests can
+ * use it without the rest of the profile
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+
+#include "arc.h"
+
+void
+arc_blurb_append_id (GByteArray *buf, guint32 reqid)
+{
+	char	hdr[16];
+	int	len;
+
+	g_return_if_fail (buf);
+
+	if (reqid == 0)
+		return;
+
+	len = snprintf (hdr, sizeof(hdr), "%c%u:", ARC_GATT_BLURB_ID, reqid);
+	g_byte_array_append (buf, (const guint8*)hdr, len);
+}
+
+int
+arc_blurb_parse_id (const guint8 *data, gsize len, guint32 *reqid)
+{
+	guint64	val;
+	gsize	u;
+
+	g_return_val_if_fail (reqid, -1);
+
+	*reqid = 0;
+
+	if (len == 0 || data[0] != ARC_GATT_BLURB_ID)
+		return 0;
+
+	for (u = 1, val = 0; u != len && g_ascii_isdigit (data[u]); ++u) {
+		val = val * 10 + (data[u] - '0');
+		if (val > G_MAXUINT32)
+			return -1;
+	}
+
+	if (u == 1 || u == len || data[u] != ':' || val == 0)
+		return -1;
+
+	*reqid = (guint32)val;
+
+	return u + 1;
+}
+
+
+
+
+/*
+ * a small LZ77-style codec for ARC payloads, which tend to repeat
+ * themselves; a control byte c < 0x80 is followed by c + 1 literal
+ * bytes, while c >= 0x80 copies (c & 0x7f) + 3 bytes from earlier
+ * output, at the 16-bit little-endian distance that follows
+ */
+#define ARC_LZ_MIN_MATCH	3
+#define ARC_LZ_MAX_MATCH	(0x7f + ARC_LZ_MIN_MATCH)
+#define ARC_LZ_MAX_LITERALS	0x80
+#define ARC_LZ_MAX_DISTANCE	G_MAXUINT16
+#define ARC_LZ_HASH_BITS	12
+
+static guint
+lz_hash (const guint8 *data)
+{
+	guint32 val;
+
+	val = data[0] | data[1] << 8 | data[2] << 16;
+
+	return (val * 2654435761U) >> (32 - ARC_LZ_HASH_BITS);
+}
+
+static void
+lz_literals (GByteArray *out, const guint8 *data, gsize len)
+{
+	while (len > 0) {
+		guint8 n, ctl;
+
+		n   = MIN (len, ARC_LZ_MAX_LITERALS);
+		ctl = n - 1;
+		g_byte_array_append (out, &ctl, 1);
+		g_byte_array_append (out, data, n);
+
+		data += n;
+		len  -= n;
+	}
+}
+
+GByteArray*
+arc_compress (const guint8 *data, gsize len)
+{
+	GByteArray	*out;
+	gsize		*table; /* position + 1 of the last 3-byte match */
+	gsize		 pos, lit;
+
+	out   = g_byte_array_sized_new (len + len / ARC_LZ_MAX_LITERALS + 1);
+	table = g_new0 (gsize, 1 << ARC_LZ_HASH_BITS);
+
+	for (pos = lit = 0; pos + ARC_LZ_MIN_MATCH <= len;) {
+
+		gsize	cand, mlen;
+		guint	h;
+		guint8	ctl[3];
+
+		h	 = lz_hash (data + pos);
+		cand	 = table[h];
+		table[h] = pos + 1;
+
+		if (cand == 0 || pos - (cand - 1) > ARC_LZ_MAX_DISTANCE ||
+		    memcmp (data + cand - 1, data + pos,
+			    ARC_LZ_MIN_MATCH) != 0) {
+			++pos;
+			continue;
+		}
+
+		--cand;
+		for (mlen = ARC_LZ_MIN_MATCH;
+		     pos + mlen < len && mlen < ARC_LZ_MAX_MATCH &&
+			     data[cand + mlen] == data[pos + mlen]; ++mlen)
+			;
+
+		lz_literals (out, data + lit, pos - lit);
+
+		ctl[0] = 0x80 | (mlen - ARC_LZ_MIN_MATCH);
+		ctl[1] = (pos - cand) & 0xff;
+		ctl[2] = (pos - cand) >> 8;
+		g_byte_array_append (out, ctl, sizeof(ctl));
+
+		pos += mlen;
+		lit  = pos;
+	}
+
+	lz_literals (out, data + lit, len - lit);
+	g_free (table);
+
+	return out;
+}
+
+GByteArray*
+arc_decompress (const guint8 *data, gsize len, gsize maxlen)
+{
+	GByteArray	*out;
+	gsize		 pos;
+
+	out = g_byte_array_new ();
+
+	for (pos = 0; pos != len;) {
+
+		guint8	ctl;
+		gsize	n, dist;
+
+		ctl = data[pos++];
+
+		if (ctl < 0x80) {
+			n = ctl + 1;
+			if (n > len - pos || out->len + n > maxlen)
+				goto fail;
+
+			g_byte_array_append (out, data + pos, n);
+			pos += n;
+			continue;
+		}
+
+		n = (ctl & 0x7f) + ARC_LZ_MIN_MATCH;
+		if (len - pos < 2 || out->len + n > maxlen)
+			goto fail;
+
+		dist = data[pos] | data[pos + 1] << 8;
+		pos += 2;
+		if (dist == 0 || dist > out->len)
+			goto fail;
+
+		/* the source may overlap what we are writing */
+		while (n-- > 0) {
+			guint8 byte;
+
+			byte = out->data[out->len - dist];
+			g_byte_array_append (out, &byte, 1);
+		}
+	}
+
+	return out;
+
+fail:
+	g_byte_array_unref (out);
+	return NULL;
+}
+
+
+
+GByteArray*
+arc_blurb_frame (const guint8 *data, gsize len, guint8 mode)
+{
+	GByteArray	*frame, *packed;
+	const guint8	*payload;
+	gsize		 plen;
+	guint8		 hdr[ARC_BIN_HDR_LEN];
+
+	payload = data;
+	plen	= len;
+	packed	= NULL;
+	hdr[1]	= 0;
+
+	/* only send it compressed if that actually helps */
+	if ((mode & ARC_MODE_BINARY) && (mode & ARC_MODE_COMPRESS)) {
+		packed = arc_compress (data, len);
+		if (packed->len < len) {
+			payload = packed->data;
+			plen	= packed->len;
+			hdr[1] |= ARC_BIN_FLAG_COMPRESSED;
+		}
+	}
+
+	if ((mode & ARC_MODE_BINARY) && plen <= G_MAXUINT16) {
+		hdr[0] = ARC_GATT_BLURB_BIN;
+		hdr[2] = plen & 0xff;
+		hdr[3] = plen >> 8;
+
+		frame = g_byte_array_sized_new (sizeof(hdr) + plen);
+		g_byte_array_append (frame, hdr, sizeof(hdr));
+		g_byte_array_append (frame, payload, plen);
+	} else {
+		guint8 byte;
+
+		/* wrap in 0xfe <data> 0xff */
+		frame = g_byte_array_sized_new (len + 2);
+		byte = ARC_GATT_BLURB_PRE;
+		g_byte_array_append (frame, &byte, 1);
+		g_byte_array_append (frame, data, len);
+		byte = ARC_GATT_BLURB_POST;
+		g_byte_array_append (frame, &byte, 1);
+	}
+
+	if (packed)
+		g_byte_array_unref (packed);
+
+	return frame;
+}
+
+GByteArray*
+arc_blurb_unpack (guint8 flags, const guint8 *payload, gsize len,
+		  gsize maxlen)
+{
+	GByteArray *blurb;
+
+	if (flags & ~ARC_BIN_FLAG_COMPRESSED)
+		return NULL; /* something we don't know about */
+
+	if (flags & ARC_BIN_FLAG_COMPRESSED)
+		return arc_decompress (payload, len, maxlen);
+
+	if (len > maxlen)
+		return NULL;
+
+	blurb = g_byte_array_sized_new (len);
+	g_byte_array_append (blurb, payload, len);
+
+	return blurb;
+}
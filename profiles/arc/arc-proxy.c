@@ -9,6 +9,7 @@
 
 #include "config.h"
 #include <unistd.h>
+#include <errno.h>
 
 #include "lib/uuid.h"
 #include "src/plugin.h"
@@ -32,6 +33,16 @@
 
 #include "arc.h"
 
+/* maximum number of chunks handed to the ATT layer at once */
+#define ARC_WRITE_MAX_PENDING 8
+
+/* maximum size of a (decompressed) notified value */
+#define ARC_RX_MAXLEN (64 * 1024)
+
+/* seconds a Call() waits for its result; servers without request-ids
+ * never send one */
+#define ARC_CALL_TIMEOUT 30
+
 /* ARCProxys contain device-specific data */
 typedef struct {
 
@@ -44,15 +55,50 @@ typedef struct {
 	uint16_t	handles[ARC_ID_NUM];
 	uint16_t	val_handles[ARC_ID_NUM];
 	uint16_t	ccc_handles[ARC_ID_NUM];
+	uint8_t		props[ARC_ID_NUM];
 
 	int             not_ids[ARC_ID_NUM]; /* notifications */
 
+	/* frames being reassembled from notifications */
+	GByteArray	*rx[ARC_ID_NUM];
+	guint8		 rx_seq[ARC_ID_NUM];
+	gboolean	 rx_active[ARC_ID_NUM];
+	gboolean	 rx_binary[ARC_ID_NUM];
+
+	guint8		 mode; /* ARC_MODE_*, as acknowledged by the server */
+
 	int	 attio_id;
 	GAttrib *attrib;
+
+	GQueue	*writes; /* ARCWrites; the head is in progress */
+
+	/* outstanding Call()s */
+	GHashTable	*calls; /* request-id => ARCCall */
+	guint32		 last_reqid;
 } ARCProxy;
 
+typedef struct {
+	ARCProxy	*aproxy;
+	guint32		 reqid;
+	DBusMessage	*msg;
+	guint		 timeout_id;
+} ARCCall;
+
 static GSList *ARC_BLOBS = NULL;
 
+typedef struct _ARCWrite ARCWrite;
+
+/* called when a chunked write has completed or failed */
+typedef void (*ARCWriteFunc) (ARCProxy *aproxy, ARCID id, gboolean success,
+			      gpointer user_data);
+
+static void arc_write_abort_all (ARCProxy *aproxy);
+static void arc_proxy_call_done (ARCProxy *aproxy, guint32 reqid,
+				 const guint8 *data, gsize len);
+static void arc_proxy_fail_calls (ARCProxy *aproxy);
+static void arc_call_free (ARCCall *call);
+static void arc_proxy_negotiate (ARCProxy *aproxy);
+
 
 static ARCProxy*
 find_arc_blob (struct btd_device *device)
@@ -224,19 +270,164 @@ on_notify_target (const uint8_t *pdu, uint16_t len, ARCProxy *aproxy)
 
 
 
+/*
+ * the server streams Event and Result as notifications, each carrying
+ * a header byte followed by the next piece of the framed value; the
+ * header is ARC_NOTIFY_FIRST for the first piece of a frame, and a
+ * wrapping sequence number for the rest. A gap means a chunk was lost,
+ * in which case the rest of that frame is dropped
+ */
 static void
-on_notify_event (const uint8_t *pdu, uint16_t len, ARCProxy *aproxy)
+arc_proxy_rx_done (ARCProxy *aproxy, ARCID id)
 {
-	DBG ("%s", __FUNCTION__);
+	GByteArray	*rx;
 
-	g_free (aproxy->values[ARC_EVENT_ID]);
-	aproxy->values[ARC_EVENT_ID] = g_strndup ((const char*)pdu + 1, len - 1);
+	guint32		 reqid;
+	int		 hdrlen;
+
+	rx = aproxy->rx[id];
+	aproxy->rx_active[id] = FALSE;
+
+	/* the server acknowledges the framing mode we asked for */
+	if (id == ARC_RESULT_ID && rx->len == 2 &&
+	    rx->data[0] == ARC_GATT_BLURB_MODE) {
+		aproxy->mode = rx->data[1] & ARC_MODE_SUPPORTED;
+		DBG ("%s: mode 0x%02x", device_get_path (aproxy->device),
+		     aproxy->mode);
+		return;
+	}
+
+	hdrlen = arc_blurb_parse_id (rx->data, rx->len, &reqid);
+	if (hdrlen < 0) {
+		error ("%s: malformed request-id", arc_id_to_prop (id));
+		return;
+	}
+
+	/* the result for one of our calls */
+	if (reqid != 0) {
+		arc_proxy_call_done (aproxy, reqid, rx->data + hdrlen,
+				     rx->len - hdrlen);
+		return;
+	}
+
+	if (!g_utf8_validate ((const char*)rx->data, rx->len, NULL)) {
+		error ("%s: not valid utf8", arc_id_to_prop (id));
+		return;
+	}
+
+	g_free (aproxy->values[id]);
+	aproxy->values[id] = g_strndup ((const char*)rx->data, rx->len);
 
-	/* tell DBus we got an event result */
 	g_dbus_emit_property_changed (btd_get_dbus_connection (),
 				      device_get_path (aproxy->device),
 				      ARC_PROXY_IFACE,
-				      "Event");
+				      arc_id_to_prop (id));
+}
+
+/*
+ * a binary frame is 0xfc <flags> <16-bit little-endian length>
+ * <payload>; it is complete once we have the length's worth
+ */
+static void
+arc_proxy_rx_binary (ARCProxy *aproxy, ARCID id, const uint8_t *data,
+		     uint16_t len)
+{
+	GByteArray	*rx, *blurb;
+	guint		 plen;
+
+	rx = aproxy->rx[id];
+	g_byte_array_append (rx, data, len);
+
+	if (rx->len < ARC_BIN_HDR_LEN)
+		return;
+
+	plen = rx->data[2] | (rx->data[3] << 8);
+	if (rx->len < ARC_BIN_HDR_LEN + plen)
+		return;
+
+	blurb = arc_blurb_unpack (rx->data[1], rx->data + ARC_BIN_HDR_LEN,
+				  plen, ARC_RX_MAXLEN);
+	if (!blurb) {
+		error ("%s: malformed binary frame", arc_id_to_prop (id));
+		aproxy->rx_active[id] = FALSE;
+		return;
+	}
+
+	g_byte_array_set_size (rx, 0);
+	g_byte_array_append (rx, blurb->data, blurb->len);
+	g_byte_array_unref (blurb);
+
+	arc_proxy_rx_done (aproxy, id);
+}
+
+static void
+arc_proxy_rx (ARCProxy *aproxy, ARCID id, const uint8_t *pdu, uint16_t len)
+{
+	GByteArray	*rx;
+	guint8		 seq;
+	guint16		 u;
+
+	/* opcode, handle, sequence number */
+	if (len < 4)
+		return;
+
+	rx  = aproxy->rx[id];
+	seq = pdu[3];
+
+	if (seq == ARC_NOTIFY_FIRST) {
+		g_byte_array_set_size (rx, 0);
+		aproxy->rx_active[id] = TRUE;
+		aproxy->rx_binary[id] = len > 4 &&
+			pdu[4] == ARC_GATT_BLURB_BIN;
+		seq = 0;
+	} else if (!aproxy->rx_active[id])
+		return; /* rest of a dropped frame */
+	else if (seq != ((aproxy->rx_seq[id] + 1) & ARC_NOTIFY_SEQ_MASK)) {
+		error ("%s: lost chunk (got %u, expected %u)",
+		       arc_id_to_prop (id), seq,
+		       (aproxy->rx_seq[id] + 1) & ARC_NOTIFY_SEQ_MASK);
+		aproxy->rx_active[id] = FALSE;
+		return;
+	}
+
+	aproxy->rx_seq[id] = seq;
+
+	if (aproxy->rx_binary[id]) {
+		arc_proxy_rx_binary (aproxy, id, pdu + 4, len - 4);
+		return;
+	}
+
+	for (u = 4; u != len; ++u) {
+		switch (pdu[u]) {
+		case ARC_GATT_BLURB_PRE:
+			g_byte_array_set_size (rx, 0);
+			break;
+		case ARC_GATT_BLURB_POST:
+			arc_proxy_rx_done (aproxy, id);
+			return;
+		default:
+			if (rx->len >= ARC_RX_MAXLEN) {
+				error ("%s: frame too large",
+				       arc_id_to_prop (id));
+				aproxy->rx_active[id] = FALSE;
+				return;
+			}
+			g_byte_array_append (rx, &pdu[u], 1);
+			break;
+		}
+	}
+}
+
+static void
+on_notify_event (const uint8_t *pdu, uint16_t len, ARCProxy *aproxy)
+{
+	arc_proxy_rx (aproxy, ARC_EVENT_ID, pdu, len);
+}
+
+static void
+on_notify_result (const uint8_t *pdu, uint16_t len, ARCProxy *aproxy)
+{
+	arc_proxy_rx (aproxy, ARC_RESULT_ID, pdu, len);
 }
 
 
@@ -272,6 +463,12 @@ on_ccc_written (guint8 status, const guint8 *pdu, guint16 len,
 					   ndata->func,
 					   ndata->aproxy,
 					   NULL);
+
+	/* the server acknowledges the mode with a notified result */
+	if (ndata->id == ARC_RESULT_ID &&
+	    ndata->aproxy->not_ids[ndata->id] > 0)
+		arc_proxy_negotiate (ndata->aproxy);
+
 	g_free (ndata);
 }
 
@@ -302,98 +499,70 @@ install_ccc (ARCProxy *aproxy, ARCID id, uint16_t bits,
 
 typedef struct {
 	char		uuid[MAX_LEN_UUID_STR + 1];
+	ARCID		id;
 	ARCProxy		*aproxy;
 } CharX; /* characteristic */
 
 
-/* static void */
-/* process_desc_ccc (CharX *chrx, uint16_t uuid, uint16_t handle) */
-/* { */
-/* 	uint8_t		 atval[2]; */
-/* 	uint16_t	 val; */
-/* 	char		*msg; */
-
-/* 	if (uuid != GATT_CLIENT_CHARAC_CFG_UUID) */
-/* 		return; */
-
-/* 	if (!chrx->uuid) */
-/* 		return; */
-
-/* 	if (g_ascii_strcasecmp (chrx->uuid, ARC_EVENT_UUID) == 0) { */
-
-/* 		chrx->aproxy->ccc_handles[ARC_EVENT_ID] = handle; */
-/* 		install_ccc (chrx->aproxy, ARC_EVENT_ID, */
-/* 			     GATT_CLIENT_CHARAC_CFG_NOTIF_BIT, */
-/* 			     (GAttribNotifyFunc)on_notify_event); */
-
-/* 	}  else if (g_ascii_strcasecmp (chrx->uuid, ARC_TARGET_UUID) == 0) { */
+static void
+process_desc_ccc (CharX *chrx, uint16_t uuid, uint16_t handle)
+{
+	ARCProxy		*aproxy;
+	GAttribNotifyFunc	 func;
 
-/* 		chrx->aproxy->ccc_handles[ARC_TARGET_ID] = handle; */
-/* 		install_ccc (chrx->aproxy, ARC_TARGET_ID, */
-/* 			     GATT_CLIENT_CHARAC_CFG_NOTIF_BIT, */
-/* 			     (GAttribNotifyFunc)on_notify_target); */
-/* 	} */
-/* } */
+	if (uuid != GATT_CLIENT_CHARAC_CFG_UUID)
+		return;
 
+	aproxy = chrx->aproxy;
+	if (!(aproxy->props[chrx->id] & GATT_CHR_PROP_NOTIFY))
+		return;
 
-static void
-on_write_gatt (guint8 status, const guint8 *pdu, guint16 len,
-	       gpointer user_data)
-{
-	if (status != 0)
-		error("failure writing %s to gatt: %s",
-		      user_data ? (char*)user_data : "\b",
-		      att_ecode2str (status));
+	switch (chrx->id) {
+	case ARC_EVENT_ID:
+		func = (GAttribNotifyFunc)on_notify_event;
+		break;
+	case ARC_RESULT_ID:
+		func = (GAttribNotifyFunc)on_notify_result;
+		break;
+	default:
+		return;
+	}
 
-	DBG ("written %u byte(s) to gatt", len);
+	aproxy->ccc_handles[chrx->id] = handle;
+	install_ccc (aproxy, chrx->id, GATT_CLIENT_CHARAC_CFG_NOTIF_BIT, func);
 }
 
 
 static void
-on_discover_desc (guint8 status, const guint8 *pdu, guint16 len,
-		  CharX *chrx)
+on_discover_desc (guint8 status, GSList *descs, CharX *chrx)
 {
-	struct att_data_list	*dlst;
-	uint8_t			 frm;
-	int			 i;
-
-	dlst = NULL;
+	GSList *cur;
 
 	if (status != 0) {
 		error("char disco failed for %s: %s",
 		      chrx->uuid, att_ecode2str(status));
-		return;
-	}
-
-	dlst = dec_find_info_resp (pdu, len, &frm);
-	if (!dlst)
-		return;
-
-	if (frm != ATT_FIND_INFO_RESP_FMT_16BIT) {
-		if (dlst)
-			att_data_list_free(dlst);
-		return;
+		goto leave;
 	}
 
-	for (i = 0; i < dlst->num; ++i) {
+	/* the proxy may have disconnected in the meantime */
+	if (!chrx->aproxy->attrib)
+		goto leave;
 
-		uint8_t		*val;
-		uint16_t	 handle, uuid;
+	for (cur = descs; cur; cur = g_slist_next (cur)) {
 
-		val    = dlst->data[i];
-		handle = get_le16 (val);
-		uuid   = get_le16 (val + 2);
+		struct gatt_desc *desc;
 
-		/* process_desc_ccc (chrx, uuid, handle); */
+		desc = (struct gatt_desc*)cur->data;
+		process_desc_ccc (chrx, desc->uuid16, desc->handle);
 	}
 
-	if (dlst)
-		att_data_list_free(dlst);
+leave:
+	g_free (chrx);
 }
 
 
 static void
-desc_char_disco (ARCProxy *aproxy, struct gatt_char *chr,
+desc_char_disco (ARCProxy *aproxy, struct gatt_char *chr, ARCID id,
 		 uint16_t start, uint16_t end)
 {
 	CharX	*chrx;
@@ -403,15 +572,13 @@ desc_char_disco (ARCProxy *aproxy, struct gatt_char *chr,
 
 	chrx	    = g_new0 (CharX, 1);
 	chrx->aproxy = aproxy;
+	chrx->id     = id;
 	memcpy(chrx->uuid, chr->uuid, sizeof(chr->uuid));
 
-	gatt_discover_desc (
-		aproxy->attrib,
-		start, end, NULL,
-		(GAttribResultFunc)on_discover_desc,
-		chrx);
-
-	g_free(chrx);
+	/* chrx is freed in on_discover_desc */
+	if (gatt_discover_desc (aproxy->attrib, start, end, NULL,
+				(gatt_cb_t)on_discover_desc, chrx) == 0)
+		g_free (chrx);
 }
 
 
@@ -432,17 +599,21 @@ process_chr (ARCProxy *aproxy, struct gatt_char *chr, uint16_t start,
 
 		aproxy->handles[ARC_RESULT_ID]	  = chr->handle;
 		aproxy->val_handles[ARC_RESULT_ID] = chr->value_handle;
+		aproxy->props[ARC_RESULT_ID]	   = chr->properties;
+		desc_char_disco (aproxy, chr, ARC_RESULT_ID, start, end);
 
 	} else if (g_ascii_strcasecmp (chr->uuid, ARC_REQUEST_UUID) == 0) {
 
 		aproxy->handles[ARC_REQUEST_ID]	   = chr->handle;
 		aproxy->val_handles[ARC_REQUEST_ID] = chr->value_handle;
+		aproxy->props[ARC_REQUEST_ID]	    = chr->properties;
 
 	} else if (g_ascii_strcasecmp (chr->uuid, ARC_EVENT_UUID) == 0) {
 
 		aproxy->handles[ARC_EVENT_ID]	 = chr->handle;
 		aproxy->val_handles[ARC_EVENT_ID] = chr->value_handle;
-		desc_char_disco (aproxy, chr, start, end);
+		aproxy->props[ARC_EVENT_ID]	  = chr->properties;
+		desc_char_disco (aproxy, chr, ARC_EVENT_ID, start, end);
 
 
 	/* } else if (g_ascii_strcasecmp (chr->uuid, ARC_TARGET_UUID) == 0) { */
@@ -458,7 +629,7 @@ process_chr (ARCProxy *aproxy, struct gatt_char *chr, uint16_t start,
 
 
 static void
-on_discover (GSList *chrs, guint8 status, ARCProxy *aproxy)
+on_discover (guint8 status, GSList *chrs, ARCProxy *aproxy)
 {
 	GSList *cur;
 
@@ -517,6 +688,7 @@ on_attio_connected (GAttrib *attrib, ARCProxy *aproxy)
 static void
 on_attio_disconnected (ARCProxy *aproxy)
 {
+	GAttrib	*attrib;
 	unsigned u;
 
 	if (aproxy->attio_id > 0) {
@@ -527,11 +699,19 @@ on_attio_disconnected (ARCProxy *aproxy)
 	for (u = 0; u != ARC_ID_NUM; ++u) {
 		if (aproxy->not_ids[u] > 0)
 			g_attrib_unregister(aproxy->attrib, aproxy->not_ids[u]);
-		aproxy->not_ids[u] = 0;
+		aproxy->not_ids[u]   = 0;
+		aproxy->rx_active[u] = FALSE;
 	}
 
-	g_attrib_unref (aproxy->attrib);
+	/* negotiated again on the next connection */
+	aproxy->mode = 0;
+
+	attrib	       = aproxy->attrib;
 	aproxy->attrib = NULL;
+
+	arc_write_abort_all (aproxy);
+	arc_proxy_fail_calls (aproxy);
+	g_attrib_unref (attrib);
 }
 
 
@@ -540,6 +720,7 @@ arc_blob_new (struct btd_device *device)
 {
 	ARCProxy			*aproxy;
 	struct gatt_primary	*primary;
+	unsigned		 u;
 
 	primary = btd_device_get_primary (device, ARC_SERVICE_UUID);
 	if (!primary)
@@ -555,6 +736,14 @@ arc_blob_new (struct btd_device *device)
 	aproxy->svc_range->start = primary->range.start;
 	aproxy->svc_range->end	= primary->range.end;
 
+	aproxy->writes = g_queue_new ();
+	aproxy->calls  = g_hash_table_new_full (
+		g_direct_hash, g_direct_equal,
+		NULL, (GDestroyNotify)arc_call_free);
+
+	for (u = 0; u != ARC_ID_NUM; ++u)
+		aproxy->rx[u] = g_byte_array_new ();
+
 	aproxy->attio_id = btd_device_add_attio_callback (
 		device,
 		(attio_connect_cb)on_attio_connected,
@@ -570,6 +759,7 @@ arc_blob_new (struct btd_device *device)
 static void
 arc_blob_destroy (ARCProxy *aproxy)
 {
+	GAttrib	*attrib;
 	unsigned u;
 
 	if (!aproxy)
@@ -584,65 +774,345 @@ arc_blob_destroy (ARCProxy *aproxy)
 	btd_device_unref (aproxy->device);
 	btd_adapter_unref (aproxy->adapter);
 
-	if (aproxy->attrib)
-		g_attrib_unref (aproxy->attrib);
+	attrib	       = aproxy->attrib;
+	aproxy->attrib = NULL;
 
-	for (u = 0; u != ARC_ID_NUM; ++u)
+	arc_write_abort_all (aproxy);
+	g_queue_free (aproxy->writes);
+
+	arc_proxy_fail_calls (aproxy);
+	g_hash_table_destroy (aproxy->calls);
+
+	if (attrib)
+		g_attrib_unref (attrib);
+
+	for (u = 0; u != ARC_ID_NUM; ++u) {
 		g_free(aproxy->values[u]);
+		g_byte_array_unref (aproxy->rx[u]);
+	}
 
 	g_free (aproxy);
 }
 
 
 
-static int
-chunked_gatt_write (ARCProxy *aproxy, const char* str, ARCID id)
+typedef enum {
+	ARC_WRITE_CMD,	/* write without response */
+	ARC_WRITE_REQ,	/* a single write request */
+	ARC_WRITE_PREP	/* prepared writes, then execute */
+} ARCWriteMode;
+
+/*
+ * a framed payload being written to one of the characteristics; the
+ * chunks follow the negotiated MTU, and up to ARC_WRITE_MAX_PENDING of
+ * them are handed to the ATT layer at once
+ */
+struct _ARCWrite {
+	ARCProxy	*aproxy; /* NULL once aborted */
+	ARCID		 id;
+	ARCWriteMode	 mode;
+	GByteArray	*bytes;
+	guint		 pos;
+	guint		 pending;
+	gboolean	 executing;
+	gboolean	 failed;
+	ARCWriteFunc	 func;
+	gpointer	 user_data;
+};
+
+
+static void
+arc_write_free (ARCWrite *awrite)
+{
+	g_byte_array_unref (awrite->bytes);
+	g_free (awrite);
+}
+
+static void arc_write_pump (ARCWrite *awrite);
+
+static void
+arc_write_done (ARCWrite *awrite)
+{
+	ARCProxy *aproxy;
+	ARCWrite *next;
+
+	aproxy = awrite->aproxy;
+
+	DBG ("%s: %s %u byte(s) to %s", __FUNCTION__,
+	     awrite->failed ? "failed writing" : "written",
+	     awrite->bytes->len, arc_id_to_prop (awrite->id));
+
+	g_queue_pop_head (aproxy->writes);
+
+	if (awrite->func)
+		awrite->func (aproxy, awrite->id, !awrite->failed,
+			      awrite->user_data);
+
+	arc_write_free (awrite);
+
+	next = g_queue_peek_head (aproxy->writes);
+	if (next)
+		arc_write_pump (next);
+}
+
+
+static void
+on_write_rsp (guint8 status, const guint8 *pdu, guint16 len,
+	      gpointer user_data)
+{
+	ARCWrite *awrite;
+
+	awrite = (ARCWrite*)user_data;
+
+	if (status != 0) {
+		error("failure writing %s to gatt: %s",
+		      arc_id_to_prop (awrite->id), att_ecode2str (status));
+		awrite->failed = TRUE;
+	}
+}
+
+
+static void
+on_write_sent (gpointer user_data)
 {
-	const unsigned	 chunksize = 20;
-	GString		*gstr;
-	char		*s;
+	ARCWrite *awrite;
 
-	/* wrap in 0xfe <string> 0xff */
-	gstr = g_string_new (str);
-	g_string_prepend_c (gstr, 0xfe);
-	g_string_append_c (gstr, 0xff);
+	awrite = (ARCWrite*)user_data;
+	awrite->pending--;
 
-	/* send in bufsize blobs */
-	s   = gstr->str;
+	if (!awrite->aproxy) {
+		if (awrite->pending == 0)
+			arc_write_free (awrite);
+		return;
+	}
 
-	for (;;) {
-		size_t	size;
-		int	ret;
+	arc_write_pump (awrite);
+}
 
-		size = MIN(strlen(s), chunksize);
 
-		ret = gatt_write_char (
-			aproxy->attrib,
-			aproxy->val_handles[id],
-			(uint8_t*)s,
-			size,
-			(GAttribResultFunc)on_write_gatt,
-			"chunked");
+static gboolean
+arc_write_send (ARCWrite *awrite, uint8_t *buf, uint16_t plen)
+{
+	GAttribResultFunc func;
+
+	if (plen == 0)
+		return FALSE;
+
+	/* commands have no response; they are done once written out */
+	func = awrite->mode == ARC_WRITE_CMD ? NULL : on_write_rsp;
+
+	/* on_write_sent is called once the chunk is gone... */
+	awrite->pending++;
+
+	if (g_attrib_send (awrite->aproxy->attrib, 0, buf, plen, func,
+			   awrite, on_write_sent) != 0)
+		return TRUE;
+
+	/* ...but not when it could not be sent at all */
+	awrite->pending--;
+
+	return FALSE;
+}
+
 
-		if (ret == 0) {
-			error ("failed to write attrib");
+static void
+arc_write_pump (ARCWrite *awrite)
+{
+	ARCProxy	*aproxy;
+	uint8_t		*buf;
+	size_t		 buflen;
+	uint16_t	 handle, plen;
+
+	aproxy = awrite->aproxy;
+	handle = aproxy->val_handles[awrite->id];
+	buf    = g_attrib_get_buffer (aproxy->attrib, &buflen);
+
+	while (!awrite->failed && awrite->pos < awrite->bytes->len &&
+	       awrite->pending < ARC_WRITE_MAX_PENDING) {
+
+		const uint8_t	*val;
+		size_t		 size;
+
+		val  = awrite->bytes->data + awrite->pos;
+		size = awrite->bytes->len - awrite->pos;
+
+		switch (awrite->mode) {
+		case ARC_WRITE_CMD:
+			size = MIN (size, buflen - 3);
+			plen = enc_write_cmd (handle, val, size, buf, buflen);
+			break;
+		case ARC_WRITE_REQ:
+			plen = enc_write_req (handle, val, size, buf, buflen);
+			break;
+		case ARC_WRITE_PREP:
+		default:
+			size = MIN (size, buflen - 5);
+			plen = enc_prep_write_req (handle, awrite->pos, val,
+						   size, buf, buflen);
 			break;
 		}
 
-		DBG ("written chunk (%u octets)", size);
+		if (!arc_write_send (awrite, buf, plen)) {
+			error ("failed to write chunk of %s",
+			       arc_id_to_prop (awrite->id));
+			awrite->failed = TRUE;
+			break;
+		}
+
+		awrite->pos += size;
+	}
+
+	if (awrite->pending > 0)
+		return;
+
+	/* all prepared chunks are acknowledged; apply (or drop) them */
+	if (awrite->mode == ARC_WRITE_PREP && !awrite->executing &&
+	    awrite->pos > 0) {
+		awrite->executing = TRUE;
+		plen = enc_exec_write_req (awrite->failed ?
+					   ATT_CANCEL_ALL_PREP_WRITES :
+					   ATT_WRITE_ALL_PREP_WRITES,
+					   buf, buflen);
+		if (arc_write_send (awrite, buf, plen))
+			return;
+
+		awrite->failed = TRUE;
+		if (awrite->pending > 0)
+			return;
+	}
+
+	arc_write_done (awrite);
+}
+
+
+/*
+ * fail all queued writes; the ones that still have chunks in the ATT
+ * layer are freed once those are gone
+ */
+static void
+arc_write_abort_all (ARCProxy *aproxy)
+{
+	ARCWrite *awrite;
+
+	while ((awrite = g_queue_pop_head (aproxy->writes))) {
 
-		if (size < chunksize)
-			break; /* we're done */
+		if (awrite->func)
+			awrite->func (aproxy, awrite->id, FALSE,
+				      awrite->user_data);
 
-		s += size;
+		if (awrite->pending > 0)
+			awrite->aproxy = NULL;
+		else
+			arc_write_free (awrite);
 	}
+}
+
+
+static int
+chunked_gatt_write_blurb (ARCProxy *aproxy, const guint8 *blurb, gsize len,
+			  guint8 mode, ARCID id, ARCWriteFunc func,
+			  gpointer user_data)
+{
+	ARCWrite	*awrite;
+	size_t		 buflen;
 
-	g_string_free (gstr, TRUE);
+	if (!aproxy->attrib || aproxy->val_handles[id] == 0)
+		return -ENOTCONN;
+
+	awrite		  = g_new0 (ARCWrite, 1);
+	awrite->aproxy	  = aproxy;
+	awrite->id	  = id;
+	awrite->func	  = func;
+	awrite->user_data = user_data;
+	awrite->bytes	  = arc_blurb_frame (blurb, len, mode);
+
+	g_attrib_get_buffer (aproxy->attrib, &buflen);
+
+	if (aproxy->props[id] & GATT_CHR_PROP_WRITE_WITHOUT_RESP)
+		awrite->mode = ARC_WRITE_CMD;
+	else if (awrite->bytes->len <= buflen - 3)
+		awrite->mode = ARC_WRITE_REQ;
+	else
+		awrite->mode = ARC_WRITE_PREP;
+
+	/* prepared write offsets are 16 bits */
+	if (awrite->mode == ARC_WRITE_PREP && awrite->bytes->len > G_MAXUINT16) {
+		error ("%s: request too large (%u bytes)", __FUNCTION__,
+		       awrite->bytes->len);
+		arc_write_free (awrite);
+		return -EMSGSIZE;
+	}
+
+	DBG ("writing %u byte(s) to %s (mtu %u, mode %d)",
+	     awrite->bytes->len, arc_id_to_prop (id), (unsigned)buflen,
+	     awrite->mode);
+
+	/* writes are not interleaved; the peer reassembles the frame */
+	g_queue_push_tail (aproxy->writes, awrite);
+	if (g_queue_peek_head (aproxy->writes) == awrite)
+		arc_write_pump (awrite);
 
 	return 0;
 }
 
 
+static int
+chunked_gatt_write (ARCProxy *aproxy, const char* str, guint32 reqid,
+		    ARCID id, ARCWriteFunc func, gpointer user_data)
+{
+	GByteArray	*blurb;
+	int		 rv;
+
+	/* [request-id] <string>, framed as negotiated */
+	blurb = g_byte_array_sized_new (strlen (str) + 16);
+	arc_blurb_append_id (blurb, reqid);
+	g_byte_array_append (blurb, (const guint8*)str, strlen (str));
+
+	rv = chunked_gatt_write_blurb (aproxy, blurb->data, blurb->len,
+				       aproxy->mode, id, func, user_data);
+	g_byte_array_unref (blurb);
+
+	return rv;
+}
+
+
+/*
+ * ask for binary (compressed) frames; servers that do not know about
+ * them never answer, and we keep using text frames
+ */
+static void
+arc_proxy_negotiate (ARCProxy *aproxy)
+{
+	guint8 blurb[2];
+
+	blurb[0] = ARC_GATT_BLURB_MODE;
+	blurb[1] = ARC_MODE_BINARY | ARC_MODE_COMPRESS;
+
+	if (chunked_gatt_write_blurb (aproxy, blurb, sizeof(blurb), 0,
+				      ARC_REQUEST_ID, NULL, NULL) != 0)
+		DBG ("cannot negotiate mode");
+}
+
+
+static void
+on_request_written (ARCProxy *aproxy, ARCID id, gboolean success,
+		    gpointer user_data)
+{
+	GDBusPendingPropertySet pid;
+
+	pid = GPOINTER_TO_UINT (user_data);
+
+	if (!success) {
+		g_dbus_pending_property_error(
+			pid, ERROR_INTERFACE ".Failed",
+			"Failed to write request");
+		return;
+	}
+
+	g_dbus_pending_property_success (pid);
+}
+
+
 
 static void
 request_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
@@ -681,7 +1151,14 @@ request_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
 		/* 	(GAttribResultFunc)on_write_gatt, */
 		/* 	"request-id"); */
 
-		chunked_gatt_write (aproxy, req, ARC_REQUEST_ID);
+		if (chunked_gatt_write (aproxy, req, 0, ARC_REQUEST_ID,
+					on_request_written,
+					GUINT_TO_POINTER (id)) != 0) {
+			g_dbus_pending_property_error(
+				id, ERROR_INTERFACE ".Failed",
+				"Failed to write request");
+			return;
+		}
 
 		g_free (aproxy->values[ARC_REQUEST_ID]);
 		aproxy->values[ARC_REQUEST_ID] = g_strdup (req);
@@ -761,7 +1238,11 @@ property_get (const GDBusPropertyTable *property,
 		error ("%s: not valid utf8", __FUNCTION__);
 	}
 
-	DBG ("reading %d (0x%04f) from GATT", id,
+	/* notifications keep the value up to date */
+	if (aproxy->not_ids[id] > 0)
+		goto leave;
+
+	DBG ("reading %d (0x%04x) from GATT", id,
 	     aproxy->val_handles[id]);
 
 	/* schedule an update; this is for debugging */
@@ -772,7 +1253,7 @@ property_get (const GDBusPropertyTable *property,
 	if (rv == 0)
 		error ("reading gatt failed");
 
-
+leave:
 	dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &val);
 
 
@@ -811,6 +1292,160 @@ target_get  (const GDBusPropertyTable *property,
 
 
 
+/*
+ * calls carry a request-id, which the server puts in the result; so
+ * there can be any number of them outstanding, and their results can
+ * come back in any order. A call without a result after
+ * ARC_CALL_TIMEOUT seconds fails
+ */
+static void
+arc_call_free (ARCCall *call)
+{
+	if (call->timeout_id != 0)
+		g_source_remove (call->timeout_id);
+
+	dbus_message_unref (call->msg);
+	g_free (call);
+}
+
+
+static gboolean
+on_call_timeout (ARCCall *call)
+{
+	call->timeout_id = 0;
+
+	error ("no result for request %u", call->reqid);
+
+	g_dbus_send_message (btd_get_dbus_connection (),
+			     btd_error_failed (call->msg, "timed out"));
+	g_hash_table_remove (call->aproxy->calls,
+			     GUINT_TO_POINTER (call->reqid));
+
+	return FALSE;
+}
+
+
+static void
+arc_proxy_call_done (ARCProxy *aproxy, guint32 reqid, const guint8 *data,
+		     gsize len)
+{
+	ARCCall		*call;
+	DBusMessage	*msg, *reply;
+	char		*result;
+
+	call = g_hash_table_lookup (aproxy->calls, GUINT_TO_POINTER (reqid));
+	if (!call) {
+		DBG ("result for unknown request %u", reqid);
+		return;
+	}
+
+	msg = call->msg;
+
+	if (!g_utf8_validate ((const char*)data, len, NULL))
+		reply = btd_error_failed (msg, "result is not valid utf8");
+	else {
+		result = g_strndup ((const char*)data, len);
+		reply  = g_dbus_create_reply (msg,
+					      DBUS_TYPE_STRING, &result,
+					      DBUS_TYPE_INVALID);
+		g_free (result);
+	}
+
+	g_dbus_send_message (btd_get_dbus_connection (), reply);
+	g_hash_table_remove (aproxy->calls, GUINT_TO_POINTER (reqid));
+}
+
+
+static void
+arc_proxy_fail_calls (ARCProxy *aproxy)
+{
+	GHashTableIter	 iter;
+	ARCCall		*call;
+
+	g_hash_table_iter_init (&iter, aproxy->calls);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer)&call)) {
+		g_dbus_send_message (btd_get_dbus_connection (),
+				     btd_error_failed (call->msg,
+						       "disconnected"));
+		g_hash_table_iter_remove (&iter);
+	}
+}
+
+
+static void
+on_call_written (ARCProxy *aproxy, ARCID id, gboolean success,
+		 gpointer user_data)
+{
+	ARCCall *call;
+
+	if (success)
+		return; /* now, wait for the result */
+
+	call = g_hash_table_lookup (aproxy->calls, user_data);
+	if (!call)
+		return;
+
+	g_dbus_send_message (btd_get_dbus_connection (),
+			     btd_error_failed (call->msg,
+					       "failed to write request"));
+	g_hash_table_remove (aproxy->calls, user_data);
+}
+
+
+static DBusMessage*
+call_method (DBusConnection *conn, DBusMessage *msg, ARCProxy *aproxy)
+{
+	const char	*req;
+	guint32		 reqid;
+	ARCCall		*call;
+
+	if (!dbus_message_get_args (msg, NULL,
+				    DBUS_TYPE_STRING, &req,
+				    DBUS_TYPE_INVALID))
+		return btd_error_invalid_args (msg);
+
+	/* the results come as notifications */
+	if (!aproxy->attrib || aproxy->not_ids[ARC_RESULT_ID] == 0)
+		return btd_error_not_ready (msg);
+
+	/* 0 means 'no request-id' */
+	reqid = ++aproxy->last_reqid;
+	if (reqid == 0)
+		reqid = ++aproxy->last_reqid;
+
+	call		 = g_new0 (ARCCall, 1);
+	call->aproxy	 = aproxy;
+	call->reqid	 = reqid;
+	call->msg	 = dbus_message_ref (msg);
+	call->timeout_id = g_timeout_add_seconds (
+		ARC_CALL_TIMEOUT, (GSourceFunc)on_call_timeout, call);
+
+	g_hash_table_replace (aproxy->calls, GUINT_TO_POINTER (reqid), call);
+
+	DBG ("calling %u (%s)", reqid, device_get_path (aproxy->device));
+
+	if (chunked_gatt_write (aproxy, req, reqid, ARC_REQUEST_ID,
+				on_call_written,
+				GUINT_TO_POINTER (reqid)) != 0) {
+		g_hash_table_remove (aproxy->calls, GUINT_TO_POINTER (reqid));
+		return btd_error_failed (msg, "failed to write request");
+	}
+
+	return NULL;
+}
+
+
+static const GDBusMethodTable
+PROXY_METHODS[] = {
+	{ GDBUS_ASYNC_METHOD
+	  ("Call",
+	   GDBUS_ARGS({"Request", "s"}),  /* json blob (in) */
+	   GDBUS_ARGS({"Result", "s"}),   /* json blob (out) */
+	   (GDBusMethodFunction)call_method) },
+	{}
+};
+
+
 static const GDBusPropertyTable
 PROXY_PROPS[] = {
 	{ "Request", "s",
@@ -852,7 +1487,7 @@ arc_probe_proxy (struct btd_service *service)
 			btd_get_dbus_connection(),
 			device_get_path (device),
 			ARC_PROXY_IFACE,
-			NULL,
+			PROXY_METHODS,
 			NULL,
 			PROXY_PROPS,
 			aproxy,
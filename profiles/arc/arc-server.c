@@ -48,31 +48,77 @@
 #include "src/error.h"
 #include "src/uuid-helper.h"
 #include "src/storage.h"
-#include "attrib/gattrib.h"
-#include "attrib/att.h"
-#include "attrib/gatt.h"
-#include "src/attrib-server.h"
-#include "attrib/att-database.h"
-#include "attrib/gatt-service.h"
-#include "src/attio.h"
 #include "src/eir.h"
+#include "btio/btio.h"
+#include "src/shared/att.h"
+#include "src/shared/gatt-db.h"
+#include "src/shared/gatt-server.h"
+#include "src/gatt-database.h"
 
 #include "arc.h"
 
-#define CLIENT_TIMEOUT 100 /*seconds*/
+#define CLIENT_TIMEOUT 100 /*seconds of inactivity*/
+
+/* the default advertise/pause windows; 0 means the scheduler is off,
+ * and some external agent calls EnableAdvertising */
+#define ARC_ADV_WINDOW		0 /*msec*/
+#define ARC_PAUSE_WINDOW	0 /*msec*/
+
+/* the size of the chunks for reads; empirically derived */
+#define ARC_READ_MAXLEN 19
+
+/* memory for values being reassembled and per-connection values */
+#define ARC_CONN_MAX_BYTES	(64 * 1024)
+#define ARC_SERVER_MAX_BYTES	(512 * 1024)
 
 static GSList *ARC_SERVERS = NULL;
 
+/* what the scheduler has seen; times are in msec */
+typedef struct {
+	guint	 windows;		/* advertise windows so far */
+	guint	 connections;		/* clients that used ARC */
+	guint	 timed_connections;	/* ... in an advertise window */
+	guint	 last_connect_time;	/* since the advertise window began */
+	guint64	 connect_time;		/* total for timed_connections */
+	guint	 requests;
+	guint	 window_requests;	/* in the current cycle */
+	guint	 last_window_requests;	/* in the previous cycle */
+} ARCStats;
+
 typedef struct  {
 	struct btd_adapter	*adapter;
+	struct gatt_db_attribute *service;
 	GHashTable		*char_table;
 	guint			 adv_id, disc_id;
 	struct mgmt		*mgmt;
 	guint			 magic;
 	gboolean		 adv;
+	GSList			*conns; /* ARCConns */
+	gsize			 mem;	/* bytes held by the ARCConns */
+
+	/* the scheduler; adv_id is its timeout */
+	guint			 adv_window, pause_window; /* msec */
+	gboolean		 adv_window_active;
+	gint64			 window_start;
+	GHashTable		*connect_times; /* address => msec */
+	guint			 idle_timeout; /* sec */
+	ARCStats		 stats;
 } ARCServer;
 
-static gboolean arc_server_advertise (ARCServer *self, gboolean enable);
+typedef struct _ARCConn ARCConn;
+
+static gboolean arc_server_advertise (ARCServer *self, gboolean enable,
+				      ARCAdvertiseFunc func,
+				      gpointer user_data,
+				      GDestroyNotify destroy);
+static gboolean arc_sched_is_running (ARCServer *self);
+static void arc_sched_link_connected (ARCServer *self,
+				      const bdaddr_t *bdaddr);
+static void arc_sched_link_disconnected (ARCServer *self,
+					 const bdaddr_t *bdaddr);
+static void arc_server_drop_conns (ARCServer *self);
+static void arc_server_notify (ARCServer *self, ARCChar *achar,
+			       GByteArray *val, struct btd_device *target);
 
 static void gatt_property_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
 			       GDBusPendingPropertySet id, ARCServer *aserver);
@@ -82,50 +128,29 @@ static gboolean gatt_property_get (const GDBusPropertyTable *property,
 				   DBusMessageIter *iter, ARCServer *aserver);
 
 static void
-each_device_disconnect (struct btd_device *device, void *data)
+on_connected (uint16_t index, uint16_t length,
+	      const struct mgmt_ev_device_connected *ev, ARCServer *self)
 {
-	ARCServer *self;
-
-	self = (ARCServer*)data;
-
-	if (!btd_device_is_connected (device))
+	if (length < sizeof (*ev))
 		return;
 
-	DBG ("arc: automatically disconnecting");
-	btd_adapter_disconnect_device (self->adapter,
-				       device_get_address(device),
-				       BDADDR_LE_PUBLIC);
-}
-
-static gboolean
-do_disconnect (ARCServer *self)
-{
-	btd_adapter_for_each_device (self->adapter,
-				     each_device_disconnect, self);
-	return FALSE;
+	arc_sched_link_connected (self, &ev->addr.bdaddr);
 }
 
 static void
-on_connected (uint16_t index, uint16_t length,
-	const void *param, ARCServer *self)
+on_disconnected (uint16_t index, uint16_t length,
+		const struct mgmt_ev_device_disconnected *ev, ARCServer *self)
 {
 	DBG ("%s", __FUNCTION__);
 
-	g_timeout_add_seconds (CLIENT_TIMEOUT, (GSourceFunc)do_disconnect,
-			       self);
-
-	/* clear out any connection-specific data */
-	arc_char_table_clear_working_data (self->char_table);
-}
-
+	if (length >= sizeof (*ev))
+		arc_sched_link_disconnected (self, &ev->addr.bdaddr);
 
+	/* the scheduler will get to it */
+	if (arc_sched_is_running (self) && !self->adv_window_active)
+		return;
 
-static void
-on_disconnected (uint16_t index, uint16_t length,
-		const void *param, ARCServer *self)
-{
-	DBG ("%s", __FUNCTION__);
-	arc_server_advertise (self, TRUE);
+	arc_server_advertise (self, TRUE, NULL, NULL, NULL);
 }
 
 ARCServer*
@@ -134,28 +159,45 @@ arc_server_new (struct btd_adapter *adapter)
 	ARCServer	*self;
 	unsigned	 u;
 
-	self		 = g_new0 (ARCServer, 1);
-	self->adapter	 = btd_adapter_ref (adapter);
-	self->char_table = arc_char_table_new ();
+	self		   = g_new0 (ARCServer, 1);
+	self->adapter	   = btd_adapter_ref (adapter);
+	self->char_table   = arc_char_table_new ();
+	self->adv_window   = ARC_ADV_WINDOW;
+	self->pause_window = ARC_PAUSE_WINDOW;
+	self->idle_timeout = CLIENT_TIMEOUT;
+	self->connect_times = g_hash_table_new_full (
+		g_str_hash, g_str_equal, g_free, NULL);
 
 	/*
 	 * we need the mgmt interface to be able to get the
-	 * connected/disconnected callbacks
+	 * (dis)connected callbacks
 	 */
 	self->mgmt = mgmt_new_default ();
-	mgmt_register(self->mgmt, MGMT_EV_DEVICE_DISCONNECTED,
-		      btd_adapter_get_index (adapter),
-		      (mgmt_notify_func_t)on_disconnected, self, NULL);
-
 	mgmt_register(self->mgmt, MGMT_EV_DEVICE_CONNECTED,
 		      btd_adapter_get_index (adapter),
 		      (mgmt_notify_func_t)on_connected, self, NULL);
+	mgmt_register(self->mgmt, MGMT_EV_DEVICE_DISCONNECTED,
+		      btd_adapter_get_index (adapter),
+		      (mgmt_notify_func_t)on_disconnected, self, NULL);
 
 	return self;
 }
 
 
 
+static struct gatt_db*
+arc_server_get_db (ARCServer *self)
+{
+	struct btd_gatt_database *database;
+
+	database = btd_adapter_get_database (self->adapter);
+	if (!database)
+		return NULL;
+
+	return btd_gatt_database_get_db (database);
+}
+
+
 static void
 arc_server_destroy (ARCServer *self)
 {
@@ -167,6 +209,12 @@ arc_server_destroy (ARCServer *self)
 
 	ARC_SERVERS = g_slist_remove (ARC_SERVERS, self);
 
+	arc_server_drop_conns (self);
+
+	if (self->service)
+		gatt_db_remove_service (arc_server_get_db (self),
+					self->service);
+
 	if (self->adv_id != 0) {
 		g_source_remove (self->adv_id);
 		self->adv_id = 0;
@@ -175,8 +223,20 @@ arc_server_destroy (ARCServer *self)
 	if (self->char_table)
 		g_hash_table_destroy (self->char_table);
 
-	if (self->mgmt)
-		mgmt_unref (self->mgmt);
+	g_hash_table_destroy (self->connect_times);
+
+	/*
+	 * drop what still refers to us, and remove our advertisement;
+	 * the mgmt interface lives until that request is done, since
+	 * unref'ing it would cancel the request
+	 */
+	if (self->mgmt) {
+		mgmt_unregister_all (self->mgmt);
+		mgmt_cancel_all (self->mgmt);
+		arc_enable_advertising (self->mgmt, self->adapter,
+					self->magic, FALSE, NULL, self->mgmt,
+					(GDestroyNotify)mgmt_unref);
+	}
 
 	if (self->adapter)
 		btd_adapter_unref (self->adapter);
@@ -184,11 +244,198 @@ arc_server_destroy (ARCServer *self)
 	g_free (self);
 }
 
+typedef struct {
+	ARCServer	*aserver;
+	gboolean	 enable;
+	ARCAdvertiseFunc func;
+	gpointer	 user_data;
+	GDestroyNotify	 destroy;
+} ARCAdvertise;
+
+static void
+arc_advertise_free (ARCAdvertise *adv)
+{
+	if (adv->destroy)
+		adv->destroy (adv->user_data);
+
+	g_free (adv);
+}
+
+static void
+on_advertise_done (gboolean success, ARCAdvertise *adv)
+{
+	/* the state only changes once the kernel has accepted it */
+	if (success)
+		adv->aserver->adv = adv->enable;
+
+	if (adv->func)
+		adv->func (success, adv->user_data);
+}
+
+static gboolean
+arc_server_advertise (ARCServer *self, gboolean enable,
+		      ARCAdvertiseFunc func, gpointer user_data,
+		      GDestroyNotify destroy)
+{
+	ARCAdvertise *adv;
+
+	adv		= g_new0 (ARCAdvertise, 1);
+	adv->aserver	= self;
+	adv->enable	= enable;
+	adv->func	= func;
+	adv->user_data	= user_data;
+	adv->destroy	= destroy;
+
+	/* on failure, adv is freed already */
+	return arc_enable_advertising (self->mgmt, self->adapter,
+				       self->magic, enable,
+				       (ARCAdvertiseFunc)on_advertise_done,
+				       adv,
+				       (GDestroyNotify)arc_advertise_free);
+}
+
+/* the advertising data includes the magic and the name */
+static void
+arc_server_update_advertising (ARCServer *self)
+{
+	if (self->adv)
+		arc_server_advertise (self, TRUE, NULL, NULL, NULL);
+}
+
+
+/*
+ * the advertise/pause duty cycle: when both windows are set, we
+ * alternate between advertising (so clients can connect) and not
+ * advertising (so the adapter is free to scan and connect to others;
+ * starting discovery is still up to whoever wants it)
+ */
+static gboolean
+arc_sched_is_running (ARCServer *self)
+{
+	return self->adv_id != 0;
+}
+
+static gboolean on_sched_timeout (ARCServer *self);
+
+static void
+arc_sched_enter (ARCServer *self, gboolean adv)
+{
+	if (adv) {
+		/* a cycle starts with the advertise window */
+		if (self->stats.windows > 0)
+			self->stats.last_window_requests =
+				self->stats.window_requests;
+		self->stats.window_requests = 0;
+		++self->stats.windows;
+		self->window_start = g_get_monotonic_time ();
+	}
+
+	self->adv_window_active = adv;
+	arc_server_advertise (self, adv, NULL, NULL, NULL);
+
+	self->adv_id = g_timeout_add (
+		adv ? self->adv_window : self->pause_window,
+		(GSourceFunc)on_sched_timeout, self);
+
+	g_dbus_emit_property_changed (btd_get_dbus_connection (),
+				      adapter_get_path (self->adapter),
+				      ARC_SERVER_IFACE, "Window");
+}
+
 static gboolean
-arc_server_advertise (ARCServer *self, gboolean enable)
+on_sched_timeout (ARCServer *self)
+{
+	self->adv_id = 0;
+	arc_sched_enter (self, !self->adv_window_active);
+
+	return FALSE;
+}
+
+static void
+arc_sched_stop (ARCServer *self)
+{
+	if (!arc_sched_is_running (self))
+		return;
+
+	g_source_remove (self->adv_id);
+	self->adv_id = 0;
+
+	g_dbus_emit_property_changed (btd_get_dbus_connection (),
+				      adapter_get_path (self->adapter),
+				      ARC_SERVER_IFACE, "Window");
+}
+
+/* (re)start the scheduler after the windows changed */
+static void
+arc_sched_update (ARCServer *self)
+{
+	arc_sched_stop (self);
+
+	if (self->adv_window > 0 && self->pause_window > 0)
+		arc_sched_enter (self, TRUE);
+}
+
+/*
+ * a link came up; if that happened in an advertise window, remember
+ * how long after the window began, until we know whether it is an ARC
+ * client
+ */
+static void
+arc_sched_link_connected (ARCServer *self, const bdaddr_t *bdaddr)
+{
+	char	addr[18];
+	guint	msecs;
+
+	ba2str (bdaddr, addr);
+
+	if (!arc_sched_is_running (self) || !self->adv_window_active) {
+		g_hash_table_remove (self->connect_times, addr);
+		return;
+	}
+
+	msecs = (g_get_monotonic_time () - self->window_start) / 1000;
+	g_hash_table_insert (self->connect_times, g_strdup (addr),
+			     GUINT_TO_POINTER (msecs));
+}
+
+static void
+arc_sched_link_disconnected (ARCServer *self, const bdaddr_t *bdaddr)
+{
+	char addr[18];
+
+	ba2str (bdaddr, addr);
+	g_hash_table_remove (self->connect_times, addr);
+}
+
+/* a client made its first ARC access */
+static void
+arc_sched_connected (ARCServer *self, struct btd_device *device)
+{
+	char		addr[18];
+	gpointer	val;
+
+	++self->stats.connections;
+
+	if (!device)
+		return;
+
+	ba2str (device_get_address (device), addr);
+	if (!g_hash_table_lookup_extended (self->connect_times, addr,
+					   NULL, &val))
+		return;
+
+	self->stats.last_connect_time  = GPOINTER_TO_UINT (val);
+	self->stats.connect_time      += GPOINTER_TO_UINT (val);
+	++self->stats.timed_connections;
+
+	g_hash_table_remove (self->connect_times, addr);
+}
+
+static void
+arc_sched_request_served (ARCServer *self)
 {
-	return arc_enable_advertising (self->adapter,
-				       self->magic, enable);
+	++self->stats.requests;
+	++self->stats.window_requests;
 }
 
 
@@ -236,22 +483,377 @@ find_arc_server_from_device (struct btd_device *device)
 }
 
 
+static void
+handle_blob (ARCServer *self, struct btd_device *device, ARCChar *achar,
+	     GByteArray *val)
+{
+	DBG ("%s", __FUNCTION__);
+
+	if (g_strcmp0 (achar->uuidstr, ARC_REQUEST_UUID) == 0) {
+
+		const char	*objpath;
+		const guint8	*payload;
+		char		*request;
+		guint32		 reqid;
+		int		 hdrlen;
+
+		hdrlen = arc_blurb_parse_id (val->data, val->len, &reqid);
+		if (hdrlen < 0) {
+			error ("request has a malformed request-id");
+			return;
+		}
+
+		payload = val->data + hdrlen;
+
+		/* make sure it's valid utf8 */
+		if (!g_utf8_validate ((const char*)payload, val->len - hdrlen,
+				      NULL)) {
+			error ("request is not valid utf8");
+			return;
+		}
+
+		if (!device) {
+			error ("request from unknown device");
+			return;
+		}
+
+		objpath = device_get_path (device);
+		request = g_strndup ((const char*)payload, val->len - hdrlen);
+
+		DBG ("emitting method-called (%u: %s)", reqid, request);
+
+		/* requests with an id are answered with SubmitResultWithId,
+		 * possibly out of order */
+		if (reqid != 0)
+			g_dbus_emit_signal (
+				btd_get_dbus_connection(),
+				adapter_get_path (self->adapter),
+				ARC_SERVER_IFACE, "MethodCalledWithId",
+				DBUS_TYPE_OBJECT_PATH, &objpath,
+				DBUS_TYPE_UINT32, &reqid,
+				DBUS_TYPE_STRING, &request,
+				DBUS_TYPE_INVALID);
+		else
+			g_dbus_emit_signal (
+				btd_get_dbus_connection(),
+				adapter_get_path (self->adapter),
+				ARC_SERVER_IFACE, "MethodCalled",
+				DBUS_TYPE_OBJECT_PATH, &objpath,
+				DBUS_TYPE_STRING, &request,
+				DBUS_TYPE_INVALID);
+
+		g_free (request);
+		arc_sched_request_served (self);
+	}
+}
+
+
+/*
+ * find the device on the other end of an ATT bearer
+ */
+static struct btd_device*
+find_device_for_att (ARCServer *self, struct bt_att *att)
+{
+	GIOChannel	*io;
+	GError		*gerr;
+	bdaddr_t	 dst;
+	uint8_t		 dst_type;
+
+	if (!att)
+		return NULL;
+
+	io = g_io_channel_unix_new (bt_att_get_fd (att));
+	if (!io)
+		return NULL;
+
+	gerr = NULL;
+	bt_io_get (io, &gerr,
+		   BT_IO_OPT_DEST_BDADDR, &dst,
+		   BT_IO_OPT_DEST_TYPE, &dst_type,
+		   BT_IO_OPT_INVALID);
+	g_io_channel_unref (io);
+
+	if (gerr) {
+		error ("bt_io_get: %s", gerr->message);
+		g_error_free (gerr);
+		return NULL;
+	}
+
+	return btd_adapter_find_device (self->adapter, &dst, dst_type);
+}
+
+
+/* the connection-specific state for one characteristic */
+typedef struct {
+	GByteArray	*rx;	  /* the value being written */
+	gboolean	 discard; /* rx went over budget; drop the frame */
+	GByteArray	*val;	  /* value of a private characteristic */
+	guint		 pos;	  /* of the chunked read in progress */
+	gboolean	 reading;
+
+	gboolean	 in_text; /* between 0xfe and 0xff */
+	gboolean	 binary;  /* inside a binary frame */
+	guint8		 bin_hdr[ARC_BIN_HDR_LEN];
+	guint		 bin_hdr_len;
+	guint		 bin_pos; /* payload bytes seen so far */
+} ARCConnChar;
+
+/*
+ * a connected client; this lives as long as its ATT bearer, so any
+ * number of clients can have writes and reads in progress at once
+ */
+struct _ARCConn {
+	ARCServer		*server;
+	struct bt_att		*att;
+	struct btd_device	*device;
+	unsigned		 disconn_id;
+	guint			 idle_id;
+	GHashTable		*chars; /* value handle => ARCConnChar */
+	gsize			 mem;	/* bytes held in the ARCConnChars */
+	guint8			 mode;	/* ARC_MODE_*; 0 for text frames */
+};
+
+/*
+ * requests and results belong to the client that sent / receives
+ * them; everything else is shared
+ */
+static gboolean
+arc_char_is_private (ARCChar *achar)
+{
+	return g_strcmp0 (achar->uuidstr, ARC_REQUEST_UUID) == 0 ||
+		g_strcmp0 (achar->uuidstr, ARC_RESULT_UUID) == 0;
+}
+
+
+static void
+arc_conn_char_free (ARCConnChar *cchar)
+{
+	g_byte_array_unref (cchar->rx);
+	g_byte_array_unref (cchar->val);
+	g_free (cchar);
+}
+
+
+/* the destroy-notify for the disconnect handler */
+static void
+arc_conn_free (ARCConn *conn)
+{
+	ARCServer *self;
+
+	self	    = conn->server;
+	self->conns = g_slist_remove (self->conns, conn);
+	self->mem  -= conn->mem;
+
+	if (conn->idle_id != 0)
+		g_source_remove (conn->idle_id);
+
+	g_hash_table_destroy (conn->chars);
+
+	if (conn->device)
+		btd_device_unref (conn->device);
+
+	bt_att_unref (conn->att);
+	g_free (conn);
+}
+
+
+static void
+on_conn_disconnected (int err, ARCConn *conn)
+{
+	DBG ("%s: %s", __FUNCTION__,
+	     conn->device ? device_get_path (conn->device) : "<unknown>");
+}
+
+
 static gboolean
-arc_attrib_db_update (ARCServer *self, ARCChar *achar)
-{
-	int ret;
-
-	ret = attrib_db_update (self->adapter,
-				achar->val_handle,
-				NULL,
-				achar->val->data,
-				achar->val->len,
-				NULL);
-	if (ret != 0) {
-		error ("failed to write attribute: %s",
-		       strerror (-ret));
+on_conn_idle (ARCConn *conn)
+{
+	conn->idle_id = 0;
+
+	if (!conn->device)
 		return FALSE;
-	} else if (achar->val->len == 0)
+
+	DBG ("arc: disconnecting idle %s", device_get_path (conn->device));
+	btd_adapter_disconnect_device (
+		conn->server->adapter, device_get_address (conn->device),
+		btd_device_get_bdaddr_type (conn->device));
+
+	return FALSE;
+}
+
+
+/* restart the idle timeout */
+static void
+arc_conn_touch (ARCConn *conn)
+{
+	if (conn->idle_id != 0)
+		g_source_remove (conn->idle_id);
+
+	conn->idle_id = 0;
+	if (conn->server->idle_timeout > 0)
+		conn->idle_id = g_timeout_add_seconds (
+			conn->server->idle_timeout,
+			(GSourceFunc)on_conn_idle, conn);
+}
+
+
+static ARCConn*
+arc_conn_get (ARCServer *self, struct bt_att *att)
+{
+	GSList	*cur;
+	ARCConn	*conn;
+
+	if (!att)
+		return NULL;
+
+	for (cur = self->conns; cur; cur = g_slist_next (cur))
+		if (((ARCConn*)cur->data)->att == att)
+			return (ARCConn*)cur->data;
+
+	conn	     = g_new0 (ARCConn, 1);
+	conn->server = self;
+	conn->att    = bt_att_ref (att);
+	conn->device = find_device_for_att (self, att);
+	conn->chars  = g_hash_table_new_full (
+		g_direct_hash, g_direct_equal,
+		NULL, (GDestroyNotify)arc_conn_char_free);
+
+	if (conn->device)
+		btd_device_ref (conn->device);
+
+	self->conns = g_slist_prepend (self->conns, conn);
+	arc_sched_connected (self, conn->device);
+
+	/* arc_conn_free runs when the bearer goes away */
+	conn->disconn_id = bt_att_register_disconnect (
+		att, (bt_att_disconnect_func_t)on_conn_disconnected, conn,
+		(bt_att_destroy_func_t)arc_conn_free);
+	if (conn->disconn_id == 0) {
+		error ("failed to track connection");
+		arc_conn_free (conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+
+static ARCConn*
+arc_conn_find_by_device (ARCServer *self, struct btd_device *device)
+{
+	GSList *cur;
+
+	for (cur = self->conns; cur; cur = g_slist_next (cur))
+		if (((ARCConn*)cur->data)->device == device)
+			return (ARCConn*)cur->data;
+
+	return NULL;
+}
+
+
+static ARCConnChar*
+arc_conn_get_char (ARCConn *conn, ARCChar *achar)
+{
+	ARCConnChar *cchar;
+
+	cchar = g_hash_table_lookup (conn->chars,
+				     GUINT_TO_POINTER (achar->val_handle));
+	if (cchar)
+		return cchar;
+
+	cchar	   = g_new0 (ARCConnChar, 1);
+	cchar->rx  = g_byte_array_new ();
+	cchar->val = g_byte_array_new ();
+
+	g_hash_table_insert (conn->chars,
+			     GUINT_TO_POINTER (achar->val_handle), cchar);
+
+	return cchar;
+}
+
+
+static void
+arc_server_drop_conns (ARCServer *self)
+{
+	while (self->conns) {
+		ARCConn *conn;
+
+		conn = (ARCConn*)self->conns->data;
+
+		/* this calls arc_conn_free */
+		if (!bt_att_unregister_disconnect (conn->att,
+						   conn->disconn_id))
+			arc_conn_free (conn);
+	}
+}
+
+
+static gboolean
+arc_conn_append (ARCConn *conn, GByteArray *buf, const guint8 *data,
+		 guint len)
+{
+	ARCServer *self;
+
+	self = conn->server;
+
+	if (conn->mem + len > ARC_CONN_MAX_BYTES ||
+	    self->mem + len > ARC_SERVER_MAX_BYTES)
+		return FALSE;
+
+	g_byte_array_append (buf, data, len);
+	conn->mem += len;
+	self->mem += len;
+
+	return TRUE;
+}
+
+
+/*
+ * replace the contents of one of the connection's buffers, staying
+ * within the per-connection and overall memory budgets; on failure,
+ * the buffer is left empty
+ */
+static gboolean
+arc_conn_set (ARCConn *conn, GByteArray *buf, const guint8 *data, guint len)
+{
+	ARCServer *self;
+
+	self	    = conn->server;
+	conn->mem  -= buf->len;
+	self->mem  -= buf->len;
+	g_byte_array_set_size (buf, 0);
+
+	return arc_conn_append (conn, buf, data, len);
+}
+
+
+/*
+ * the gatt-db does not keep a copy of our values; reads are served
+ * from achar->val, so an update only needs to restart any chunked
+ * reads that are in progress
+ */
+static gboolean
+arc_gatt_db_update (ARCServer *self, ARCChar *achar)
+{
+	GSList *cur;
+
+	if (!self->service || achar->val_handle == 0) {
+		error ("%s: service not registered (%s)",
+		       __FUNCTION__, achar->name);
+		return FALSE;
+	}
+
+	for (cur = self->conns; cur; cur = g_slist_next (cur)) {
+		ARCConnChar *cchar;
+
+		cchar = g_hash_table_lookup (
+			((ARCConn*)cur->data)->chars,
+			GUINT_TO_POINTER (achar->val_handle));
+		if (cchar)
+			cchar->reading = FALSE;
+	}
+
+	if (achar->val->len == 0)
 		DBG ("%s: clearing attr %s",
 			__FUNCTION__, achar->name);
 
@@ -260,274 +862,448 @@ arc_attrib_db_update (ARCServer *self, ARCChar *achar)
 
 
 static gboolean
-arc_attrib_db_clear (ARCServer *self, ARCChar *achar)
+arc_gatt_db_clear (ARCServer *self, ARCChar *achar)
+{
+	arc_char_set_value_string (achar, NULL);
+
+	if (!arc_gatt_db_update (self, achar))
+		return FALSE;
+
+	DBG ("%s: cleared attr %s", __FUNCTION__, achar->name);
+
+	return TRUE;
+}
+
+
+
+
+/*
+ * the client asks for a framing mode; we answer with the subset we
+ * support (in the old mode), and use it from then on
+ */
+static void
+arc_conn_negotiate (ARCConn *conn, guint8 requested)
+{
+	ARCChar		*result_achar;
+	GByteArray	*val;
+	guint8		 ack[2];
+
+	ack[0] = ARC_GATT_BLURB_MODE;
+	ack[1] = requested & ARC_MODE_SUPPORTED;
+	if (!(ack[1] & ARC_MODE_BINARY))
+		ack[1] = 0; /* compression only applies to binary frames */
+
+	result_achar = arc_char_table_find_by_uuid (conn->server->char_table,
+						    ARC_RESULT_UUID);
+	if (!result_achar || !conn->device) {
+		error ("cannot acknowledge mode");
+		return;
+	}
+
+	/* only notified; a result that is yet to be read stays */
+	val = g_byte_array_sized_new (sizeof(ack));
+	g_byte_array_append (val, ack, sizeof(ack));
+	arc_server_notify (conn->server, result_achar, val, conn->device);
+	g_byte_array_unref (val);
+
+	DBG ("%s: mode 0x%02x (asked for 0x%02x)",
+	     device_get_path (conn->device), ack[1], requested);
+
+	conn->mode = ack[1];
+}
+
+
+static void
+arc_conn_rx_done (ARCConn *conn, ARCChar *achar, ARCConnChar *cchar)
+{
+	GByteArray *tmp;
+
+	if (!arc_char_is_private (achar)) {
+		arc_char_set_value_string (achar, NULL);
+		g_byte_array_append (achar->val, cchar->rx->data,
+				     cchar->rx->len);
+		arc_gatt_db_update (conn->server, achar);
+		arc_conn_set (conn, cchar->rx, NULL, 0);
+		return;
+	}
+
+	if (g_strcmp0 (achar->uuidstr, ARC_REQUEST_UUID) == 0 &&
+	    cchar->rx->len == 2 &&
+	    cchar->rx->data[0] == ARC_GATT_BLURB_MODE) {
+		arc_conn_negotiate (conn, cchar->rx->data[1]);
+		arc_conn_set (conn, cchar->rx, NULL, 0);
+		return;
+	}
+
+	/* the received value becomes the connection's value */
+	tmp	       = cchar->val;
+	cchar->val     = cchar->rx;
+	cchar->rx      = tmp;
+	cchar->reading = FALSE;
+	arc_conn_set (conn, cchar->rx, NULL, 0);
+
+	handle_blob (conn->server, conn->device, achar, cchar->val);
+}
+
+
+/* add a piece of a value; FALSE if the frame is being dropped */
+static gboolean
+arc_conn_rx (ARCConn *conn, ARCChar *achar, ARCConnChar *cchar,
+	     const guint8 *data, guint len)
 {
-	int ret;
-
-	ret = attrib_db_update (self->adapter,
-				achar->val_handle,
-				NULL, NULL, 0, NULL);
-	if (ret != 0) {
-		error ("failed to write attribute: %s",
-		       strerror (-ret));
-		return FALSE;
-	} else
-		DBG ("%s: cleared attr %s", achar->name);
+	if (cchar->discard || len == 0)
+		return !cchar->discard;
+
+	if (!arc_conn_append (conn, cchar->rx, data, len)) {
+		error ("%s: over budget, dropping value (%u byte(s))",
+		       achar->name, cchar->rx->len + len);
+		arc_conn_set (conn, cchar->rx, NULL, 0);
+		cchar->discard = TRUE;
+	}
 
-	return TRUE;
+	return !cchar->discard;
 }
 
 
+/*
+ * add to a binary frame: 0xfc <flags> <16-bit little-endian length>
+ * <payload>; since the length is known, there is no need to look for
+ * markers. Returns the number of bytes used.
+ */
+static size_t
+arc_conn_rx_binary (ARCConn *conn, ARCChar *achar, ARCConnChar *cchar,
+		    const guint8 *data, size_t len, uint8_t *ecode)
+{
+	GByteArray	*blurb;
+	size_t		 used, size;
+	guint		 bin_len;
+	gboolean	 rv;
 
+	used = 0;
+	while (cchar->bin_hdr_len < ARC_BIN_HDR_LEN && used < len)
+		cchar->bin_hdr[cchar->bin_hdr_len++] = data[used++];
 
-static void
-handle_blob (ARCServer *self, struct attribute *attr,
-	     struct btd_device *device, ARCChar *achar)
-{
-	DBG ("%s", __FUNCTION__);
+	if (cchar->bin_hdr_len < ARC_BIN_HDR_LEN)
+		return used;
 
-	if (g_strcmp0 (achar->uuidstr, ARC_REQUEST_UUID) == 0) {
+	bin_len = cchar->bin_hdr[2] | (cchar->bin_hdr[3] << 8);
+	size	= MIN (len - used, bin_len - cchar->bin_pos);
+	if (!arc_conn_rx (conn, achar, cchar, data + used, size))
+		*ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 
-		int		 ret;
-		char		*str;
-		const char	*objpath;
-		const char	*empty;
-		ARCChar		*result_char;
-		char		*request;
+	used	       += size;
+	cchar->bin_pos += size;
+	if (cchar->bin_pos < bin_len)
+		return used;
 
-		/* make sure it's valid utf8 */
-		if (!g_utf8_validate (
-			    (const char*)achar->val->data,
-			    achar->val->len, NULL)) {
-			error ("request is not valid utf8");
-			return;
-		}
+	/* we have the whole frame */
+	cchar->binary = FALSE;
+	if (cchar->discard) {
+		cchar->discard = FALSE;
+		return used;
+	}
 
-		objpath = device_get_path (device);
+	blurb = arc_blurb_unpack (cchar->bin_hdr[1], cchar->rx->data,
+				  cchar->rx->len, ARC_CONN_MAX_BYTES);
+	if (!blurb) {
+		error ("%s: malformed binary frame", achar->name);
+		arc_conn_set (conn, cchar->rx, NULL, 0);
+		*ecode = BT_ATT_ERROR_UNLIKELY;
+		return used;
+	}
 
-		/* when processing the current method, clear any
-		 * existing result */
-		/* DBG ("clearing old results"); */
-		/* if (!arc_attrib_db_clear (self, achar)) { */
-		/*	error ("failed to update attrib"); */
-		/*	return; */
-		/* } */
+	rv = arc_conn_set (conn, cchar->rx, blurb->data, blurb->len);
+	g_byte_array_unref (blurb);
+	if (!rv) {
+		error ("%s: over budget, dropping value", achar->name);
+		*ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+		return used;
+	}
 
-		request = arc_char_get_value_string (achar);
-		if (!request)
-			request = g_strdup ("");
+	arc_conn_rx_done (conn, achar, cchar);
 
-		DBG ("emitting method-called (%s)", request);
+	return used;
+}
 
-		g_dbus_emit_signal (
-			btd_get_dbus_connection(),
-			adapter_get_path (self->adapter),
-			ARC_SERVER_IFACE, "MethodCalled",
-			DBUS_TYPE_OBJECT_PATH, &objpath,
-			DBUS_TYPE_STRING, &request,
-			DBUS_TYPE_INVALID);
 
-		g_free (request);
-	}
+static gboolean
+arc_conn_is_marker (ARCConn *conn, ARCConnChar *cchar, guint8 byte)
+{
+	if (byte == ARC_GATT_BLURB_PRE || byte == ARC_GATT_BLURB_POST)
+		return TRUE;
+
+	/* binary frames start outside text frames, once negotiated */
+	return byte == ARC_GATT_BLURB_BIN && !cchar->in_text &&
+		(conn->mode & ARC_MODE_BINARY);
 }
 
 
-static uint8_t
-attr_arc_server_write (struct attribute *attr, struct btd_device *device,
-		       ARCServer *self)
+static void
+attr_arc_server_write (struct gatt_db_attribute *attrib, unsigned int id,
+		       uint16_t offset, const uint8_t *value, size_t len,
+		       uint8_t opcode, struct bt_att *att, void *user_data)
 {
+	ARCServer	*self;
 	ARCChar		*achar;
-	unsigned	 u;
+	ARCConn		*conn;
+	ARCConnChar	*cchar;
+	uint16_t	 handle;
+	uint8_t		 ecode;
+	size_t		 u, end;
+
+	self   = (ARCServer*)user_data;
+	handle = gatt_db_attribute_get_handle (attrib);
 
-	DBG ("writing handle 0x%04x", attr->handle);
+	DBG ("writing handle 0x%04x", handle);
 
-	achar = arc_char_table_find_by_attr (self->char_table, attr);
+	achar = arc_char_table_find_by_handle (self->char_table, handle);
 	if (!achar) {
 		error ("unknown handle");
-		return 0;
+		gatt_db_attribute_write_result (attrib, id,
+						BT_ATT_ERROR_UNLIKELY);
+		return;
 	}
 
-	if (!achar->flags & ARC_CHAR_FLAG_WRITABLE) {
+	if (!(achar->flags & ARC_CHAR_FLAG_WRITABLE)) {
 		error ("characteristic is not writable");
-		return 0;
+		gatt_db_attribute_write_result (
+			attrib, id, BT_ATT_ERROR_WRITE_NOT_PERMITTED);
+		return;
+	}
+
+	conn = arc_conn_get (self, att);
+	if (!conn) {
+		gatt_db_attribute_write_result (attrib, id,
+						BT_ATT_ERROR_UNLIKELY);
+		return;
 	}
 
 	DBG ("%s: %s", __FUNCTION__, achar->name);
 
+	arc_conn_touch (conn);
+	cchar = arc_conn_get_char (conn, achar);
+	ecode = 0;
+
 	/* if we see 0xfe, we start from scratch;
-	 * otherwise, accumulate until we see 0xff*/
-	for (u = 0; u != attr->len; ++u) {
-		guint8 byte;
-		byte = (guint8)attr->data[u];
-		switch (byte) {
-		case ARC_GATT_BLURB_PRE: /* remove everything */
-			arc_char_set_value_string (achar, NULL);
-			break;
-		case ARC_GATT_BLURB_POST:
-			handle_blob (self, attr, device, achar);
-			break;
-		default: /* append */
-			g_byte_array_append (achar->val, &byte, 1);
+	 * otherwise, accumulate until we see 0xff; 0xfc starts a
+	 * binary frame */
+	for (u = 0; u < len; u = end + 1) {
+
+		if (cchar->binary) {
+			end = u + arc_conn_rx_binary (conn, achar, cchar,
+						      value + u, len - u,
+						      &ecode) - 1;
+			continue;
+		}
+
+		for (end = u; end < len; ++end)
+			if (arc_conn_is_marker (conn, cchar, value[end]))
+				break;
+
+		if (!arc_conn_rx (conn, achar, cchar, value + u, end - u))
+			ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+
+		if (end == len)
 			break;
+
+		if (value[end] == ARC_GATT_BLURB_POST && !cchar->discard)
+			arc_conn_rx_done (conn, achar, cchar);
+		else /* remove everything */
+			arc_conn_set (conn, cchar->rx, NULL, 0);
+
+		cchar->discard = FALSE;
+		cchar->in_text = value[end] == ARC_GATT_BLURB_PRE;
+
+		if (value[end] == ARC_GATT_BLURB_BIN) {
+			cchar->binary	   = TRUE;
+			cchar->bin_hdr[0]  = value[end];
+			cchar->bin_hdr_len = 1;
+			cchar->bin_pos	   = 0;
 		}
 	}
 
-	return 0;
+	gatt_db_attribute_write_result (attrib, id, ecode);
 }
 
 
 
-static uint8_t
-attr_arc_server_read (struct attribute	*attr,
-		      struct btd_device *device, ARCServer *self)
+static void
+attr_arc_server_read (struct gatt_db_attribute *attrib, unsigned int id,
+		      uint16_t offset, uint8_t opcode, struct bt_att *att,
+		      void *user_data)
 {
+	ARCServer	*self;
 	ARCChar		*achar;
-	ARCID		 id;
-	size_t		 len;
-	const guint	 BLE_MAXLEN = 19; /* empirically derived */
+	ARCConn		*conn;
+	ARCConnChar	*cchar;
+	GByteArray	*val;
+	uint16_t	 handle;
+	guint		 len, size;
+	guint8		 chunk[ARC_READ_MAXLEN];
 
-	achar = arc_char_table_find_by_attr (self->char_table, attr);
+	self   = (ARCServer*)user_data;
+	handle = gatt_db_attribute_get_handle (attrib);
+
+	achar = arc_char_table_find_by_handle (self->char_table, handle);
 	if (!achar) {
 		error ("unknown handle");
-		return 0;
+		gatt_db_attribute_read_result (attrib, id,
+					       BT_ATT_ERROR_UNLIKELY,
+					       NULL, 0);
+		return;
 	}
 
-	if (!achar->flags & ARC_CHAR_FLAG_READABLE) {
+	if (!(achar->flags & ARC_CHAR_FLAG_READABLE)) {
 		error ("characteristic is not readable");
-		return 0;
+		gatt_db_attribute_read_result (
+			attrib, id, BT_ATT_ERROR_READ_NOT_PERMITTED,
+			NULL, 0);
+		return;
 	}
 
-	/* write in chunks; this is an ugly workaround because bluez
-	 * cannot do long-writes (2013.09.20) */
-	if (!achar->writing) /* copy the characteristic to our scratchpad */
-		arc_char_init_scratch (achar, TRUE/*copy*/);
-
-	DBG ("%s: %s (%u byte(s), %u bytes(s) left)",
-		__FUNCTION__, achar->name, achar->val->len,
-		achar->val_scratch->len);
-
-	len = MIN (BLE_MAXLEN, achar->val_scratch->len);
+	/* every chunk fits in a single read response; a blob read
+	 * would otherwise consume the next chunk */
+	if (offset != 0) {
+		gatt_db_attribute_read_result (
+			attrib, id, BT_ATT_ERROR_ATTRIBUTE_NOT_LONG,
+			NULL, 0);
+		return;
+	}
 
-	if (len == 0) { /* special case: empty */
-		static uint8_t empty[] = { 0xfe, 0xff };
-		attr->data = (uint8_t*)g_memdup(empty, sizeof(empty));
-		attr->len  = sizeof (empty);
-		return 0;
+	conn = arc_conn_get (self, att);
+	if (!conn) {
+		gatt_db_attribute_read_result (attrib, id,
+					       BT_ATT_ERROR_UNLIKELY,
+					       NULL, 0);
+		return;
 	}
 
-	/* we just start with this value; set the beginning-of-data
-	 * token (length is one less) */
-	if (!achar->writing) {
+	arc_conn_touch (conn);
+	cchar = arc_conn_get_char (conn, achar);
+	val   = arc_char_is_private (achar) ? cchar->val : achar->val;
+
+	/* read in chunks; this is an ugly workaround because bluez
+	 * cannot do long-writes (2013.09.20) */
+	len = 0;
+	if (!cchar->reading || cchar->pos > val->len) {
 		DBG ("%s: writing start blurb (%s)", __FUNCTION__, achar->name);
-		achar->data[0] = ARC_GATT_BLURB_PRE;
-		/* the token for begin-of-data */
-		if (len > 0) { /* copy a chunk  and remove it */
-			memcpy (&achar->data[1],
-				achar->val_scratch->data, len - 1);
-			g_byte_array_remove_range (
-				achar->val_scratch, 0, len - 1);
-		}
-		achar->writing = TRUE;
-	} else if (len > 0) { /* we're in the middle */
-		DBG ("%s: writing middle blurb (%s)", __FUNCTION__, achar->name);
-		memcpy (achar->data, achar->val_scratch->data, len);
-		g_byte_array_remove_range (achar->val_scratch, 0, len);
+		chunk[len++]   = ARC_GATT_BLURB_PRE;
+		cchar->pos     = 0;
+		cchar->reading = TRUE;
 	}
 
+	size = MIN (ARC_READ_MAXLEN - len, val->len - cchar->pos);
+	memcpy (chunk + len, val->data + cchar->pos, size);
+	len	   += size;
+	cchar->pos += size;
+
+	DBG ("%s: %s (%u byte(s), %u bytes(s) left)",
+		__FUNCTION__, achar->name, val->len, val->len - cchar->pos);
+
 	/* we're at the end? check if there's space left; if not, this
 	 * goes with the next read */
-	if (achar->val_scratch->len == 0 && len < BLE_MAXLEN) {
+	if (cchar->pos == val->len && len < ARC_READ_MAXLEN) {
 		DBG ("%s: writing end blurb (%s)", __FUNCTION__, achar->name);
-		achar->data[len] = ARC_GATT_BLURB_POST;
-		len += 1;
-		achar->writing	 = FALSE;
-		arc_char_init_scratch (achar, FALSE/*don't copy*/);
+		chunk[len++]   = ARC_GATT_BLURB_POST;
+		cchar->reading = FALSE;
 	}
 
-	attr->data = (uint8_t*)g_memdup(achar->data, len);
-	attr->len  = len;
+	DBG ("reading handle 0x%04x", handle);
 
-	DBG ("reading handle 0x%04x", attr->handle);
+	gatt_db_attribute_read_result (attrib, id, 0, chunk, len);
+}
 
-	return 0;
+static gboolean
+add_characteristic (ARCServer *self, ARCChar *achar)
+{
+	struct gatt_db_attribute	*attrib;
+	uint32_t			 perm;
+
+	perm = 0;
+	if (achar->flags & ARC_CHAR_FLAG_READABLE)
+		perm |= BT_ATT_PERM_READ;
+	if (achar->flags & ARC_CHAR_FLAG_WRITABLE)
+		perm |= BT_ATT_PERM_WRITE;
+
+	attrib = gatt_db_service_add_characteristic (
+		self->service, &achar->uuid, perm, achar->gatt_props,
+		attr_arc_server_read, attr_arc_server_write, self);
+	if (!attrib) {
+		error ("failed to add characteristic %s", achar->name);
+		return FALSE;
+	}
+
+	achar->val_handle = gatt_db_attribute_get_handle (attrib);
+	achar->handle	  = achar->val_handle - 1;
+
+	if (!(achar->flags & ARC_CHAR_FLAG_NOTIFY))
+		return TRUE;
+
+	attrib = btd_gatt_database_add_ccc (
+		btd_adapter_get_database (self->adapter),
+		gatt_db_attribute_get_handle (self->service),
+		NULL, NULL, NULL);
+	if (!attrib) {
+		error ("failed to add ccc for %s", achar->name);
+		return FALSE;
+	}
+
+	achar->ccc_handle = gatt_db_attribute_get_handle (attrib);
+
+	return TRUE;
 }
 
+
 static gboolean
 register_service (ARCServer *self)
 {
-	GHashTableIter	 iter;
-	gboolean	 rv;
-	const char	*uuidstr;
+	struct gatt_db	*db;
 	bt_uuid_t	 srv_uuid;
-	ARCChar		*req_char, *event_char, *result_char,
-			*devname_char, *jid_char;
+	unsigned	 u;
+	const char	*uuids[] = {
+		ARC_REQUEST_UUID, ARC_EVENT_UUID, ARC_RESULT_UUID,
+		ARC_DEVNAME_UUID, ARC_JID_UUID
+	};
+
+	db = arc_server_get_db (self);
+	if (!db) {
+		error ("no gatt database for adapter");
+		return FALSE;
+	}
 
 	bt_string_to_uuid (&srv_uuid, ARC_SERVICE_UUID);
 
-	req_char     = arc_char_table_find_by_uuid (self->char_table,
-						ARC_REQUEST_UUID);
-	event_char   = arc_char_table_find_by_uuid (self->char_table,
-						ARC_EVENT_UUID);
-	result_char  = arc_char_table_find_by_uuid (self->char_table,
-						ARC_RESULT_UUID);
-	devname_char = arc_char_table_find_by_uuid (self->char_table,
-						ARC_DEVNAME_UUID);
-	jid_char     = arc_char_table_find_by_uuid (self->char_table,
-						ARC_JID_UUID);
-
-	rv = gatt_service_add (
-		self->adapter, GATT_PRIM_SVC_UUID, &srv_uuid,
-
-		GATT_OPT_CHR_UUID, &req_char->uuid,
-		GATT_OPT_CHR_PROPS, req_char->gatt_props,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_WRITE,
-		attr_arc_server_write, self,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_READ,
-		attr_arc_server_read, self,
-		GATT_OPT_CHR_VALUE_GET_HANDLE, &req_char->val_handle,
-
-		GATT_OPT_CHR_UUID, &event_char->uuid,
-		GATT_OPT_CHR_PROPS, event_char->gatt_props,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_WRITE,
-		attr_arc_server_write, self,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_READ,
-		attr_arc_server_read, self,
-		GATT_OPT_CHR_VALUE_GET_HANDLE, &event_char->val_handle,
-
-		GATT_OPT_CHR_UUID, &result_char->uuid,
-		GATT_OPT_CHR_PROPS, result_char->gatt_props,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_WRITE,
-		attr_arc_server_write, self,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_READ,
-		attr_arc_server_read, self,
-		GATT_OPT_CHR_VALUE_GET_HANDLE, &result_char->val_handle,
-
-		GATT_OPT_CHR_UUID, &devname_char->uuid,
-		GATT_OPT_CHR_PROPS, devname_char->gatt_props,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_WRITE,
-		attr_arc_server_write, self,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_READ,
-		attr_arc_server_read, self,
-		GATT_OPT_CHR_VALUE_GET_HANDLE, &devname_char->val_handle,
-
-		GATT_OPT_CHR_UUID, &jid_char->uuid,
-		GATT_OPT_CHR_PROPS, jid_char->gatt_props,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_WRITE,
-		attr_arc_server_write, self,
-		GATT_OPT_CHR_VALUE_CB, ATTRIB_READ,
-		attr_arc_server_read, self,
-		GATT_OPT_CHR_VALUE_GET_HANDLE, &jid_char->val_handle,
-
-		GATT_OPT_INVALID);
-
-
-	if (!rv)  {
-		error ("failed to add characteristics");
+	/* the service declaration, declaration and value for each
+	 * characteristic, and the ccc's of result and event */
+	self->service = gatt_db_add_service (db, &srv_uuid, true,
+					     1 + 2 * G_N_ELEMENTS (uuids) + 2);
+	if (!self->service) {
+		error ("failed to add service");
 		return FALSE;
-	} else
-		DBG ("added characteristics");
+	}
+
+	for (u = 0; u != G_N_ELEMENTS (uuids); ++u) {
+		ARCChar *achar;
+
+		achar = arc_char_table_find_by_uuid (self->char_table,
+						     uuids[u]);
+		if (!achar || !add_characteristic (self, achar))
+			goto fail;
+	}
+
+	if (!gatt_db_service_set_active (self->service, true))
+		goto fail;
+
+	DBG ("added characteristics");
 
 	return TRUE;
+
+fail:
+	error ("failed to add characteristics");
+	gatt_db_remove_service (db, self->service);
+	self->service = NULL;
+
+	return FALSE;
 }
 
 /*
@@ -565,47 +1341,118 @@ find_device_for_object_path (ARCServer *self, const char *obj_path)
 	return cbdata.device;
 }
 
-static int
-chunked_attrib_db_update (ARCServer *self, ARCChar *achar)
+typedef struct {
+	ARCServer		*server;
+	ARCChar			*achar;
+	struct btd_device	*target; /* NULL for every subscriber */
+	GByteArray		*val;
+	GByteArray		*frames[ARC_MODE_SUPPORTED + 1]; /* by mode */
+} StreamData;
+
+/*
+ * push a frame to one subscriber as a series of notifications; each
+ * starts with a header byte, ARC_NOTIFY_FIRST for the first one and
+ * a wrapping sequence number for the rest, followed by as much of the
+ * frame as the MTU allows
+ */
+static void
+stream_to_subscriber (struct btd_device *device,
+		      struct bt_gatt_server *server, void *user_data)
 {
-	int		 ret;
-	const unsigned	 chunksize = 20;
-	unsigned	 len;
-	guint8		*bytes, *cur;
-	char		*s;
-
-	/* wrap in 0xfe <data> 0xff */
-	len   = achar->val->len + 2;
-	bytes = g_new (guint8, len);
-	memcpy (bytes + 1, achar->val->data, achar->val->len);
-	bytes[0]		   = ARC_GATT_BLURB_PRE;
-	bytes[achar->val->len + 1] = ARC_GATT_BLURB_POST;
-
-	ret			   = 0;
-	cur			   = bytes;
-
-
-	for (;;) {
-		size_t	size;
-		size = MIN(len, chunksize);
-		if (!arc_attrib_db_update (self, achar)) {
-			error ("failed to update attrib ('%s')", achar->name);
+	StreamData	*sdata;
+	ARCConn		*conn;
+	GByteArray	*frame;
+	guint8		*buf;
+	guint		 pos, chunksize, num;
+	guint8		 mode;
+	uint16_t	 mtu;
+
+	sdata = (StreamData*)user_data;
+
+	if (sdata->target && sdata->target != device)
+		return;
+
+	/* frame it the way this client asked for */
+	conn = arc_conn_find_by_device (sdata->server, device);
+	mode = conn ? conn->mode : 0;
+	if (!sdata->frames[mode])
+		sdata->frames[mode] = arc_blurb_frame (
+			sdata->val->data, sdata->val->len, mode);
+	frame = sdata->frames[mode];
+
+	/* 3 bytes of notification header, 1 for the sequence number */
+	mtu = bt_gatt_server_get_mtu (server);
+	if (mtu <= 4)
+		return;
+
+	chunksize = mtu - 4;
+	buf	  = g_malloc (chunksize + 1);
+
+	for (pos = 0, num = 0; pos < frame->len; ++num) {
+		guint size;
+
+		size   = MIN (chunksize, frame->len - pos);
+		buf[0] = num ? num & ARC_NOTIFY_SEQ_MASK : ARC_NOTIFY_FIRST;
+		memcpy (buf + 1, frame->data + pos, size);
+
+		if (!bt_gatt_server_send_notification (
+			    server, sdata->achar->val_handle, buf, size + 1)) {
+			error ("failed to notify %s", sdata->achar->name);
 			break;
 		}
-		DBG ("written chunk (%u octets)", size);
 
-		if (size < chunksize)
-			break; /* we're done */
+		pos += size;
+	}
+
+	DBG ("streamed %s to %s (%u chunk(s))", sdata->achar->name,
+	     device_get_path (device), num);
+
+	g_free (buf);
+}
+
+
+static void
+arc_server_notify (ARCServer *self, ARCChar *achar, GByteArray *val,
+		   struct btd_device *target)
+{
+	StreamData	sdata;
+	unsigned	u;
 
-		cur += size;
-		len -= size;
+	/* not notifiable; readers will pick it up */
+	if (achar->ccc_handle == 0)
+		return;
+
+	/* frames are built as needed, once for each mode */
+	memset (&sdata, 0, sizeof(sdata));
+	sdata.server = self;
+	sdata.achar  = achar;
+	sdata.target = target;
+	sdata.val    = val;
+
+	btd_gatt_database_foreach_subscriber (
+		btd_adapter_get_database (self->adapter),
+		achar->ccc_handle, stream_to_subscriber, &sdata);
+
+	for (u = 0; u != G_N_ELEMENTS (sdata.frames); ++u)
+		if (sdata.frames[u])
+			g_byte_array_unref (sdata.frames[u]);
+}
+
+
+static int
+chunked_gatt_db_update (ARCServer *self, ARCChar *achar)
+{
+	if (!arc_gatt_db_update (self, achar)) {
+		error ("failed to update attrib ('%s')", achar->name);
+		return -EIO;
 	}
 
-	g_free (bytes);
+	arc_server_notify (self, achar, achar->val, NULL);
 
-	return ret;
+	return 0;
 }
 
+
 static DBusMessage*
 emit_event_method (DBusConnection *conn, DBusMessage *msg,
 		   ARCServer *self)
@@ -632,7 +1479,7 @@ emit_event_method (DBusConnection *conn, DBusMessage *msg,
 
 	arc_char_set_value_string (event_achar, event);
 
-	ret = chunked_attrib_db_update (self, event_achar);
+	ret = chunked_gatt_db_update (self, event_achar);
 	if (ret != 0)
 		DBG ("error writing event to GATT: %s",
 		     strerror(-ret));
@@ -648,22 +1495,16 @@ emit_event_method (DBusConnection *conn, DBusMessage *msg,
 
 
 static DBusMessage*
-submit_result_method (DBusConnection *conn, DBusMessage *msg, ARCServer *self)
+submit_result (ARCServer *self, DBusMessage *msg, const char *target_path,
+	       guint32 reqid, const char *results)
 {
 	DBusMessage		*reply;
-	const char		*results, *target_path;
-	gboolean		 rv;
-	int			 ret;
-	char			*res;
 	struct btd_device	*device;
 	ARCChar			*result_achar;
-
-	rv     = dbus_message_get_args (msg, NULL,
-					DBUS_TYPE_OBJECT_PATH, &target_path,
-					DBUS_TYPE_STRING, &results,
-					DBUS_TYPE_INVALID);
-	if (!rv || !results)
-		return btd_error_invalid_args (msg);
+	ARCConn			*conn;
+	ARCConnChar		*cchar;
+	GByteArray		*val;
+	gboolean		 rv;
 
 	device = find_device_for_object_path (self, target_path);
 	if (!device)
@@ -674,14 +1515,25 @@ submit_result_method (DBusConnection *conn, DBusMessage *msg, ARCServer *self)
 	if (!result_achar)
 		return btd_error_failed (msg, "could not find characteristic");
 
-	/* arc_attrib_db_clear (self, result_achar); */
-	arc_char_set_value_string (result_achar, results);
+	/* results are kept with the connection they are for */
+	conn = arc_conn_find_by_device (self, device);
+	if (!conn)
+		return btd_error_failed (msg, "target is not connected");
 
-	DBG ("%s: updating with [%s]", __FUNCTION__, results);
-	if (!arc_attrib_db_update (self, result_achar)) {
-		return btd_error_failed
-			(msg, "gatt update failed (result)");
-	}
+	DBG ("%s: updating with [%u: %s]", __FUNCTION__, reqid, results);
+
+	val = g_byte_array_new ();
+	arc_blurb_append_id (val, reqid);
+	g_byte_array_append (val, (const guint8*)results, strlen (results));
+
+	cchar = arc_conn_get_char (conn, result_achar);
+	rv    = arc_conn_set (conn, cchar->val, val->data, val->len);
+	g_byte_array_unref (val);
+	if (!rv)
+		return btd_error_failed (msg, "result is too large");
+
+	cchar->reading = FALSE;
+	arc_server_notify (self, result_achar, cchar->val, device);
 
 	if (!(reply = dbus_message_new_method_return (msg)))
 		return btd_error_failed (msg, "error creating DBus reply");
@@ -692,48 +1544,109 @@ submit_result_method (DBusConnection *conn, DBusMessage *msg, ARCServer *self)
 }
 
 
+static DBusMessage*
+submit_result_method (DBusConnection *conn, DBusMessage *msg, ARCServer *self)
+{
+	const char	*results, *target_path;
+	gboolean	 rv;
+
+	rv     = dbus_message_get_args (msg, NULL,
+					DBUS_TYPE_OBJECT_PATH, &target_path,
+					DBUS_TYPE_STRING, &results,
+					DBUS_TYPE_INVALID);
+	if (!rv || !results)
+		return btd_error_invalid_args (msg);
+
+	return submit_result (self, msg, target_path, 0, results);
+}
+
+
+static DBusMessage*
+submit_result_with_id_method (DBusConnection *conn, DBusMessage *msg,
+			      ARCServer *self)
+{
+	const char	*results, *target_path;
+	guint32		 reqid;
+	gboolean	 rv;
+
+	rv     = dbus_message_get_args (msg, NULL,
+					DBUS_TYPE_OBJECT_PATH, &target_path,
+					DBUS_TYPE_UINT32, &reqid,
+					DBUS_TYPE_STRING, &results,
+					DBUS_TYPE_INVALID);
+	if (!rv || !results || reqid == 0)
+		return btd_error_invalid_args (msg);
+
+	return submit_result (self, msg, target_path, reqid, results);
+}
+
+
+
+static void
+on_enable_advertising_done (gboolean success, DBusMessage *msg)
+{
+	DBusMessage *reply;
+
+	if (success)
+		reply = dbus_message_new_method_return (msg);
+	else
+		reply = btd_error_failed (msg, "changing advertising failed");
+
+	g_dbus_send_message (btd_get_dbus_connection (), reply);
+}
+
 
 /**
  * Implementation of the EnableAdvertising DBus method.
  *
  * Attempt to change the advertising state of this adapter; this is
  * needed before doing scans, since one cannot do scans while in
- * advertising mode
+ * advertising mode. The reply is sent once the kernel has handled
+ * the request.
  *
  * @param conn dbus connection
  * @param msg dbus message
  * @param self this arc server
  *
- * @return a DBUS-message with the response
+ * @return NULL, or a DBUS-message with an error
  */
 static DBusMessage*
 enable_advertising_method (DBusConnection *conn, DBusMessage *msg, ARCServer *self)
 {
-	DBusMessage	*reply;
 	gboolean	 enable, rv;
-	int		 ret;
 
 	rv = dbus_message_get_args (msg, NULL,
 				    DBUS_TYPE_BOOLEAN, &enable,
 				    DBUS_TYPE_INVALID);
+	if (!rv)
+		return btd_error_invalid_args (msg);
+
+	DBG ("arc: %sable advertising", enable ? "en" : "dis");
+
+	/* the scheduler is in charge */
+	if (arc_sched_is_running (self))
+		return btd_error_busy (msg);
 
 	/* turning advertising on/off */
-	if (!arc_server_advertise (self, enable)) {
-		char	*blurb;
+	if (!arc_server_advertise (
+		    self, enable,
+		    (ARCAdvertiseFunc)on_enable_advertising_done,
+		    dbus_message_ref (msg),
+		    (GDestroyNotify)dbus_message_unref)) {
+		char		*blurb;
+		DBusMessage	*reply;
+
 		blurb = g_strdup_printf ("%sabling advertising failed",
 					 enable ? "en" : "dis");
 		reply = btd_error_failed (msg, blurb);
 		g_free (blurb);
-	} else if (!(reply = dbus_message_new_method_return (msg)))
-		reply = btd_error_failed (msg, "error creating DBus reply");
-	else {
-		DBG ("arc: %sable advertising", enable ? "en" : "dis");
-		dbus_message_append_args(reply, DBUS_TYPE_INVALID);
+
+		return reply;
 	}
 
 	/* btd_adapter_set_fast_connectable (self->adapter, enable); */
 
-	return reply;
+	return NULL;
 }
 
 
@@ -778,13 +1691,15 @@ name_property_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
 	}
 
 	arc_char_set_value_string (name_char, name);
-	if (chunked_attrib_db_update (aserver, name_char)) {
+	if (chunked_gatt_db_update (aserver, name_char)) {
 		g_dbus_pending_property_error(
 			id, ERROR_INTERFACE ".InvalidArguments",
 			"Failed to update GATT");
 		return;
 	}
 
+	arc_server_update_advertising (aserver);
+
 	g_dbus_emit_property_changed (btd_get_dbus_connection (),
 				      adapter_get_path (aserver->adapter),
 				      ARC_SERVER_IFACE, property->name);
@@ -811,6 +1726,7 @@ magic_property_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
 	aserver->magic = byte;
 
 	DBG ("setting magic to 0x%x", byte);
+	arc_server_update_advertising (aserver);
 
 	g_dbus_emit_property_changed (btd_get_dbus_connection (),
 				adapter_get_path (aserver->adapter),
@@ -859,7 +1775,7 @@ gatt_property_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
 	}
 
 	arc_char_set_value_string (achar, str);
-	if (chunked_attrib_db_update (aserver, achar) != 0) {
+	if (chunked_gatt_db_update (aserver, achar) != 0) {
 		g_dbus_pending_property_error(
 			id, ERROR_INTERFACE ".InvalidArguments",
 			"Failed to update GATT");
@@ -916,6 +1832,117 @@ gatt_property_get (const GDBusPropertyTable *property,
 
 
 
+static gboolean
+sched_property_get (const GDBusPropertyTable *property,
+		    DBusMessageIter *iter, ARCServer *aserver)
+{
+	guint32 val;
+
+	if (g_strcmp0 (property->name, "AdvertiseWindow") == 0)
+		val = aserver->adv_window;
+	else if (g_strcmp0 (property->name, "PauseWindow") == 0)
+		val = aserver->pause_window;
+	else
+		val = aserver->idle_timeout;
+
+	dbus_message_iter_append_basic (iter, DBUS_TYPE_UINT32, &val);
+	return TRUE;
+}
+
+
+
+static void
+sched_property_set (const GDBusPropertyTable *property, DBusMessageIter *iter,
+		    GDBusPendingPropertySet id, ARCServer *aserver)
+{
+	guint32 val;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_UINT32) {
+		g_dbus_pending_property_error(
+			id, ERROR_INTERFACE ".InvalidArguments",
+			"Invalid request parameter");
+		return;
+	}
+
+	dbus_message_iter_get_basic(iter, &val);
+	DBG ("setting %s to %u", property->name, val);
+
+	if (g_strcmp0 (property->name, "AdvertiseWindow") == 0)
+		aserver->adv_window = val;
+	else if (g_strcmp0 (property->name, "PauseWindow") == 0)
+		aserver->pause_window = val;
+	else /* takes effect at the next client activity */
+		aserver->idle_timeout = val;
+
+	if (g_strcmp0 (property->name, "IdleTimeout") != 0)
+		arc_sched_update (aserver);
+
+	g_dbus_emit_property_changed (btd_get_dbus_connection (),
+				      adapter_get_path (aserver->adapter),
+				      ARC_SERVER_IFACE, property->name);
+
+	g_dbus_pending_property_success (id);
+}
+
+
+
+static gboolean
+window_property_get (const GDBusPropertyTable *property,
+		     DBusMessageIter *iter, ARCServer *aserver)
+{
+	const char *window;
+
+	if (!arc_sched_is_running (aserver))
+		window = "off";
+	else
+		window = aserver->adv_window_active ? "advertise" : "pause";
+
+	dbus_message_iter_append_basic (iter, DBUS_TYPE_STRING, &window);
+	return TRUE;
+}
+
+
+
+static gboolean
+stats_property_get (const GDBusPropertyTable *property,
+		    DBusMessageIter *iter, ARCServer *aserver)
+{
+	DBusMessageIter	 dict;
+	ARCStats	*stats;
+	guint32		 avg;
+
+	stats = &aserver->stats;
+	avg   = stats->timed_connections ?
+		stats->connect_time / stats->timed_connections : 0;
+
+	dbus_message_iter_open_container (
+		iter, DBUS_TYPE_ARRAY,
+		DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+		DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+		DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	dict_append_entry (&dict, "Windows", DBUS_TYPE_UINT32,
+			   &stats->windows);
+	dict_append_entry (&dict, "Connections", DBUS_TYPE_UINT32,
+			   &stats->connections);
+	dict_append_entry (&dict, "LastConnectTime", DBUS_TYPE_UINT32,
+			   &stats->last_connect_time);
+	dict_append_entry (&dict, "AverageConnectTime", DBUS_TYPE_UINT32,
+			   &avg);
+	dict_append_entry (&dict, "Requests", DBUS_TYPE_UINT32,
+			   &stats->requests);
+	dict_append_entry (&dict, "WindowRequests", DBUS_TYPE_UINT32,
+			   &stats->window_requests);
+	dict_append_entry (&dict, "LastWindowRequests", DBUS_TYPE_UINT32,
+			   &stats->last_window_requests);
+
+	dbus_message_iter_close_container (iter, &dict);
+
+	return TRUE;
+}
+
+
+
 static const GDBusPropertyTable
 ARC_SERVER_PROPS[] = {
 	{ "DeviceName", "s",
@@ -933,6 +1960,29 @@ ARC_SERVER_PROPS[] = {
 	  (GDBusPropertySetter)magic_property_set,
 	  NULL
 	},
+	{ "AdvertiseWindow", "u", /* msec */
+	  (GDBusPropertyGetter)sched_property_get,
+	  (GDBusPropertySetter)sched_property_set,
+	  NULL
+	},
+	{ "PauseWindow", "u", /* msec */
+	  (GDBusPropertyGetter)sched_property_get,
+	  (GDBusPropertySetter)sched_property_set,
+	  NULL
+	},
+	{ "IdleTimeout", "u", /* sec */
+	  (GDBusPropertyGetter)sched_property_get,
+	  (GDBusPropertySetter)sched_property_set,
+	  NULL
+	},
+	{ "Window", "s",
+	  (GDBusPropertyGetter)window_property_get,
+	  NULL, NULL
+	},
+	{ "Statistics", "a{sv}",
+	  (GDBusPropertyGetter)stats_property_get,
+	  NULL, NULL
+	},
 	{}
 };
 
@@ -942,6 +1992,10 @@ ARC_SERVER_SIGNALS[] = {
 	{ GDBUS_SIGNAL ("MethodCalled",
 			GDBUS_ARGS({"Caller", "o"},
 				   {"Params", "s"}))},
+	{ GDBUS_SIGNAL ("MethodCalledWithId",
+			GDBUS_ARGS({"Caller", "o"},
+				   {"Id", "u"},
+				   {"Params", "s"}))},
 	{}
 };
 
@@ -954,12 +2008,19 @@ ARC_SERVER_METHODS[] = {
 		      {"Result", "s" }), /* json blob (in) */
 	   NULL, (GDBusMethodFunction)submit_result_method)},
 
+	{ GDBUS_METHOD
+	  ("SubmitResultWithId",
+	   GDBUS_ARGS({"Recipient", "o"},
+		      {"Id", "u"},
+		      {"Result", "s" }), /* json blob (in) */
+	   NULL, (GDBusMethodFunction)submit_result_with_id_method)},
+
 	{ GDBUS_METHOD
 	  ("EmitEvent",
 	   GDBUS_ARGS({ "Event", "s" }), /* json blob (in) */
 	   NULL, (GDBusMethodFunction)emit_event_method) },
 
-	{ GDBUS_METHOD
+	{ GDBUS_ASYNC_METHOD
 	  ("EnableAdvertising",
 	   GDBUS_ARGS({ "Enable", "b" }),
 	   NULL, (GDBusMethodFunction)enable_advertising_method) },
@@ -71,30 +71,11 @@ free_arch_char (ARCChar *achar)
 
 	if (achar->val)
 		g_byte_array_unref (achar->val);
-	if (achar->val_scratch)
-		g_byte_array_unref (achar->val_scratch);
 
 	g_free (achar);
 }
 
 
-void
-arc_char_init_scratch (ARCChar *achar, gboolean copy)
-{
-	/* remove old garbage */
-	if (achar->val_scratch->len)
-		g_byte_array_remove_range (
-			achar->val_scratch, 0, achar->val_scratch->len);
-
-	/* copy from val */
-	if (copy && achar->val->len)
-		g_byte_array_append (achar->val_scratch,
-				     achar->val->data, achar->val->len);
-}
-
-
-
-
 GHashTable*
 arc_char_table_new (void)
 {
@@ -112,11 +93,12 @@ arc_char_table_new (void)
 	arc_char_table_add_char (
 		char_table,
 		ARC_RESULT_UUID, "Result",
-		ARC_CHAR_FLAG_READABLE);
+		ARC_CHAR_FLAG_READABLE | ARC_CHAR_FLAG_NOTIFY);
 	arc_char_table_add_char (
 		char_table,
 		ARC_EVENT_UUID, "Event",
-		ARC_CHAR_FLAG_READABLE | ARC_CHAR_FLAG_WRITABLE);
+		ARC_CHAR_FLAG_READABLE | ARC_CHAR_FLAG_WRITABLE |
+		ARC_CHAR_FLAG_NOTIFY);
 	arc_char_table_add_char (
 		char_table,
 		ARC_DEVNAME_UUID, "DeviceName",
@@ -145,7 +127,6 @@ arc_char_table_add_char (GHashTable *table,
 	achar->name	   = g_strdup (name);
 	achar->uuidstr	   = g_strdup (uuidstr);
 	achar->val	   = g_byte_array_new ();
-	achar->val_scratch = g_byte_array_new ();
 	achar->flags	   = flags;
 
 	bt_string_to_uuid (&achar->uuid, achar->uuidstr);
@@ -153,8 +134,12 @@ arc_char_table_add_char (GHashTable *table,
 	achar->gatt_props = 0;
 	if (achar->flags & ARC_CHAR_FLAG_READABLE)
 		achar->gatt_props |= GATT_CHR_PROP_READ;
+	/* writes can be streamed without waiting for responses */
 	if (achar->flags & ARC_CHAR_FLAG_WRITABLE)
-		achar->gatt_props |= GATT_CHR_PROP_WRITE;
+		achar->gatt_props |= GATT_CHR_PROP_WRITE |
+			GATT_CHR_PROP_WRITE_WITHOUT_RESP;
+	if (achar->flags & ARC_CHAR_FLAG_NOTIFY)
+		achar->gatt_props |= GATT_CHR_PROP_NOTIFY;
 
 	g_hash_table_insert (table, achar->uuidstr, achar);
 
@@ -173,20 +158,19 @@ arc_char_table_find_by_uuid (GHashTable *table, const char *uuid)
 
 
 ARCChar*
-arc_char_table_find_by_attr (GHashTable *table,
-				  struct attribute* attr)
+arc_char_table_find_by_handle (GHashTable *table, guint16 handle)
 {
 	GHashTableIter	 iter;
 	const char	*uuidstr;
 	ARCChar		*achar;
 
 	g_return_val_if_fail (table, NULL);
-	g_return_val_if_fail (attr, NULL);
+	g_return_val_if_fail (handle != 0, NULL);
 
 	g_hash_table_iter_init (&iter, table);
 	while (g_hash_table_iter_next (&iter, (gpointer)&uuidstr,
 				       (gpointer)&achar))
-		if (attr->handle == achar->val_handle)
+		if (handle == achar->val_handle)
 			return achar;
 
 	return NULL;
@@ -212,24 +196,6 @@ arc_char_table_find_by_name (GHashTable *table, const char *name)
 }
 
 
-void
-arc_char_table_clear_working_data (GHashTable *table)
-{
-	GHashTableIter	 iter;
-	const char	*uuidstr;
-	ARCChar		*achar;
-
-	g_return_if_fail (table);
-
-	g_hash_table_iter_init (&iter, table);
-	while (g_hash_table_iter_next (&iter, (gpointer)&uuidstr,
-				       (gpointer)&achar)) {
-		arc_char_init_scratch (achar, FALSE/*don't copy*/);
-		achar->writing = FALSE;
-	}
-}
-
-
 
 
 void
@@ -259,7 +225,6 @@ arc_char_get_value_string (ARCChar *achar)
 
 
 
-
 const char*
 arc_id_to_prop (ARCID id)
 {
@@ -322,223 +287,166 @@ arc_dump_bytes (uint8_t *bytes, size_t len)
 
 
 
-static int
-hci_enable_adv (int hcidev, gboolean enable)
-{
-	struct hci_request			rq;
-	le_set_advertise_enable_cp		advertise_cp;
-	le_set_advertising_parameters_cp	adv_params_cp;
-	uint8_t					status;
-	int					ret;
-
-	/* p.1059 of the BT Core Spec 4.x */
-
-	memset(&adv_params_cp, 0, sizeof(adv_params_cp));
-	adv_params_cp.min_interval = htobs(0x0800);
-	adv_params_cp.max_interval = htobs(0x0800);
-	adv_params_cp.chan_map	   = 0x07; /* all channels */
-	adv_params_cp.advtype	   = 0x00; /* Connectable undirected
-					    * advertising */
- 	memset(&rq, 0, sizeof(rq));
-	rq.ogf	  = OGF_LE_CTL;
-	rq.ocf	  = OCF_LE_SET_ADVERTISING_PARAMETERS;
-	rq.cparam = &adv_params_cp;
-	rq.clen	  = LE_SET_ADVERTISING_PARAMETERS_CP_SIZE;
-	rq.rparam = &status;
-	rq.rlen	  = 1;
-
-	ret = hci_send_req (hcidev, &rq, 1000);
-	if (ret != 0) {
-		error ("setting adv params failed: %s", strerror(errno));
-		return ret;
-	}
-
-	memset(&advertise_cp, 0, sizeof(advertise_cp));
-	advertise_cp.enable = enable ? 0x01 : 0x00;
-
-	memset(&rq, 0, sizeof(rq));
-	rq.ogf	  = OGF_LE_CTL;
-	rq.ocf	  = OCF_LE_SET_ADVERTISE_ENABLE;
-	rq.cparam = &advertise_cp;
-	rq.clen	  = LE_SET_ADVERTISE_ENABLE_CP_SIZE;
-	rq.rparam = &status;
-	rq.rlen	  = 1;
-
-	ret = hci_send_req (hcidev, &rq, 1000);
-	if (ret != 0) {
-		error ("enable adv failed: %s", strerror(errno));
-		return ret;
-	}
-
-	return 0;
-}
-
+/* the advertising instance used for ARC; note that this is shared
+ * with the LE advertising manager, which should not be used together
+ * with ARC */
+#define ARC_ADV_INSTANCE	0x01
 
+/* the legacy advertising data limit */
+#define ARC_ADV_DATA_MAXLEN	31
 
 
 /* this all makes sense after reading the BT spec, in particular
  * Appendix C */
-static int
-hci_set_adv_data (int hcidev, uint8_t data, const char *name)
+static size_t
+arc_adv_data (uint8_t data, const char *name, uint8_t *buf)
 {
-	struct hci_request		rq;
-	le_set_advertising_data_cp	advdata_cp;
-	uint8_t				status;
-	int				ret;
-	bt_uuid_t			uuid;
-	unsigned			offset, partsize;
+	bt_uuid_t	uuid;
+	unsigned	offset, partsize;
 
-	g_return_val_if_fail (hcidev, -1);
-
-	memset(&advdata_cp, 0, sizeof(advdata_cp));
+	memset (buf, 0, ARC_ADV_DATA_MAXLEN);
 	offset = 0;
 
 	/* the UUID to advertise */
 	partsize = sizeof(uint128_t) + 1;
-	advdata_cp.data[offset + 0] = partsize;
-	advdata_cp.data[offset + 1] = 0x07; /* uuid */
+	buf[offset + 0] = partsize;
+	buf[offset + 1] = 0x07; /* uuid */
 	bt_string_to_uuid (&uuid, ARC_SERVICE_UUID);
 	g_assert (uuid.type == BT_UUID128);
-	memcpy (&advdata_cp.data[offset + 2], &uuid.value.u128,
+	memcpy (&buf[offset + 2], &uuid.value.u128,
 		sizeof(uuid.value.u128));
 	offset += partsize + 1;
 
 	/* set our manufacturer-specific byte */
 	partsize = 4;
-	advdata_cp.data[offset + 0] = partsize;
-	advdata_cp.data[offset + 1] = 0xff; /* manufacturer-specific data; */
-	advdata_cp.data[offset + 2] = 0xf2;  /* Unknown */
-	advdata_cp.data[offset + 3] = 0x00;  /* Vendor */
-	advdata_cp.data[offset + 4] = data;
+	buf[offset + 0] = partsize;
+	buf[offset + 1] = 0xff; /* manufacturer-specific data; */
+	buf[offset + 2] = 0xf2;  /* Unknown */
+	buf[offset + 3] = 0x00;  /* Vendor */
+	buf[offset + 4] = data;
 	offset += partsize + 1;
 
 	/* the local name to advertise */
-	if (name && name[0] != '\0') {
+	if (name && name[0] != '\0' && offset + 2 < ARC_ADV_DATA_MAXLEN) {
 		unsigned strsize;
-		strsize = MIN(strlen(name),
-			      LE_SET_ADVERTISING_DATA_CP_SIZE - offset - 4);
+		strsize = MIN(strlen(name), ARC_ADV_DATA_MAXLEN - offset - 2);
 		partsize = strsize + 1;
-		advdata_cp.data[offset + 0] = partsize;
-		advdata_cp.data[offset + 1] = 0x08;	/* short local name */
-		memcpy (&advdata_cp.data[offset + 2], name, strsize);
+		buf[offset + 0] = partsize;
+		buf[offset + 1] = 0x08;	/* short local name */
+		memcpy (&buf[offset + 2], name, strsize);
 		offset += partsize + 1;
 
 		DBG ("advertising name '%s'", name);
 	}
 
-	advdata_cp.length  = offset + 1;
-
-	DBG ("hci adv data");
-	arc_dump_bytes ((uint8_t*)&advdata_cp, sizeof(advdata_cp));
-
-	memset (&rq, 0, sizeof(rq));
-	rq.ogf	  = OGF_LE_CTL;
-	rq.ocf	  = OCF_LE_SET_ADVERTISING_DATA;
-	rq.cparam = &advdata_cp;
-	rq.clen	  = sizeof (advdata_cp);
-	rq.rparam = &status;
-	rq.rlen	  = 1;
-
-	return hci_send_req (hcidev, &rq, 1000);
+	return offset;
 }
 
 
+typedef struct {
+	gboolean		enable;
+	ARCAdvertiseFunc	func;
+	gpointer		user_data;
+	GDestroyNotify		destroy;
+} AdvData;
 
-/**
- * Get an HCI-device handle. Close with hci_close_dev
- *
- * @param serf an ARCServer
- * @param hcisock an HCI-socket
- *
- * @return the device handle, < 0 in case or error
- */
-static int
-get_hci_device (struct btd_adapter *adapter, int hcisock)
+static void
+adv_data_free (AdvData *adata)
 {
-	int			hcidev, fd;
-	struct hci_dev_info	devinfo;
+	if (adata->destroy)
+		adata->destroy (adata->user_data);
 
-	devinfo.dev_id = btd_adapter_get_index (adapter);
-	if (devinfo.dev_id == MGMT_INDEX_NONE) {
-		error ("can't get adapter index");
-		return -1;
-	}
-
-	devinfo.flags = HCI_RAW;
-
-	if (ioctl (hcisock, HCIGETDEVINFO, (void*)&devinfo) != 0) {
-		error ("can't get hci socket");
-		return -1;
-	}
-
-	fd = hci_open_dev (devinfo.dev_id);
-	hci_read_bd_addr(fd, &devinfo.bdaddr, 1000);
-	hci_close_dev(fd);
-
-	hcidev = hci_open_dev (devinfo.dev_id);
-	if (hcidev < 0) {
-		error ("failed to open hci device");
-		return -1;
-	}
+	g_free (adata);
+}
 
-	return hcidev;
+static void
+on_advertising_done (uint8_t status, uint16_t length, const void *param,
+		     AdvData *adata)
+{
+	gboolean success;
+
+	/* when disabling, there may not have been anything to remove */
+	success = status == MGMT_STATUS_SUCCESS ||
+		(!adata->enable && status == MGMT_STATUS_INVALID_PARAMS);
+	if (!success)
+		error ("failed to %sable advertising: %s (0x%02x)",
+		       adata->enable ? "en" : "dis",
+		       mgmt_errstr (status), status);
+
+	if (adata->func)
+		adata->func (success, adata->user_data);
 }
 
 
 /**
- * Enable/Disable advertising using the HCI-interface
+ * Enable/Disable advertising through the management interface; this
+ * does not block, the result is reported through func.
  *
+ * @param mgmt a management interface
  * @param adapter a bluetooth adapter
  * @param magic the magic byte to set
  * @param enable if TRUE, enable advertising, otherwise disable it
+ * @param func function to call when done (or NULL)
+ * @param user_data user data for func
+ * @param destroy function to free user_data (or NULL)
  *
- * @return TRUE if enabling or disabling worked, FALSE otherwise
+ * @return TRUE if the request was sent, FALSE otherwise; in the
+ * latter case, func is not called (destroy is)
  */
 gboolean
-arc_enable_advertising (struct btd_adapter *adapter, uint8_t magic,
-			gboolean enable)
+arc_enable_advertising (struct mgmt *mgmt, struct btd_adapter *adapter,
+			uint8_t magic, gboolean enable,
+			ARCAdvertiseFunc func, gpointer user_data,
+			GDestroyNotify destroy)
 {
-	gboolean		rv;
-	struct hci_dev_info	devinfo;
-	struct hci_request	rq;
-	int			hcisock, hcidev, ret;
-	uint8_t byte[] = { 0x0 };
-
-	rv     = FALSE;
-	hcidev = hcisock = -1;
-
-	hcisock = socket (AF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
-	if (hcisock < 0)  {
-		error ("cannot open hci-socket: %s", strerror (errno));
-		goto leave;
+	AdvData		*adata;
+	uint8_t		 buf[sizeof (struct mgmt_cp_add_advertising) +
+			     ARC_ADV_DATA_MAXLEN];
+	uint16_t	 opcode, len;
+	unsigned	 id;
+
+	adata		 = g_new0 (AdvData, 1);
+	adata->enable	 = enable;
+	adata->func	 = func;
+	adata->user_data = user_data;
+	adata->destroy	 = destroy;
+
+	if (enable) {
+		struct mgmt_cp_add_advertising *cp;
+
+		/* adding an existing instance updates its data */
+		cp		 = (struct mgmt_cp_add_advertising*)buf;
+		memset (cp, 0, sizeof (*cp));
+		cp->instance	 = ARC_ADV_INSTANCE;
+		cp->flags	 = htobl (MGMT_ADV_FLAG_CONNECTABLE);
+		cp->adv_data_len = arc_adv_data (
+			magic, btd_adapter_get_name (adapter), cp->data);
+
+		DBG ("mgmt adv data");
+		arc_dump_bytes (cp->data, cp->adv_data_len);
+
+		opcode = MGMT_OP_ADD_ADVERTISING;
+		len    = sizeof (*cp) + cp->adv_data_len;
+	} else {
+		struct mgmt_cp_remove_advertising *cp;
+
+		cp	     = (struct mgmt_cp_remove_advertising*)buf;
+		cp->instance = ARC_ADV_INSTANCE;
+
+		opcode = MGMT_OP_REMOVE_ADVERTISING;
+		len    = sizeof (*cp);
 	}
 
-	hcidev = get_hci_device (adapter, hcisock);
-	if (hcidev < 0)
-		goto leave;
-
-	if (hci_enable_adv (hcidev, enable) != 0) {
-		error ("failed to %sable advertising",
-		       enable ? "en" : "dis");
-		goto leave;
+	id = mgmt_send (mgmt, opcode, btd_adapter_get_index (adapter),
+			len, buf, (mgmt_request_func_t)on_advertising_done,
+			adata, (mgmt_destroy_func_t)adv_data_free);
+	if (id == 0) {
+		error ("failed to send advertising request");
+		adv_data_free (adata);
+		return FALSE;
 	}
 
-	ret = hci_set_adv_data (hcidev, magic,
-		btd_adapter_get_name (adapter));
-	if (ret != 0) {
-		error ("setting arc data failed (%d)", ret);
-		goto leave;
-	}
-
-	rv = TRUE;
-leave:
-	if (hcidev >= 0)
-		hci_close_dev (hcidev);
-
-	if (hcisock >= 0)
-		close (hcisock);
-
-	return rv;
+	return TRUE;
 }
 
 
@@ -12,6 +12,8 @@
 
 #include <glib.h>
 
+#include "src/shared/att-types.h"
+
 G_BEGIN_DECLS
 
 /* DBus */
@@ -36,28 +38,27 @@ typedef enum {
 	ARC_CHAR_FLAG_NONE	= 0,
 	ARC_CHAR_FLAG_READABLE  = 1 << 0,
 	ARC_CHAR_FLAG_WRITABLE  = 1 << 1,
-	ARC_CHAR_FLAG_SERVER    = 1 << 2
+	ARC_CHAR_FLAG_SERVER    = 1 << 2,
+	ARC_CHAR_FLAG_NOTIFY    = 1 << 3
 } ARCCharFlags;
 
 /**
  * ARC Characteristic
  *
- *
- *
+ * The value is shared by all connections; anything that is
+ * connection-specific (half-written or half-read values, requests and
+ * results) lives with the connection in arc-server.c
  */
 struct ARCChar {
 	char		*name;
-	GByteArray	*val, *val_scratch;
+	GByteArray	*val;
 	guint16		 handle;
 	guint16		 val_handle;
+	guint16		 ccc_handle;
 	ARCCharFlags     flags;
 	char		*uuidstr;
 	bt_uuid_t	 uuid;
 	guint		 gatt_props;
-	gboolean	 writing;
-
-	/* we need to keep these for attrib... */
-	char		 data[ATT_MAX_VALUE_LEN];
 };
 typedef struct ARCChar	 ARCChar;
 
@@ -80,15 +81,6 @@ void arc_char_set_value_string (ARCChar *achar, const char *str);
 char* arc_char_get_value_string (ARCChar *achar);
 
 
-/**
- * Clear the scratch-val, and copy the val's data into it
- *
- * @param achar
- * @param copy whether to copy val into scratch
- */
-void arc_char_init_scratch (ARCChar *achar, gboolean copy);
-
-
 /**
  * Create a new hashtable for UUID->ARCChars; free with
  * g_hash_table_unref
@@ -121,15 +113,15 @@ ARCChar* arc_char_table_find_by_uuid (GHashTable *chars,
 
 
 /**
- * Get a characteristic based on an attribute
+ * Get a characteristic based on its value handle
  *
  * @param table
- * @param attr
+ * @param handle
  *
  * @return
  */
-ARCChar* arc_char_table_find_by_attr (GHashTable *table,
-				      struct attribute* attr);
+ARCChar* arc_char_table_find_by_handle (GHashTable *table,
+					guint16 handle);
 
 
 /**
@@ -144,19 +136,106 @@ ARCChar* arc_char_table_find_by_name (GHashTable *table,
 				      const char *name);
 
 
-/**
- * Clear all working data such as half-written chunked data
- *
- * @param table
- */
-void arc_char_table_clear_working_data (GHashTable *table);
-
 #define ARC_GATT_BLURB_PRE  0xfe
 /**< prefix for an ARC blurb */
 
 #define ARC_GATT_BLURB_POST 0xff
 /**< suffix for an ARC blurb */
 
+#define ARC_GATT_BLURB_ID   0xfd
+/**< starts the request-id header of an ARC blurb */
+
+/**
+ * Append the request-id header, that is, 0xfd <decimal id> ':'; this
+ * goes right after the 0xfe, and ties a request to its result. Like
+ * 0xfe and 0xff, 0xfd never appears in UTF-8.
+ *
+ * @param buf a byte array
+ * @param reqid a request-id, or 0 for none (nothing is appended)
+ */
+void arc_blurb_append_id (GByteArray *buf, guint32 reqid);
+
+/**
+ * Get the request-id from a received blurb (without the 0xfe/0xff)
+ *
+ * @param data the blurb
+ * @param len its length
+ * @param reqid receives the request-id, or 0 if there is none
+ *
+ * @return the length of the header, which precedes the payload, or
+ * -1 if the header is malformed
+ */
+int arc_blurb_parse_id (const guint8 *data, gsize len, guint32 *reqid);
+
+#define ARC_GATT_BLURB_MODE 0xfb
+/**< a blurb of 0xfb <mode> asks for (or, as a result, acknowledges)
+ * a framing mode */
+
+#define ARC_MODE_BINARY     0x01
+/**< frames are 0xfc <flags> <16-bit little-endian length> <payload> */
+#define ARC_MODE_COMPRESS   0x02
+/**< binary payloads may be compressed */
+#define ARC_MODE_SUPPORTED  (ARC_MODE_BINARY | ARC_MODE_COMPRESS)
+
+#define ARC_GATT_BLURB_BIN  0xfc
+/**< starts a binary frame */
+#define ARC_BIN_HDR_LEN     4
+#define ARC_BIN_FLAG_COMPRESSED 0x01
+
+#define ARC_NOTIFY_FIRST    0x80
+/**< set in the header byte of the first notification of a frame */
+#define ARC_NOTIFY_SEQ_MASK 0x7f
+/**< the rest of that byte is a sequence number, which wraps around */
+
+/**
+ * Compress some data, with a small LZ77-style codec
+ *
+ * @param data the data
+ * @param len its length
+ *
+ * @return the compressed data (free with g_byte_array_unref)
+ */
+GByteArray *arc_compress (const guint8 *data, gsize len);
+
+/**
+ * Decompress data compressed with arc_compress
+ *
+ * @param data the compressed data
+ * @param len its length
+ * @param maxlen the maximum size of the result
+ *
+ * @return the data (free with g_byte_array_unref), or NULL if it is
+ * malformed or would be larger than maxlen
+ */
+GByteArray *arc_decompress (const guint8 *data, gsize len, gsize maxlen);
+
+/**
+ * Frame a blurb for sending; in text mode, that is 0xfe <blurb> 0xff,
+ * otherwise it is a binary frame, possibly compressed. Blurbs that
+ * are too large for a binary frame are sent as text.
+ *
+ * @param data the blurb
+ * @param len its length
+ * @param mode the ARC_MODE_* flags for the connection
+ *
+ * @return the frame (free with g_byte_array_unref)
+ */
+GByteArray *arc_blurb_frame (const guint8 *data, gsize len, guint8 mode);
+
+/**
+ * Get the blurb from the payload of a binary frame
+ *
+ * @param flags the flags from the frame header
+ * @param payload the payload
+ * @param len its length
+ * @param maxlen the maximum size of the blurb
+ *
+ * @return the blurb (free with g_byte_array_unref), or NULL if the
+ * payload is malformed or too large
+ */
+GByteArray *arc_blurb_unpack (guint8 flags, const guint8 *payload, gsize len,
+			      gsize maxlen);
+
 
 /* ids for the various handles */
 typedef enum {
@@ -170,6 +249,9 @@ typedef enum {
 	ARC_ID_NUM
 } ARCID;
 
+struct btd_service;
+struct btd_profile;
+struct btd_adapter;
 
 int arc_probe_proxy (struct btd_service *service);
 void arc_remove_proxy (struct btd_service *service);
@@ -183,8 +265,14 @@ const char* arc_id_to_prop (ARCID id) G_GNUC_CONST;
 
 void arc_dump_bytes (uint8_t *bytes, size_t len);
 
-gboolean arc_enable_advertising (struct btd_adapter *adapter, uint8_t magic,
-				 gboolean enable);
+/* called when an advertising request has completed */
+typedef void (*ARCAdvertiseFunc) (gboolean success, gpointer user_data);
+
+struct mgmt;
+gboolean arc_enable_advertising (struct mgmt *mgmt,
+				 struct btd_adapter *adapter, uint8_t magic,
+				 gboolean enable, ARCAdvertiseFunc func,
+				 gpointer user_data, GDestroyNotify destroy);
 
 #define ANSI_RED		"\x1b[31m"
 #define ANSI_GREEN		"\x1b[32m"
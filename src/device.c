@@ -221,11 +221,11 @@ struct btd_device {
 	struct bt_att *att;			/* The new ATT transport */
 	uint16_t att_mtu;			/* The ATT MTU */
 	unsigned int att_disconn_id;
+	guint att_sec_id;			/* Waiting for encryption */
 
 	/*
-	 * TODO: For now, device creates and owns the client-role gatt_db, but
-	 * this needs to be persisted in a more central place so that proper
-	 * attribute cache support can be built.
+	 * The client-role gatt_db is kept across connections of bonded
+	 * devices and persisted to the device cache file, see store_gatt_db.
 	 */
 	struct gatt_db *db;			/* GATT db cache */
 	struct bt_gatt_client *client;		/* GATT client instance */
@@ -549,6 +549,10 @@ static void gatt_server_cleanup(struct btd_device *device)
 	if (!device->server)
 		return;
 
+	btd_gatt_database_att_disconnected(
+				btd_adapter_get_database(device->adapter),
+				device, device->server);
+
 	bt_gatt_server_unref(device->server);
 	device->server = NULL;
 }
@@ -559,6 +563,11 @@ static void attio_cleanup(struct btd_device *device)
 		bt_att_unregister_disconnect(device->att,
 							device->att_disconn_id);
 
+	if (device->att_sec_id) {
+		g_source_remove(device->att_sec_id);
+		device->att_sec_id = 0;
+	}
+
 	if (device->att_io) {
 		g_io_channel_shutdown(device->att_io, FALSE, NULL);
 		g_io_channel_unref(device->att_io);
@@ -1779,6 +1788,145 @@ static void store_services(struct btd_device *device)
 	g_key_file_free(key_file);
 }
 
+struct gatt_saver {
+	struct gatt_db *db;
+	GKeyFile *key_file;
+	uint16_t value_handle;
+};
+
+static void store_attr_value(struct gatt_db_attribute *attr, int err,
+					const uint8_t *value, size_t length,
+					void *user_data)
+{
+	char **str = user_data;
+	size_t i;
+
+	if (err || !length)
+		return;
+
+	*str = g_malloc0(length * 2 + 1);
+
+	for (i = 0; i < length; i++)
+		sprintf(*str + (i * 2), "%2.2x", value[i]);
+}
+
+static void store_attr(struct gatt_db_attribute *attr, void *user_data)
+{
+	struct gatt_saver *saver = user_data;
+	struct gatt_db_attribute *target;
+	char handle[7], uuid_str[MAX_LEN_UUID_STR];
+	char *value = NULL, *str;
+	uint16_t attr_handle, start, end, value_handle;
+	uint8_t properties;
+	bool primary;
+	bt_uuid_t uuid;
+
+	attr_handle = gatt_db_attribute_get_handle(attr);
+	sprintf(handle, "0x%04x", attr_handle);
+
+	if (gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
+							&uuid) &&
+						start == attr_handle) {
+		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		str = g_strdup_printf("%04x:0x%04x:%s", primary ?
+					GATT_PRIM_SVC_UUID : GATT_SND_SVC_UUID,
+					end, uuid_str);
+	} else if (gatt_db_attribute_get_incl_data(attr, NULL, &start, &end)) {
+		target = gatt_db_get_attribute(saver->db, start);
+		if (!target || !gatt_db_attribute_get_service_uuid(target,
+								&uuid))
+			return;
+
+		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		str = g_strdup_printf("%04x:0x%04x:0x%04x:%s",
+					GATT_INCLUDE_UUID, start, end,
+					uuid_str);
+	} else if (gatt_db_attribute_get_char_data(attr, NULL, &value_handle,
+							&properties, &uuid)) {
+		saver->value_handle = value_handle;
+
+		/* Only values kept by the client, i.e. Database Hash */
+		gatt_db_attribute_read(gatt_db_get_attribute(saver->db,
+							value_handle), 0, 0,
+					NULL, store_attr_value, &value);
+
+		bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		if (value)
+			str = g_strdup_printf("%04x:0x%04x:0x%02x:%s:%s",
+						GATT_CHARAC_UUID, value_handle,
+						properties, value, uuid_str);
+		else
+			str = g_strdup_printf("%04x:0x%04x:0x%02x:%s",
+						GATT_CHARAC_UUID, value_handle,
+						properties, uuid_str);
+
+		g_free(value);
+	} else if (attr_handle == saver->value_handle) {
+		/* Characteristic values are implied by their declaration */
+		return;
+	} else {
+		bt_uuid_to_string(gatt_db_attribute_get_type(attr), uuid_str,
+							sizeof(uuid_str));
+		str = g_strdup(uuid_str);
+	}
+
+	g_key_file_set_string(saver->key_file, "Attributes", handle, str);
+	g_free(str);
+}
+
+static void store_service(struct gatt_db_attribute *attr, void *user_data)
+{
+	gatt_db_service_foreach(attr, NULL, store_attr, user_data);
+}
+
+/*
+ * Persist the attributes discovered on a bonded device so that discovery can
+ * be skipped on the next connection, even across restarts. The cache is
+ * validated with the Database Hash, or kept up to date with Service Changed,
+ * by bt_gatt_client.
+ */
+static void store_gatt_db(struct btd_device *device)
+{
+	char filename[PATH_MAX];
+	char src_addr[18], dst_addr[18];
+	struct gatt_saver saver;
+	GKeyFile *key_file;
+	char *data;
+	gsize length = 0;
+
+	if (!device->le_state.bonded || !bt_gatt_client_is_ready(device->client))
+		return;
+
+	if (device_address_is_private(device)) {
+		warn("Can't store attributes for private addressed device %s",
+								device->path);
+		return;
+	}
+
+	ba2str(btd_adapter_get_address(device->adapter), src_addr);
+	ba2str(&device->bdaddr, dst_addr);
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", src_addr,
+								dst_addr);
+	create_file(filename, S_IRUSR | S_IWUSR);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	g_key_file_remove_group(key_file, "Attributes", NULL);
+
+	saver.db = device->db;
+	saver.key_file = key_file;
+	saver.value_handle = 0;
+
+	gatt_db_foreach_service(device->db, NULL, store_service, &saver);
+
+	data = g_key_file_to_data(key_file, &length, NULL);
+	g_file_set_contents(filename, data, length, NULL);
+
+	g_free(data);
+	g_key_file_free(key_file);
+}
+
 static void browse_request_complete(struct browse_req *req, uint8_t bdaddr_type,
 									int err)
 {
@@ -2570,6 +2718,214 @@ static void load_att_info(struct btd_device *device, const char *local,
 	free(prim_uuid);
 }
 
+static void load_value_write_cb(struct gatt_db_attribute *attrib, int err,
+								void *user_data)
+{
+}
+
+static bool load_chrc_value(struct gatt_db_attribute *attr, const char *str,
+								size_t len)
+{
+	uint8_t value[BT_ATT_MAX_VALUE_LEN];
+	size_t i;
+
+	if (len % 2 || len / 2 > sizeof(value))
+		return false;
+
+	for (i = 0; i < len / 2; i++) {
+		if (sscanf(str + (i * 2), "%2hhx", &value[i]) != 1)
+			return false;
+	}
+
+	return gatt_db_attribute_write(attr, 0, value, len / 2, 0, NULL,
+						load_value_write_cb, NULL);
+}
+
+static bool load_service(struct gatt_db *db, uint16_t handle,
+							const char *value)
+{
+	char uuid_str[MAX_LEN_UUID_STR];
+	uint16_t type, end;
+	bt_uuid_t uuid;
+
+	if (sscanf(value, "%04hx:0x%04hx:%36s", &type, &end, uuid_str) != 3)
+		return false;
+
+	if (end < handle || bt_string_to_uuid(&uuid, uuid_str) < 0)
+		return false;
+
+	return gatt_db_insert_service(db, handle, &uuid,
+					type == GATT_PRIM_SVC_UUID,
+					end - handle + 1) != NULL;
+}
+
+static bool load_incl(struct gatt_db *db, struct gatt_db_attribute *service,
+					uint16_t handle, const char *value)
+{
+	struct gatt_db_attribute *attr;
+	uint16_t type, start, end;
+
+	if (sscanf(value, "%04hx:0x%04hx:0x%04hx:", &type, &start, &end) != 3)
+		return false;
+
+	attr = gatt_db_get_attribute(db, start);
+	if (!attr)
+		return false;
+
+	attr = gatt_db_service_add_included(service, attr);
+
+	return attr && gatt_db_attribute_get_handle(attr) == handle;
+}
+
+static bool load_chrc(struct gatt_db_attribute *service, uint16_t handle,
+							const char *value)
+{
+	struct gatt_db_attribute *attr;
+	uint16_t type, value_handle;
+	uint8_t properties;
+	const char *uuid_str, *sep;
+	bt_uuid_t uuid;
+	int len = 0;
+
+	if (sscanf(value, "%04hx:0x%04hx:0x%02hhx:%n", &type, &value_handle,
+						&properties, &len) != 3 || !len)
+		return false;
+
+	if (value_handle != handle + 1)
+		return false;
+
+	/* An optional cached value precedes the UUID */
+	value += len;
+	sep = strchr(value, ':');
+	uuid_str = sep ? sep + 1 : value;
+
+	if (bt_string_to_uuid(&uuid, uuid_str) < 0)
+		return false;
+
+	attr = gatt_db_service_insert_characteristic(service, value_handle,
+							&uuid, 0, properties,
+							NULL, NULL, NULL);
+	if (!attr)
+		return false;
+
+	if (sep)
+		return load_chrc_value(attr, value, sep - value);
+
+	return true;
+}
+
+static bool load_desc(struct gatt_db_attribute *service, uint16_t handle,
+							const char *value)
+{
+	bt_uuid_t uuid;
+
+	if (bt_string_to_uuid(&uuid, value) < 0)
+		return false;
+
+	return gatt_db_service_insert_descriptor(service, handle, &uuid, 0,
+						NULL, NULL, NULL) != NULL;
+}
+
+static bool load_attribute(struct gatt_db *db,
+					struct gatt_db_attribute **service,
+					uint16_t handle, const char *value)
+{
+	uint16_t type;
+
+	/* Descriptors are stored as their UUID only */
+	if (strlen(value) < 5 || value[4] != ':')
+		return *service && load_desc(*service, handle, value);
+
+	if (sscanf(value, "%04hx:", &type) != 1)
+		return false;
+
+	switch (type) {
+	case GATT_PRIM_SVC_UUID:
+	case GATT_SND_SVC_UUID:
+		*service = gatt_db_get_attribute(db, handle);
+		return *service != NULL;
+	case GATT_INCLUDE_UUID:
+		return *service && load_incl(db, *service, handle, value);
+	case GATT_CHARAC_UUID:
+		return *service && load_chrc(*service, handle, value);
+	}
+
+	return false;
+}
+
+static void activate_service(struct gatt_db_attribute *attr, void *user_data)
+{
+	gatt_db_service_set_active(attr, true);
+}
+
+static void load_gatt_db(struct btd_device *device, const char *local,
+							const char *peer)
+{
+	struct gatt_db_attribute *service = NULL;
+	char filename[PATH_MAX];
+	GKeyFile *key_file;
+	char **keys, **key;
+	uint16_t handle;
+	uint16_t type;
+	char *value;
+	bool ok = true;
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+
+	keys = g_key_file_get_keys(key_file, "Attributes", NULL, NULL);
+	if (!keys)
+		goto done;
+
+	/* Create all services first so includes can refer to any of them */
+	for (key = keys; *key && ok; key++) {
+		value = g_key_file_get_string(key_file, "Attributes", *key,
+									NULL);
+		if (!value)
+			continue;
+
+		handle = strtol(*key, NULL, 16);
+
+		if (strlen(value) > 4 && value[4] == ':' &&
+				sscanf(value, "%04hx:", &type) == 1 &&
+				(type == GATT_PRIM_SVC_UUID ||
+						type == GATT_SND_SVC_UUID))
+			ok = load_service(device->db, handle, value);
+
+		g_free(value);
+	}
+
+	/* Keys are stored in handle order */
+	for (key = keys; *key && ok; key++) {
+		value = g_key_file_get_string(key_file, "Attributes", *key,
+									NULL);
+		if (!value)
+			continue;
+
+		handle = strtol(*key, NULL, 16);
+		ok = load_attribute(device->db, &service, handle, value);
+
+		g_free(value);
+	}
+
+	g_strfreev(keys);
+
+	if (!ok) {
+		warn("Unable to load cached attributes for %s", peer);
+		gatt_db_clear(device->db);
+		goto done;
+	}
+
+	gatt_db_foreach_service(device->db, NULL, activate_service, NULL);
+
+	DBG("Loaded cached attributes for %s", peer);
+
+done:
+	g_key_file_free(key_file);
+}
+
 static void device_register_primaries(struct btd_device *device,
 						GSList *prim_list, int psm)
 {
@@ -2973,6 +3329,7 @@ struct btd_device *device_create_from_storage(struct btd_adapter *adapter,
 
 	load_info(device, srcaddr, address, key_file);
 	load_att_info(device, srcaddr, address);
+	load_gatt_db(device, srcaddr, address);
 
 	return device;
 }
@@ -3263,6 +3620,7 @@ static void device_remove_stored(struct btd_device *device)
 	key_file = g_key_file_new();
 	g_key_file_load_from_file(key_file, filename, 0, NULL);
 	g_key_file_remove_group(key_file, "ServiceRecords", NULL);
+	g_key_file_remove_group(key_file, "Attributes", NULL);
 
 	data = g_key_file_to_data(key_file, &length, NULL);
 	if (length > 0) {
@@ -3305,6 +3663,11 @@ void device_remove(struct btd_device *device, gboolean remove_stored)
 	if (btd_device_is_connected(device))
 		disconnect_all(device);
 
+	/* Nothing stored for the device must reach whoever gets its address */
+	btd_gatt_database_device_removed(
+				btd_adapter_get_database(device->adapter),
+				device);
+
 	if (device->store_id > 0) {
 		g_source_remove(device->store_id);
 		device->store_id = 0;
@@ -3980,13 +4343,19 @@ static void gatt_client_ready_cb(bool success, uint8_t att_ecode,
 	device_accept_gatt_profiles(device);
 
 	btd_gatt_client_ready(device->client_dbus);
+
+	store_gatt_db(device);
 }
 
 static void gatt_client_service_changed(uint16_t start_handle,
 							uint16_t end_handle,
 							void *user_data)
 {
+	struct btd_device *device = user_data;
+
 	DBG("start 0x%04x, end: 0x%04x", start_handle, end_handle);
+
+	store_gatt_db(device);
 }
 
 static void gatt_debug(const char *str, void *user_data)
@@ -4037,10 +4406,18 @@ static void gatt_server_init(struct btd_device *device, struct gatt_db *db)
 	gatt_server_cleanup(device);
 
 	device->server = bt_gatt_server_new(db, device->att, device->att_mtu);
-	if (!device->server)
+	if (!device->server) {
 		error("Failed to initialize bt_gatt_server");
+		return;
+	}
 
 	bt_gatt_server_set_debug(device->server, gatt_debug, NULL, NULL);
+	bt_gatt_server_set_prep_queue_size(device->server,
+						main_opts.prep_queue_size);
+
+	btd_gatt_database_att_connected(
+				btd_adapter_get_database(device->adapter),
+				device->att, device->server);
 }
 
 static bool local_counter(uint32_t *sign_cnt, void *user_data)
@@ -4071,6 +4448,94 @@ static bool remote_counter(uint32_t *sign_cnt, void *user_data)
 	return true;
 }
 
+bool device_attach_eatt(struct btd_device *dev, GIOChannel *io)
+{
+	int fd, err;
+
+	if (!dev->att)
+		return false;
+
+	/* The GIOChannel closes its socket on unref, bt_att keeps a copy */
+	fd = dup(g_io_channel_unix_get_fd(io));
+	if (fd < 0) {
+		error("Unable to dup EATT socket: %s", strerror(errno));
+		return false;
+	}
+
+	err = bt_att_attach_fd(dev->att, fd);
+	if (err < 0) {
+		error("Unable to attach EATT bearer: %s", strerror(-err));
+		close(fd);
+		return false;
+	}
+
+	DBG("%s: %u ATT bearers", dev->path, bt_att_get_channels(dev->att));
+
+	return true;
+}
+
+static void eatt_connect_cb(GIOChannel *io, GError *gerr, gpointer user_data)
+{
+	struct btd_device *dev = user_data;
+
+	if (gerr) {
+		DBG("EATT connection failed: %s", gerr->message);
+		return;
+	}
+
+	device_attach_eatt(dev, io);
+}
+
+static void eatt_connect(struct btd_device *dev, BtIOSecLevel sec_level)
+{
+	GIOChannel *io;
+	GError *gerr = NULL;
+	uint8_t i;
+
+	for (i = 0; i < main_opts.eatt_channels; i++) {
+		io = bt_io_connect(eatt_connect_cb, btd_device_ref(dev),
+					(GDestroyNotify) btd_device_unref,
+					&gerr,
+					BT_IO_OPT_SOURCE_BDADDR,
+					btd_adapter_get_address(dev->adapter),
+					BT_IO_OPT_SOURCE_TYPE, BDADDR_LE_PUBLIC,
+					BT_IO_OPT_DEST_BDADDR, &dev->bdaddr,
+					BT_IO_OPT_DEST_TYPE, dev->bdaddr_type,
+					BT_IO_OPT_PSM, EATT_PSM,
+					BT_IO_OPT_SEC_LEVEL, sec_level,
+					BT_IO_OPT_INVALID);
+		if (!io) {
+			DBG("EATT bt_io_connect: %s", gerr->message);
+			g_error_free(gerr);
+			btd_device_unref(dev);
+			return;
+		}
+
+		/* The connect watch holds its own reference until done */
+		g_io_channel_unref(io);
+	}
+}
+
+/*
+ * The kernel holds the ATT socket back from writing while it raises the
+ * security level, so it becomes writable once the link is encrypted.
+ */
+static gboolean att_secured_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct btd_device *dev = user_data;
+
+	dev->att_sec_id = 0;
+
+	if (cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL))
+		return FALSE;
+
+	btd_gatt_database_att_secured(btd_adapter_get_database(dev->adapter),
+								dev->att);
+
+	return FALSE;
+}
+
 bool device_attach_att(struct btd_device *dev, GIOChannel *io)
 {
 	GError *gerr = NULL;
@@ -4133,6 +4598,15 @@ bool device_attach_att(struct btd_device *dev, GIOChannel *io)
 	gatt_client_init(dev);
 	gatt_server_init(dev, btd_gatt_database_get_db(database));
 
+	if (sec_level > BT_IO_SEC_LOW)
+		dev->att_sec_id = g_io_add_watch(io, G_IO_OUT | G_IO_HUP |
+						G_IO_ERR | G_IO_NVAL,
+						att_secured_cb, dev);
+
+	/* Enhanced ATT bearers are only available on top of LE links */
+	if (cid == ATT_CID && main_opts.eatt_channels)
+		eatt_connect(dev, sec_level);
+
 	/*
 	 * Remove the device from the connect_list and give the passive
 	 * scanning another chance to be restarted in case there are
@@ -4529,6 +5003,10 @@ void device_set_bonded(struct btd_device *device, uint8_t bdaddr_type)
 		device->le_state.bonded = true;
 
 	btd_device_set_temporary(device, false);
+
+	/* Discovery may have completed before bonding */
+	if (bdaddr_type != BDADDR_BREDR)
+		store_gatt_db(device);
 }
 
 void device_set_legacy(struct btd_device *device, bool legacy)
@@ -4699,6 +5177,12 @@ void device_bonding_complete(struct btd_device *device, uint8_t bdaddr_type,
 
 	device_set_paired(device, bdaddr_type);
 
+	/* Pairing on an existing link raises its security level */
+	if (bdaddr_type != BDADDR_BREDR && device->att)
+		btd_gatt_database_att_secured(
+				btd_adapter_get_database(device->adapter),
+				device->att);
+
 	/* If services are already resolved just reply to the pairing
 	 * request
 	 */
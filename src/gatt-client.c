@@ -23,6 +23,10 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <dbus/dbus.h>
 
@@ -37,6 +41,7 @@
 #include "adapter.h"
 #include "device.h"
 #include "src/shared/queue.h"
+#include "src/shared/io.h"
 #include "src/shared/att.h"
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-client.h"
@@ -52,6 +57,9 @@
 #define GATT_CHARACTERISTIC_IFACE	"org.bluez.GattCharacteristic1"
 #define GATT_DESCRIPTOR_IFACE		"org.bluez.GattDescriptor1"
 
+/* Commands queued on the ATT bearer before an acquired write stops reading */
+#define WRITE_IO_MAX_PENDING		16
+
 struct btd_gatt_client {
 	struct btd_device *device;
 	bool ready;
@@ -90,6 +98,8 @@ struct characteristic {
 	unsigned int read_id;
 	unsigned int write_id;
 
+	struct write_io *write_io;
+
 	struct queue *descs;
 
 	bool notifying;
@@ -960,12 +970,223 @@ fail:
 	return btd_error_not_supported(msg);
 }
 
+struct write_io {
+	struct characteristic *chrc;
+	int ref_count;
+	char *owner;
+	guint watch;
+	struct io *io;
+	uint16_t mtu;
+	unsigned int pending;
+	bool paused;
+};
+
+static void write_io_unref(void *data)
+{
+	struct write_io *wio = data;
+
+	if (__sync_sub_and_fetch(&wio->ref_count, 1))
+		return;
+
+	free(wio->owner);
+	free(wio);
+}
+
+static struct write_io *write_io_ref(struct write_io *wio)
+{
+	__sync_fetch_and_add(&wio->ref_count, 1);
+
+	return wio;
+}
+
+/*
+ * Detaches the acquired write from its characteristic. Commands still queued
+ * on the bearer hold a reference until they have been sent.
+ */
+static void write_io_release(struct characteristic *chrc)
+{
+	struct write_io *wio = chrc->write_io;
+
+	if (!wio)
+		return;
+
+	DBG("owner %s", wio->owner);
+
+	chrc->write_io = NULL;
+	wio->chrc = NULL;
+
+	g_dbus_remove_watch(btd_get_dbus_connection(), wio->watch);
+	io_destroy(wio->io);
+	wio->io = NULL;
+
+	write_io_unref(wio);
+}
+
+static bool write_io_read(struct io *io, void *user_data);
+
+static void write_io_sent(void *user_data)
+{
+	struct write_io *wio = user_data;
+
+	wio->pending--;
+
+	/* Resume reading once the bearer has caught up */
+	if (wio->io && wio->paused &&
+				wio->pending <= WRITE_IO_MAX_PENDING / 2) {
+		wio->paused = false;
+		io_set_read_handler(wio->io, write_io_read, wio, NULL);
+	}
+
+	write_io_unref(wio);
+}
+
+static bool write_io_read(struct io *io, void *user_data)
+{
+	struct write_io *wio = user_data;
+	struct characteristic *chrc = wio->chrc;
+	struct bt_gatt_client *gatt = chrc->service->client->gatt;
+	uint8_t buf[wio->mtu];
+	size_t max_len;
+	ssize_t len;
+
+	/* Opcode, handle and, for signed writes, the signature */
+	max_len = sizeof(buf) - 3;
+	if (chrc->props & BT_GATT_CHRC_PROP_AUTH)
+		max_len -= BT_ATT_SIGNATURE_LEN;
+
+	while (wio->pending < WRITE_IO_MAX_PENDING) {
+		len = recv(io_get_fd(io), buf, sizeof(buf), MSG_TRUNC);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				return true;
+
+			break;
+		}
+
+		if (len == 0)
+			break;
+
+		if ((size_t) len > max_len) {
+			DBG("Dropping %zd bytes write larger than MTU", len);
+			continue;
+		}
+
+		/* Losing one datagram does not end the session */
+		if (!bt_gatt_client_send_without_response(gatt,
+					chrc->value_handle,
+					chrc->props & BT_GATT_CHRC_PROP_AUTH,
+					buf, len, write_io_sent,
+					write_io_ref(wio))) {
+			error("Failed to send %zd bytes write", len);
+			write_io_unref(wio);
+			continue;
+		}
+
+		wio->pending++;
+	}
+
+	if (wio->pending < WRITE_IO_MAX_PENDING) {
+		write_io_release(chrc);
+		return false;
+	}
+
+	/*
+	 * Stop reading so that the socket buffer fills up and the application
+	 * blocks until write_io_sent resumes.
+	 */
+	wio->paused = true;
+
+	return false;
+}
+
+static bool write_io_disconnect(struct io *io, void *user_data)
+{
+	struct write_io *wio = user_data;
+
+	write_io_release(wio->chrc);
+
+	return false;
+}
+
+static void write_io_owner_exit(DBusConnection *conn, void *user_data)
+{
+	struct write_io *wio = user_data;
+
+	wio->watch = 0;
+
+	write_io_release(wio->chrc);
+}
+
+static DBusMessage *characteristic_acquire_write(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct characteristic *chrc = user_data;
+	struct bt_gatt_client *gatt = chrc->service->client->gatt;
+	const char *sender = dbus_message_get_sender(msg);
+	struct write_io *wio;
+	DBusMessage *reply;
+	int fds[2];
+
+	if (!(chrc->props & BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP))
+		return btd_error_not_supported(msg);
+
+	if (!gatt)
+		return btd_error_not_connected(msg);
+
+	if (chrc->write_io)
+		return btd_error_not_permitted(msg, "Write acquired");
+
+	if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0)
+		return btd_error_failed(msg, strerror(errno));
+
+	wio = new0(struct write_io, 1);
+	if (!wio)
+		goto fail;
+
+	wio->chrc = chrc;
+	wio->mtu = bt_gatt_client_get_mtu(gatt);
+	wio->owner = strdup(sender);
+	wio->io = io_new(fds[0]);
+	if (!wio->owner || !wio->io) {
+		io_destroy(wio->io);
+		free(wio->owner);
+		free(wio);
+		goto fail;
+	}
+
+	io_set_close_on_destroy(wio->io, true);
+	io_set_read_handler(wio->io, write_io_read, wio, NULL);
+	io_set_disconnect_handler(wio->io, write_io_disconnect, wio, NULL);
+
+	wio->watch = g_dbus_add_disconnect_watch(btd_get_dbus_connection(),
+						sender, write_io_owner_exit,
+						wio, NULL);
+
+	chrc->write_io = write_io_ref(wio);
+
+	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &fds[1],
+						DBUS_TYPE_UINT16, &wio->mtu,
+						DBUS_TYPE_INVALID);
+	close(fds[1]);
+
+	return reply;
+
+fail:
+	close(fds[0]);
+	close(fds[1]);
+
+	return btd_error_failed(msg, "Failed to acquire write");
+}
+
 struct notify_client {
 	struct characteristic *chrc;
 	int ref_count;
 	char *owner;
 	guint watch;
 	unsigned int notify_id;
+	struct io *io;		/* Set for sessions started by AcquireNotify */
+	int fd;			/* Application end, until the reply is sent */
 };
 
 static void notify_client_free(struct notify_client *client)
@@ -973,6 +1194,11 @@ static void notify_client_free(struct notify_client *client)
 	DBG("owner %s", client->owner);
 
 	g_dbus_remove_watch(btd_get_dbus_connection(), client->watch);
+	io_destroy(client->io);
+
+	if (client->fd >= 0)
+		close(client->fd);
+
 	bt_gatt_client_unregister_notify(client->chrc->service->client->gatt,
 							client->notify_id);
 	free(client->owner);
@@ -1047,6 +1273,7 @@ static struct notify_client *notify_client_create(struct characteristic *chrc,
 		return NULL;
 
 	client->chrc = chrc;
+	client->fd = -1;
 	client->owner = strdup(owner);
 	if (!client->owner) {
 		free(client);
@@ -1090,15 +1317,96 @@ static void notify_cb(uint16_t value_handle, const uint8_t *value,
 						write_characteristic_cb, chrc);
 }
 
+static void notify_io_cb(uint16_t value_handle, const uint8_t *value,
+					uint16_t length, void *user_data)
+{
+	struct async_dbus_op *op = user_data;
+	struct notify_client *client = op->data;
+	struct iovec iov;
+	ssize_t err;
+
+	if (!client->io)
+		return;
+
+	iov.iov_base = (void *) value;
+	iov.iov_len = length;
+
+	/* Drop the value if the application isn't keeping up */
+	err = io_send(client->io, &iov, 1);
+	if (err < 0)
+		DBG("Unable to write notification to %s: %s", client->owner,
+							strerror(-err));
+}
+
+static bool notify_io_disconnect(struct io *io, void *user_data)
+{
+	struct notify_client *client = user_data;
+
+	DBG("owner %s", client->owner);
+
+	notify_client_disconnect(NULL, client);
+
+	return false;
+}
+
+static bool notify_client_create_io(struct notify_client *client)
+{
+	int fds[2];
+
+	if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC,
+								0, fds) < 0) {
+		error("Failed to create notify socket: %s", strerror(errno));
+		return false;
+	}
+
+	client->io = io_new(fds[0]);
+	if (!client->io) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	io_set_close_on_destroy(client->io, true);
+	io_set_disconnect_handler(client->io, notify_io_disconnect, client,
+									NULL);
+
+	client->fd = fds[1];
+
+	return true;
+}
+
+static DBusMessage *create_acquire_notify_reply(struct notify_client *client,
+							DBusMessage *msg)
+{
+	struct bt_gatt_client *gatt = client->chrc->service->client->gatt;
+	DBusMessage *reply;
+	uint16_t mtu;
+
+	mtu = bt_gatt_client_get_mtu(gatt);
+
+	reply = g_dbus_create_reply(msg, DBUS_TYPE_UNIX_FD, &client->fd,
+						DBUS_TYPE_UINT16, &mtu,
+						DBUS_TYPE_INVALID);
+
+	/* The message holds its own duplicate of the descriptor */
+	close(client->fd);
+	client->fd = -1;
+
+	return reply;
+}
+
 static DBusMessage *create_notify_reply(struct async_dbus_op *op,
 						bool success, uint8_t att_ecode)
 {
+	struct notify_client *client = op->data;
 	DBusMessage *reply = NULL;
 
 	if (!op->msg)
 		return NULL;
 
-	if (success)
+	if (success && client->io)
+		reply = create_acquire_notify_reply(client, op->msg);
+	else if (success)
 		reply = g_dbus_create_reply(op->msg, DBUS_TYPE_INVALID);
 	else if (att_ecode)
 		reply = create_gatt_dbus_error(op->msg, att_ecode);
@@ -1216,6 +1524,68 @@ fail:
 	return btd_error_failed(msg, "Failed to register notify session");
 }
 
+static DBusMessage *characteristic_acquire_notify(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct characteristic *chrc = user_data;
+	struct bt_gatt_client *gatt = chrc->service->client->gatt;
+	const char *sender = dbus_message_get_sender(msg);
+	struct async_dbus_op *op;
+	struct notify_client *client;
+
+	if (!(chrc->props & BT_GATT_CHRC_PROP_NOTIFY ||
+				chrc->props & BT_GATT_CHRC_PROP_INDICATE))
+		return btd_error_not_supported(msg);
+
+	/* The socket is only handed out while there is a connection */
+	if (!gatt)
+		return btd_error_not_connected(msg);
+
+	/* Each client can only have one active notify session. */
+	client = queue_find(chrc->notify_clients, match_notify_sender, sender);
+	if (client)
+		return client->notify_id ?
+				btd_error_failed(msg, "Already notifying") :
+				btd_error_in_progress(msg);
+
+	client = notify_client_create(chrc, sender);
+	if (!client)
+		return btd_error_failed(msg, "Failed allocate notify session");
+
+	if (!notify_client_create_io(client)) {
+		notify_client_free(client);
+		return btd_error_failed(msg, "Failed to create notify socket");
+	}
+
+	queue_push_tail(chrc->notify_clients, client);
+	queue_push_tail(chrc->service->client->all_notify_clients, client);
+
+	op = new0(struct async_dbus_op, 1);
+	if (!op)
+		goto fail;
+
+	op->data = client;
+	op->msg = dbus_message_ref(msg);
+
+	client->notify_id = bt_gatt_client_register_notify(gatt,
+						chrc->value_handle,
+						register_notify_cb, notify_io_cb,
+						op, async_dbus_op_free);
+	if (client->notify_id)
+		return NULL;
+
+	async_dbus_op_free(op);
+
+fail:
+	queue_remove(chrc->notify_clients, client);
+	queue_remove(chrc->service->client->all_notify_clients, client);
+
+	/* Directly free the client */
+	notify_client_free(client);
+
+	return btd_error_failed(msg, "Failed to register notify session");
+}
+
 static DBusMessage *characteristic_stop_notify(DBusConnection *conn,
 					DBusMessage *msg, void *user_data)
 {
@@ -1295,6 +1665,14 @@ static const GDBusMethodTable characteristic_methods[] = {
 						characteristic_start_notify) },
 	{ GDBUS_EXPERIMENTAL_METHOD("StopNotify", NULL, NULL,
 						characteristic_stop_notify) },
+	{ GDBUS_EXPERIMENTAL_METHOD("AcquireWrite", NULL,
+						GDBUS_ARGS({ "fd", "h" },
+							{ "mtu", "q" }),
+						characteristic_acquire_write) },
+	{ GDBUS_EXPERIMENTAL_ASYNC_METHOD("AcquireNotify", NULL,
+						GDBUS_ARGS({ "fd", "h" },
+							{ "mtu", "q" }),
+						characteristic_acquire_notify) },
 	{ }
 };
 
@@ -1393,6 +1771,8 @@ static void unregister_characteristic(void *data)
 	if (chrc->write_id)
 		bt_gatt_client_cancel(gatt, chrc->write_id);
 
+	write_io_release(chrc);
+
 	queue_remove_all(chrc->notify_clients, NULL, NULL, remove_client);
 	queue_remove_all(chrc->descs, NULL, NULL, unregister_descriptor);
 
@@ -1801,7 +2181,9 @@ static void register_notify(void *data, void *user_data)
 
 	notify_client->notify_id = bt_gatt_client_register_notify(client->gatt,
 					notify_client->chrc->value_handle,
-					register_notify_cb, notify_cb,
+					register_notify_cb,
+					notify_client->io ? notify_io_cb :
+								notify_cb,
 					op, async_dbus_op_free);
 	if (notify_client->notify_id)
 		return;
@@ -1923,6 +2305,9 @@ static void cancel_chrc_ops(void *data, void *user_data)
 		chrc->write_id = 0;
 	}
 
+	/* The acquired write doesn't survive the connection */
+	write_io_release(chrc);
+
 	queue_foreach(chrc->descs, cancel_desc_ops, user_data);
 }
 
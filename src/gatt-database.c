@@ -37,6 +37,7 @@
 #include "src/shared/gatt-db.h"
 #include "src/shared/gatt-server.h"
 #include "log.h"
+#include "hcid.h"
 #include "error.h"
 #include "adapter.h"
 #include "device.h"
@@ -52,6 +53,10 @@
 #define ATT_PSM 31
 #endif
 
+#ifndef EATT_PSM
+#define EATT_PSM 39
+#endif
+
 #define GATT_MANAGER_IFACE	"org.bluez.GattManager1"
 #define GATT_SERVICE_IFACE	"org.bluez.GattService1"
 #define GATT_CHRC_IFACE		"org.bluez.GattCharacteristic1"
@@ -70,6 +75,7 @@ struct btd_gatt_database {
 	unsigned int db_id;
 	GIOChannel *le_io;
 	GIOChannel *l2cap_io;
+	GIOChannel *eatt_io;
 	uint32_t gap_handle;
 	uint32_t gatt_handle;
 	struct queue *device_states;
@@ -113,6 +119,15 @@ struct external_chrc {
 	struct queue *pending_reads;
 	struct queue *pending_writes;
 	unsigned int ntfy_cnt;
+
+	/* Value cache, enabled by the CacheMaxAge property */
+	bool cacheable;
+	uint32_t max_age;		/* Seconds, 0 if it never expires */
+	bool cache_valid;
+	gint64 cache_time;
+	uint8_t *cache;
+	size_t cache_len;
+	unsigned int cache_gen;		/* Bumped when the value changes */
 };
 
 struct external_desc {
@@ -130,15 +145,32 @@ struct pending_op {
 	struct gatt_db_attribute *attrib;
 	struct queue *owner_queue;
 	struct iovec data;
+	struct external_chrc *cache_chrc;	/* Set to fill the value cache */
+	unsigned int cache_gen;			/* Of cache_chrc when sent */
+	uint16_t offset;
 };
 
 struct device_state {
 	bdaddr_t bdaddr;
 	uint8_t bdaddr_type;
 	struct queue *ccc_states;
+	struct bt_gatt_server *server;	/* Set while connected */
+	bool bonded;			/* Updated on disconnection */
+	struct queue *outbox;		/* Values to send on reconnection */
+	size_t outbox_size;
+	int sec_level;			/* Of the link CCCs were written on */
+	bool sec_wait;			/* Set while waiting for sec_level */
+};
+
+struct pending_notify {
+	uint16_t handle;
+	bool indicate;
+	uint16_t len;
+	uint8_t value[0];
 };
 
 struct ccc_state {
+	struct device_state *dev_state;
 	uint16_t handle;
 	uint8_t value[2];
 };
@@ -148,6 +180,7 @@ struct ccc_cb_data {
 	btd_gatt_database_ccc_write_t callback;
 	btd_gatt_database_destroy_t destroy;
 	void *user_data;
+	struct queue *subscribers;	/* ccc_state of connected devices */
 };
 
 struct device_info {
@@ -162,6 +195,7 @@ static void ccc_cb_free(void *data)
 	if (ccc_cb->destroy)
 		ccc_cb->destroy(ccc_cb->user_data);
 
+	queue_destroy(ccc_cb->subscribers, NULL);
 	free(ccc_cb);
 }
 
@@ -185,6 +219,13 @@ static bool ccc_cb_match_handle(const void *data, const void *match_data)
 	return ccc_cb->handle == handle;
 }
 
+static struct ccc_cb_data *find_ccc_cb(struct btd_gatt_database *database,
+								uint16_t handle)
+{
+	return queue_find(database->ccc_callbacks, ccc_cb_match_handle,
+							UINT_TO_PTR(handle));
+}
+
 static bool dev_state_match(const void *a, const void *b)
 {
 	const struct device_state *dev_state = a;
@@ -238,6 +279,13 @@ static struct device_state *device_state_create(bdaddr_t *bdaddr,
 		return NULL;
 	}
 
+	dev_state->outbox = queue_new();
+	if (!dev_state->outbox) {
+		queue_destroy(dev_state->ccc_states, NULL);
+		free(dev_state);
+		return NULL;
+	}
+
 	bacpy(&dev_state->bdaddr, bdaddr);
 	dev_state->bdaddr_type = bdaddr_type;
 
@@ -287,20 +335,80 @@ static struct ccc_state *get_ccc_state(struct btd_gatt_database *database,
 	if (!ccc)
 		return NULL;
 
+	ccc->dev_state = dev_state;
 	ccc->handle = handle;
 	queue_push_tail(dev_state->ccc_states, ccc);
 
 	return ccc;
 }
 
+/*
+ * Keeps the subscribers of a CCC limited to connected or bonded devices with
+ * notifications or indications enabled, so that sending a value doesn't
+ * need to go through every known device.
+ */
+static void update_subscriber(struct btd_gatt_database *database,
+							struct ccc_state *ccc)
+{
+	struct ccc_cb_data *ccc_cb;
+
+	ccc_cb = find_ccc_cb(database, ccc->handle);
+	if (!ccc_cb)
+		return;
+
+	queue_remove(ccc_cb->subscribers, ccc);
+
+	if (!ccc->value[0])
+		return;
+
+	if (ccc->dev_state->server || ccc->dev_state->bonded)
+		queue_push_tail(ccc_cb->subscribers, ccc);
+}
+
+static void update_device_subscriber(void *data, void *user_data)
+{
+	update_subscriber(user_data, data);
+}
+
 static void device_state_free(void *data)
 {
 	struct device_state *state = data;
 
 	queue_destroy(state->ccc_states, free);
+	queue_destroy(state->outbox, free);
+	bt_gatt_server_unref(state->server);
 	free(state);
 }
 
+static void clear_ccc_state(void *data, void *user_data)
+{
+	struct ccc_state *ccc = data;
+
+	ccc->value[0] = 0;
+	ccc->value[1] = 0;
+	update_subscriber(user_data, ccc);
+}
+
+/* Drops all subscriptions of a device, and anything waiting for it */
+static void clear_device_state(struct btd_gatt_database *database,
+					struct device_state *dev_state)
+{
+	queue_foreach(dev_state->ccc_states, clear_ccc_state, database);
+	queue_remove_all(dev_state->ccc_states, NULL, NULL, free);
+
+	queue_remove_all(dev_state->outbox, NULL, NULL, free);
+	dev_state->outbox_size = 0;
+	dev_state->sec_level = 0;
+}
+
+static void device_state_forget(struct btd_gatt_database *database,
+					struct device_state *dev_state)
+{
+	clear_device_state(database, dev_state);
+	queue_remove(database->device_states, dev_state);
+	device_state_free(dev_state);
+}
+
 static void cancel_pending_read(void *data)
 {
 	struct pending_op *op = data;
@@ -328,6 +436,7 @@ static void chrc_free(void *data)
 	queue_destroy(chrc->pending_writes, cancel_pending_write);
 
 	g_free(chrc->path);
+	free(chrc->cache);
 
 	g_dbus_proxy_set_property_watch(chrc->proxy, NULL, NULL);
 	g_dbus_proxy_unref(chrc->proxy);
@@ -435,6 +544,11 @@ static void gatt_database_free(void *data)
 		g_io_channel_unref(database->l2cap_io);
 	}
 
+	if (database->eatt_io) {
+		g_io_channel_shutdown(database->eatt_io, FALSE, NULL);
+		g_io_channel_unref(database->eatt_io);
+	}
+
 	if (database->gatt_handle)
 		adapter_service_remove(database->adapter,
 							database->gatt_handle);
@@ -493,6 +607,42 @@ static void connect_cb(GIOChannel *io, GError *gerr, gpointer user_data)
 	device_attach_att(device, io);
 }
 
+static void eatt_connect_cb(GIOChannel *io, GError *gerr, gpointer user_data)
+{
+	struct btd_adapter *adapter;
+	struct btd_device *device;
+	uint8_t dst_type;
+	bdaddr_t src, dst;
+
+	DBG("New incoming EATT connection");
+
+	if (gerr) {
+		error("%s", gerr->message);
+		return;
+	}
+
+	bt_io_get(io, &gerr, BT_IO_OPT_SOURCE_BDADDR, &src,
+						BT_IO_OPT_DEST_BDADDR, &dst,
+						BT_IO_OPT_DEST_TYPE, &dst_type,
+						BT_IO_OPT_INVALID);
+	if (gerr) {
+		error("bt_io_get: %s", gerr->message);
+		g_error_free(gerr);
+		return;
+	}
+
+	adapter = adapter_find(&src);
+	if (!adapter)
+		return;
+
+	/* Additional bearers need the fixed channel to be up already */
+	device = btd_adapter_find_device(adapter, &dst, dst_type);
+	if (!device)
+		return;
+
+	device_attach_eatt(device, io);
+}
+
 static void gap_device_name_read_cb(struct gatt_db_attribute *attrib,
 					unsigned int id, uint16_t offset,
 					uint8_t opcode, struct bt_att *att,
@@ -775,8 +925,7 @@ static void gatt_ccc_write_cb(struct gatt_db_attribute *attrib,
 		goto done;
 	}
 
-	ccc_cb = queue_find(database->ccc_callbacks, ccc_cb_match_handle,
-			UINT_TO_PTR(gatt_db_attribute_get_handle(attrib)));
+	ccc_cb = find_ccc_cb(database, handle);
 	if (!ccc_cb) {
 		ecode = BT_ATT_ERROR_UNLIKELY;
 		goto done;
@@ -792,6 +941,15 @@ static void gatt_ccc_write_cb(struct gatt_db_attribute *attrib,
 	if (!ecode) {
 		ccc->value[0] = value[0];
 		ccc->value[1] = value[1];
+		update_subscriber(database, ccc);
+
+		/* Deferred values are only sent over a link at least as
+		 * secure as the one the subscription was made on.
+		 */
+		if (value[0])
+			ccc->dev_state->sec_level = MAX(
+					ccc->dev_state->sec_level,
+					bt_att_get_sec_level(att));
 	}
 
 done:
@@ -815,12 +973,19 @@ service_add_ccc(struct gatt_db_attribute *service,
 		return NULL;
 	}
 
+	ccc_cb->subscribers = queue_new();
+	if (!ccc_cb->subscribers) {
+		free(ccc_cb);
+		return NULL;
+	}
+
 	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
 	ccc = gatt_db_service_add_descriptor(service, &uuid,
 				BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
 				gatt_ccc_read_cb, gatt_ccc_write_cb, database);
 	if (!ccc) {
 		error("Failed to create CCC entry in database");
+		queue_destroy(ccc_cb->subscribers, NULL);
 		free(ccc_cb);
 		return NULL;
 	}
@@ -899,43 +1064,111 @@ static void conf_cb(void *user_data)
 	DBG("GATT server received confirmation");
 }
 
-static void send_notification_to_device(void *data, void *user_data)
+static bool pending_notify_match_handle(const void *a, const void *b)
 {
-	struct device_state *device_state = data;
-	struct notify *notify = user_data;
-	struct ccc_state *ccc;
-	struct btd_device *device;
+	const struct pending_notify *entry = a;
 
-	ccc = find_ccc_state(device_state, notify->ccc_handle);
-	if (!ccc)
+	return entry->handle == PTR_TO_UINT(b);
+}
+
+/*
+ * Keeps the latest value of each handle for a bonded device that isn't
+ * connected, dropping the oldest values once the configured size is used up.
+ */
+static void outbox_push(struct device_state *dev_state, struct notify *notify)
+{
+	size_t max_size = main_opts.notify_outbox_size;
+	struct pending_notify *entry;
+
+	if (!max_size || notify->len > max_size)
 		return;
 
-	if (!ccc->value[0] || (notify->indicate && !(ccc->value[0] & 0x02)))
+	entry = queue_remove_if(dev_state->outbox, pending_notify_match_handle,
+						UINT_TO_PTR(notify->handle));
+	if (entry) {
+		dev_state->outbox_size -= entry->len;
+		free(entry);
+	}
+
+	while (dev_state->outbox_size + notify->len > max_size) {
+		entry = queue_pop_head(dev_state->outbox);
+		if (!entry)
+			break;
+
+		DBG("Dropping deferred value of handle 0x%04x", entry->handle);
+
+		dev_state->outbox_size -= entry->len;
+		free(entry);
+	}
+
+	entry = malloc(sizeof(*entry) + notify->len);
+	if (!entry)
 		return;
 
-	device = btd_adapter_get_device(notify->database->adapter,
-						&device_state->bdaddr,
-						device_state->bdaddr_type);
-	if (!device)
+	entry->handle = notify->handle;
+	entry->indicate = notify->indicate;
+	entry->len = notify->len;
+
+	if (notify->len)
+		memcpy(entry->value, notify->value, notify->len);
+
+	queue_push_tail(dev_state->outbox, entry);
+	dev_state->outbox_size += entry->len;
+}
+
+static void outbox_flush(struct device_state *dev_state)
+{
+	struct pending_notify *entry;
+
+	if (queue_isempty(dev_state->outbox))
+		return;
+
+	DBG("Sending %u deferred values", queue_length(dev_state->outbox));
+
+	while ((entry = queue_pop_head(dev_state->outbox))) {
+		if (entry->indicate)
+			bt_gatt_server_send_indication(dev_state->server,
+						entry->handle, entry->value,
+						entry->len, conf_cb,
+						NULL, NULL);
+		else
+			bt_gatt_server_send_notification(dev_state->server,
+						entry->handle, entry->value,
+						entry->len);
+
+		free(entry);
+	}
+
+	dev_state->outbox_size = 0;
+}
+
+static void send_notification_to_device(void *data, void *user_data)
+{
+	struct ccc_state *ccc = data;
+	struct notify *notify = user_data;
+	struct bt_gatt_server *server = ccc->dev_state->server;
+
+	if (notify->indicate && !(ccc->value[0] & 0x02))
 		return;
 
 	/*
-	 * TODO: If the device is not connected but bonded, send the
-	 * notification/indication when it becomes connected.
+	 * Bonded device that isn't connected, or not yet secure enough;
+	 * send when it is
 	 */
+	if (!server || ccc->dev_state->sec_wait) {
+		outbox_push(ccc->dev_state, notify);
+		return;
+	}
+
 	if (!notify->indicate) {
 		DBG("GATT server sending notification");
-		bt_gatt_server_send_notification(
-					btd_device_get_gatt_server(device),
-					notify->handle, notify->value,
-					notify->len);
+		bt_gatt_server_send_notification(server, notify->handle,
+						notify->value, notify->len);
 		return;
 	}
 
 	DBG("GATT server sending indication");
-	bt_gatt_server_send_indication(btd_device_get_gatt_server(device),
-							notify->handle,
-							notify->value,
+	bt_gatt_server_send_indication(server, notify->handle, notify->value,
 							notify->len, conf_cb,
 							NULL, NULL);
 }
@@ -946,6 +1179,11 @@ static void send_notification_to_devices(struct btd_gatt_database *database,
 					bool indicate)
 {
 	struct notify notify;
+	struct ccc_cb_data *ccc_cb;
+
+	ccc_cb = find_ccc_cb(database, ccc_handle);
+	if (!ccc_cb)
+		return;
 
 	memset(&notify, 0, sizeof(notify));
 
@@ -956,7 +1194,7 @@ static void send_notification_to_devices(struct btd_gatt_database *database,
 	notify.len = len;
 	notify.indicate = indicate;
 
-	queue_foreach(database->device_states, send_notification_to_device,
+	queue_foreach(ccc_cb->subscribers, send_notification_to_device,
 								&notify);
 }
 
@@ -1010,11 +1248,32 @@ static bool ccc_match_service(const void *data, const void *match_data)
 	return ccc->handle >= start && ccc->handle <= end;
 }
 
+static bool pending_notify_match_service(const void *data,
+							const void *match_data)
+{
+	const struct pending_notify *entry = data;
+	const struct gatt_db_attribute *attrib = match_data;
+	uint16_t start, end;
+
+	if (!gatt_db_attribute_get_service_handles(attrib, &start, &end))
+		return false;
+
+	return entry->handle >= start && entry->handle <= end;
+}
+
 static void remove_device_ccc(void *data, void *user_data)
 {
 	struct device_state *state = data;
+	struct pending_notify *entry;
 
 	queue_remove_all(state->ccc_states, ccc_match_service, user_data, free);
+
+	while ((entry = queue_remove_if(state->outbox,
+						pending_notify_match_service,
+						user_data))) {
+		state->outbox_size -= entry->len;
+		free(entry);
+	}
 }
 
 static void gatt_db_service_removed(struct gatt_db_attribute *attrib,
@@ -1253,6 +1512,24 @@ static bool parse_flags(GDBusProxy *proxy, uint8_t *props, uint8_t *ext_props)
 	return true;
 }
 
+static bool parse_cache(GDBusProxy *proxy, struct external_chrc *chrc)
+{
+	DBusMessageIter iter;
+
+	/* The property is optional, values aren't cached without it */
+	if (!g_dbus_proxy_get_property(proxy, "CacheMaxAge", &iter))
+		return true;
+
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
+		return false;
+
+	dbus_message_iter_get_basic(&iter, &chrc->max_age);
+
+	chrc->cacheable = true;
+
+	return true;
+}
+
 static void proxy_added_cb(GDBusProxy *proxy, void *user_data)
 {
 	struct external_service *service = user_data;
@@ -1325,6 +1602,12 @@ static void proxy_added_cb(GDBusProxy *proxy, void *user_data)
 			return;
 		}
 
+		if (!parse_cache(proxy, chrc)) {
+			error("Failed to parse characteristic cache max age");
+			service->failed = true;
+			return;
+		}
+
 		if ((chrc->props & BT_GATT_CHRC_PROP_NOTIFY ||
 				chrc->props & BT_GATT_CHRC_PROP_INDICATE) &&
 				!incr_attr_count(service, 1)) {
@@ -1439,6 +1722,67 @@ static bool parse_primary(GDBusProxy *proxy, bool *primary)
 	return true;
 }
 
+static void cache_store(struct external_chrc *chrc, const uint8_t *value,
+								size_t len)
+{
+	uint8_t *cache = NULL;
+
+	if (len) {
+		cache = malloc(len);
+		if (!cache) {
+			chrc->cache_valid = false;
+			return;
+		}
+
+		memcpy(cache, value, len);
+	}
+
+	free(chrc->cache);
+	chrc->cache = cache;
+	chrc->cache_len = len;
+	chrc->cache_valid = true;
+	chrc->cache_time = g_get_monotonic_time();
+}
+
+/* Makes replies to reads that are already in flight stale as well */
+static void cache_invalidate(struct external_chrc *chrc)
+{
+	chrc->cache_valid = false;
+	chrc->cache_gen++;
+}
+
+static bool cache_is_fresh(struct external_chrc *chrc)
+{
+	gint64 age;
+
+	if (!chrc->cache_valid)
+		return false;
+
+	if (!chrc->max_age)
+		return true;
+
+	age = g_get_monotonic_time() - chrc->cache_time;
+
+	return age < (gint64) chrc->max_age * G_USEC_PER_SEC;
+}
+
+static void cache_read_result(struct gatt_db_attribute *attrib,
+					unsigned int id, uint16_t offset,
+					const uint8_t *value, size_t len)
+{
+	if (offset > len) {
+		gatt_db_attribute_read_result(attrib, id,
+						BT_ATT_ERROR_INVALID_OFFSET,
+						NULL, 0);
+		return;
+	}
+
+	len -= offset;
+
+	gatt_db_attribute_read_result(attrib, id, 0, len ? value + offset :
+								NULL, len);
+}
+
 static uint8_t dbus_error_to_att_ecode(const char *error_name)
 {
 	/* TODO: Parse error ATT ecode from error_message */
@@ -1508,6 +1852,14 @@ static void read_reply_cb(DBusMessage *message, void *user_data)
 	len = MIN(BT_ATT_MAX_VALUE_LEN, len);
 	value = len ? value : NULL;
 
+	if (op->cache_chrc) {
+		if (op->cache_gen == op->cache_chrc->cache_gen)
+			cache_store(op->cache_chrc, value, len);
+
+		cache_read_result(op->attrib, op->id, op->offset, value, len);
+		return;
+	}
+
 done:
 	gatt_db_attribute_read_result(op->attrib, op->id, ecode, value, len);
 }
@@ -1542,7 +1894,9 @@ static struct pending_op *pending_read_new(struct queue *owner_queue,
 
 static void send_read(struct gatt_db_attribute *attrib, GDBusProxy *proxy,
 						struct queue *owner_queue,
-						unsigned int id)
+						unsigned int id,
+						struct external_chrc *cache_chrc,
+						uint16_t offset)
 {
 	struct pending_op *op;
 	uint8_t ecode = BT_ATT_ERROR_UNLIKELY;
@@ -1554,6 +1908,10 @@ static void send_read(struct gatt_db_attribute *attrib, GDBusProxy *proxy,
 		goto error;
 	}
 
+	op->cache_chrc = cache_chrc;
+	op->cache_gen = cache_chrc ? cache_chrc->cache_gen : 0;
+	op->offset = offset;
+
 	if (g_dbus_proxy_method_call(proxy, "ReadValue", NULL, read_reply_cb,
 						op, pending_op_free) == TRUE)
 		return;
@@ -1729,33 +2087,54 @@ static uint8_t ccc_write_cb(uint16_t value, void *user_data)
 	return 0;
 }
 
-static void property_changed_cb(GDBusProxy *proxy, const char *name,
-					DBusMessageIter *iter, void *user_data)
+static bool parse_value_prop(DBusMessageIter *iter, uint8_t **value,
+								int *len)
 {
-	struct external_chrc *chrc = user_data;
 	DBusMessageIter array;
-	uint8_t *value = NULL;
-	int len = 0;
 
-	if (strcmp(name, "Value"))
-		return;
+	*value = NULL;
+	*len = 0;
 
 	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) {
 		DBG("Malformed \"Value\" property received");
-		return;
+		return false;
 	}
 
 	dbus_message_iter_recurse(iter, &array);
-	dbus_message_iter_get_fixed_array(&array, &value, &len);
+	dbus_message_iter_get_fixed_array(&array, value, len);
 
-	if (len < 0) {
+	if (*len < 0) {
 		DBG("Malformed \"Value\" property received");
-		return;
+		return false;
 	}
 
 	/* Truncate the value if it's too large */
-	len = MIN(BT_ATT_MAX_VALUE_LEN, len);
-	value = len ? value : NULL;
+	*len = MIN(BT_ATT_MAX_VALUE_LEN, *len);
+	*value = *len ? *value : NULL;
+
+	return true;
+}
+
+static void property_changed_cb(GDBusProxy *proxy, const char *name,
+					DBusMessageIter *iter, void *user_data)
+{
+	struct external_chrc *chrc = user_data;
+	uint8_t *value;
+	int len;
+
+	if (strcmp(name, "Value"))
+		return;
+
+	if (!parse_value_prop(iter, &value, &len))
+		return;
+
+	if (chrc->cacheable) {
+		cache_invalidate(chrc);
+		cache_store(chrc, value, len);
+	}
+
+	if (!chrc->ccc)
+		return;
 
 	send_notification_to_devices(chrc->service->database,
 				gatt_db_attribute_get_handle(chrc->attrib),
@@ -1764,6 +2143,25 @@ static void property_changed_cb(GDBusProxy *proxy, const char *name,
 				chrc->props & BT_GATT_CHRC_PROP_INDICATE);
 }
 
+/*
+ * Serves the first reads from the Value property if the object has one;
+ * this only fills the cache, subscribers are not notified
+ */
+static void cache_prime(struct external_chrc *chrc)
+{
+	DBusMessageIter iter;
+	uint8_t *value;
+	int len;
+
+	if (!g_dbus_proxy_get_property(chrc->proxy, "Value", &iter))
+		return;
+
+	if (!parse_value_prop(&iter, &value, &len))
+		return;
+
+	cache_store(chrc, value, len);
+}
+
 static bool database_add_ccc(struct external_service *service,
 						struct external_chrc *chrc)
 {
@@ -1778,12 +2176,6 @@ static bool database_add_ccc(struct external_service *service,
 		return false;
 	}
 
-	if (g_dbus_proxy_set_property_watch(chrc->proxy, property_changed_cb,
-							chrc) == FALSE) {
-		error("Failed to set up property watch for characteristic");
-		return false;
-	}
-
 	DBG("Created CCC entry for characteristic");
 
 	return true;
@@ -1843,7 +2235,7 @@ static void desc_read_cb(struct gatt_db_attribute *attrib,
 		return;
 	}
 
-	send_read(attrib, desc->proxy, desc->pending_reads, id);
+	send_read(attrib, desc->proxy, desc->pending_reads, id, NULL, 0);
 }
 
 static void desc_write_cb(struct gatt_db_attribute *attrib,
@@ -1901,7 +2293,19 @@ static void chrc_read_cb(struct gatt_db_attribute *attrib,
 		return;
 	}
 
-	send_read(attrib, chrc->proxy, chrc->pending_reads, id);
+	if (!chrc->cacheable) {
+		send_read(attrib, chrc->proxy, chrc->pending_reads, id, NULL,
+									0);
+		return;
+	}
+
+	if (cache_is_fresh(chrc)) {
+		cache_read_result(attrib, id, offset, chrc->cache,
+							chrc->cache_len);
+		return;
+	}
+
+	send_read(attrib, chrc->proxy, chrc->pending_reads, id, chrc, offset);
 }
 
 static void chrc_write_cb(struct gatt_db_attribute *attrib,
@@ -1917,6 +2321,9 @@ static void chrc_write_cb(struct gatt_db_attribute *attrib,
 		return;
 	}
 
+	/* Read the value back from the application after a write */
+	cache_invalidate(chrc);
+
 	send_write(attrib, chrc->proxy, chrc->pending_writes, id, value, len);
 }
 
@@ -1958,6 +2365,21 @@ static bool database_add_chrc(struct external_service *service,
 	if (!database_add_cep(service, chrc))
 		return false;
 
+	/*
+	 * Value changes are needed to notify subscribed devices and to keep
+	 * the value cache up to date.
+	 */
+	if ((chrc->ccc || chrc->cacheable) &&
+			g_dbus_proxy_set_property_watch(chrc->proxy,
+							property_changed_cb,
+							chrc) == FALSE) {
+		error("Failed to set up property watch for characteristic");
+		return false;
+	}
+
+	if (chrc->cacheable)
+		cache_prime(chrc);
+
 	/* Handle the descriptors that belong to this characteristic. */
 	entry = queue_get_entries(service->descs);
 	while (entry) {
@@ -2452,6 +2874,23 @@ struct btd_gatt_database *btd_gatt_database_new(struct btd_adapter *adapter)
 		goto fail;
 	}
 
+	/* Enhanced ATT bearers (LE connection oriented channels) */
+	if (main_opts.eatt_channels) {
+		database->eatt_io = bt_io_listen(eatt_connect_cb, NULL, NULL,
+					NULL, &gerr,
+					BT_IO_OPT_SOURCE_BDADDR, addr,
+					BT_IO_OPT_SOURCE_TYPE, BDADDR_LE_PUBLIC,
+					BT_IO_OPT_PSM, EATT_PSM,
+					BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_LOW,
+					BT_IO_OPT_INVALID);
+		if (!database->eatt_io) {
+			/* Not fatal, older kernels lack LE CoC support */
+			error("Failed to listen for EATT: %s", gerr->message);
+			g_error_free(gerr);
+			gerr = NULL;
+		}
+	}
+
 	if (g_dbus_register_interface(btd_get_dbus_connection(),
 						adapter_get_path(adapter),
 						GATT_MANAGER_IFACE,
@@ -2489,3 +2928,199 @@ struct gatt_db *btd_gatt_database_get_db(struct btd_gatt_database *database)
 
 	return database->db;
 }
+
+struct foreach_subscriber_data {
+	struct btd_gatt_database *database;
+	btd_gatt_database_subscriber_t func;
+	void *user_data;
+};
+
+static void foreach_subscriber(void *data, void *user_data)
+{
+	struct ccc_state *ccc = data;
+	struct foreach_subscriber_data *foreach = user_data;
+	struct device_state *dev_state = ccc->dev_state;
+	struct btd_device *device;
+
+	/* Skip bonded devices that are not connected or not yet secure */
+	if (!dev_state->server || dev_state->sec_wait ||
+						!(ccc->value[0] & 0x01))
+		return;
+
+	device = btd_adapter_find_device(foreach->database->adapter,
+						&dev_state->bdaddr,
+						dev_state->bdaddr_type);
+	if (!device)
+		return;
+
+	foreach->func(device, dev_state->server, foreach->user_data);
+}
+
+void btd_gatt_database_foreach_subscriber(struct btd_gatt_database *database,
+					uint16_t ccc_handle,
+					btd_gatt_database_subscriber_t func,
+					void *user_data)
+{
+	struct foreach_subscriber_data foreach;
+	struct ccc_cb_data *ccc_cb;
+
+	if (!database || !func)
+		return;
+
+	ccc_cb = find_ccc_cb(database, ccc_handle);
+	if (!ccc_cb)
+		return;
+
+	foreach.database = database;
+	foreach.func = func;
+	foreach.user_data = user_data;
+
+	queue_foreach(ccc_cb->subscribers, foreach_subscriber, &foreach);
+}
+
+/*
+ * The security of a reconnecting device is raised after it connects; the
+ * outbox is held back until the link is as secure as the one the device
+ * subscribed on, see btd_gatt_database_att_secured.
+ */
+static void outbox_flush_when_secure(struct device_state *dev_state,
+							struct bt_att *att)
+{
+	if (bt_att_get_sec_level(att) >= dev_state->sec_level) {
+		dev_state->sec_wait = false;
+		outbox_flush(dev_state);
+		return;
+	}
+
+	if (!dev_state->sec_wait)
+		DBG("Deferring values until security level %d",
+							dev_state->sec_level);
+
+	dev_state->sec_wait = true;
+}
+
+void btd_gatt_database_att_connected(struct btd_gatt_database *database,
+						struct bt_att *att,
+						struct bt_gatt_server *server)
+{
+	struct device_state *dev_state;
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+
+	if (!database || !server)
+		return;
+
+	/* Use the same address CCC writes are recorded with */
+	if (!get_dst_info(att, &bdaddr, &bdaddr_type))
+		return;
+
+	dev_state = get_device_state(database, &bdaddr, bdaddr_type);
+	if (!dev_state)
+		return;
+
+	bt_gatt_server_unref(dev_state->server);
+	dev_state->server = bt_gatt_server_ref(server);
+
+	queue_foreach(dev_state->ccc_states, update_device_subscriber,
+								database);
+
+	outbox_flush_when_secure(dev_state, att);
+}
+
+void btd_gatt_database_att_secured(struct btd_gatt_database *database,
+							struct bt_att *att)
+{
+	struct device_state *dev_state;
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+
+	if (!database || !att)
+		return;
+
+	if (!get_dst_info(att, &bdaddr, &bdaddr_type))
+		return;
+
+	dev_state = find_device_state(database, &bdaddr, bdaddr_type);
+	if (!dev_state || !dev_state->server || !dev_state->sec_wait)
+		return;
+
+	outbox_flush_when_secure(dev_state, att);
+}
+
+static bool dev_state_match_server(const void *a, const void *b)
+{
+	const struct device_state *dev_state = a;
+
+	return dev_state->server == b;
+}
+
+void btd_gatt_database_att_disconnected(struct btd_gatt_database *database,
+						struct btd_device *device,
+						struct bt_gatt_server *server)
+{
+	struct device_state *dev_state;
+
+	if (!database || !server)
+		return;
+
+	dev_state = queue_find(database->device_states, dev_state_match_server,
+									server);
+	if (!dev_state)
+		return;
+
+	dev_state->server = NULL;
+	dev_state->bonded = device_is_bonded(device, dev_state->bdaddr_type);
+	dev_state->sec_wait = false;
+
+	bt_gatt_server_unref(server);
+
+	/* Subscriptions of devices that aren't bonded end with the link */
+	if (!dev_state->bonded) {
+		device_state_forget(database, dev_state);
+		return;
+	}
+
+	queue_foreach(dev_state->ccc_states, update_device_subscriber,
+								database);
+}
+
+struct forget_data {
+	struct btd_gatt_database *database;
+	const bdaddr_t *bdaddr;
+};
+
+static void forget_device_state(void *data, void *user_data)
+{
+	struct device_state *dev_state = data;
+	struct forget_data *forget = user_data;
+
+	if (bacmp(&dev_state->bdaddr, forget->bdaddr))
+		return;
+
+	clear_device_state(forget->database, dev_state);
+	dev_state->bonded = false;
+}
+
+static bool dev_state_match_offline(const void *a, const void *b)
+{
+	const struct device_state *dev_state = a;
+
+	return !dev_state->server && !bacmp(&dev_state->bdaddr, b);
+}
+
+void btd_gatt_database_device_removed(struct btd_gatt_database *database,
+						struct btd_device *device)
+{
+	struct forget_data forget;
+
+	if (!database || !device)
+		return;
+
+	forget.database = database;
+	forget.bdaddr = device_get_address(device);
+
+	/* Connected ones go once they disconnect */
+	queue_foreach(database->device_states, forget_device_state, &forget);
+	queue_remove_all(database->device_states, dev_state_match_offline,
+					(void *) forget.bdaddr, device_state_free);
+}
@@ -34,3 +34,23 @@ btd_gatt_database_add_ccc(struct btd_gatt_database *database,
 				btd_gatt_database_ccc_write_t write_callback,
 				void *user_data,
 				btd_gatt_database_destroy_t destroy);
+
+typedef void (*btd_gatt_database_subscriber_t) (struct btd_device *device,
+						struct bt_gatt_server *server,
+						void *user_data);
+
+void btd_gatt_database_foreach_subscriber(struct btd_gatt_database *database,
+					uint16_t ccc_handle,
+					btd_gatt_database_subscriber_t func,
+					void *user_data);
+
+void btd_gatt_database_att_connected(struct btd_gatt_database *database,
+						struct bt_att *att,
+						struct bt_gatt_server *server);
+void btd_gatt_database_att_secured(struct btd_gatt_database *database,
+							struct bt_att *att);
+void btd_gatt_database_att_disconnected(struct btd_gatt_database *database,
+						struct btd_device *device,
+						struct bt_gatt_server *server);
+void btd_gatt_database_device_removed(struct btd_gatt_database *database,
+						struct btd_device *device);
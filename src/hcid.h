@@ -39,6 +39,9 @@ struct main_opts {
 	gboolean	name_resolv;
 	gboolean	debug_keys;
 	gboolean	fast_conn;
+	uint8_t		eatt_channels;
+	uint32_t	notify_outbox_size;
+	uint32_t	prep_queue_size;
 
 	uint16_t	did_source;
 	uint16_t	did_vendor;
@@ -63,6 +63,11 @@
 
 #define DEFAULT_PAIRABLE_TIMEOUT       0 /* disabled */
 #define DEFAULT_DISCOVERABLE_TIMEOUT 180 /* 3 minutes */
+#define MAX_EATT_CHANNELS              5
+#define DEFAULT_NOTIFY_OUTBOX_SIZE  1024 /* bytes per bonded device */
+#define MAX_NOTIFY_OUTBOX_SIZE     65536
+#define DEFAULT_PREP_QUEUE_SIZE     8192 /* bytes per connection */
+#define MAX_PREP_QUEUE_SIZE        65536
 
 #define SHUTDOWN_GRACE_SECONDS 10
 
@@ -88,6 +93,9 @@ static const char * const supported_options[] = {
 	"DebugKeys",
 	"ControllerMode",
 	"MultiProfile",
+	"EATTChannels",
+	"NotifyOutboxSize",
+	"PrepareQueueSize",
 };
 
 GKeyFile *btd_get_main_conf(void)
@@ -335,6 +343,34 @@ static void parse_config(GKeyFile *config)
 		g_clear_error(&err);
 	else
 		main_opts.fast_conn = boolean;
+
+	val = g_key_file_get_integer(config, "General", "EATTChannels", &err);
+	if (err) {
+		g_clear_error(&err);
+	} else {
+		DBG("EATTChannels=%d", val);
+		main_opts.eatt_channels = MIN(MAX(val, 0), MAX_EATT_CHANNELS);
+	}
+
+	val = g_key_file_get_integer(config, "General", "NotifyOutboxSize",
+									&err);
+	if (err) {
+		g_clear_error(&err);
+	} else {
+		DBG("NotifyOutboxSize=%d", val);
+		main_opts.notify_outbox_size = MIN(MAX(val, 0),
+						MAX_NOTIFY_OUTBOX_SIZE);
+	}
+
+	val = g_key_file_get_integer(config, "General", "PrepareQueueSize",
+									&err);
+	if (err) {
+		g_clear_error(&err);
+	} else {
+		DBG("PrepareQueueSize=%d", val);
+		main_opts.prep_queue_size = MIN(MAX(val, 0),
+						MAX_PREP_QUEUE_SIZE);
+	}
 }
 
 static void init_defaults(void)
@@ -350,6 +386,8 @@ static void init_defaults(void)
 	main_opts.reverse_sdp = TRUE;
 	main_opts.name_resolv = TRUE;
 	main_opts.debug_keys = FALSE;
+	main_opts.notify_outbox_size = DEFAULT_NOTIFY_OUTBOX_SIZE;
+	main_opts.prep_queue_size = DEFAULT_PREP_QUEUE_SIZE;
 
 	if (sscanf(VERSION, "%hhu.%hhu", &major, &minor) != 2)
 		return;
@@ -28,12 +28,14 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
 #include "src/shared/util.h"
 #include "src/shared/timeout.h"
 #include "lib/bluetooth.h"
+#include "lib/l2cap.h"
 #include "lib/uuid.h"
 #include "src/shared/att.h"
 #include "src/shared/crypto.h"
@@ -42,6 +44,7 @@
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
 #define ATT_TIMEOUT_INTERVAL		30000  /* 30000 ms */
+#define ATT_DEFAULT_WRITE_BURST		16  /* PDUs sent per write wakeup */
 
 /*
  * Common Profile and Service Error Code descriptions (see Supplement to the
@@ -53,31 +56,29 @@
 #define BT_ERROR_ALREADY_IN_PROGRESS		0xfe
 #define BT_ERROR_OUT_OF_RANGE			0xff
 
-/* Length of signature in write signed packet */
-#define BT_ATT_SIGNATURE_LEN		12
-
 struct att_send_op;
+struct att_chan;
 
 struct bt_att {
 	int ref_count;
 	int fd;
-	struct io *io;
 	bool io_on_l2cap;
 	int io_sec_level;		/* Only used for non-L2CAP */
 
+	struct att_chan *fixed;		/* Fixed channel, NULL once closed */
+	struct queue *chans;		/* All bearers, fixed channel first */
+	struct att_chan *current_chan;	/* Bearer of the PDU being handled */
+	unsigned int next_in_seq;
+
 	struct queue *req_queue;	/* Queued ATT protocol requests */
-	struct att_send_op *pending_req;
 	struct queue *ind_queue;	/* Queued ATT protocol indications */
-	struct att_send_op *pending_ind;
 	struct queue *write_queue;	/* Queue of PDUs ready to send */
-	bool writer_active;
+	unsigned int write_burst;	/* Max PDUs sent per write wakeup */
+	struct bt_att_stats stats;
 
 	struct queue *notify_list;	/* List of registered callbacks */
 	struct queue *disconn_list;	/* List of disconnect handlers */
 
-	bool in_req;			/* There's a pending incoming request */
-
-	uint8_t *buf;
 	uint16_t mtu;
 
 	unsigned int next_send_id;	/* IDs for "send" ops */
@@ -97,6 +98,35 @@ struct bt_att {
 	struct sign_info *remote_sign;
 };
 
+/*
+ * A bearer carrying ATT PDUs. Besides the fixed channel, additional
+ * bearers (Enhanced ATT, L2CAP connection oriented channels) can be
+ * attached; each of them follows the sequential request rule on its own
+ * so requests can be outstanding on several bearers at the same time.
+ */
+struct att_chan {
+	struct bt_att *att;
+	int fd;
+	struct io *io;
+	bool fixed;
+
+	struct att_send_op *pending_req;
+	struct att_send_op *pending_ind;
+	struct queue *queue;		/* PDUs that must use this bearer */
+	bool writer_active;
+
+	bool in_req;			/* There's a pending incoming request */
+	bool rsp_queued;		/* Its response has been queued */
+	unsigned int in_req_seq;
+	uint8_t in_req_opcode;
+	bool in_ind;			/* There's a pending incoming indication */
+	bool conf_queued;		/* Its confirmation has been queued */
+	unsigned int in_ind_seq;
+
+	uint8_t *buf;
+	uint16_t mtu;
+};
+
 struct sign_info {
 	uint8_t key[16];
 	bt_att_counter_func_t counter;
@@ -197,6 +227,7 @@ struct att_send_op {
 	uint16_t opcode;
 	void *pdu;
 	uint16_t len;
+	struct att_chan *chan;		/* Bearer the op is bound to, if any */
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
@@ -370,20 +401,55 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	return op;
 }
 
-static struct att_send_op *pick_next_send_op(struct bt_att *att)
+static bool fixed_only_opcode(uint8_t opcode)
 {
+	/*
+	 * The prepare queue of the server is tied to the bearer, so queued
+	 * writes have to stay on the fixed channel, as does MTU exchange.
+	 */
+	switch (opcode) {
+	case BT_ATT_OP_MTU_REQ:
+	case BT_ATT_OP_PREP_WRITE_REQ:
+	case BT_ATT_OP_EXEC_WRITE_REQ:
+		return true;
+	}
+
+	return false;
+}
+
+static bool match_op_for_chan(const void *a, const void *b)
+{
+	const struct att_send_op *op = a;
+	const struct att_chan *chan = b;
+
+	if (op->len > chan->mtu)
+		return false;
+
+	return chan->fixed || !fixed_only_opcode(op->opcode);
+}
+
+static struct att_send_op *pick_next_send_op(struct att_chan *chan)
+{
+	struct bt_att *att = chan->att;
 	struct att_send_op *op;
 
-	/* See if any operations are already in the write queue */
-	op = queue_pop_head(att->write_queue);
+	/* Responses and confirmations bound to this bearer go first */
+	op = queue_pop_head(chan->queue);
 	if (op)
 		return op;
 
+	/* See if any operations are already in the write queue */
+	if (chan->fixed) {
+		op = queue_pop_head(att->write_queue);
+		if (op)
+			return op;
+	}
+
 	/* If there is no pending request, pick an operation from the
 	 * request queue.
 	 */
-	if (!att->pending_req) {
-		op = queue_pop_head(att->req_queue);
+	if (!chan->pending_req) {
+		op = queue_remove_if(att->req_queue, match_op_for_chan, chan);
 		if (op)
 			return op;
 	}
@@ -391,8 +457,8 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	/* There is either a request pending or no requests queued. If there is
 	 * no pending indication, pick an operation from the indication queue.
 	 */
-	if (!att->pending_ind) {
-		op = queue_pop_head(att->ind_queue);
+	if (!chan->pending_ind) {
+		op = queue_remove_if(att->ind_queue, match_op_for_chan, chan);
 		if (op)
 			return op;
 	}
@@ -401,22 +467,23 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 }
 
 struct timeout_data {
-	struct bt_att *att;
+	struct att_chan *chan;
 	unsigned int id;
 };
 
 static bool timeout_cb(void *user_data)
 {
 	struct timeout_data *timeout = user_data;
-	struct bt_att *att = timeout->att;
+	struct att_chan *chan = timeout->chan;
+	struct bt_att *att = chan->att;
 	struct att_send_op *op = NULL;
 
-	if (att->pending_req && att->pending_req->id == timeout->id) {
-		op = att->pending_req;
-		att->pending_req = NULL;
-	} else if (att->pending_ind && att->pending_ind->id == timeout->id) {
-		op = att->pending_ind;
-		att->pending_ind = NULL;
+	if (chan->pending_req && chan->pending_req->id == timeout->id) {
+		op = chan->pending_req;
+		chan->pending_req = NULL;
+	} else if (chan->pending_ind && chan->pending_ind->id == timeout->id) {
+		op = chan->pending_ind;
+		chan->pending_ind = NULL;
 	}
 
 	if (!op)
@@ -432,53 +499,87 @@ static bool timeout_cb(void *user_data)
 	destroy_att_send_op(op);
 
 	/*
-	 * Directly terminate the connection as required by the ATT protocol.
+	 * Directly terminate the bearer as required by the ATT protocol.
 	 * This should trigger an io disconnect event which will clean up the
 	 * io and notify the upper layer.
 	 */
-	io_shutdown(att->io);
+	io_shutdown(chan->io);
 
 	return false;
 }
 
 static void write_watch_destroy(void *user_data)
 {
-	struct bt_att *att = user_data;
+	struct att_chan *chan = user_data;
 
-	att->writer_active = false;
+	chan->writer_active = false;
 }
 
-static bool can_write_data(struct io *io, void *user_data)
+static void requeue_send_op(struct bt_att *att, struct att_send_op *op)
+{
+	if (op->chan) {
+		queue_push_head(op->chan->queue, op);
+		return;
+	}
+
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+		queue_push_head(att->req_queue, op);
+		break;
+	case ATT_OP_TYPE_IND:
+		queue_push_head(att->ind_queue, op);
+		break;
+	case ATT_OP_TYPE_RSP:
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_NOT:
+	case ATT_OP_TYPE_CONF:
+	case ATT_OP_TYPE_UNKNOWN:
+	default:
+		queue_push_head(att->write_queue, op);
+		break;
+	}
+}
+
+static ssize_t send_op(struct att_chan *chan, struct io *io,
+					struct att_send_op *op, bool nonblock)
 {
-	struct bt_att *att = user_data;
-	struct att_send_op *op;
-	struct timeout_data *timeout;
-	ssize_t ret;
 	struct iovec iov;
+	ssize_t ret;
 
-	op = pick_next_send_op(att);
-	if (!op)
-		return false;
+	/*
+	 * The first PDU of a wakeup is known to fit in the socket buffer.
+	 * Any further PDUs must not block the mainloop once the buffer is
+	 * full, so these are sent with MSG_DONTWAIT.
+	 */
+	if (!nonblock) {
+		iov.iov_base = op->pdu;
+		iov.iov_len = op->len;
 
-	iov.iov_base = op->pdu;
-	iov.iov_len = op->len;
+		return io_send(io, &iov, 1);
+	}
 
-	ret = io_send(io, &iov, 1);
+	ret = send(chan->fd, op->pdu, op->len, MSG_DONTWAIT);
 	if (ret < 0) {
-		util_debug(att->debug_callback, att->debug_data,
-					"write failed: %s", strerror(-ret));
-		if (op->callback)
-			op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
-							op->user_data);
+		/* Not a socket, leave the remaining PDUs to the next wakeup */
+		if (errno == ENOTSOCK)
+			return -EAGAIN;
 
-		destroy_att_send_op(op);
-		return true;
+		return -errno;
 	}
 
+	return ret;
+}
+
+static void write_op(struct att_chan *chan, struct att_send_op *op,
+								ssize_t len)
+{
+	struct bt_att *att = chan->att;
+	struct timeout_data *timeout;
+
 	util_debug(att->debug_callback, att->debug_data,
 					"ATT op 0x%02x", op->opcode);
 
-	util_hexdump('<', op->pdu, ret, att->debug_callback, att->debug_data);
+	util_hexdump('<', op->pdu, len, att->debug_callback, att->debug_data);
 
 	/* Based on the operation type, set either the pending request or the
 	 * pending indication. If it came from the write queue, then there is
@@ -486,57 +587,152 @@ static bool can_write_data(struct io *io, void *user_data)
 	 */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
-		att->pending_req = op;
+		chan->pending_req = op;
 		break;
 	case ATT_OP_TYPE_IND:
-		att->pending_ind = op;
+		chan->pending_ind = op;
 		break;
 	case ATT_OP_TYPE_RSP:
 		/* Set in_req to false to indicate that no request is pending */
-		att->in_req = false;
-
-		/* Fall through to the next case */
+		chan->in_req = false;
+		chan->rsp_queued = false;
+		destroy_att_send_op(op);
+		return;
+	case ATT_OP_TYPE_CONF:
+		chan->in_ind = false;
+		chan->conf_queued = false;
+		destroy_att_send_op(op);
+		return;
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
-	case ATT_OP_TYPE_CONF:
 	case ATT_OP_TYPE_UNKNOWN:
 	default:
 		destroy_att_send_op(op);
-		return true;
+		return;
 	}
 
 	timeout = new0(struct timeout_data, 1);
 	if (!timeout)
-		return true;
+		return;
 
-	timeout->att = att;
+	timeout->chan = chan;
 	timeout->id = op->id;
 	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
 								timeout, free);
+}
+
+static void update_write_stats(struct bt_att *att, unsigned int count)
+{
+	if (!count)
+		return;
+
+	att->stats.write_wakeups++;
+	att->stats.pdus_sent += count;
+
+	if (count > att->stats.max_pdus_per_wakeup)
+		att->stats.max_pdus_per_wakeup = count;
+}
+
+static bool can_write_data(struct io *io, void *user_data)
+{
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
+	struct att_send_op *op;
+	unsigned int count = 0;
+	ssize_t ret;
+
+	/* Drain as many eligible PDUs as the burst limit allows */
+	while (count < att->write_burst) {
+		op = pick_next_send_op(chan);
+		if (!op) {
+			update_write_stats(att, count);
+			return false;
+		}
+
+		ret = send_op(chan, io, op, count > 0);
+		if (ret == -EAGAIN || ret == -EWOULDBLOCK) {
+			requeue_send_op(att, op);
+			break;
+		}
+
+		if (ret < 0) {
+			util_debug(att->debug_callback, att->debug_data,
+					"write failed: %s", strerror(-ret));
+			if (op->callback)
+				op->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
+							op->user_data);
+
+			/*
+			 * The reply is lost; don't let the next request from
+			 * the peer look like a protocol violation.
+			 */
+			if (op->chan == chan && op->type == ATT_OP_TYPE_RSP) {
+				chan->in_req = false;
+				chan->rsp_queued = false;
+			} else if (op->chan == chan &&
+					op->type == ATT_OP_TYPE_CONF) {
+				chan->in_ind = false;
+				chan->conf_queued = false;
+			}
+
+			destroy_att_send_op(op);
+			break;
+		}
+
+		write_op(chan, op, ret);
+		count++;
+	}
+
+	update_write_stats(att, count);
 
 	/* Return true as there may be more operations ready to write. */
 	return true;
 }
 
-static void wakeup_writer(struct bt_att *att)
+static bool chan_has_work(struct att_chan *chan)
 {
-	if (att->writer_active)
+	struct bt_att *att = chan->att;
+
+	if (!queue_isempty(chan->queue))
+		return true;
+
+	if (chan->fixed && !queue_isempty(att->write_queue))
+		return true;
+
+	if (!chan->pending_req && queue_find(att->req_queue,
+						match_op_for_chan, chan))
+		return true;
+
+	if (!chan->pending_ind && queue_find(att->ind_queue,
+						match_op_for_chan, chan))
+		return true;
+
+	return false;
+}
+
+static void wakeup_chan_writer(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+
+	if (chan->writer_active || !chan->io)
 		return;
 
 	/* Set the write handler only if there is anything that can be sent
 	 * at all.
 	 */
-	if (queue_isempty(att->write_queue)) {
-		if ((att->pending_req || queue_isempty(att->req_queue)) &&
-			(att->pending_ind || queue_isempty(att->ind_queue)))
-			return;
-	}
+	if (!chan_has_work(chan))
+		return;
 
-	if (!io_set_write_handler(att->io, can_write_data, att,
+	if (!io_set_write_handler(chan->io, can_write_data, chan,
 							write_watch_destroy))
 		return;
 
-	att->writer_active = true;
+	chan->writer_active = true;
+}
+
+static void wakeup_writer(struct bt_att *att)
+{
+	queue_foreach(att->chans, wakeup_chan_writer, NULL);
 }
 
 static void disconn_handler(void *data, void *user_data)
@@ -551,15 +747,104 @@ static void disconn_handler(void *data, void *user_data)
 		disconn->callback(err, disconn->user_data);
 }
 
+static void chan_free(void *data)
+{
+	struct att_chan *chan = data;
+
+	if (chan->pending_req)
+		destroy_att_send_op(chan->pending_req);
+
+	if (chan->pending_ind)
+		destroy_att_send_op(chan->pending_ind);
+
+	queue_destroy(chan->queue, destroy_att_send_op);
+	io_destroy(chan->io);
+
+	free(chan->buf);
+	free(chan);
+}
+
+static void chan_cancel_all(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+
+	queue_remove_all(chan->queue, NULL, NULL, destroy_att_send_op);
+	chan->rsp_queued = false;
+	chan->conf_queued = false;
+
+	/* Don't cancel the pending operations; remove their handlers */
+	if (chan->pending_req)
+		cancel_att_send_op(chan->pending_req);
+
+	if (chan->pending_ind)
+		cancel_att_send_op(chan->pending_ind);
+}
+
+static void chan_destroy_io(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+
+	io_destroy(chan->io);
+	chan->io = NULL;
+}
+
+static void requeue_pending(struct bt_att *att, struct att_send_op *op,
+							struct queue *queue)
+{
+	if (!op)
+		return;
+
+	if (op->timeout_id) {
+		timeout_remove(op->timeout_id);
+		op->timeout_id = 0;
+	}
+
+	queue_push_head(queue, op);
+}
+
+static void chan_disconnected(struct att_chan *chan)
+{
+	struct bt_att *att = chan->att;
+
+	util_debug(att->debug_callback, att->debug_data,
+					"ATT bearer %d disconnected", chan->fd);
+
+	queue_remove(att->chans, chan);
+
+	/*
+	 * The peer never answered the outstanding operations of this bearer,
+	 * give them another chance on the remaining ones. Responses bound to
+	 * the bearer are meaningless now and dropped along with it.
+	 */
+	requeue_pending(att, chan->pending_req, att->req_queue);
+	chan->pending_req = NULL;
+
+	requeue_pending(att, chan->pending_ind, att->ind_queue);
+	chan->pending_ind = NULL;
+
+	if (att->current_chan == chan)
+		att->current_chan = NULL;
+
+	chan_free(chan);
+
+	wakeup_writer(att);
+}
+
 static bool disconnect_cb(struct io *io, void *user_data)
 {
-	struct bt_att *att = user_data;
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
 	int err;
 	socklen_t len;
 
+	if (!chan->fixed) {
+		chan_disconnected(chan);
+		return false;
+	}
+
 	len = sizeof(err);
 
-	if (getsockopt(att->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+	if (getsockopt(chan->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
 		util_debug(att->debug_callback, att->debug_data,
 					"Failed to obtain disconnect error: %s",
 					strerror(errno));
@@ -570,8 +855,9 @@ static bool disconnect_cb(struct io *io, void *user_data)
 					"Physical link disconnected: %s",
 					strerror(err));
 
-	io_destroy(att->io);
-	att->io = NULL;
+	/* Losing the fixed channel tears down all the other bearers too */
+	queue_foreach(att->chans, chan_destroy_io, NULL);
+	att->fixed = NULL;
 
 	bt_att_cancel_all(att);
 
@@ -585,10 +871,11 @@ static bool disconnect_cb(struct io *io, void *user_data)
 	return false;
 }
 
-static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
+static void handle_rsp(struct att_chan *chan, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
-	struct att_send_op *op = att->pending_req;
+	struct bt_att *att = chan->att;
+	struct att_send_op *op = chan->pending_req;
 	uint8_t req_opcode;
 	uint8_t rsp_opcode;
 	uint8_t *rsp_pdu = NULL;
@@ -601,7 +888,7 @@ static void handle_rsp(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	if (!op) {
 		util_debug(att->debug_callback, att->debug_data,
 					"Received unexpected ATT response");
-		io_shutdown(att->io);
+		io_shutdown(chan->io);
 		return;
 	}
 
@@ -640,14 +927,15 @@ done:
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
 	destroy_att_send_op(op);
-	att->pending_req = NULL;
+	chan->pending_req = NULL;
 
 	wakeup_writer(att);
 }
 
-static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
+static void handle_conf(struct att_chan *chan, uint8_t *pdu, ssize_t pdu_len)
 {
-	struct att_send_op *op = att->pending_ind;
+	struct bt_att *att = chan->att;
+	struct att_send_op *op = chan->pending_ind;
 
 	/*
 	 * Disconnect the bearer if the confirmation is unexpected or the PDU is
@@ -656,7 +944,7 @@ static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
 	if (!op || pdu_len) {
 		util_debug(att->debug_callback, att->debug_data,
 				"Received unexpected/invalid ATT confirmation");
-		io_shutdown(att->io);
+		io_shutdown(chan->io);
 		return;
 	}
 
@@ -664,7 +952,7 @@ static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
 		op->callback(BT_ATT_OP_HANDLE_VAL_CONF, NULL, 0, op->user_data);
 
 	destroy_att_send_op(op);
-	att->pending_ind = NULL;
+	chan->pending_ind = NULL;
 
 	wakeup_writer(att);
 }
@@ -737,9 +1025,10 @@ fail:
 	return false;
 }
 
-static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
-								ssize_t pdu_len)
+static void handle_notify(struct att_chan *chan, uint8_t opcode,
+						uint8_t *pdu, ssize_t pdu_len)
 {
+	struct bt_att *att = chan->att;
 	const struct queue_entry *entry;
 	bool found;
 
@@ -751,6 +1040,9 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 
 	bt_att_ref(att);
 
+	/* Replies sent from within the handlers go back on this bearer */
+	att->current_chan = chan;
+
 	found = false;
 	entry = queue_get_entries(att->notify_list);
 
@@ -780,27 +1072,30 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 	if (!found && get_op_type(opcode) == ATT_OP_TYPE_REQ)
 		respond_not_supported(att, opcode);
 
+	att->current_chan = NULL;
+
 	bt_att_unref(att);
 }
 
 static bool can_read_data(struct io *io, void *user_data)
 {
-	struct bt_att *att = user_data;
+	struct att_chan *chan = user_data;
+	struct bt_att *att = chan->att;
 	uint8_t opcode;
 	uint8_t *pdu;
 	ssize_t bytes_read;
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
+	bytes_read = read(chan->fd, chan->buf, chan->mtu);
 	if (bytes_read < 0)
 		return false;
 
-	util_hexdump('>', att->buf, bytes_read,
+	util_hexdump('>', chan->buf, bytes_read,
 					att->debug_callback, att->debug_data);
 
 	if (bytes_read < ATT_MIN_PDU_LEN)
 		return true;
 
-	pdu = att->buf;
+	pdu = chan->buf;
 	opcode = pdu[0];
 
 	bt_att_ref(att);
@@ -810,12 +1105,12 @@ static bool can_read_data(struct io *io, void *user_data)
 	case ATT_OP_TYPE_RSP:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT response received: 0x%02x", opcode);
-		handle_rsp(att, opcode, pdu + 1, bytes_read - 1);
+		handle_rsp(chan, opcode, pdu + 1, bytes_read - 1);
 		break;
 	case ATT_OP_TYPE_CONF:
 		util_debug(att->debug_callback, att->debug_data,
 				"ATT confirmation received: 0x%02x", opcode);
-		handle_conf(att, pdu + 1, bytes_read - 1);
+		handle_conf(chan, pdu + 1, bytes_read - 1);
 		break;
 	case ATT_OP_TYPE_REQ:
 		/*
@@ -823,30 +1118,37 @@ static bool can_read_data(struct io *io, void *user_data)
 		 * protocol was violated. Disconnect the bearer, which will
 		 * promptly notify the upper layer via disconnect handlers.
 		 */
-		if (att->in_req) {
+		if (chan->in_req) {
 			util_debug(att->debug_callback, att->debug_data,
 					"Received request while another is "
 					"pending: 0x%02x", opcode);
-			io_shutdown(att->io);
+			io_shutdown(chan->io);
 			bt_att_unref(att);
 
 			return false;
 		}
 
-		att->in_req = true;
+		chan->in_req = true;
+		chan->in_req_seq = ++att->next_in_seq;
+		chan->in_req_opcode = opcode;
+
+		goto notify;
+	case ATT_OP_TYPE_IND:
+		chan->in_ind = true;
+		chan->in_ind_seq = ++att->next_in_seq;
 
 		/* Fall through to the next case */
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
 	case ATT_OP_TYPE_UNKNOWN:
-	case ATT_OP_TYPE_IND:
 	default:
+notify:
 		/* For all other opcodes notify the upper layer of the PDU and
 		 * let them act on it.
 		 */
 		util_debug(att->debug_callback, att->debug_data,
 					"ATT PDU received: 0x%02x", opcode);
-		handle_notify(att, opcode, pdu + 1, bytes_read - 1);
+		handle_notify(chan, opcode, pdu + 1, bytes_read - 1);
 		break;
 	}
 
@@ -882,13 +1184,7 @@ static bool is_io_l2cap_based(int fd)
 
 static void bt_att_free(struct bt_att *att)
 {
-	if (att->pending_req)
-		destroy_att_send_op(att->pending_req);
-
-	if (att->pending_ind)
-		destroy_att_send_op(att->pending_ind);
-
-	io_destroy(att->io);
+	queue_destroy(att->chans, chan_free);
 	bt_crypto_unref(att->crypto);
 
 	queue_destroy(att->req_queue, NULL);
@@ -906,11 +1202,53 @@ static void bt_att_free(struct bt_att *att)
 	free(att->local_sign);
 	free(att->remote_sign);
 
-	free(att->buf);
-
 	free(att);
 }
 
+static struct att_chan *chan_new(struct bt_att *att, int fd, uint16_t mtu,
+								bool fixed)
+{
+	struct att_chan *chan;
+
+	chan = new0(struct att_chan, 1);
+	if (!chan)
+		return NULL;
+
+	chan->att = att;
+	chan->fd = fd;
+	chan->fixed = fixed;
+	chan->mtu = mtu;
+
+	chan->buf = malloc(chan->mtu);
+	if (!chan->buf)
+		goto fail;
+
+	chan->queue = queue_new();
+	if (!chan->queue)
+		goto fail;
+
+	chan->io = io_new(fd);
+	if (!chan->io)
+		goto fail;
+
+	if (!io_set_read_handler(chan->io, can_read_data, chan, NULL))
+		goto fail;
+
+	if (!io_set_disconnect_handler(chan->io, disconnect_cb, chan, NULL))
+		goto fail;
+
+	/* Additional bearers are owned by bt_att, the fixed one by the user */
+	if (!fixed)
+		io_set_close_on_destroy(chan->io, true);
+
+	return chan;
+
+fail:
+	chan_free(chan);
+
+	return NULL;
+}
+
 struct bt_att *bt_att_new(int fd)
 {
 	struct bt_att *att;
@@ -925,17 +1263,15 @@ struct bt_att *bt_att_new(int fd)
 	att->fd = fd;
 
 	att->mtu = BT_ATT_DEFAULT_LE_MTU;
-	att->buf = malloc(att->mtu);
-	if (!att->buf)
-		goto fail;
-
-	att->io = io_new(fd);
-	if (!att->io)
-		goto fail;
+	att->write_burst = ATT_DEFAULT_WRITE_BURST;
 
 	/* crypto is optional, if not available leave it NULL */
 	att->crypto = bt_crypto_new();
 
+	att->chans = queue_new();
+	if (!att->chans)
+		goto fail;
+
 	att->req_queue = queue_new();
 	if (!att->req_queue)
 		goto fail;
@@ -956,11 +1292,14 @@ struct bt_att *bt_att_new(int fd)
 	if (!att->disconn_list)
 		goto fail;
 
-	if (!io_set_read_handler(att->io, can_read_data, att, NULL))
+	att->fixed = chan_new(att, fd, att->mtu, true);
+	if (!att->fixed)
 		goto fail;
 
-	if (!io_set_disconnect_handler(att->io, disconnect_cb, att, NULL))
+	if (!queue_push_tail(att->chans, att->fixed)) {
+		chan_free(att->fixed);
 		goto fail;
+	}
 
 	att->io_on_l2cap = is_io_l2cap_based(att->fd);
 	if (!att->io_on_l2cap)
@@ -974,6 +1313,63 @@ fail:
 	return NULL;
 }
 
+static uint16_t get_l2cap_mtu(int fd)
+{
+	struct l2cap_options opts;
+	socklen_t len;
+	uint16_t mtu;
+
+	memset(&opts, 0, sizeof(opts));
+	len = sizeof(opts);
+
+	if (getsockopt(fd, SOL_L2CAP, L2CAP_OPTIONS, &opts, &len) < 0)
+		return BT_ATT_DEFAULT_LE_MTU;
+
+	mtu = opts.imtu < opts.omtu ? opts.imtu : opts.omtu;
+
+	return mtu < BT_ATT_DEFAULT_LE_MTU ? BT_ATT_DEFAULT_LE_MTU : mtu;
+}
+
+int bt_att_attach_fd(struct bt_att *att, int fd)
+{
+	struct att_chan *chan;
+	uint16_t mtu;
+
+	if (!att || fd < 0)
+		return -EINVAL;
+
+	/* Additional bearers only make sense along an active fixed channel */
+	if (!att->fixed)
+		return -ENOTCONN;
+
+	mtu = is_io_l2cap_based(fd) ? get_l2cap_mtu(fd) : att->mtu;
+
+	chan = chan_new(att, fd, mtu, false);
+	if (!chan)
+		return -ENOMEM;
+
+	if (!queue_push_tail(att->chans, chan)) {
+		io_set_close_on_destroy(chan->io, false);
+		chan_free(chan);
+		return -ENOMEM;
+	}
+
+	util_debug(att->debug_callback, att->debug_data,
+				"ATT bearer %d attached (MTU %u)", fd, mtu);
+
+	wakeup_writer(att);
+
+	return 0;
+}
+
+unsigned int bt_att_get_channels(struct bt_att *att)
+{
+	if (!att || !att->fixed)
+		return 0;
+
+	return queue_length(att->chans);
+}
+
 struct bt_att *bt_att_ref(struct bt_att *att)
 {
 	if (!att)
@@ -1000,10 +1396,10 @@ void bt_att_unref(struct bt_att *att)
 
 bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close)
 {
-	if (!att || !att->io)
+	if (!att || !att->fixed)
 		return false;
 
-	return io_set_close_on_destroy(att->io, do_close);
+	return io_set_close_on_destroy(att->fixed->io, do_close);
 }
 
 int bt_att_get_fd(struct bt_att *att)
@@ -1052,14 +1448,50 @@ bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu)
 	if (!buf)
 		return false;
 
-	free(att->buf);
-
 	att->mtu = mtu;
-	att->buf = buf;
+
+	if (att->fixed) {
+		free(att->fixed->buf);
+		att->fixed->mtu = mtu;
+		att->fixed->buf = buf;
+	} else
+		free(buf);
+
+	return true;
+}
+
+bool bt_att_set_write_burst(struct bt_att *att, unsigned int burst)
+{
+	if (!att || !burst)
+		return false;
+
+	att->write_burst = burst;
+
+	return true;
+}
+
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	memcpy(stats, &att->stats, sizeof(*stats));
+
+	stats->write_queue_depth = queue_length(att->write_queue);
+	stats->req_queue_depth = queue_length(att->req_queue);
+	stats->ind_queue_depth = queue_length(att->ind_queue);
 
 	return true;
 }
 
+void bt_att_reset_stats(struct bt_att *att)
+{
+	if (!att)
+		return;
+
+	memset(&att->stats, 0, sizeof(att->stats));
+}
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy)
@@ -1084,7 +1516,7 @@ unsigned int bt_att_register_disconnect(struct bt_att *att,
 {
 	struct att_disconn *disconn;
 
-	if (!att || !att->io)
+	if (!att || !att->fixed)
 		return 0;
 
 	disconn = new0(struct att_disconn, 1);
@@ -1124,15 +1556,140 @@ bool bt_att_unregister_disconnect(struct bt_att *att, unsigned int id)
 	return true;
 }
 
-unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
-				const void *pdu, uint16_t length,
+static void update_queue_stats(struct bt_att *att)
+{
+	unsigned int depth;
+
+	depth = queue_length(att->write_queue);
+	if (depth > att->stats.max_write_queue_depth)
+		att->stats.max_write_queue_depth = depth;
+
+	depth = queue_length(att->req_queue);
+	if (depth > att->stats.max_req_queue_depth)
+		att->stats.max_req_queue_depth = depth;
+
+	depth = queue_length(att->ind_queue);
+	if (depth > att->stats.max_ind_queue_depth)
+		att->stats.max_ind_queue_depth = depth;
+}
+
+struct match_in_data {
+	enum att_op_type type;
+	struct att_chan *chan;
+};
+
+static void find_oldest_in(void *data, void *user_data)
+{
+	struct att_chan *chan = data;
+	struct match_in_data *match = user_data;
+
+	if (match->type == ATT_OP_TYPE_RSP) {
+		if (!chan->in_req || chan->rsp_queued)
+			return;
+
+		if (!match->chan || chan->in_req_seq < match->chan->in_req_seq)
+			match->chan = chan;
+
+		return;
+	}
+
+	if (!chan->in_ind || chan->conf_queued)
+		return;
+
+	if (!match->chan || chan->in_ind_seq < match->chan->in_ind_seq)
+		match->chan = chan;
+}
+
+/*
+ * Responses and confirmations have to go out on the bearer the request or
+ * indication arrived on: the one being handled right now if the reply is
+ * sent synchronously, otherwise the one that has been waiting the longest.
+ */
+static struct att_chan *find_reply_chan(struct bt_att *att,
+							enum att_op_type type)
+{
+	struct att_chan *chan = att->current_chan;
+	struct match_in_data match;
+
+	if (chan) {
+		if (type == ATT_OP_TYPE_RSP && chan->in_req &&
+							!chan->rsp_queued)
+			return chan;
+
+		if (type == ATT_OP_TYPE_CONF && chan->in_ind &&
+							!chan->conf_queued)
+			return chan;
+	}
+
+	match.type = type;
+	match.chan = NULL;
+	queue_foreach(att->chans, find_oldest_in, &match);
+
+	return match.chan;
+}
+
+/*
+ * Replies are encoded against the MTU of the connection, which can be
+ * larger than the one of the bearer they go out on. Read values and
+ * lists are cut down to what fits, as their requests allow for that;
+ * any other reply is replaced by an error.
+ */
+static void fit_reply_to_chan(struct att_chan *chan, struct att_send_op *op)
+{
+	uint8_t *pdu = op->pdu;
+	uint16_t hdr_len = 0, elem_len = 0;
+
+	if (op->len <= chan->mtu)
+		return;
+
+	switch (op->opcode) {
+	case BT_ATT_OP_READ_RSP:
+	case BT_ATT_OP_READ_BLOB_RSP:
+	case BT_ATT_OP_READ_MULT_RSP:
+		op->len = chan->mtu;
+		return;
+	case BT_ATT_OP_READ_BY_TYPE_RSP:
+	case BT_ATT_OP_READ_BY_GRP_TYPE_RSP:
+		hdr_len = 2;
+		elem_len = pdu[1];
+		break;
+	case BT_ATT_OP_FIND_INFO_RSP:
+		hdr_len = 2;
+		elem_len = pdu[1] == 0x01 ? 4 : 18;
+		break;
+	case BT_ATT_OP_FIND_BY_TYPE_VAL_RSP:
+		hdr_len = 1;
+		elem_len = 4;
+		break;
+	}
+
+	if (elem_len && hdr_len + elem_len <= chan->mtu) {
+		op->len = hdr_len + (chan->mtu - hdr_len) / elem_len * elem_len;
+		return;
+	}
+
+	util_debug(chan->att->debug_callback, chan->att->debug_data,
+			"ATT reply 0x%02x does not fit bearer (%u > %u)",
+			op->opcode, op->len, chan->mtu);
+
+	/* An MTU is at least 23 octets, so there's room for the error */
+	op->opcode = BT_ATT_OP_ERROR_RSP;
+	op->len = 5;
+	pdu[0] = BT_ATT_OP_ERROR_RSP;
+	pdu[1] = chan->in_req_opcode;
+	put_le16(0x0000, &pdu[2]);
+	pdu[4] = BT_ATT_ERROR_UNLIKELY;
+}
+
+static unsigned int att_send(struct bt_att *att, struct att_chan *chan,
+				uint8_t opcode, const void *pdu, uint16_t length,
 				bt_att_response_func_t callback, void *user_data,
 				bt_att_destroy_func_t destroy)
 {
 	struct att_send_op *op;
 	bool result;
 
-	if (!att || !att->io)
+	if (!att || !att->fixed)
 		return 0;
 
 	op = create_att_send_op(att, opcode, pdu, length, callback, user_data,
@@ -1153,11 +1710,30 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	case ATT_OP_TYPE_IND:
 		result = queue_push_tail(att->ind_queue, op);
 		break;
+	case ATT_OP_TYPE_RSP:
+	case ATT_OP_TYPE_CONF:
+		if (!chan)
+			chan = find_reply_chan(att, op->type);
+
+		if (chan) {
+			op->chan = chan;
+			fit_reply_to_chan(chan, op);
+			result = queue_push_tail(chan->queue, op);
+			if (!result)
+				break;
+
+			if (op->type == ATT_OP_TYPE_RSP)
+				chan->rsp_queued = true;
+			else
+				chan->conf_queued = true;
+
+			break;
+		}
+
+		/* Fall through to the next case */
 	case ATT_OP_TYPE_CMD:
 	case ATT_OP_TYPE_NOT:
 	case ATT_OP_TYPE_UNKNOWN:
-	case ATT_OP_TYPE_RSP:
-	case ATT_OP_TYPE_CONF:
 	default:
 		result = queue_push_tail(att->write_queue, op);
 		break;
@@ -1169,11 +1745,64 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 		return 0;
 	}
 
+	update_queue_stats(att);
+
 	wakeup_writer(att);
 
 	return op->id;
 }
 
+unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
+				const void *pdu, uint16_t length,
+				bt_att_response_func_t callback, void *user_data,
+				bt_att_destroy_func_t destroy)
+{
+	return att_send(att, NULL, opcode, pdu, length, callback, user_data,
+								destroy);
+}
+
+unsigned int bt_att_get_request_id(struct bt_att *att)
+{
+	struct att_chan *chan;
+
+	if (!att)
+		return 0;
+
+	chan = att->current_chan;
+	if (!chan || !chan->in_req || chan->rsp_queued)
+		return 0;
+
+	return chan->in_req_seq;
+}
+
+static bool match_request_id(const void *a, const void *b)
+{
+	const struct att_chan *chan = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	return chan->in_req && !chan->rsp_queued && chan->in_req_seq == id;
+}
+
+unsigned int bt_att_reply(struct bt_att *att, unsigned int request_id,
+				uint8_t opcode, const void *pdu,
+				uint16_t length)
+{
+	struct att_chan *chan = NULL;
+
+	if (!att)
+		return 0;
+
+	if (request_id) {
+		/* The bearer went away or the request was already answered */
+		chan = queue_find(att->chans, match_request_id,
+						UINT_TO_PTR(request_id));
+		if (!chan)
+			return 0;
+	}
+
+	return att_send(att, chan, opcode, pdu, length, NULL, NULL, NULL);
+}
+
 static bool match_op_id(const void *a, const void *b)
 {
 	const struct att_send_op *op = a;
@@ -1182,22 +1811,40 @@ static bool match_op_id(const void *a, const void *b)
 	return op->id == id;
 }
 
+static bool match_pending_id(const void *a, const void *b)
+{
+	const struct att_chan *chan = a;
+	unsigned int id = PTR_TO_UINT(b);
+
+	if (chan->pending_req && chan->pending_req->id == id)
+		return true;
+
+	return chan->pending_ind && chan->pending_ind->id == id;
+}
+
+static bool match_queued_id(const void *a, const void *b)
+{
+	const struct att_chan *chan = a;
+
+	return queue_find(chan->queue, match_op_id, b);
+}
+
 bool bt_att_cancel(struct bt_att *att, unsigned int id)
 {
+	struct att_chan *chan;
 	struct att_send_op *op;
 
 	if (!att || !id)
 		return false;
 
-	if (att->pending_req && att->pending_req->id == id) {
-		/* Don't cancel the pending request; remove it's handlers */
-		cancel_att_send_op(att->pending_req);
-		return true;
-	}
+	chan = queue_find(att->chans, match_pending_id, UINT_TO_PTR(id));
+	if (chan) {
+		/* Don't cancel the pending operation; remove it's handlers */
+		if (chan->pending_req && chan->pending_req->id == id)
+			cancel_att_send_op(chan->pending_req);
+		else
+			cancel_att_send_op(chan->pending_ind);
 
-	if (att->pending_ind && att->pending_ind->id == id) {
-		/* Don't cancel the pending indication; remove it's handlers */
-		cancel_att_send_op(att->pending_ind);
 		return true;
 	}
 
@@ -1213,9 +1860,16 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 	if (op)
 		goto done;
 
-	if (!op)
+	chan = queue_find(att->chans, match_queued_id, UINT_TO_PTR(id));
+	if (!chan)
 		return false;
 
+	op = queue_remove_if(chan->queue, match_op_id, UINT_TO_PTR(id));
+	if (op->type == ATT_OP_TYPE_RSP)
+		chan->rsp_queued = false;
+	else if (op->type == ATT_OP_TYPE_CONF)
+		chan->conf_queued = false;
+
 done:
 	destroy_att_send_op(op);
 
@@ -1233,13 +1887,7 @@ bool bt_att_cancel_all(struct bt_att *att)
 	queue_remove_all(att->ind_queue, NULL, NULL, destroy_att_send_op);
 	queue_remove_all(att->write_queue, NULL, NULL, destroy_att_send_op);
 
-	if (att->pending_req)
-		/* Don't cancel the pending request; remove it's handlers */
-		cancel_att_send_op(att->pending_req);
-
-	if (att->pending_ind)
-		/* Don't cancel the pending request; remove it's handlers */
-		cancel_att_send_op(att->pending_ind);
+	queue_foreach(att->chans, chan_cancel_all, NULL);
 
 	return true;
 }
@@ -1272,8 +1920,9 @@ static uint8_t att_ecode_from_error(int err)
 	return BT_ATT_ERROR_UNLIKELY;
 }
 
-unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
-						uint16_t handle, int error)
+unsigned int bt_att_reply_error(struct bt_att *att, unsigned int request_id,
+					uint8_t opcode, uint16_t handle,
+					int error)
 {
 	struct bt_att_pdu_error_rsp pdu;
 	uint8_t ecode;
@@ -1289,8 +1938,14 @@ unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
 	put_le16(handle, &pdu.handle);
 	pdu.ecode = ecode;
 
-	return bt_att_send(att, BT_ATT_OP_ERROR_RSP, &pdu, sizeof(pdu),
-							NULL, NULL, NULL);
+	return bt_att_reply(att, request_id, BT_ATT_OP_ERROR_RSP, &pdu,
+								sizeof(pdu));
+}
+
+unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
+						uint16_t handle, int error)
+{
+	return bt_att_reply_error(att, 0, opcode, handle, error);
 }
 
 unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
@@ -1300,7 +1955,7 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 {
 	struct att_notify *notify;
 
-	if (!att || !callback || !att->io)
+	if (!att || !callback || !att->fixed)
 		return 0;
 
 	notify = new0(struct att_notify, 1);
@@ -37,6 +37,14 @@ bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close);
 
 int bt_att_get_fd(struct bt_att *att);
 
+/*
+ * Attach an additional bearer (e.g. an Enhanced ATT L2CAP channel) to an
+ * existing connection. On success bt_att takes ownership of fd and closes it
+ * once the bearer goes away.
+ */
+int bt_att_attach_fd(struct bt_att *att, int fd);
+unsigned int bt_att_get_channels(struct bt_att *att);
+
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(uint8_t opcode, const void *pdu,
@@ -54,6 +62,22 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
+struct bt_att_stats {
+	uint64_t write_wakeups;
+	uint64_t pdus_sent;
+	unsigned int max_pdus_per_wakeup;
+	unsigned int write_queue_depth;
+	unsigned int max_write_queue_depth;
+	unsigned int req_queue_depth;
+	unsigned int max_req_queue_depth;
+	unsigned int ind_queue_depth;
+	unsigned int max_ind_queue_depth;
+};
+
+bool bt_att_set_write_burst(struct bt_att *att, unsigned int burst);
+bool bt_att_get_stats(struct bt_att *att, struct bt_att_stats *stats);
+void bt_att_reset_stats(struct bt_att *att);
+
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
@@ -69,6 +93,19 @@ bool bt_att_cancel_all(struct bt_att *att);
 unsigned int bt_att_send_error_rsp(struct bt_att *att, uint8_t opcode,
 						uint16_t handle, int error);
 
+/*
+ * With several bearers, responses completed asynchronously must name the
+ * request they answer. bt_att_get_request_id is only valid from within a
+ * request handler; 0 makes the reply functions behave like bt_att_send.
+ */
+unsigned int bt_att_get_request_id(struct bt_att *att);
+unsigned int bt_att_reply(struct bt_att *att, unsigned int request_id,
+				uint8_t opcode, const void *pdu,
+				uint16_t length);
+unsigned int bt_att_reply_error(struct bt_att *att, unsigned int request_id,
+					uint8_t opcode, uint16_t handle,
+					int error);
+
 unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_notify_func_t callback,
 						void *user_data,
@@ -33,6 +33,7 @@
 #include <assert.h>
 #include <limits.h>
 #include <sys/uio.h>
+#include <time.h>
 
 #ifndef MAX
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -46,6 +47,11 @@
 
 #define GATT_SVC_UUID	0x1801
 #define SVC_CHNGD_UUID	0x2a05
+#define DB_HASH_UUID	0x2b2a
+#define DB_HASH_LEN	16
+
+/* Discovery requests kept outstanding on each ATT bearer */
+#define DISCOVERY_REQS_PER_CHAN	1
 
 struct bt_gatt_client {
 	struct bt_att *att;
@@ -67,6 +73,10 @@ struct bt_gatt_client {
 	bool in_init;
 	bool ready;
 
+	/* Database Hash read from the peer during init, if it has one */
+	uint8_t db_hash[DB_HASH_LEN];
+	bool db_hash_valid;
+
 	/*
 	 * Queue of long write requests. An error during "prepare write"
 	 * requests can result in a cancel through "execute write". To prevent
@@ -104,7 +114,9 @@ struct bt_gatt_client {
 	unsigned int next_request_id;
 
 	struct bt_gatt_request *discovery_req;
+	struct queue *discovery_tasks;	/* Concurrent discovery requests */
 	unsigned int mtu_req_id;
+	unsigned int db_hash_req_id;
 };
 
 struct request {
@@ -343,12 +355,34 @@ typedef void (*discovery_op_complete_func_t)(struct discovery_op *op,
 							uint8_t att_ecode);
 typedef void (*discovery_op_fail_func_t)(struct discovery_op *op);
 
+enum discovery_phase {
+	DISCOVERY_PRIMARY,
+	DISCOVERY_SECONDARY,
+	DISCOVERY_INCLUDES,
+	DISCOVERY_CHARACTERISTICS,
+	DISCOVERY_DONE,
+};
+
+static const char *discovery_phase_str[] = {
+	"primary services",
+	"secondary services",
+	"included services",
+	"characteristics and descriptors",
+	"done",
+};
+
 struct discovery_op {
 	struct bt_gatt_client *client;
 	struct queue *pending_svcs;
-	struct queue *pending_chrcs;
-	struct queue *tmp_queue;
-	struct gatt_db_attribute *cur_svc;
+	struct queue *svcs;		/* Services being discovered */
+	struct queue *tasks;		/* Requests not sent yet */
+	struct queue *desc_tasks;	/* Sent ahead of the other tasks */
+	unsigned int in_flight;
+	bool failed;
+	uint8_t att_ecode;
+	enum discovery_phase phase;
+	uint64_t phase_start;
+	uint64_t start_time;
 	bool success;
 	uint16_t start;
 	uint16_t end;
@@ -357,11 +391,73 @@ struct discovery_op {
 	discovery_op_fail_func_t failure_func;
 };
 
+struct discovery_svc {
+	struct gatt_db_attribute *attr;
+	struct queue *chrcs;		/* Characteristics in handle order */
+	unsigned int pending;		/* Requests not completed yet */
+};
+
+struct desc {
+	uint16_t handle;
+	bt_uuid_t uuid;
+};
+
+struct chrc {
+	uint16_t start_handle;
+	uint16_t end_handle;
+	uint16_t value_handle;
+	uint8_t properties;
+	bt_uuid_t uuid;
+	struct queue *descs;
+};
+
+enum discovery_task_type {
+	DISCOVERY_TASK_INCLUDES,
+	DISCOVERY_TASK_CHARACTERISTICS,
+	DISCOVERY_TASK_DESCRIPTORS,
+};
+
+struct discovery_task {
+	struct discovery_op *op;
+	struct discovery_svc *svc;
+	struct chrc *chrc;
+	enum discovery_task_type type;
+	uint16_t start;
+	uint16_t end;
+	struct bt_gatt_request *req;
+};
+
+static uint64_t get_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void chrc_free(void *data)
+{
+	struct chrc *chrc = data;
+
+	queue_destroy(chrc->descs, free);
+	free(chrc);
+}
+
+static void discovery_svc_free(void *data)
+{
+	struct discovery_svc *svc = data;
+
+	queue_destroy(svc->chrcs, chrc_free);
+	free(svc);
+}
+
 static void discovery_op_free(struct discovery_op *op)
 {
 	queue_destroy(op->pending_svcs, NULL);
-	queue_destroy(op->pending_chrcs, free);
-	queue_destroy(op->tmp_queue, NULL);
+	queue_destroy(op->tasks, free);
+	queue_destroy(op->desc_tasks, free);
+	queue_destroy(op->svcs, discovery_svc_free);
 	free(op);
 }
 
@@ -380,12 +476,16 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 	if (!op->pending_svcs)
 		goto fail;
 
-	op->pending_chrcs = queue_new();
-	if (!op->pending_chrcs)
+	op->svcs = queue_new();
+	if (!op->svcs)
 		goto fail;
 
-	op->tmp_queue = queue_new();
-	if (!op->tmp_queue)
+	op->tasks = queue_new();
+	if (!op->tasks)
+		goto fail;
+
+	op->desc_tasks = queue_new();
+	if (!op->desc_tasks)
 		goto fail;
 
 	op->client = client;
@@ -393,6 +493,9 @@ static struct discovery_op *discovery_op_create(struct bt_gatt_client *client,
 	op->failure_func = failure_func;
 	op->start = start;
 	op->end = end;
+	op->phase = DISCOVERY_PRIMARY;
+	op->start_time = get_monotonic_usec();
+	op->phase_start = op->start_time;
 
 	return op;
 
@@ -415,7 +518,7 @@ static void discovery_op_unref(void *data)
 	if (__sync_sub_and_fetch(&op->ref_count, 1))
 		return;
 
-	if (!op->success)
+	if (!op->success && op->failure_func)
 		op->failure_func(op);
 
 	discovery_op_free(op);
@@ -430,14 +533,260 @@ static void discovery_req_clear(struct bt_gatt_client *client)
 	client->discovery_req = NULL;
 }
 
+static void discovery_op_set_phase(struct discovery_op *op,
+						enum discovery_phase phase)
+{
+	struct bt_gatt_client *client = op->client;
+	uint64_t now = get_monotonic_usec();
+
+	util_debug(client->debug_callback, client->debug_data,
+				"Discovery of %s took %u us",
+				discovery_phase_str[op->phase],
+				(unsigned int) (now - op->phase_start));
+
+	if (phase == DISCOVERY_DONE)
+		util_debug(client->debug_callback, client->debug_data,
+				"Discovery of 0x%04x-0x%04x took %u us",
+				op->start, op->end,
+				(unsigned int) (now - op->start_time));
+
+	op->phase = phase;
+	op->phase_start = now;
+}
+
+static void discovery_op_finish(struct discovery_op *op)
+{
+	if (!op->failed) {
+		discovery_op_set_phase(op, DISCOVERY_DONE);
+	} else if (op->failure_func) {
+		/*
+		 * Clean up right away: the request that completed last still
+		 * holds a reference and only drops it after the complete
+		 * callback, which may have freed the client by then.
+		 */
+		op->failure_func(op);
+		op->failure_func = NULL;
+	}
+
+	op->success = !op->failed;
+	op->complete_func(op, op->success, op->att_ecode);
+}
+
+static void discovery_op_fail(struct discovery_op *op, uint8_t att_ecode)
+{
+	if (op->failed)
+		return;
+
+	op->failed = true;
+	op->att_ecode = att_ecode;
+
+	/* Let the requests in flight complete but don't send any more */
+	queue_remove_all(op->tasks, NULL, NULL, free);
+	queue_remove_all(op->desc_tasks, NULL, NULL, free);
+}
+
+static bool discovery_task_add(struct discovery_op *op,
+					struct discovery_svc *svc,
+					struct chrc *chrc,
+					enum discovery_task_type type,
+					uint16_t start, uint16_t end)
+{
+	struct discovery_task *task;
+	struct queue *tasks;
+
+	task = new0(struct discovery_task, 1);
+	if (!task)
+		return false;
+
+	task->op = op;
+	task->svc = svc;
+	task->chrc = chrc;
+	task->type = type;
+	task->start = start;
+	task->end = end;
+
+	/*
+	 * Descriptors are discovered before moving on to the next service so
+	 * that a single bearer sees the same request order as a sequential
+	 * discovery would produce.
+	 */
+	if (type == DISCOVERY_TASK_DESCRIPTORS)
+		tasks = op->desc_tasks;
+	else
+		tasks = op->tasks;
+
+	if (!queue_push_tail(tasks, task)) {
+		free(task);
+		return false;
+	}
+
+	svc->pending++;
+
+	return true;
+}
+
+static void discovery_task_destroy(void *data)
+{
+	struct discovery_task *task = data;
+
+	discovery_op_unref(task->op);
+	free(task);
+}
+
+static void discover_incl_cb(bool success, uint8_t att_ecode,
+				struct bt_gatt_result *result, void *user_data);
 static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data);
+static void discover_descs_cb(bool success, uint8_t att_ecode,
+						struct bt_gatt_result *result,
+						void *user_data);
+
+static bool discovery_task_send(struct discovery_task *task)
+{
+	struct discovery_op *op = task->op;
+	struct bt_gatt_client *client = op->client;
+
+	discovery_op_ref(op);
+
+	switch (task->type) {
+	case DISCOVERY_TASK_INCLUDES:
+		task->req = bt_gatt_discover_included_services(client->att,
+							task->start, task->end,
+							discover_incl_cb, task,
+							discovery_task_destroy);
+		break;
+	case DISCOVERY_TASK_CHARACTERISTICS:
+		task->req = bt_gatt_discover_characteristics(client->att,
+							task->start, task->end,
+							discover_chrcs_cb, task,
+							discovery_task_destroy);
+		break;
+	case DISCOVERY_TASK_DESCRIPTORS:
+		task->req = bt_gatt_discover_descriptors(client->att,
+							task->start, task->end,
+							discover_descs_cb, task,
+							discovery_task_destroy);
+		break;
+	}
+
+	if (!task->req) {
+		discovery_op_unref(op);
+		return false;
+	}
+
+	queue_push_tail(client->discovery_tasks, task);
+	op->in_flight++;
+
+	return true;
+}
+
+/*
+ * Called first thing from the request callbacks. Returns false if the
+ * discovery has already failed and the result should be ignored.
+ */
+static bool discovery_task_done(struct discovery_task *task)
+{
+	struct discovery_op *op = task->op;
+
+	queue_remove(op->client->discovery_tasks, task);
+	bt_gatt_request_unref(task->req);
+	task->req = NULL;
+
+	op->in_flight--;
+	task->svc->pending--;
+
+	return !op->failed;
+}
+
+static void discover_chrcs(struct discovery_op *op);
+
+/*
+ * Sends queued requests, keeping a few of them outstanding on each ATT
+ * bearer so the peer never waits on us between two responses, and moves on
+ * to the next phase once everything is complete.
+ */
+static void discovery_op_run(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+	struct discovery_task *task;
+	unsigned int window;
+
+	window = MAX(bt_att_get_channels(client->att), 1) *
+						DISCOVERY_REQS_PER_CHAN;
+
+	while (op->in_flight < window) {
+		task = queue_pop_head(op->desc_tasks);
+		if (!task)
+			task = queue_pop_head(op->tasks);
+		if (!task)
+			break;
+
+		if (!discovery_task_send(task)) {
+			util_debug(client->debug_callback, client->debug_data,
+					"Failed to start discovery request");
+			free(task);
+			discovery_op_fail(op, 0);
+			break;
+		}
+	}
+
+	if (op->in_flight)
+		return;
+
+	if (!op->failed && op->phase == DISCOVERY_INCLUDES) {
+		discover_chrcs(op);
+		return;
+	}
+
+	discovery_op_finish(op);
+}
+
+static void discover_includes(struct discovery_op *op)
+{
+	struct gatt_db_attribute *attr;
+	struct discovery_svc *svc;
+	uint16_t start, end;
+
+	discovery_op_set_phase(op, DISCOVERY_INCLUDES);
+
+	while ((attr = queue_pop_head(op->pending_svcs))) {
+		svc = new0(struct discovery_svc, 1);
+		if (!svc)
+			goto failed;
+
+		svc->attr = attr;
+		svc->chrcs = queue_new();
+
+		if (!svc->chrcs || !queue_push_tail(op->svcs, svc)) {
+			discovery_svc_free(svc);
+			goto failed;
+		}
+
+		if (!gatt_db_attribute_get_service_handles(attr, &start, &end))
+			goto failed;
+
+		if (start == end)
+			continue;
+
+		if (!discovery_task_add(op, svc, NULL, DISCOVERY_TASK_INCLUDES,
+								start, end))
+			goto failed;
+	}
+
+	discovery_op_run(op);
+	return;
+
+failed:
+	discovery_op_fail(op, 0);
+	discovery_op_run(op);
+}
 
 static void discover_incl_cb(bool success, uint8_t att_ecode,
 				struct bt_gatt_result *result, void *user_data)
 {
-	struct discovery_op *op = user_data;
+	struct discovery_task *task = user_data;
+	struct discovery_op *op = task->op;
 	struct bt_gatt_client *client = op->client;
 	struct bt_gatt_iter iter;
 	struct gatt_db_attribute *attr, *tmp;
@@ -447,19 +796,17 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int includes_count, i;
 
-	discovery_req_clear(client);
+	if (!discovery_task_done(task))
+		goto done;
 
 	if (!success) {
 		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
-			goto next;
+			goto done;
 
 		goto failed;
 	}
 
-	/* Get the currently processed service */
-	attr = op->cur_svc;
-	if (!attr)
-		goto failed;
+	attr = task->svc->attr;
 
 	if (!result || !bt_gatt_iter_init(&iter, result))
 		goto failed;
@@ -503,162 +850,120 @@ static void discover_incl_cb(bool success, uint8_t att_ecode,
 			goto failed;
 	}
 
-next:
-	/* Move on to the next service */
-	attr = queue_pop_head(op->pending_svcs);
-	if (!attr) {
-		struct queue *tmp_queue;
+	goto done;
 
-		tmp_queue = op->pending_svcs;
-		op->pending_svcs = op->tmp_queue;
-		op->tmp_queue = tmp_queue;
+failed:
+	discovery_op_fail(op, att_ecode);
 
-		/*
-		 * We have processed all include definitions. Move on to
-		 * characteristics.
-		 */
-		attr = queue_pop_head(op->pending_svcs);
+done:
+	discovery_op_run(op);
+}
+
+/*
+ * Characteristics and descriptors of a service are discovered concurrently
+ * and only inserted once all of them are known, since the database expects
+ * them in handle order.
+ */
+static bool discovery_svc_complete(struct discovery_svc *svc)
+{
+	struct gatt_db_attribute *attr;
+	struct chrc *chrc_data;
+	struct desc *desc_data;
+
+	while ((chrc_data = queue_pop_head(svc->chrcs))) {
+		attr = gatt_db_service_insert_characteristic(svc->attr,
+							chrc_data->value_handle,
+							&chrc_data->uuid, 0,
+							chrc_data->properties,
+							NULL, NULL, NULL);
 		if (!attr)
 			goto failed;
 
-		if (!gatt_db_attribute_get_service_handles(attr, &start, &end))
+		if (gatt_db_attribute_get_handle(attr) !=
+							chrc_data->value_handle)
 			goto failed;
 
-		op->cur_svc = attr;
+		while ((desc_data = queue_pop_head(chrc_data->descs))) {
+			attr = gatt_db_service_insert_descriptor(svc->attr,
+							desc_data->handle,
+							&desc_data->uuid, 0,
+							NULL, NULL, NULL);
+			free(desc_data);
 
-		client->discovery_req = bt_gatt_discover_characteristics(
-							client->att,
-							start, end,
-							discover_chrcs_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-		if (client->discovery_req)
-			return;
+			if (!attr)
+				goto failed;
+		}
 
-		util_debug(client->debug_callback, client->debug_data,
-				"Failed to start characteristic discovery");
-		discovery_op_unref(op);
-		goto failed;
+		chrc_free(chrc_data);
 	}
 
-	queue_push_tail(op->tmp_queue, attr);
-	op->cur_svc = attr;
-	if (!gatt_db_attribute_get_service_handles(attr, &start, &end))
-		goto failed;
-
-	if (start == end)
-		goto next;
-
-	client->discovery_req = bt_gatt_discover_included_services(client->att,
-							start, end,
-							discover_incl_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
-		return;
+	gatt_db_service_set_active(svc->attr, true);
 
-	util_debug(client->debug_callback, client->debug_data,
-					"Failed to start included discovery");
-	discovery_op_unref(op);
+	return true;
 
 failed:
-	op->success = false;
-	op->complete_func(op, false, att_ecode);
+	chrc_free(chrc_data);
+	return false;
 }
 
-struct chrc {
-	uint16_t start_handle;
-	uint16_t end_handle;
-	uint16_t value_handle;
-	uint8_t properties;
-	bt_uuid_t uuid;
-};
-
-static void discover_descs_cb(bool success, uint8_t att_ecode,
-						struct bt_gatt_result *result,
-						void *user_data);
-
-static bool discover_descs(struct discovery_op *op, bool *discovering)
+static void discover_chrcs(struct discovery_op *op)
 {
-	struct bt_gatt_client *client = op->client;
-	struct gatt_db_attribute *attr;
-	struct chrc *chrc_data;
-	uint16_t desc_start;
+	const struct queue_entry *entry;
+	struct discovery_svc *svc;
+	uint16_t start, end;
 
-	*discovering = false;
+	discovery_op_set_phase(op, DISCOVERY_CHARACTERISTICS);
 
-	while ((chrc_data = queue_pop_head(op->pending_chrcs))) {
-		attr = gatt_db_service_insert_characteristic(op->cur_svc,
-							chrc_data->value_handle,
-							&chrc_data->uuid, 0,
-							chrc_data->properties,
-							NULL, NULL, NULL);
+	for (entry = queue_get_entries(op->svcs); entry; entry = entry->next) {
+		svc = entry->data;
 
-		if (!attr)
+		if (!gatt_db_attribute_get_service_handles(svc->attr, &start,
+									&end))
 			goto failed;
 
-		if (gatt_db_attribute_get_handle(attr) !=
-							chrc_data->value_handle)
-			goto failed;
-
-		desc_start = chrc_data->value_handle + 1;
-
-		if (desc_start > chrc_data->end_handle) {
-			free(chrc_data);
+		/* Nothing to discover after the service declaration */
+		if (start == end) {
+			gatt_db_service_set_active(svc->attr, true);
 			continue;
 		}
 
-		client->discovery_req = bt_gatt_discover_descriptors(
-							client->att, desc_start,
-							chrc_data->end_handle,
-							discover_descs_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-		if (client->discovery_req) {
-			*discovering = true;
-			goto done;
-		}
-
-		util_debug(client->debug_callback, client->debug_data,
-					"Failed to start descriptor discovery");
-		discovery_op_unref(op);
-
-		goto failed;
+		if (!discovery_task_add(op, svc, NULL,
+					DISCOVERY_TASK_CHARACTERISTICS,
+					start, end))
+			goto failed;
 	}
 
-done:
-	free(chrc_data);
-	return true;
+	discovery_op_run(op);
+	return;
 
 failed:
-	free(chrc_data);
-	return false;
+	discovery_op_fail(op, 0);
+	discovery_op_run(op);
 }
 
 static void discover_descs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data)
 {
-	struct discovery_op *op = user_data;
+	struct discovery_task *task = user_data;
+	struct discovery_op *op = task->op;
 	struct bt_gatt_client *client = op->client;
 	struct bt_gatt_iter iter;
-	struct gatt_db_attribute *attr;
-	uint16_t handle, start, end;
+	struct desc *desc_data;
+	uint16_t handle;
 	uint128_t u128;
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int desc_count;
-	bool discovering;
 
-	discovery_req_clear(client);
+	if (!discovery_task_done(task))
+		goto done;
 
 	if (!success) {
-		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND) {
-			success = true;
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
 			goto next;
-		}
 
-		goto done;
+		goto failed;
 	}
 
 	if (!result || !bt_gatt_iter_init(&iter, result))
@@ -680,67 +985,38 @@ static void discover_descs_cb(bool success, uint8_t att_ecode,
 						"handle: 0x%04x, uuid: %s",
 						handle, uuid_str);
 
-		attr = gatt_db_service_insert_descriptor(op->cur_svc, handle,
-							&uuid, 0, NULL, NULL,
-							NULL);
-		if (!attr)
+		desc_data = new0(struct desc, 1);
+		if (!desc_data)
 			goto failed;
 
-		if (gatt_db_attribute_get_handle(attr) != handle)
-			goto failed;
+		desc_data->handle = handle;
+		desc_data->uuid = uuid;
+
+		queue_push_tail(task->chrc->descs, desc_data);
 	}
 
 next:
-	if (!discover_descs(op, &discovering))
+	if (!task->svc->pending && !discovery_svc_complete(task->svc))
 		goto failed;
 
-	if (discovering)
-		return;
-
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
-	attr = queue_pop_head(op->pending_svcs);
-	if (!attr)
-		goto done;
-
-	if (!gatt_db_attribute_get_service_handles(attr, &start, &end))
-		goto failed;
-
-	if (start == end)
-		goto next;
-
-	/* Move on to the next service */
-	op->cur_svc = attr;
-
-	client->discovery_req = bt_gatt_discover_characteristics(client->att,
-							start, end,
-							discover_chrcs_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
-		return;
-
-	util_debug(client->debug_callback, client->debug_data,
-				"Failed to start characteristic discovery");
-	discovery_op_unref(op);
+	goto done;
 
 failed:
-	success = false;
+	discovery_op_fail(op, att_ecode);
 
 done:
-	op->success = success;
-	op->complete_func(op, success, att_ecode);
+	discovery_op_run(op);
 }
 
 static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 						struct bt_gatt_result *result,
 						void *user_data)
 {
-	struct discovery_op *op = user_data;
+	struct discovery_task *task = user_data;
+	struct discovery_op *op = task->op;
 	struct bt_gatt_client *client = op->client;
+	struct discovery_svc *svc = task->svc;
 	struct bt_gatt_iter iter;
-	struct gatt_db_attribute *attr;
 	struct chrc *chrc_data;
 	uint16_t start, end, value;
 	uint8_t properties;
@@ -748,20 +1024,18 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 	bt_uuid_t uuid;
 	char uuid_str[MAX_LEN_UUID_STR];
 	unsigned int chrc_count;
-	bool discovering;
 
-	discovery_req_clear(client);
+	if (!discovery_task_done(task))
+		goto done;
 
 	if (!success) {
-		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND) {
-			success = true;
+		if (att_ecode == BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND)
 			goto next;
-		}
 
-		goto done;
+		goto failed;
 	}
 
-	if (!op->cur_svc || !result || !bt_gatt_iter_init(&iter, result))
+	if (!result || !bt_gatt_iter_init(&iter, result))
 		goto failed;
 
 	chrc_count = bt_gatt_result_characteristic_count(result);
@@ -791,55 +1065,38 @@ static void discover_chrcs_cb(bool success, uint8_t att_ecode,
 		chrc_data->value_handle = value;
 		chrc_data->properties = properties;
 		chrc_data->uuid = uuid;
+		chrc_data->descs = queue_new();
 
-		queue_push_tail(op->pending_chrcs, chrc_data);
-	}
+		if (!chrc_data->descs ||
+				!queue_push_tail(svc->chrcs, chrc_data)) {
+			chrc_free(chrc_data);
+			goto failed;
+		}
 
-	/*
-	 * Sequentially discover descriptors for each characteristic and insert
-	 * the characteristics into the database as we proceed.
-	 */
-	if (!discover_descs(op, &discovering))
-		goto failed;
+		/*
+		 * Skip descriptor discovery if the handle range leaves no room
+		 * for descriptors after the value.
+		 */
+		if (value >= end)
+			continue;
 
-	if (discovering)
-		return;
+		if (!discovery_task_add(op, svc, chrc_data,
+						DISCOVERY_TASK_DESCRIPTORS,
+						value + 1, end))
+			goto failed;
+	}
 
 next:
-	/* Done with the current service */
-	gatt_db_service_set_active(op->cur_svc, true);
-
-	attr = queue_pop_head(op->pending_svcs);
-	if (!attr)
-		goto done;
-
-	if (!gatt_db_attribute_get_service_handles(attr, &start, &end))
+	if (!svc->pending && !discovery_svc_complete(svc))
 		goto failed;
 
-	if (start == end)
-		goto next;
-
-	/* Move on to the next service */
-	op->cur_svc = attr;
-
-	client->discovery_req = bt_gatt_discover_characteristics(client->att,
-							start, end,
-							discover_chrcs_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
-		return;
-
-	util_debug(client->debug_callback, client->debug_data,
-				"Failed to start characteristic discovery");
-	discovery_op_unref(op);
+	goto done;
 
 failed:
-	success = false;
+	discovery_op_fail(op, att_ecode);
 
 done:
-	op->success = success;
-	op->complete_func(op, success, att_ecode);
+	discovery_op_run(op);
 }
 
 static void discover_secondary_cb(bool success, uint8_t att_ecode,
@@ -902,36 +1159,9 @@ static void discover_secondary_cb(bool success, uint8_t att_ecode,
 	}
 
 next:
-	/* Sequentially discover included services */
-	attr = queue_pop_head(op->pending_svcs);
-
-	/* Complete with success if queue is empty */
-	if (!attr)
-		goto done;
-
-	/*
-	 * Store the service in the tmp queue to be reused during
-	 * characteristics discovery later.
-	 */
-	queue_push_tail(op->tmp_queue, attr);
-	op->cur_svc = attr;
-
-	if (!gatt_db_attribute_get_service_handles(attr, &start, &end)) {
-		success = false;
-		goto done;
-	}
-
-	client->discovery_req = bt_gatt_discover_included_services(client->att,
-							start, end,
-							discover_incl_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
-		return;
-
-	util_debug(client->debug_callback, client->debug_data,
-				"Failed to start included services discovery");
-	discovery_op_unref(op);
+	/* Discover the remaining attributes of all services found */
+	discover_includes(op);
+	return;
 
 done:
 	op->success = success;
@@ -991,6 +1221,8 @@ static void discover_primary_cb(bool success, uint8_t att_ecode,
 	}
 
 secondary:
+	discovery_op_set_phase(op, DISCOVERY_SECONDARY);
+
 	/* Discover secondary services */
 	client->discovery_req = bt_gatt_discover_secondary_services(client->att,
 						NULL, op->start, op->end,
@@ -1021,10 +1253,157 @@ static void notify_client_ready(struct bt_gatt_client *client, bool success,
 	bt_gatt_client_unref(client);
 }
 
+static void get_first_attribute(struct gatt_db_attribute *attrib,
+								void *user_data)
+{
+	struct gatt_db_attribute **stored = user_data;
+
+	if (*stored)
+		return;
+
+	*stored = attrib;
+}
+
+static void discover_all(struct discovery_op *op)
+{
+	struct bt_gatt_client *client = op->client;
+
+	/* Don't do discovery if the database was pre-populated */
+	if (!gatt_db_isempty(client->db)) {
+		op->complete_func(op, true, 0);
+		return;
+	}
+
+	/* Don't account for the MTU exchange in the discovery timings */
+	op->start_time = get_monotonic_usec();
+	op->phase_start = op->start_time;
+
+	client->discovery_req = bt_gatt_discover_all_primary_services(
+							client->att, NULL,
+							discover_primary_cb,
+							discovery_op_ref(op),
+							discovery_op_unref);
+	if (client->discovery_req)
+		return;
+
+	util_debug(client->debug_callback, client->debug_data,
+			"Failed to initiate primary service discovery");
+
+	client->in_init = false;
+	notify_client_ready(client, false, 0);
+
+	discovery_op_unref(op);
+}
+
+static struct gatt_db_attribute *find_db_hash(struct gatt_db *db)
+{
+	struct gatt_db_attribute *attr = NULL;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, DB_HASH_UUID);
+
+	gatt_db_find_by_type(db, 0x0001, 0xffff, &uuid, get_first_attribute,
+									&attr);
+
+	return attr;
+}
+
+struct db_hash_match {
+	const uint8_t *hash;
+	bool match;
+};
+
+static void db_hash_match_cb(struct gatt_db_attribute *attrib, int err,
+					const uint8_t *value, size_t length,
+					void *user_data)
+{
+	struct db_hash_match *data = user_data;
+
+	data->match = !err && length == DB_HASH_LEN &&
+					!memcmp(value, data->hash, DB_HASH_LEN);
+}
+
+static bool db_hash_cached(struct bt_gatt_client *client)
+{
+	struct db_hash_match data;
+	struct gatt_db_attribute *attr;
+
+	attr = find_db_hash(client->db);
+	if (!attr)
+		return false;
+
+	data.hash = client->db_hash;
+	data.match = false;
+
+	gatt_db_attribute_read(attr, 0, 0, NULL, db_hash_match_cb, &data);
+
+	return data.match;
+}
+
+static void db_hash_write_cb(struct gatt_db_attribute *attrib, int err,
+								void *user_data)
+{
+}
+
+static void db_hash_store(struct bt_gatt_client *client)
+{
+	struct gatt_db_attribute *attr;
+
+	if (!client->db_hash_valid)
+		return;
+
+	attr = find_db_hash(client->db);
+	if (!attr)
+		return;
+
+	gatt_db_attribute_write(attr, 0, client->db_hash, DB_HASH_LEN, 0, NULL,
+							db_hash_write_cb, NULL);
+}
+
+static void db_hash_read_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct discovery_op *op = user_data;
+	struct bt_gatt_client *client = op->client;
+	const uint8_t *data = pdu;
+
+	client->db_hash_req_id = 0;
+
+	/* Only a single handle-value pair is expected */
+	if (opcode != BT_ATT_OP_READ_BY_TYPE_RSP || length < 1 ||
+					data[0] != 2 + DB_HASH_LEN ||
+					length < 1 + data[0]) {
+		util_debug(client->debug_callback, client->debug_data,
+					"Database Hash not available");
+		discover_all(op);
+		return;
+	}
+
+	memcpy(client->db_hash, data + 3, DB_HASH_LEN);
+	client->db_hash_valid = true;
+
+	util_debug(client->debug_callback, client->debug_data,
+				"Database Hash handle: 0x%04x",
+				get_le16(data + 1));
+
+	/*
+	 * A pre-populated database is only trusted if it was stored along with
+	 * the same hash; otherwise drop it and rediscover everything.
+	 */
+	if (!gatt_db_isempty(client->db) && !db_hash_cached(client)) {
+		util_debug(client->debug_callback, client->debug_data,
+				"Database Hash changed, discarding cache");
+		gatt_db_clear(client->db);
+	}
+
+	discover_all(op);
+}
+
 static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 {
 	struct discovery_op *op = user_data;
 	struct bt_gatt_client *client = op->client;
+	uint8_t pdu[6];
 
 	op->success = success;
 	client->mtu_req_id = 0;
@@ -1044,27 +1423,26 @@ static void exchange_mtu_cb(bool success, uint8_t att_ecode, void *user_data)
 					"MTU exchange complete, with MTU: %u",
 					bt_att_get_mtu(client->att));
 
-	/* Don't do discovery if the database was pre-populated */
-	if (!gatt_db_isempty(client->db)) {
-		op->complete_func(op, true, 0);
-		return;
-	}
-
-	client->discovery_req = bt_gatt_discover_all_primary_services(
-							client->att, NULL,
-							discover_primary_cb,
-							discovery_op_ref(op),
-							discovery_op_unref);
-	if (client->discovery_req)
+	/*
+	 * Read the Database Hash before anything else, peers that don't
+	 * support it will simply respond with an error.
+	 */
+	put_le16(0x0001, pdu);
+	put_le16(0xffff, pdu + 2);
+	put_le16(DB_HASH_UUID, pdu + 4);
+
+	client->db_hash_req_id = bt_att_send(client->att,
+						BT_ATT_OP_READ_BY_TYPE_REQ,
+						pdu, sizeof(pdu),
+						db_hash_read_cb,
+						discovery_op_ref(op),
+						discovery_op_unref);
+	if (client->db_hash_req_id)
 		return;
 
-	util_debug(client->debug_callback, client->debug_data,
-			"Failed to initiate primary service discovery");
-
-	client->in_init = false;
-	notify_client_ready(client, false, att_ecode);
-
 	discovery_op_unref(op);
+
+	discover_all(op);
 }
 
 struct service_changed_op {
@@ -1096,17 +1474,6 @@ static void process_service_changed(struct bt_gatt_client *client,
 static void service_changed_cb(uint16_t value_handle, const uint8_t *value,
 					uint16_t length, void *user_data);
 
-static void get_first_attribute(struct gatt_db_attribute *attrib,
-								void *user_data)
-{
-	struct gatt_db_attribute **stored = user_data;
-
-	if (*stored)
-		return;
-
-	*stored = attrib;
-}
-
 static void service_changed_complete(struct discovery_op *op, bool success,
 							uint8_t att_ecode)
 {
@@ -1127,6 +1494,10 @@ static void service_changed_complete(struct discovery_op *op, bool success,
 		gatt_db_clear_range(client->db, start_handle, end_handle);
 	}
 
+	/* The hash read during init no longer describes the database */
+	client->db_hash_valid = false;
+	gatt_db_attribute_reset(find_db_hash(client->db));
+
 	/* Notify the upper layer of changed services */
 	if (client->svc_chngd_callback)
 		client->svc_chngd_callback(start_handle, end_handle,
@@ -1286,6 +1657,9 @@ static void init_complete(struct discovery_op *op, bool success,
 	if (!success)
 		goto fail;
 
+	/* Keep the hash along with the attributes so the cache can be reused */
+	db_hash_store(client);
+
 	bt_uuid16_create(&uuid, SVC_CHNGD_UUID);
 
 	gatt_db_find_by_type(client->db, 0x0001, 0xffff, &uuid,
@@ -1591,6 +1965,7 @@ static void bt_gatt_client_free(struct bt_gatt_client *client)
 	queue_destroy(client->long_write_queue, request_unref);
 	queue_destroy(client->notify_chrcs, notify_chrc_free);
 	queue_destroy(client->pending_requests, request_unref);
+	queue_destroy(client->discovery_tasks, NULL);
 
 	free(client);
 }
@@ -1650,6 +2025,10 @@ struct bt_gatt_client *bt_gatt_client_new(struct gatt_db *db,
 	if (!client->pending_requests)
 		goto fail;
 
+	client->discovery_tasks = queue_new();
+	if (!client->discovery_tasks)
+		goto fail;
+
 	client->notify_id = bt_att_register(att, BT_ATT_OP_HANDLE_VAL_NOT,
 						notify_cb, client, NULL);
 	if (!client->notify_id)
@@ -1845,6 +2224,17 @@ bool bt_gatt_client_cancel(struct bt_gatt_client *client, unsigned int id)
 	return cancel_request(req);
 }
 
+static void cancel_discovery_task(void *data)
+{
+	struct discovery_task *task = data;
+	struct bt_gatt_request *req = task->req;
+
+	/* Dropping the last reference frees the task */
+	task->req = NULL;
+	bt_gatt_request_cancel(req);
+	bt_gatt_request_unref(req);
+}
+
 bool bt_gatt_client_cancel_all(struct bt_gatt_client *client)
 {
 	if (!client || !client->att)
@@ -1859,9 +2249,15 @@ bool bt_gatt_client_cancel_all(struct bt_gatt_client *client)
 		client->discovery_req = NULL;
 	}
 
+	queue_remove_all(client->discovery_tasks, NULL, NULL,
+							cancel_discovery_task);
+
 	if (client->mtu_req_id)
 		bt_att_cancel(client->att, client->mtu_req_id);
 
+	if (client->db_hash_req_id)
+		bt_att_cancel(client->att, client->db_hash_req_id);
+
 	return true;
 }
 
@@ -2195,6 +2591,19 @@ unsigned int bt_gatt_client_write_without_response(
 					uint16_t value_handle,
 					bool signed_write,
 					const uint8_t *value, uint16_t length) {
+	return bt_gatt_client_send_without_response(client, value_handle,
+							signed_write, value,
+							length, NULL, NULL);
+}
+
+unsigned int bt_gatt_client_send_without_response(
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					bool signed_write,
+					const uint8_t *value, uint16_t length,
+					bt_gatt_client_destroy_func_t destroy,
+					void *user_data)
+{
 	uint8_t pdu[2 + length];
 	struct request *req;
 	int security;
@@ -2218,9 +2627,16 @@ unsigned int bt_gatt_client_write_without_response(
 	put_le16(value_handle, pdu);
 	memcpy(pdu + 2, value, length);
 
+	/* Set before sending, in case the request is done right away */
+	req->data = user_data;
+	req->destroy = destroy;
+
 	req->att_id = bt_att_send(client->att, op, pdu, sizeof(pdu), NULL, req,
 								request_unref);
 	if (!req->att_id) {
+		/* The caller keeps user_data */
+		req->data = NULL;
+		req->destroy = NULL;
 		request_unref(req);
 		return 0;
 	}
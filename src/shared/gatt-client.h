@@ -95,6 +95,17 @@ unsigned int bt_gatt_client_write_without_response(
 					uint16_t value_handle,
 					bool signed_write,
 					const uint8_t *value, uint16_t length);
+/*
+ * Like bt_gatt_client_write_without_response but destroy is called once the
+ * command has left the ATT queue, either written to the bearer or dropped.
+ */
+unsigned int bt_gatt_client_send_without_response(
+					struct bt_gatt_client *client,
+					uint16_t value_handle,
+					bool signed_write,
+					const uint8_t *value, uint16_t length,
+					bt_gatt_client_destroy_func_t destroy,
+					void *user_data);
 unsigned int bt_gatt_client_write_value(struct bt_gatt_client *client,
 					uint16_t value_handle,
 					const uint8_t *value, uint16_t length,
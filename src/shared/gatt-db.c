@@ -49,11 +49,29 @@ static const bt_uuid_t characteristic_uuid = { .type = BT_UUID16,
 static const bt_uuid_t included_service_uuid = { .type = BT_UUID16,
 					.value.u16 = GATT_INCLUDE_UUID };
 
+/* Attributes of a given type, sorted by handle */
+struct type_index {
+	uint128_t key;
+	struct gatt_db_attribute **attrs;
+	unsigned int count;
+	unsigned int alloc;
+};
+
 struct gatt_db {
 	int ref_count;
 	uint16_t next_handle;
 	struct queue *services;
 
+	/* Services sorted by start handle, for lookups by handle */
+	struct gatt_db_service **svc_index;
+	unsigned int svc_count;
+	unsigned int svc_alloc;
+
+	/* Attribute types sorted by their 128-bit form, for type queries */
+	struct type_index *types;
+	unsigned int type_count;
+	unsigned int type_alloc;
+
 	struct queue *notify_list;
 	unsigned int next_notify_id;
 };
@@ -107,6 +125,7 @@ struct gatt_db_service {
 	bool claimed;
 	uint16_t num_handles;
 	struct gatt_db_attribute **attributes;
+	struct gatt_db_attribute **handles;	/* Indexed by handle - start */
 };
 
 static void pending_read_result(struct pending_read *p, int err,
@@ -285,6 +304,266 @@ static void notify_service_changed(struct gatt_db *db,
 	gatt_db_unref(db);
 }
 
+static void type_key(const bt_uuid_t *uuid, uint128_t *key)
+{
+	bt_uuid_t uuid128;
+
+	memset(&uuid128, 0, sizeof(uuid128));
+	bt_uuid_to_uuid128(uuid, &uuid128);
+
+	*key = uuid128.value.u128;
+}
+
+static struct type_index *type_index_find(struct gatt_db *db,
+						const uint128_t *key,
+						unsigned int *pos)
+{
+	unsigned int lo = 0, hi = db->type_count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		int cmp = memcmp(&db->types[mid].key, key, sizeof(*key));
+
+		if (!cmp)
+			return &db->types[mid];
+
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (pos)
+		*pos = lo;
+
+	return NULL;
+}
+
+/* Returns the position of the first attribute with a handle >= handle */
+static unsigned int type_index_lower(const struct type_index *type,
+							uint16_t handle)
+{
+	unsigned int lo = 0, hi = type->count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (type->attrs[mid]->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void type_index_drop(struct gatt_db *db, unsigned int pos)
+{
+	free(db->types[pos].attrs);
+
+	db->type_count--;
+	memmove(&db->types[pos], &db->types[pos + 1],
+			(db->type_count - pos) * sizeof(*db->types));
+}
+
+static bool type_index_add(struct gatt_db *db,
+					struct gatt_db_attribute *attribute)
+{
+	struct type_index *type;
+	unsigned int pos = 0;
+	uint128_t key;
+
+	type_key(&attribute->uuid, &key);
+
+	type = type_index_find(db, &key, &pos);
+	if (!type) {
+		if (db->type_count == db->type_alloc) {
+			struct type_index *types;
+			unsigned int alloc;
+
+			alloc = db->type_alloc ? db->type_alloc * 2 : 16;
+			types = realloc(db->types, alloc * sizeof(*types));
+			if (!types)
+				return false;
+
+			db->types = types;
+			db->type_alloc = alloc;
+		}
+
+		memmove(&db->types[pos + 1], &db->types[pos],
+				(db->type_count - pos) * sizeof(*db->types));
+		db->type_count++;
+
+		type = &db->types[pos];
+		memset(type, 0, sizeof(*type));
+		type->key = key;
+	}
+
+	if (type->count == type->alloc) {
+		struct gatt_db_attribute **attrs;
+		unsigned int alloc = type->alloc ? type->alloc * 2 : 4;
+
+		attrs = realloc(type->attrs, alloc * sizeof(*attrs));
+		if (!attrs) {
+			/* Don't leave an empty entry behind */
+			if (!type->count)
+				type_index_drop(db, type - db->types);
+
+			return false;
+		}
+
+		type->attrs = attrs;
+		type->alloc = alloc;
+	}
+
+	/* Keep equal handles in insertion order */
+	pos = type_index_lower(type, attribute->handle + 1);
+	if (attribute->handle == UINT16_MAX)
+		pos = type->count;
+
+	memmove(&type->attrs[pos + 1], &type->attrs[pos],
+				(type->count - pos) * sizeof(*type->attrs));
+	type->attrs[pos] = attribute;
+	type->count++;
+
+	return true;
+}
+
+static void type_index_remove(struct gatt_db *db,
+					struct gatt_db_attribute *attribute)
+{
+	struct type_index *type;
+	unsigned int pos;
+	uint128_t key;
+
+	if (!db->type_count)
+		return;
+
+	type_key(&attribute->uuid, &key);
+
+	type = type_index_find(db, &key, NULL);
+	if (!type)
+		return;
+
+	for (pos = type_index_lower(type, attribute->handle);
+						pos < type->count; pos++) {
+		if (type->attrs[pos] != attribute)
+			continue;
+
+		type->count--;
+		memmove(&type->attrs[pos], &type->attrs[pos + 1],
+				(type->count - pos) * sizeof(*type->attrs));
+		return;
+	}
+}
+
+static void type_index_clear(struct gatt_db *db)
+{
+	unsigned int i;
+
+	for (i = 0; i < db->type_count; i++)
+		free(db->types[i].attrs);
+
+	free(db->types);
+	db->types = NULL;
+	db->type_count = 0;
+	db->type_alloc = 0;
+}
+
+static bool service_index_attribute(struct gatt_db_service *service,
+					struct gatt_db_attribute *attribute)
+{
+	uint16_t start = service->attributes[0]->handle;
+
+	if (service->db && !type_index_add(service->db, attribute))
+		return false;
+
+	/* Handles outside of the service range are never looked up */
+	if (attribute->handle < start ||
+			attribute->handle - start >= service->num_handles)
+		return true;
+
+	service->handles[attribute->handle - start] = attribute;
+
+	return true;
+}
+
+static void service_unindex_attribute(struct gatt_db_service *service,
+					struct gatt_db_attribute *attribute)
+{
+	uint16_t start = service->attributes[0]->handle;
+
+	if (service->db)
+		type_index_remove(service->db, attribute);
+
+	if (attribute->handle < start ||
+			attribute->handle - start >= service->num_handles)
+		return;
+
+	if (service->handles[attribute->handle - start] == attribute)
+		service->handles[attribute->handle - start] = NULL;
+}
+
+/* Returns the position of the first service starting after handle */
+static unsigned int service_index_upper(struct gatt_db *db, uint16_t handle)
+{
+	unsigned int lo = 0, hi = db->svc_count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+
+		if (db->svc_index[mid]->attributes[0]->handle <= handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool service_index_add(struct gatt_db *db,
+					struct gatt_db_service *service)
+{
+	unsigned int pos;
+
+	if (db->svc_count == db->svc_alloc) {
+		struct gatt_db_service **index;
+		unsigned int alloc = db->svc_alloc ? db->svc_alloc * 2 : 16;
+
+		index = realloc(db->svc_index, alloc * sizeof(*index));
+		if (!index)
+			return false;
+
+		db->svc_index = index;
+		db->svc_alloc = alloc;
+	}
+
+	pos = service_index_upper(db, service->attributes[0]->handle);
+
+	memmove(&db->svc_index[pos + 1], &db->svc_index[pos],
+			(db->svc_count - pos) * sizeof(*db->svc_index));
+	db->svc_index[pos] = service;
+	db->svc_count++;
+
+	return true;
+}
+
+static void service_index_remove(struct gatt_db *db,
+					struct gatt_db_service *service)
+{
+	unsigned int pos;
+
+	pos = service_index_upper(db, service->attributes[0]->handle);
+	if (!pos || db->svc_index[pos - 1] != service)
+		return;
+
+	pos--;
+	db->svc_count--;
+
+	memmove(&db->svc_index[pos], &db->svc_index[pos + 1],
+			(db->svc_count - pos) * sizeof(*db->svc_index));
+}
+
 static void gatt_db_service_destroy(void *data)
 {
 	struct gatt_db_service *service = data;
@@ -293,10 +572,15 @@ static void gatt_db_service_destroy(void *data)
 	if (service->active)
 		notify_service_changed(service->db, service, false);
 
-	for (i = 0; i < service->num_handles; i++)
+	for (i = 0; i < service->num_handles; i++) {
+		if (service->db && service->attributes[i])
+			type_index_remove(service->db, service->attributes[i]);
+
 		attribute_destroy(service->attributes[i]);
+	}
 
 	free(service->attributes);
+	free(service->handles);
 	free(service);
 }
 
@@ -312,7 +596,10 @@ static void gatt_db_destroy(struct gatt_db *db)
 	queue_destroy(db->notify_list, notify_destroy);
 	db->notify_list = NULL;
 
+	db->svc_count = 0;
+	type_index_clear(db);
 	queue_destroy(db->services, gatt_db_service_destroy);
+	free(db->svc_index);
 	free(db);
 }
 
@@ -395,6 +682,15 @@ static struct gatt_db_service *gatt_db_service_create(const bt_uuid_t *uuid,
 		return NULL;
 	}
 
+	service->handles = new0(struct gatt_db_attribute *, num_handles);
+	if (!service->handles) {
+		free(service->attributes);
+		free(service);
+		return NULL;
+	}
+
+	service->num_handles = num_handles;
+
 	if (primary)
 		type = &primary_service_uuid;
 	else
@@ -409,6 +705,8 @@ static struct gatt_db_service *gatt_db_service_create(const bt_uuid_t *uuid,
 		return NULL;
 	}
 
+	service->handles[0] = service->attributes[0];
+
 	return service;
 }
 
@@ -424,6 +722,7 @@ bool gatt_db_remove_service(struct gatt_db *db,
 	service = attrib->service;
 
 	queue_remove(db->services, service);
+	service_index_remove(db, service);
 
 	gatt_db_service_destroy(service);
 
@@ -435,6 +734,8 @@ bool gatt_db_clear(struct gatt_db *db)
 	if (!db)
 		return false;
 
+	db->svc_count = 0;
+	type_index_clear(db);
 	queue_remove_all(db->services, NULL, NULL, gatt_db_service_destroy);
 
 	db->next_handle = 0;
@@ -473,6 +774,7 @@ bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
 							uint16_t end_handle)
 {
 	struct clear_range range;
+	unsigned int i, count;
 
 	if (!db || start_handle > end_handle)
 		return false;
@@ -480,6 +782,15 @@ bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
 	range.start = start_handle;
 	range.end = end_handle;
 
+	for (i = 0, count = 0; i < db->svc_count; i++) {
+		if (match_range(db->svc_index[i], &range))
+			continue;
+
+		db->svc_index[count++] = db->svc_index[i];
+	}
+
+	db->svc_count = count;
+
 	queue_remove_all(db->services, match_range, &range,
 						gatt_db_service_destroy);
 
@@ -542,22 +853,30 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 	if (!service)
 		return NULL;
 
+	if (!service_index_add(db, service))
+		goto fail;
+
 	if (after) {
 		if (!queue_push_after(db->services, after, service))
-			goto fail;
+			goto unindex;
 	} else if (!queue_push_head(db->services, service)) {
-		goto fail;
+		goto unindex;
 	}
 
 	service->db = db;
-	service->attributes[0]->handle = handle;
-	service->num_handles = num_handles;
+	if (!type_index_add(db, service->attributes[0])) {
+		service->db = NULL;
+		queue_remove(db->services, service);
+		goto unindex;
+	}
 
 	/* Fast-forward next_handle if the new service was added to the end */
 	db->next_handle = MAX(handle + num_handles, db->next_handle);
 
 	return service->attributes[0];
 
+unindex:
+	service_index_remove(db, service);
 fail:
 	gatt_db_service_destroy(service);
 	return NULL;
@@ -651,6 +970,11 @@ attribute_update(struct gatt_db_service *service, int index)
 	 */
 	previous_handle = service->attributes[index - 1]->handle;
 	service->attributes[index]->handle = previous_handle + 1;
+	if (!service_index_attribute(service, service->attributes[index])) {
+		attribute_destroy(service->attributes[index]);
+		service->attributes[index] = NULL;
+		return NULL;
+	}
 
 	return service->attributes[index];
 }
@@ -706,18 +1030,33 @@ service_insert_characteristic(struct gatt_db_service *service,
 	if (!service->attributes[i])
 		return NULL;
 
+	if (!service_index_attribute(service, service->attributes[i]))
+		goto fail_decl;
+
 	i++;
 
 	service->attributes[i] = new_attribute(service, handle, uuid, NULL, 0);
-	if (!service->attributes[i]) {
-		free(service->attributes[i - 1]);
-		return NULL;
+	if (!service->attributes[i])
+		goto unindex_decl;
+
+	if (!service_index_attribute(service, service->attributes[i])) {
+		attribute_destroy(service->attributes[i]);
+		service->attributes[i] = NULL;
+		goto unindex_decl;
 	}
 
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
 	return service->attributes[i];
+
+unindex_decl:
+	i--;
+	service_unindex_attribute(service, service->attributes[i]);
+fail_decl:
+	attribute_destroy(service->attributes[i]);
+	service->attributes[i] = NULL;
+	return NULL;
 }
 
 struct gatt_db_attribute *
@@ -783,6 +1122,12 @@ service_insert_descriptor(struct gatt_db_service *service,
 	if (!service->attributes[i])
 		return NULL;
 
+	if (!service_index_attribute(service, service->attributes[i])) {
+		attribute_destroy(service->attributes[i]);
+		service->attributes[i] = NULL;
+		return NULL;
+	}
+
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
@@ -967,37 +1312,37 @@ next_service:
 }
 
 struct find_by_type_value_data {
-	bt_uuid_t uuid;
 	uint16_t start_handle;
 	uint16_t end_handle;
 	gatt_db_attribute_cb_t func;
 	void *user_data;
 	const void *value;
 	size_t value_len;
-	unsigned int num_of_res;
 };
 
-static void find_by_type(void *data, void *user_data)
+static unsigned int find_by_type(struct gatt_db *db, const bt_uuid_t *uuid,
+				struct find_by_type_value_data *search_data)
 {
-	struct find_by_type_value_data *search_data = user_data;
-	struct gatt_db_service *service = data;
 	struct gatt_db_attribute *attribute;
-	int i;
+	struct type_index *type;
+	unsigned int num_of_res = 0;
+	unsigned int i;
+	uint128_t key;
 
-	if (!service->active)
-		return;
+	type_key(uuid, &key);
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
+	type = type_index_find(db, &key, NULL);
+	if (!type)
+		return 0;
 
-		if (!attribute)
-			continue;
+	for (i = type_index_lower(type, search_data->start_handle);
+							i < type->count; i++) {
+		attribute = type->attrs[i];
 
-		if ((attribute->handle < search_data->start_handle) ||
-				(attribute->handle > search_data->end_handle))
-			continue;
+		if (attribute->handle > search_data->end_handle)
+			break;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
+		if (!attribute->service->active)
 			continue;
 
 		/* TODO: fix for read-callback based attributes */
@@ -1006,9 +1351,11 @@ static void find_by_type(void *data, void *user_data)
 							search_data->value_len))
 			continue;
 
-		search_data->num_of_res++;
+		num_of_res++;
 		search_data->func(attribute, search_data->user_data);
 	}
+
+	return num_of_res;
 }
 
 unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
@@ -1021,15 +1368,12 @@ unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
 
 	memset(&data, 0, sizeof(data));
 
-	data.uuid = *type;
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.func = func;
 	data.user_data = user_data;
 
-	queue_foreach(db->services, find_by_type, &data);
-
-	return data.num_of_res;
+	return find_by_type(db, type, &data);
 }
 
 unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
@@ -1043,7 +1387,6 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 {
 	struct find_by_type_value_data data;
 
-	data.uuid = *type;
 	data.start_handle = start_handle;
 	data.end_handle = end_handle;
 	data.func = func;
@@ -1051,60 +1394,38 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 	data.value = value;
 	data.value_len = value_len;
 
-	queue_foreach(db->services, find_by_type, &data);
-
-	return data.num_of_res;
+	return find_by_type(db, type, &data);
 }
 
-struct read_by_type_data {
-	struct queue *queue;
-	bt_uuid_t uuid;
-	uint16_t start_handle;
-	uint16_t end_handle;
-};
-
-static void read_by_type(void *data, void *user_data)
+void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
+						uint16_t end_handle,
+						const bt_uuid_t type,
+						struct queue *queue)
 {
-	struct read_by_type_data *search_data = user_data;
-	struct gatt_db_service *service = data;
 	struct gatt_db_attribute *attribute;
-	int i;
+	struct type_index *index;
+	unsigned int i;
+	uint128_t key;
 
-	if (!service->active)
-		return;
+	type_key(&type, &key);
 
-	for (i = 0; i < service->num_handles; i++) {
-		attribute = service->attributes[i];
-		if (!attribute)
-			continue;
+	index = type_index_find(db, &key, NULL);
+	if (!index)
+		return;
 
-		if (attribute->handle < search_data->start_handle)
-			continue;
+	for (i = type_index_lower(index, start_handle); i < index->count; i++) {
+		attribute = index->attrs[i];
 
-		if (attribute->handle > search_data->end_handle)
-			return;
+		if (attribute->handle > end_handle)
+			break;
 
-		if (bt_uuid_cmp(&search_data->uuid, &attribute->uuid))
+		if (!attribute->service->active)
 			continue;
 
-		queue_push_tail(search_data->queue, attribute);
+		queue_push_tail(queue, attribute);
 	}
 }
 
-void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
-						uint16_t end_handle,
-						const bt_uuid_t type,
-						struct queue *queue)
-{
-	struct read_by_type_data data;
-	data.uuid = type;
-	data.start_handle = start_handle;
-	data.end_handle = end_handle;
-	data.queue = queue;
-
-	queue_foreach(db->services, read_by_type, &data);
-}
-
 
 struct find_information_data {
 	struct queue *queue;
@@ -1293,40 +1614,27 @@ void gatt_db_service_foreach_incl(struct gatt_db_attribute *attrib,
 								user_data);
 }
 
-static bool find_service_for_handle(const void *data, const void *user_data)
-{
-	const struct gatt_db_service *service = data;
-	uint16_t handle = PTR_TO_UINT(user_data);
-	uint16_t start, end;
-
-	gatt_db_service_get_handles(service, &start, &end);
-
-	return (start <= handle) && (handle <= end);
-}
-
 struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 							uint16_t handle)
 {
 	struct gatt_db_service *service;
-	int i;
+	unsigned int pos;
+	uint16_t start;
 
 	if (!db || !handle)
 		return NULL;
 
-	service = queue_find(db->services, find_service_for_handle,
-							UINT_TO_PTR(handle));
-	if (!service)
+	pos = service_index_upper(db, handle);
+	if (!pos)
 		return NULL;
 
-	for (i = 0; i < service->num_handles; i++) {
-		if (!service->attributes[i])
-			continue;
+	service = db->svc_index[pos - 1];
+	start = service->attributes[0]->handle;
 
-		if (service->attributes[i]->handle == handle)
-			return service->attributes[i];
-	}
+	if (handle - start >= service->num_handles)
+		return NULL;
 
-	return NULL;
+	return service->handles[handle - start];
 }
 
 static bool find_service_with_uuid(const void *data, const void *user_data)
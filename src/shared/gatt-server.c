@@ -47,37 +47,78 @@
  */
 #define DEFAULT_MAX_PREP_QUEUE_LEN 30
 
+/* Default limit of the prepared data held for each connection */
+#define DEFAULT_MAX_PREP_QUEUE_SIZE 8192
+
+/* Encoded discovery responses kept for each database */
+#define DISCOVERY_CACHE_MAX_ENTRIES 256
+
+/*
+ * Responses to the discovery requests only depend on the database layout and
+ * the MTU, and clients tend to repeat the same procedures on every connection,
+ * so the encoded responses are shared by all the servers of a database until
+ * one of its services changes.
+ */
+struct discovery_cache {
+	struct gatt_db *db;
+	int ref_count;
+	unsigned int db_id;
+	struct queue *entries;
+	unsigned int num_entries;
+};
+
+struct discovery_rsp {
+	uint8_t opcode;
+	uint16_t start;
+	uint16_t end;
+	bt_uuid_t type;
+	uint16_t mtu;
+	uint8_t ecode;
+	uint16_t len;
+	uint8_t pdu[0];
+};
+
+static struct queue *discovery_caches;
+
+struct discovery_key {
+	uint8_t opcode;
+	uint16_t start;
+	uint16_t end;
+	const bt_uuid_t *type;
+	uint16_t mtu;
+};
+
 struct async_read_op {
 	struct bt_gatt_server *server;
+	unsigned int req_id;
 	uint8_t opcode;
 	bool done;
 	uint8_t *pdu;
 	size_t pdu_len;
 	size_t value_len;
 	struct queue *db_data;
+	bool cacheable;
+	bt_uuid_t type;
+	struct discovery_key key;
 };
 
 struct async_write_op {
 	struct bt_gatt_server *server;
+	unsigned int req_id;
 	uint8_t opcode;
 };
 
+/*
+ * Prepared values are stored back to back in the server arena, contiguous
+ * fragments of the same handle are merged into a single entry.
+ */
 struct prep_write_data {
-	struct bt_gatt_server *server;
-	uint8_t *value;
 	uint16_t handle;
 	uint16_t offset;
-	uint16_t length;
+	size_t value_off;
+	size_t length;
 };
 
-static void prep_write_data_destroy(void *user_data)
-{
-	struct prep_write_data *data = user_data;
-
-	free(data->value);
-	free(data);
-}
-
 struct bt_gatt_server {
 	struct gatt_db *db;
 	struct bt_att *att;
@@ -99,15 +140,203 @@ struct bt_gatt_server {
 
 	struct queue *prep_queue;
 	unsigned int max_prep_queue_len;
+	uint8_t *prep_arena;
+	size_t prep_arena_len;
+	size_t prep_arena_size;
+	size_t max_prep_queue_size;
+	unsigned int exec_req_id;
+
+	/* One per bearer at most, requests can overlap with Enhanced ATT */
+	struct queue *pending_read_ops;
+	struct queue *pending_write_ops;
 
-	struct async_read_op *pending_read_op;
-	struct async_write_op *pending_write_op;
+	struct discovery_cache *cache;
 
 	bt_gatt_server_debug_func_t debug_callback;
 	bt_gatt_server_destroy_func_t debug_destroy;
 	void *debug_data;
 };
 
+static void discovery_cache_clear(struct discovery_cache *cache)
+{
+	queue_remove_all(cache->entries, NULL, NULL, free);
+	cache->num_entries = 0;
+}
+
+static void discovery_cache_service_changed(struct gatt_db_attribute *attrib,
+								void *user_data)
+{
+	discovery_cache_clear(user_data);
+}
+
+static bool match_cache_db(const void *a, const void *b)
+{
+	const struct discovery_cache *cache = a;
+
+	return cache->db == b;
+}
+
+static struct discovery_cache *discovery_cache_get(struct gatt_db *db)
+{
+	struct discovery_cache *cache;
+
+	cache = queue_find(discovery_caches, match_cache_db, db);
+	if (cache)
+		goto done;
+
+	if (!discovery_caches) {
+		discovery_caches = queue_new();
+		if (!discovery_caches)
+			return NULL;
+	}
+
+	cache = new0(struct discovery_cache, 1);
+	if (!cache)
+		return NULL;
+
+	cache->entries = queue_new();
+	if (!cache->entries) {
+		free(cache);
+		return NULL;
+	}
+
+	cache->db = db;
+	cache->db_id = gatt_db_register(db, discovery_cache_service_changed,
+					discovery_cache_service_changed,
+					cache, NULL);
+	if (!cache->db_id) {
+		queue_destroy(cache->entries, NULL);
+		free(cache);
+		return NULL;
+	}
+
+	queue_push_tail(discovery_caches, cache);
+
+done:
+	cache->ref_count++;
+
+	return cache;
+}
+
+static void discovery_cache_put(struct discovery_cache *cache)
+{
+	if (!cache || --cache->ref_count)
+		return;
+
+	queue_remove(discovery_caches, cache);
+	if (queue_isempty(discovery_caches)) {
+		queue_destroy(discovery_caches, NULL);
+		discovery_caches = NULL;
+	}
+
+	gatt_db_unregister(cache->db, cache->db_id);
+	queue_destroy(cache->entries, free);
+	free(cache);
+}
+
+static bool match_discovery_rsp(const void *a, const void *b)
+{
+	const struct discovery_rsp *rsp = a;
+	const struct discovery_key *key = b;
+
+	if (rsp->opcode != key->opcode || rsp->start != key->start ||
+				rsp->end != key->end || rsp->mtu != key->mtu)
+		return false;
+
+	return !key->type || !bt_uuid_cmp(&rsp->type, key->type);
+}
+
+static struct discovery_rsp *discovery_cache_find(struct bt_gatt_server *server,
+					const struct discovery_key *key)
+{
+	if (!server->cache)
+		return NULL;
+
+	return queue_find(server->cache->entries, match_discovery_rsp, key);
+}
+
+static void discovery_cache_add(struct bt_gatt_server *server,
+					const struct discovery_key *key,
+					uint8_t ecode, const uint8_t *pdu,
+					uint16_t len)
+{
+	struct discovery_cache *cache = server->cache;
+	struct discovery_rsp *rsp;
+
+	if (!cache)
+		return;
+
+	/* Drop the oldest response to make room */
+	if (cache->num_entries == DISCOVERY_CACHE_MAX_ENTRIES) {
+		free(queue_pop_head(cache->entries));
+		cache->num_entries--;
+	}
+
+	rsp = malloc(sizeof(*rsp) + len);
+	if (!rsp)
+		return;
+
+	memset(rsp, 0, sizeof(*rsp));
+	rsp->opcode = key->opcode;
+	rsp->start = key->start;
+	rsp->end = key->end;
+	rsp->mtu = key->mtu;
+	rsp->ecode = ecode;
+	rsp->len = len;
+
+	if (key->type)
+		rsp->type = *key->type;
+
+	if (len)
+		memcpy(rsp->pdu, pdu, len);
+
+	if (!queue_push_tail(cache->entries, rsp)) {
+		free(rsp);
+		return;
+	}
+
+	cache->num_entries++;
+}
+
+/* Sends a cached response, returns false if there is none */
+static bool discovery_cache_send(struct bt_gatt_server *server,
+					const struct discovery_key *key,
+					uint8_t rsp_opcode)
+{
+	struct discovery_rsp *rsp;
+
+	rsp = discovery_cache_find(server, key);
+	if (!rsp)
+		return false;
+
+	util_debug(server->debug_callback, server->debug_data,
+				"Using cached response - opcode: 0x%02x",
+				key->opcode);
+
+	if (rsp->ecode)
+		bt_att_send_error_rsp(server->att, key->opcode, key->start,
+								rsp->ecode);
+	else
+		bt_att_send(server->att, rsp_opcode, rsp->pdu, rsp->len,
+							NULL, NULL, NULL);
+
+	return true;
+}
+
+static void detach_read_op(void *data, void *user_data)
+{
+	struct async_read_op *op = data;
+
+	op->server = NULL;
+}
+
+static void detach_write_op(void *data, void *user_data)
+{
+	struct async_write_op *op = data;
+
+	op->server = NULL;
+}
+
 static void bt_gatt_server_free(struct bt_gatt_server *server)
 {
 	if (server->debug_destroy)
@@ -126,13 +355,16 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 	bt_att_unregister(server->att, server->prep_write_id);
 	bt_att_unregister(server->att, server->exec_write_id);
 
-	if (server->pending_read_op)
-		server->pending_read_op->server = NULL;
+	queue_foreach(server->pending_read_ops, detach_read_op, NULL);
+	queue_destroy(server->pending_read_ops, NULL);
 
-	if (server->pending_write_op)
-		server->pending_write_op->server = NULL;
+	queue_foreach(server->pending_write_ops, detach_write_op, NULL);
+	queue_destroy(server->pending_write_ops, NULL);
 
-	queue_destroy(server->prep_queue, prep_write_data_destroy);
+	queue_destroy(server->prep_queue, free);
+	free(server->prep_arena);
+
+	discovery_cache_put(server->cache);
 
 	gatt_db_unref(server->db);
 	bt_att_unref(server->att);
@@ -241,18 +473,13 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 	uint8_t ecode = 0;
 	uint16_t ehandle = 0;
 	struct queue *q = NULL;
+	struct discovery_key key;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
-	q = queue_new();
-	if (!q) {
-		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
-		goto error;
-	}
-
 	start = get_le16(pdu);
 	end = get_le16(pdu + 2);
 	get_uuid_le(pdu + 4, length - 4, &type);
@@ -286,10 +513,26 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
+	key.opcode = opcode;
+	key.start = start;
+	key.end = end;
+	key.type = &type;
+	key.mtu = mtu;
+
+	if (discovery_cache_send(server, &key, BT_ATT_OP_READ_BY_GRP_TYPE_RSP))
+		return;
+
+	q = queue_new();
+	if (!q) {
+		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+		goto error;
+	}
+
 	gatt_db_read_by_group_type(server->db, start, end, type, q);
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		discovery_cache_add(server, &key, ecode, NULL, 0);
 		goto error;
 	}
 
@@ -301,6 +544,8 @@ static void read_by_grp_type_cb(uint8_t opcode, const void *pdu,
 
 	queue_destroy(q, NULL);
 
+	discovery_cache_add(server, &key, 0, rsp_pdu, rsp_len);
+
 	bt_att_send(server->att, BT_ATT_OP_READ_BY_GRP_TYPE_RSP,
 							rsp_pdu, rsp_len,
 							NULL, NULL, NULL);
@@ -315,7 +560,7 @@ error:
 static void async_read_op_destroy(struct async_read_op *op)
 {
 	if (op->server)
-		op->server->pending_read_op = NULL;
+		queue_remove(op->server->pending_read_ops, op);
 
 	queue_destroy(op->db_data, NULL);
 	free(op->pdu);
@@ -343,8 +588,8 @@ static void read_by_type_read_complete_cb(struct gatt_db_attribute *attr,
 
 	/* Terminate the operation if there was an error */
 	if (err) {
-		bt_att_send_error_rsp(server->att, BT_ATT_OP_READ_BY_TYPE_REQ,
-								handle, err);
+		bt_att_reply_error(server->att, op->req_id,
+					BT_ATT_OP_READ_BY_TYPE_REQ, handle, err);
 		async_read_op_destroy(op);
 		return;
 	}
@@ -387,10 +632,13 @@ static void process_read_by_type(struct async_read_op *op)
 	attr = queue_pop_head(op->db_data);
 
 	if (op->done || !attr) {
-		bt_att_send(server->att, BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
-								op->pdu_len,
-								NULL, NULL,
-								NULL);
+		if (op->cacheable)
+			discovery_cache_add(server, &op->key, 0, op->pdu,
+								op->pdu_len);
+
+		bt_att_reply(server->att, op->req_id,
+					BT_ATT_OP_READ_BY_TYPE_RSP, op->pdu,
+					op->pdu_len);
 		async_read_op_destroy(op);
 		return;
 	}
@@ -415,11 +663,24 @@ static void process_read_by_type(struct async_read_op *op)
 	ecode = BT_ATT_ERROR_UNLIKELY;
 
 error:
-	bt_att_send_error_rsp(server->att, BT_ATT_OP_READ_BY_TYPE_REQ,
+	bt_att_reply_error(server->att, op->req_id, BT_ATT_OP_READ_BY_TYPE_REQ,
 				gatt_db_attribute_get_handle(attr), ecode);
 	async_read_op_destroy(op);
 }
 
+static bool is_declaration_type(const bt_uuid_t *type)
+{
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+	if (!bt_uuid_cmp(type, &uuid))
+		return true;
+
+	bt_uuid16_create(&uuid, GATT_INCLUDE_UUID);
+
+	return !bt_uuid_cmp(type, &uuid);
+}
+
 static void read_by_type_cb(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
@@ -430,18 +691,14 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 	uint8_t ecode;
 	struct queue *q = NULL;
 	struct async_read_op *op;
+	struct discovery_key key;
+	bool cacheable;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
-	q = queue_new();
-	if (!q) {
-		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
-		goto error;
-	}
-
 	start = get_le16(pdu);
 	end = get_le16(pdu + 2);
 	get_uuid_le(pdu + 4, length - 4, &type);
@@ -462,15 +719,34 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	gatt_db_read_by_type(server->db, start, end, type, q);
+	key.opcode = opcode;
+	key.start = start;
+	key.end = end;
+	key.type = &type;
+	key.mtu = bt_att_get_mtu(server->att);
 
-	if (queue_isempty(q)) {
-		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+	/*
+	 * Only declarations are part of the database layout, other values
+	 * may change or depend on the client.
+	 */
+	cacheable = is_declaration_type(&type);
+
+	if (cacheable && discovery_cache_send(server, &key,
+						BT_ATT_OP_READ_BY_TYPE_RSP))
+		return;
+
+	q = queue_new();
+	if (!q) {
+		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 		goto error;
 	}
 
-	if (server->pending_read_op) {
-		ecode = BT_ATT_ERROR_UNLIKELY;
+	gatt_db_read_by_type(server->db, start, end, type, q);
+
+	if (queue_isempty(q)) {
+		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		if (cacheable)
+			discovery_cache_add(server, &key, ecode, NULL, 0);
 		goto error;
 	}
 
@@ -489,8 +765,13 @@ static void read_by_type_cb(uint8_t opcode, const void *pdu,
 
 	op->opcode = opcode;
 	op->server = server;
+	op->req_id = bt_att_get_request_id(server->att);
 	op->db_data = q;
-	server->pending_read_op = op;
+	op->cacheable = cacheable;
+	op->type = type;
+	op->key = key;
+	op->key.type = &op->type;
+	queue_push_tail(server->pending_read_ops, op);
 
 	process_read_by_type(op);
 
@@ -566,18 +847,13 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 	uint8_t ecode = 0;
 	uint16_t ehandle = 0;
 	struct queue *q = NULL;
+	struct discovery_key key;
 
 	if (length != 4) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
-	q = queue_new();
-	if (!q) {
-		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
-		goto error;
-	}
-
 	start = get_le16(pdu);
 	end = get_le16(pdu + 2);
 
@@ -597,10 +873,26 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
+	key.opcode = opcode;
+	key.start = start;
+	key.end = end;
+	key.type = NULL;
+	key.mtu = mtu;
+
+	if (discovery_cache_send(server, &key, BT_ATT_OP_FIND_INFO_RSP))
+		return;
+
+	q = queue_new();
+	if (!q) {
+		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+		goto error;
+	}
+
 	gatt_db_find_information(server->db, start, end, q);
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		discovery_cache_add(server, &key, ecode, NULL, 0);
 		goto error;
 	}
 
@@ -609,6 +901,8 @@ static void find_info_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
+	discovery_cache_add(server, &key, 0, rsp_pdu, rsp_len);
+
 	bt_att_send(server->att, BT_ATT_OP_FIND_INFO_RSP, rsp_pdu, rsp_len,
 							NULL, NULL, NULL);
 	queue_destroy(q, NULL);
@@ -716,7 +1010,7 @@ error:
 static void async_write_op_destroy(struct async_write_op *op)
 {
 	if (op->server)
-		op->server->pending_write_op = NULL;
+		queue_remove(op->server->pending_write_ops, op);
 
 	free(op);
 }
@@ -736,10 +1030,11 @@ static void write_complete_cb(struct gatt_db_attribute *attr, int err,
 	handle = gatt_db_attribute_get_handle(attr);
 
 	if (err)
-		bt_att_send_error_rsp(server->att, op->opcode, handle, err);
+		bt_att_reply_error(server->att, op->req_id, op->opcode,
+								handle, err);
 	else
-		bt_att_send(server->att, BT_ATT_OP_WRITE_RSP, NULL, 0,
-							NULL, NULL, NULL);
+		bt_att_reply(server->att, op->req_id, BT_ATT_OP_WRITE_RSP,
+								NULL, 0);
 
 	async_write_op_destroy(op);
 }
@@ -778,11 +1073,6 @@ static void write_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	if (server->pending_write_op) {
-		ecode = BT_ATT_ERROR_UNLIKELY;
-		goto error;
-	}
-
 	op = new0(struct async_write_op, 1);
 	if (!op) {
 		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
@@ -790,8 +1080,9 @@ static void write_cb(uint8_t opcode, const void *pdu,
 	}
 
 	op->server = server;
+	op->req_id = bt_att_get_request_id(server->att);
 	op->opcode = opcode;
-	server->pending_write_op = op;
+	queue_push_tail(server->pending_write_ops, op);
 
 	if (gatt_db_attribute_write(attr, 0, pdu + 2, length - 2, opcode,
 							server->att,
@@ -852,16 +1143,16 @@ static void read_complete_cb(struct gatt_db_attribute *attr, int err,
 	handle = gatt_db_attribute_get_handle(attr);
 
 	if (err) {
-		bt_att_send_error_rsp(server->att, op->opcode, handle, err);
+		bt_att_reply_error(server->att, op->req_id, op->opcode,
+								handle, err);
 		async_read_op_destroy(op);
 		return;
 	}
 
 	rsp_opcode = get_read_rsp_opcode(op->opcode);
 
-	bt_att_send(server->att, rsp_opcode, len ? value : NULL,
-						MIN((unsigned) mtu - 1, len),
-						NULL, NULL, NULL);
+	bt_att_reply(server->att, op->req_id, rsp_opcode, len ? value : NULL,
+						MIN((unsigned) mtu - 1, len));
 	async_read_op_destroy(op);
 }
 
@@ -892,11 +1183,6 @@ static void handle_read_req(struct bt_gatt_server *server, uint8_t opcode,
 		goto error;
 	}
 
-	if (server->pending_read_op) {
-		ecode = BT_ATT_ERROR_UNLIKELY;
-		goto error;
-	}
-
 	op = new0(struct async_read_op, 1);
 	if (!op) {
 		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
@@ -905,7 +1191,8 @@ static void handle_read_req(struct bt_gatt_server *server, uint8_t opcode,
 
 	op->opcode = opcode;
 	op->server = server;
-	server->pending_read_op = op;
+	op->req_id = bt_att_get_request_id(server->att);
+	queue_push_tail(server->pending_read_ops, op);
 
 	if (gatt_db_attribute_read(attr, offset, opcode, server->att,
 							read_complete_cb, op))
@@ -957,6 +1244,7 @@ static void read_blob_cb(uint8_t opcode, const void *pdu,
 
 struct read_multiple_resp_data {
 	struct bt_gatt_server *server;
+	unsigned int req_id;
 	uint16_t *handles;
 	size_t cur_handle;
 	size_t num_handles;
@@ -984,7 +1272,7 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 	uint16_t handle = gatt_db_attribute_get_handle(attr);
 
 	if (err != 0) {
-		bt_att_send_error_rsp(data->server->att,
+		bt_att_reply_error(data->server->att, data->req_id,
 					BT_ATT_OP_READ_MULT_REQ, handle, err);
 		read_multiple_resp_data_free(data);
 		return;
@@ -993,7 +1281,7 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 	perm = gatt_db_attribute_get_permissions(attr);
 
 	if (perm && !(perm & BT_ATT_PERM_READ)) {
-		bt_att_send_error_rsp(data->server->att,
+		bt_att_reply_error(data->server->att, data->req_id,
 					BT_ATT_OP_READ_MULT_REQ, handle,
 					BT_ATT_ERROR_READ_NOT_PERMITTED);
 		read_multiple_resp_data_free(data);
@@ -1009,8 +1297,9 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 
 	if ((data->length >= data->mtu - 1) ||
 				(data->cur_handle == data->num_handles)) {
-		bt_att_send(data->server->att, BT_ATT_OP_READ_MULT_RSP,
-				data->rsp_data, data->length, NULL, NULL, NULL);
+		bt_att_reply(data->server->att, data->req_id,
+					BT_ATT_OP_READ_MULT_RSP, data->rsp_data,
+					data->length);
 		read_multiple_resp_data_free(data);
 		return;
 	}
@@ -1024,7 +1313,7 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 					data->handles[data->cur_handle]);
 
 	if (!next_attr) {
-		bt_att_send_error_rsp(data->server->att,
+		bt_att_reply_error(data->server->att, data->req_id,
 					BT_ATT_OP_READ_MULT_REQ,
 					data->handles[data->cur_handle],
 					BT_ATT_ERROR_INVALID_HANDLE);
@@ -1035,7 +1324,7 @@ static void read_multiple_complete_cb(struct gatt_db_attribute *attr, int err,
 	if (!gatt_db_attribute_read(next_attr, 0, BT_ATT_OP_READ_MULT_REQ,
 					data->server->att,
 					read_multiple_complete_cb, data)) {
-		bt_att_send_error_rsp(data->server->att,
+		bt_att_reply_error(data->server->att, data->req_id,
 						BT_ATT_OP_READ_MULT_REQ,
 						data->handles[data->cur_handle],
 						BT_ATT_ERROR_UNLIKELY);
@@ -1061,6 +1350,7 @@ static void read_multiple_cb(uint8_t opcode, const void *pdu,
 	}
 
 	data.server = server;
+	data.req_id = bt_att_get_request_id(server->att);
 	data.num_handles = length / 2;
 	data.cur_handle = 0;
 	data.mtu = bt_att_get_mtu(server->att);
@@ -1098,27 +1388,59 @@ error:
 	bt_att_send_error_rsp(server->att, opcode, 0, ecode);
 }
 
+static void prep_queue_clear(struct bt_gatt_server *server)
+{
+	queue_remove_all(server->prep_queue, NULL, NULL, free);
+
+	free(server->prep_arena);
+	server->prep_arena = NULL;
+	server->prep_arena_len = 0;
+	server->prep_arena_size = 0;
+}
+
+static bool prep_arena_reserve(struct bt_gatt_server *server, size_t len)
+{
+	size_t size = server->prep_arena_size;
+	uint8_t *arena;
+
+	if (server->prep_arena_len + len <= size)
+		return true;
+
+	if (!size)
+		size = MIN(256, server->max_prep_queue_size);
+
+	while (size < server->prep_arena_len + len)
+		size *= 2;
+
+	size = MIN(size, server->max_prep_queue_size);
+
+	arena = realloc(server->prep_arena, size);
+	if (!arena)
+		return false;
+
+	server->prep_arena = arena;
+	server->prep_arena_size = size;
+
+	return true;
+}
+
 static void prep_write_cb(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
 	struct bt_gatt_server *server = user_data;
-	struct prep_write_data *prep_data = NULL;
+	struct prep_write_data *prep_data;
 	uint16_t handle = 0;
 	uint16_t offset;
 	struct gatt_db_attribute *attr;
 	uint8_t ecode;
 	uint32_t perm;
+	size_t len;
 
 	if (length < 4) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
 		goto error;
 	}
 
-	if (queue_length(server->prep_queue) >= server->max_prep_queue_len) {
-		ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
-		goto error;
-	}
-
 	handle = get_le16(pdu);
 	offset = get_le16(pdu + 2);
 
@@ -1145,38 +1467,62 @@ static void prep_write_cb(uint8_t opcode, const void *pdu,
 		goto error;
 	}
 
-	prep_data = new0(struct prep_write_data, 1);
-	if (!prep_data) {
+	len = length - 4;
+
+	if (server->prep_arena_len + len > server->max_prep_queue_size) {
+		ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
+		goto error;
+	}
+
+	prep_data = queue_peek_tail(server->prep_queue);
+	if (!prep_data || prep_data->handle != handle ||
+			prep_data->offset + prep_data->length != offset) {
+		if (queue_length(server->prep_queue) >=
+						server->max_prep_queue_len) {
+			ecode = BT_ATT_ERROR_PREPARE_QUEUE_FULL;
+			goto error;
+		}
+
+		prep_data = NULL;
+	}
+
+	if (!prep_arena_reserve(server, len)) {
 		ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 		goto error;
 	}
 
-	prep_data->length = length - 4;
-	if (prep_data->length) {
-		prep_data->value = malloc(prep_data->length);
-		if (!prep_data->value) {
+	if (!prep_data) {
+		prep_data = new0(struct prep_write_data, 1);
+		if (!prep_data) {
+			ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
+			goto error;
+		}
+
+		prep_data->handle = handle;
+		prep_data->offset = offset;
+		prep_data->value_off = server->prep_arena_len;
+
+		if (!queue_push_tail(server->prep_queue, prep_data)) {
+			free(prep_data);
 			ecode = BT_ATT_ERROR_INSUFFICIENT_RESOURCES;
 			goto error;
 		}
 	}
 
-	prep_data->server = server;
-	prep_data->handle = handle;
-	prep_data->offset = offset;
-	memcpy(prep_data->value, pdu + 4, prep_data->length);
+	/* The queue tail always owns the end of the arena */
+	if (len)
+		memcpy(server->prep_arena + server->prep_arena_len, pdu + 4,
+									len);
 
-	queue_push_tail(server->prep_queue, prep_data);
+	server->prep_arena_len += len;
+	prep_data->length += len;
 
 	bt_att_send(server->att, BT_ATT_OP_PREP_WRITE_RSP, pdu, length, NULL,
 								NULL, NULL);
 	return;
 
 error:
-	if (prep_data)
-		prep_write_data_destroy(prep_data);
-
 	bt_att_send_error_rsp(server->att, opcode, handle, ecode);
-
 }
 
 static void exec_next_prep_write(struct bt_gatt_server *server,
@@ -1203,24 +1549,28 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 
 	next = queue_pop_head(server->prep_queue);
 	if (!next) {
-		bt_att_send(server->att, BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0,
-							NULL, NULL, NULL);
+		prep_queue_clear(server);
+		bt_att_reply(server->att, server->exec_req_id,
+					BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0);
 		return;
 	}
 
+	ehandle = next->handle;
+
 	attr = gatt_db_get_attribute(server->db, next->handle);
 	if (!attr) {
+		free(next);
 		err = BT_ATT_ERROR_UNLIKELY;
 		goto error;
 	}
 
 	status = gatt_db_attribute_write(attr, next->offset,
-						next->value, next->length,
-						BT_ATT_OP_EXEC_WRITE_REQ,
-						server->att,
-						exec_write_complete_cb, server);
+				next->length ?
+				server->prep_arena + next->value_off : NULL,
+				next->length, BT_ATT_OP_EXEC_WRITE_REQ,
+				server->att, exec_write_complete_cb, server);
 
-	prep_write_data_destroy(next);
+	free(next);
 
 	if (status)
 		return;
@@ -1228,8 +1578,9 @@ static void exec_next_prep_write(struct bt_gatt_server *server,
 	err = BT_ATT_ERROR_UNLIKELY;
 
 error:
-	bt_att_send_error_rsp(server->att, BT_ATT_OP_EXEC_WRITE_REQ,
-								ehandle, err);
+	prep_queue_clear(server);
+	bt_att_reply_error(server->att, server->exec_req_id,
+				BT_ATT_OP_EXEC_WRITE_REQ, ehandle, err);
 }
 
 static void exec_write_cb(uint8_t opcode, const void *pdu,
@@ -1260,13 +1611,13 @@ static void exec_write_cb(uint8_t opcode, const void *pdu,
 	}
 
 	if (!write) {
-		queue_remove_all(server->prep_queue, NULL, NULL,
-						prep_write_data_destroy);
+		prep_queue_clear(server);
 		bt_att_send(server->att, BT_ATT_OP_EXEC_WRITE_RSP, NULL, 0,
 							NULL, NULL, NULL);
 		return;
 	}
 
+	server->exec_req_id = bt_att_get_request_id(server->att);
 	exec_next_prep_write(server, 0, 0);
 
 	return;
@@ -1418,6 +1769,7 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 	server->att = bt_att_ref(att);
 	server->mtu = MAX(mtu, BT_ATT_DEFAULT_LE_MTU);
 	server->max_prep_queue_len = DEFAULT_MAX_PREP_QUEUE_LEN;
+	server->max_prep_queue_size = DEFAULT_MAX_PREP_QUEUE_SIZE;
 
 	server->prep_queue = queue_new();
 	if (!server->prep_queue) {
@@ -1425,6 +1777,16 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 		return NULL;
 	}
 
+	server->pending_read_ops = queue_new();
+	server->pending_write_ops = queue_new();
+	if (!server->pending_read_ops || !server->pending_write_ops) {
+		bt_gatt_server_free(server);
+		return NULL;
+	}
+
+	/* Discovery still works without the cache */
+	server->cache = discovery_cache_get(db);
+
 	if (!gatt_server_register_att_handlers(server)) {
 		bt_gatt_server_free(server);
 		return NULL;
@@ -1472,6 +1834,25 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 	return true;
 }
 
+bool bt_gatt_server_set_prep_queue_size(struct bt_gatt_server *server,
+								size_t size)
+{
+	if (!server)
+		return false;
+
+	server->max_prep_queue_size = size;
+
+	return true;
+}
+
+uint16_t bt_gatt_server_get_mtu(struct bt_gatt_server *server)
+{
+	if (!server)
+		return 0;
+
+	return bt_att_get_mtu(server->att);
+}
+
 bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length)
@@ -22,6 +22,7 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
 
 struct bt_gatt_server;
 
@@ -40,6 +41,11 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 					void *user_data,
 					bt_gatt_server_destroy_func_t destroy);
 
+bool bt_gatt_server_set_prep_queue_size(struct bt_gatt_server *server,
+								size_t size);
+
+uint16_t bt_gatt_server_get_mtu(struct bt_gatt_server *server);
+
 bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length);
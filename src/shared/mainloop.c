@@ -27,23 +27,35 @@
 #endif
 
 #include <stdio.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
 
 #include "mainloop.h"
 
-#define MAX_EPOLL_EVENTS 10
+#define DEFAULT_EPOLL_EVENTS 64
+#define MAX_EPOLL_EVENTS 4096
 
 static int epoll_fd;
 static int epoll_terminate;
 static int exit_status;
 
+static struct epoll_event *epoll_events;
+static unsigned int epoll_max_events = DEFAULT_EPOLL_EVENTS;
+
+/* Events of the current epoll_wait batch still waiting to be dispatched */
+static int dispatch_index;
+static int dispatch_count;
+
+static struct mainloop_stats stats;
+
 struct mainloop_data {
 	int fd;
 	uint32_t events;
@@ -52,9 +64,10 @@ struct mainloop_data {
 	void *user_data;
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
+#define MIN_MAINLOOP_ENTRIES 128
 
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
+static struct mainloop_data **mainloop_list;
+static unsigned int mainloop_list_size;
 
 struct timeout_data {
 	int fd;
@@ -75,16 +88,134 @@ static struct signal_data *signal_data;
 
 void mainloop_init(void)
 {
-	unsigned int i;
-
 	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_list_size = 0;
+
+	memset(&stats, 0, sizeof(stats));
 
 	epoll_terminate = 0;
 }
 
+static bool mainloop_list_resize(int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size;
+
+	if ((unsigned int) fd < mainloop_list_size)
+		return true;
+
+	size = mainloop_list_size ? mainloop_list_size : MIN_MAINLOOP_ENTRIES;
+	while (size <= (unsigned int) fd)
+		size *= 2;
+
+	list = realloc(mainloop_list, size * sizeof(*list));
+	if (!list)
+		return false;
+
+	memset(list + mainloop_list_size, 0,
+			(size - mainloop_list_size) * sizeof(*list));
+
+	mainloop_list = list;
+	mainloop_list_size = size;
+
+	return true;
+}
+
+static struct mainloop_data *mainloop_list_get(int fd)
+{
+	if (fd < 0 || (unsigned int) fd >= mainloop_list_size)
+		return NULL;
+
+	return mainloop_list[fd];
+}
+
+int mainloop_set_max_events(unsigned int max_events)
+{
+	struct epoll_event *events;
+
+	if (!max_events || max_events > MAX_EPOLL_EVENTS)
+		return -EINVAL;
+
+	/* The batch array cannot be replaced while it is being dispatched */
+	if (dispatch_index < dispatch_count)
+		return -EBUSY;
+
+	if (epoll_events) {
+		events = realloc(epoll_events, max_events * sizeof(*events));
+		if (!events)
+			return -ENOMEM;
+
+		epoll_events = events;
+	}
+
+	epoll_max_events = max_events;
+
+	return 0;
+}
+
+void mainloop_get_stats(struct mainloop_stats *out)
+{
+	if (out)
+		memcpy(out, &stats, sizeof(stats));
+}
+
+void mainloop_reset_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+static uint64_t get_monotonic_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void dispatch_events(int nfds)
+{
+	uint64_t start, elapsed;
+
+	stats.wakeups++;
+	stats.events += nfds;
+
+	if ((unsigned int) nfds > stats.max_events_per_wakeup)
+		stats.max_events_per_wakeup = nfds;
+
+	if ((unsigned int) nfds == epoll_max_events)
+		stats.full_batches++;
+
+	start = get_monotonic_usec();
+
+	dispatch_count = nfds;
+
+	for (dispatch_index = 0; dispatch_index < dispatch_count;
+							dispatch_index++) {
+		struct epoll_event *ev = &epoll_events[dispatch_index];
+		struct mainloop_data *data = ev->data.ptr;
+
+		/* Removed by an earlier callback of the same batch */
+		if (!data)
+			continue;
+
+		data->callback(data->fd, ev->events, data->user_data);
+	}
+
+	dispatch_index = 0;
+	dispatch_count = 0;
+
+	elapsed = get_monotonic_usec() - start;
+
+	stats.callback_usec += elapsed;
+
+	if (elapsed > stats.max_callback_usec)
+		stats.max_callback_usec = elapsed;
+}
+
 void mainloop_quit(void)
 {
 	epoll_terminate = 1;
@@ -141,22 +272,22 @@ int mainloop_run(void)
 		}
 	}
 
+	if (!epoll_events) {
+		epoll_events = malloc(epoll_max_events * sizeof(*epoll_events));
+		if (!epoll_events)
+			return EXIT_FAILURE;
+	}
+
 	exit_status = EXIT_SUCCESS;
 
 	while (!epoll_terminate) {
-		struct epoll_event events[MAX_EPOLL_EVENTS];
-		int n, nfds;
+		int nfds;
 
-		nfds = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1);
-		if (nfds < 0)
+		nfds = epoll_wait(epoll_fd, epoll_events, epoll_max_events, -1);
+		if (nfds <= 0)
 			continue;
 
-		for (n = 0; n < nfds; n++) {
-			struct mainloop_data *data = events[n].data.ptr;
-
-			data->callback(data->fd, events[n].events,
-							data->user_data);
-		}
+		dispatch_events(nfds);
 	}
 
 	if (signal_data) {
@@ -167,7 +298,7 @@ int mainloop_run(void)
 			signal_data->destroy(signal_data->user_data);
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
+	for (i = 0; i < mainloop_list_size; i++) {
 		struct mainloop_data *data = mainloop_list[i];
 
 		mainloop_list[i] = NULL;
@@ -182,6 +313,13 @@ int mainloop_run(void)
 		}
 	}
 
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_list_size = 0;
+
+	free(epoll_events);
+	epoll_events = NULL;
+
 	close(epoll_fd);
 	epoll_fd = 0;
 
@@ -195,9 +333,15 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (fd < 0 || !callback)
 		return -EINVAL;
 
+	if (mainloop_list_get(fd))
+		return -EEXIST;
+
+	if (!mainloop_list_resize(fd))
+		return -ENOMEM;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -230,10 +374,10 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = mainloop_list_get(fd);
 	if (!data)
 		return -ENXIO;
 
@@ -253,17 +397,23 @@ int mainloop_modify_fd(int fd, uint32_t events)
 int mainloop_remove_fd(int fd)
 {
 	struct mainloop_data *data;
-	int err;
+	int err, n;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0)
 		return -EINVAL;
 
-	data = mainloop_list[fd];
+	data = mainloop_list_get(fd);
 	if (!data)
 		return -ENXIO;
 
 	mainloop_list[fd] = NULL;
 
+	/* Drop pending events of the current batch that refer to this fd */
+	for (n = dispatch_index + 1; n < dispatch_count; n++) {
+		if (epoll_events[n].data.ptr == data)
+			epoll_events[n].data.ptr = NULL;
+	}
+
 	err = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, data->fd, NULL);
 
 	if (data->destroy)
@@ -22,6 +22,7 @@
  *
  */
 
+#include <stdint.h>
 #include <signal.h>
 #include <sys/epoll.h>
 
@@ -37,6 +38,19 @@ void mainloop_exit_success(void);
 void mainloop_exit_failure(void);
 int mainloop_run(void);
 
+struct mainloop_stats {
+	uint64_t wakeups;
+	uint64_t events;
+	uint64_t full_batches;
+	unsigned int max_events_per_wakeup;
+	uint64_t callback_usec;
+	uint64_t max_callback_usec;
+};
+
+int mainloop_set_max_events(unsigned int max_events);
+void mainloop_get_stats(struct mainloop_stats *stats);
+void mainloop_reset_stats(void);
+
 int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy);
 int mainloop_modify_fd(int fd, uint32_t events);
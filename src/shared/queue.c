@@ -28,6 +28,18 @@
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 
+/*
+ * Entries of all queues are recycled through a common free list, so that
+ * pushing and popping does not hit the allocator once the list is warm.
+ *
+ * The free list is not protected by any lock; like the rest of the shared
+ * code, queues must only be used from a single thread (the mainloop).
+ */
+#define ENTRY_CACHE_MAX 1024
+
+static struct queue_entry *entry_cache;
+static unsigned int entry_cache_len;
+
 struct queue {
 	int ref_count;
 	struct queue_entry *head;
@@ -93,16 +105,32 @@ static void queue_entry_unref(struct queue_entry *entry)
 	if (__sync_sub_and_fetch(&entry->ref_count, 1))
 		return;
 
-	free(entry);
+	if (entry_cache_len >= ENTRY_CACHE_MAX) {
+		free(entry);
+		return;
+	}
+
+	entry->data = NULL;
+	entry->next = entry_cache;
+	entry_cache = entry;
+	entry_cache_len++;
 }
 
 static struct queue_entry *queue_entry_new(void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
-	if (!entry)
-		return NULL;
+	if (entry_cache) {
+		entry = entry_cache;
+		entry_cache = entry->next;
+		entry_cache_len--;
+
+		entry->next = NULL;
+	} else {
+		entry = new0(struct queue_entry, 1);
+		if (!entry)
+			return NULL;
+	}
 
 	entry->data = data;
 
@@ -417,3 +445,115 @@ bool queue_isempty(struct queue *queue)
 
 	return queue->entries == 0;
 }
+
+void queue_list_init(struct queue_list *list)
+{
+	if (!list)
+		return;
+
+	list->head = NULL;
+	list->tail = NULL;
+	list->entries = 0;
+}
+
+void queue_list_push_tail(struct queue_list *list, struct queue_link *link)
+{
+	if (!list || !link)
+		return;
+
+	link->next = NULL;
+
+	if (list->tail)
+		list->tail->next = link;
+	else
+		list->head = link;
+
+	list->tail = link;
+	list->entries++;
+}
+
+void queue_list_push_head(struct queue_list *list, struct queue_link *link)
+{
+	if (!list || !link)
+		return;
+
+	link->next = list->head;
+	list->head = link;
+
+	if (!list->tail)
+		list->tail = link;
+
+	list->entries++;
+}
+
+struct queue_link *queue_list_pop_head(struct queue_list *list)
+{
+	struct queue_link *link;
+
+	if (!list || !list->head)
+		return NULL;
+
+	link = list->head;
+
+	list->head = link->next;
+	if (!list->head)
+		list->tail = NULL;
+
+	link->next = NULL;
+	list->entries--;
+
+	return link;
+}
+
+struct queue_link *queue_list_peek_head(struct queue_list *list)
+{
+	if (!list)
+		return NULL;
+
+	return list->head;
+}
+
+bool queue_list_remove(struct queue_list *list, struct queue_link *link)
+{
+	struct queue_link *tmp, *prev;
+
+	if (!list || !link)
+		return false;
+
+	for (tmp = list->head, prev = NULL; tmp;
+					prev = tmp, tmp = tmp->next) {
+		if (tmp != link)
+			continue;
+
+		if (prev)
+			prev->next = tmp->next;
+		else
+			list->head = tmp->next;
+
+		if (!tmp->next)
+			list->tail = prev;
+
+		tmp->next = NULL;
+		list->entries--;
+
+		return true;
+	}
+
+	return false;
+}
+
+unsigned int queue_list_length(struct queue_list *list)
+{
+	if (!list)
+		return 0;
+
+	return list->entries;
+}
+
+bool queue_list_isempty(struct queue_list *list)
+{
+	if (!list)
+		return true;
+
+	return list->entries == 0;
+}
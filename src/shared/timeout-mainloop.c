@@ -18,33 +18,258 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
 #include "mainloop.h"
 #include "util.h"
 #include "timeout.h"
 
+/*
+ * All timeouts of the loop share a single timerfd. Pending timeouts are
+ * kept in a hierarchical timer wheel with millisecond ticks: level 0
+ * covers the next 64 ms, every further level is 64 times coarser. Entries
+ * of the higher levels are cascaded down once their slot comes up, so
+ * adding and removing a timeout are both constant time.
+ */
+#define WHEEL_BITS	6
+#define WHEEL_SIZE	(1 << WHEEL_BITS)
+#define WHEEL_MASK	(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS	4
+#define WHEEL_RANGE	(1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define ID_INDEX_BITS	20
+#define ID_INDEX_MASK	((1U << ID_INDEX_BITS) - 1)
+#define ID_GEN_MASK	((1U << (32 - ID_INDEX_BITS)) - 1)
+
 struct timeout_data {
-	int id;
+	struct timeout_data *prev;
+	struct timeout_data *next;
+	unsigned int id;
+	uint64_t expires;
 	timeout_func_t func;
 	timeout_destroy_func_t destroy;
 	unsigned int timeout;
 	void *user_data;
+	bool running;
+	bool removed;
+};
+
+struct timeout_slot {
+	struct timeout_data *prev;
+	struct timeout_data *next;
 };
 
-static void timeout_callback(int id, void *user_data)
+struct timeout_wheel {
+	int fd;
+	uint64_t current;
+	uint64_t armed;
+	unsigned int count;
+	uint64_t bitmap[WHEEL_LEVELS];
+	struct timeout_slot slots[WHEEL_LEVELS][WHEEL_SIZE];
+	struct timeout_data **table;
+	unsigned int *generation;
+	unsigned int table_size;
+	unsigned int *free_index;
+	unsigned int free_count;
+};
+
+static struct timeout_wheel *wheel;
+
+#define slot_head(slot) ((struct timeout_data *) (slot))
+
+static void slot_init(struct timeout_slot *slot)
 {
-	struct timeout_data *data = user_data;
+	slot->prev = slot_head(slot);
+	slot->next = slot_head(slot);
+}
 
-	if (data->func(data->user_data) &&
-			!mainloop_modify_timeout(data->id, data->timeout))
+static bool slot_empty(struct timeout_slot *slot)
+{
+	return slot->next == slot_head(slot);
+}
+
+static void slot_append(struct timeout_slot *slot, struct timeout_data *data)
+{
+	data->next = slot_head(slot);
+	data->prev = slot->prev;
+	slot->prev->next = data;
+	slot->prev = data;
+}
+
+static void slot_move(struct timeout_slot *dst, struct timeout_slot *src)
+{
+	if (slot_empty(src)) {
+		slot_init(dst);
 		return;
+	}
+
+	dst->next = src->next;
+	dst->prev = src->prev;
+	dst->next->prev = slot_head(dst);
+	dst->prev->next = slot_head(dst);
+
+	slot_init(src);
+}
+
+static uint64_t get_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_unlink(struct timeout_data *data)
+{
+	struct timeout_data *prev = data->prev;
+	struct timeout_data *next = data->next;
+	unsigned int level, index;
+
+	prev->next = next;
+	next->prev = prev;
+
+	data->prev = NULL;
+	data->next = NULL;
+
+	/* Keep the bitmap of non-empty slots in sync */
+	if (prev != next)
+		return;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		struct timeout_slot *first = wheel->slots[level];
+		struct timeout_slot *slot = (struct timeout_slot *) prev;
+
+		if (slot < first || slot >= first + WHEEL_SIZE)
+			continue;
+
+		index = slot - first;
+		wheel->bitmap[level] &= ~(1ULL << index);
+		break;
+	}
+}
+
+static void wheel_insert(struct timeout_data *data)
+{
+	uint64_t expires = data->expires;
+	uint64_t delta;
+	unsigned int level, index;
+
+	if (expires < wheel->current)
+		expires = wheel->current;
+
+	delta = expires - wheel->current;
+	if (delta >= WHEEL_RANGE)
+		expires = wheel->current + WHEEL_RANGE - 1;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+		if (delta < 1ULL << (WHEEL_BITS * (level + 1)))
+			break;
+	}
+
+	index = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
 
-	mainloop_remove_timeout(data->id);
+	slot_append(&wheel->slots[level][index], data);
+	wheel->bitmap[level] |= 1ULL << index;
 }
 
-static void timeout_destroy(void *user_data)
+static unsigned int first_bit_after(uint64_t bitmap, unsigned int index)
 {
-	struct timeout_data *data = user_data;
+	unsigned int shift = (index + 1) & WHEEL_MASK;
+	uint64_t rotated;
+
+	rotated = shift ? (bitmap >> shift) | (bitmap << (WHEEL_SIZE - shift)) :
+									bitmap;
+
+	return __builtin_ctzll(rotated);
+}
+
+/*
+ * Returns the next tick at which either a level 0 slot expires or a
+ * non-empty slot of a higher level has to be cascaded, 0 if the wheel
+ * is empty.
+ */
+static uint64_t wheel_next_tick(void)
+{
+	uint64_t next = 0;
+	unsigned int level;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		unsigned int shift = WHEEL_BITS * level;
+		uint64_t base = wheel->current >> shift;
+		uint64_t tick;
+
+		if (!wheel->bitmap[level])
+			continue;
+
+		tick = (base + 1 + first_bit_after(wheel->bitmap[level],
+						base & WHEEL_MASK)) << shift;
+
+		if (!next || tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+static void wheel_arm(void)
+{
+	struct itimerspec itimer;
+	uint64_t next;
+
+	next = wheel_next_tick();
+	if (next == wheel->armed)
+		return;
+
+	memset(&itimer, 0, sizeof(itimer));
+
+	if (next) {
+		itimer.it_value.tv_sec = next / 1000;
+		itimer.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(wheel->fd, TFD_TIMER_ABSTIME, &itimer, NULL) < 0)
+		return;
+
+	wheel->armed = next;
+}
+
+static void wheel_cascade(unsigned int level)
+{
+	struct timeout_slot list;
+	unsigned int index;
+
+	index = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+	slot_move(&list, &wheel->slots[level][index]);
+	wheel->bitmap[level] &= ~(1ULL << index);
+
+	while (!slot_empty(&list)) {
+		struct timeout_data *data = list.next;
+
+		list.next = data->next;
+		data->next->prev = slot_head(&list);
+
+		wheel_insert(data);
+	}
+}
+
+static void free_id(unsigned int id)
+{
+	unsigned int index = (id & ID_INDEX_MASK) - 1;
+
+	wheel->table[index] = NULL;
+	wheel->generation[index] = (wheel->generation[index] + 1) & ID_GEN_MASK;
+	wheel->free_index[wheel->free_count++] = index;
+}
+
+static void timeout_free(struct timeout_data *data)
+{
+	free_id(data->id);
+	wheel->count--;
 
 	if (data->destroy)
 		data->destroy(data->user_data);
@@ -52,34 +277,258 @@ static void timeout_destroy(void *user_data)
 	free(data);
 }
 
+static void wheel_expire(struct timeout_slot *list)
+{
+	while (!slot_empty(list)) {
+		struct timeout_data *data = list->next;
+		bool again;
+
+		wheel_unlink(data);
+
+		data->running = true;
+		again = data->func(data->user_data);
+		data->running = false;
+
+		if (data->removed || !again) {
+			timeout_free(data);
+			continue;
+		}
+
+		data->expires = get_now() + (data->timeout ? data->timeout : 1);
+		wheel_insert(data);
+	}
+}
+
+static void wheel_advance(void)
+{
+	uint64_t now = get_now();
+
+	while (wheel->current < now) {
+		struct timeout_slot list;
+		uint64_t next;
+		unsigned int level, index;
+
+		next = wheel_next_tick();
+		if (!next || next > now) {
+			wheel->current = now;
+			break;
+		}
+
+		wheel->current = next;
+
+		for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if (!(next & ((1ULL << (WHEEL_BITS * level)) - 1)))
+				wheel_cascade(level);
+		}
+
+		index = next & WHEEL_MASK;
+
+		slot_move(&list, &wheel->slots[0][index]);
+		wheel->bitmap[0] &= ~(1ULL << index);
+
+		/*
+		 * Run the expired timeouts from a detached list so that
+		 * callbacks can freely add and remove timeouts. Removing
+		 * the last entry of the detached list must not touch the
+		 * bitmap of the wheel slot it came from.
+		 */
+		wheel_expire(&list);
+	}
+}
+
+static void wheel_callback(int fd, uint32_t events, void *user_data)
+{
+	uint64_t expired;
+
+	if (events & (EPOLLERR | EPOLLHUP))
+		return;
+
+	if (read(fd, &expired, sizeof(expired)) < 0)
+		return;
+
+	wheel->armed = 0;
+
+	wheel_advance();
+	wheel_arm();
+}
+
+static void wheel_destroy(void *user_data)
+{
+	struct timeout_wheel *w = user_data;
+	unsigned int i;
+
+	wheel = NULL;
+
+	for (i = 0; i < w->table_size; i++) {
+		struct timeout_data *data = w->table[i];
+
+		if (!data)
+			continue;
+
+		if (data->destroy)
+			data->destroy(data->user_data);
+
+		free(data);
+	}
+
+	close(w->fd);
+	free(w->table);
+	free(w->generation);
+	free(w->free_index);
+	free(w);
+}
+
+static bool wheel_create(void)
+{
+	unsigned int level, index;
+
+	wheel = new0(struct timeout_wheel, 1);
+	if (!wheel)
+		return false;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		for (index = 0; index < WHEEL_SIZE; index++)
+			slot_init(&wheel->slots[level][index]);
+	}
+
+	wheel->current = get_now();
+
+	wheel->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->fd < 0)
+		goto failed;
+
+	if (mainloop_add_fd(wheel->fd, EPOLLIN, wheel_callback, wheel,
+							wheel_destroy) < 0) {
+		close(wheel->fd);
+		goto failed;
+	}
+
+	return true;
+
+failed:
+	free(wheel);
+	wheel = NULL;
+	return false;
+}
+
+static bool alloc_id(struct timeout_data *data)
+{
+	unsigned int index;
+
+	if (!wheel->free_count) {
+		unsigned int size = wheel->table_size ? wheel->table_size * 2 :
+									64;
+		struct timeout_data **table;
+		unsigned int *generation, *free_index;
+
+		if (size > ID_INDEX_MASK)
+			return false;
+
+		table = realloc(wheel->table, size * sizeof(*table));
+		if (!table)
+			return false;
+
+		wheel->table = table;
+
+		generation = realloc(wheel->generation,
+						size * sizeof(*generation));
+		if (!generation)
+			return false;
+
+		wheel->generation = generation;
+
+		free_index = realloc(wheel->free_index,
+						size * sizeof(*free_index));
+		if (!free_index)
+			return false;
+
+		wheel->free_index = free_index;
+
+		for (index = wheel->table_size; index < size; index++) {
+			table[index] = NULL;
+			generation[index] = 0;
+		}
+
+		/* Hand out the lower indexes first */
+		for (index = size; index > wheel->table_size; index--)
+			free_index[wheel->free_count++] = index - 1;
+
+		wheel->table_size = size;
+	}
+
+	index = wheel->free_index[--wheel->free_count];
+
+	wheel->table[index] = data;
+	data->id = (wheel->generation[index] << ID_INDEX_BITS) | (index + 1);
+
+	return true;
+}
+
+static struct timeout_data *lookup_id(unsigned int id)
+{
+	unsigned int index = (id & ID_INDEX_MASK) - 1;
+	struct timeout_data *data;
+
+	if (!wheel || !(id & ID_INDEX_MASK) || index >= wheel->table_size)
+		return NULL;
+
+	data = wheel->table[index];
+	if (!data || data->id != id)
+		return NULL;
+
+	return data;
+}
+
 unsigned int timeout_add(unsigned int timeout, timeout_func_t func,
 			void *user_data, timeout_destroy_func_t destroy)
 {
 	struct timeout_data *data;
 
+	if (!func)
+		return 0;
+
+	if (!wheel && !wheel_create())
+		return 0;
+
 	data = new0(struct timeout_data, 1);
 	if (!data)
 		return 0;
 
+	if (!alloc_id(data)) {
+		free(data);
+		return 0;
+	}
+
 	data->func = func;
 	data->user_data = user_data;
 	data->timeout = timeout;
 	data->destroy = destroy;
+	data->expires = get_now() + (timeout ? timeout : 1);
 
-	data->id = mainloop_add_timeout(timeout, timeout_callback, data,
-							timeout_destroy);
-	if (data->id < 0) {
-		free(data);
-		return 0;
-	}
+	/* Catch up with the clock if nothing was pending */
+	if (!wheel->count++)
+		wheel->current = get_now();
+
+	wheel_insert(data);
+	wheel_arm();
 
-	return (unsigned int) data->id;
+	return data->id;
 }
 
 void timeout_remove(unsigned int id)
 {
-	if (!id)
+	struct timeout_data *data;
+
+	data = lookup_id(id);
+	if (!data || data->removed)
 		return;
 
-	mainloop_remove_timeout((int) id);
+	/* Freed by wheel_expire once the callback returns */
+	if (data->running) {
+		data->removed = true;
+		return;
+	}
+
+	wheel_unlink(data);
+	timeout_free(data);
 }
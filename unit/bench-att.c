@@ -0,0 +1,133 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "src/shared/util.h"
+#include "src/shared/att.h"
+#include "unit/bench.h"
+
+static struct bt_att *server;
+static struct bt_att *client;
+
+static unsigned int received;
+static unsigned int expected;
+
+static const uint8_t value[] = { 0x01, 0x00, 0xde, 0xad, 0xbe, 0xef,
+					0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
+
+static void wait_for(unsigned int count)
+{
+	expected = count;
+
+	while (received < expected)
+		g_main_context_iteration(NULL, TRUE);
+}
+
+static void notify_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	received++;
+}
+
+static void bench_notify(unsigned int iterations, const void *data)
+{
+	unsigned int i;
+
+	received = 0;
+
+	for (i = 0; i < iterations; i++)
+		bt_att_send(server, BT_ATT_OP_HANDLE_VAL_NOT, value,
+					sizeof(value), NULL, NULL, NULL);
+
+	wait_for(iterations);
+}
+
+static void read_req_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	bt_att_send(server, BT_ATT_OP_READ_RSP, value + 2, sizeof(value) - 2,
+							NULL, NULL, NULL);
+}
+
+static void read_rsp_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	received++;
+
+	if (received < expected)
+		bt_att_send(client, BT_ATT_OP_READ_REQ, value, 2,
+						read_rsp_cb, NULL, NULL);
+}
+
+static void bench_read_request(unsigned int iterations, const void *data)
+{
+	received = 0;
+	expected = iterations;
+
+	bt_att_send(client, BT_ATT_OP_READ_REQ, value, 2, read_rsp_cb,
+								NULL, NULL);
+
+	wait_for(iterations);
+}
+
+int main(int argc, char *argv[])
+{
+	int fds[2];
+
+	bench_init(&argc, &argv);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		return EXIT_FAILURE;
+
+	server = bt_att_new(fds[0]);
+	client = bt_att_new(fds[1]);
+	if (!server || !client)
+		return EXIT_FAILURE;
+
+	bt_att_set_close_on_unref(server, true);
+	bt_att_set_close_on_unref(client, true);
+
+	bt_att_register(client, BT_ATT_OP_HANDLE_VAL_NOT, notify_cb,
+								NULL, NULL);
+	bt_att_register(server, BT_ATT_OP_READ_REQ, read_req_cb, NULL, NULL);
+
+	bench_add("att/notify", bench_notify, NULL);
+	bench_add("att/read_request", bench_read_request, NULL);
+
+	bench_run();
+
+	bt_att_unref(client);
+	bt_att_unref(server);
+
+	return EXIT_SUCCESS;
+}
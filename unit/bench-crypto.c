@@ -0,0 +1,96 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "src/shared/crypto.h"
+#include "unit/bench.h"
+
+static struct bt_crypto *crypto;
+
+static const uint8_t key[] = {
+	0x3c, 0x4f, 0xcf, 0x09, 0x88, 0x15, 0xf7, 0xab, 0xa6, 0xd2, 0xae, 0x28,
+	0x16, 0x15, 0x7e, 0x2b
+};
+
+static const uint8_t msg[] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11,
+	0x73, 0x93, 0x17, 0x2a
+};
+
+static void bench_e(unsigned int iterations, const void *data)
+{
+	uint8_t res[16];
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++)
+		bt_crypto_e(crypto, key, msg, res);
+}
+
+static void bench_ah(unsigned int iterations, const void *data)
+{
+	uint8_t r[3] = { 0x70, 0x81, 0x94 };
+	uint8_t hash[3];
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++)
+		bt_crypto_ah(crypto, key, r, hash);
+}
+
+static void bench_sign_att(unsigned int iterations, const void *data)
+{
+	uint8_t signature[12];
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++)
+		bt_crypto_sign_att(crypto, key, msg, sizeof(msg), i,
+								signature);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	bench_init(&argc, &argv);
+
+	crypto = bt_crypto_new();
+	if (!crypto) {
+		bench_skip("crypto/*", "kernel crypto interface not available");
+		return bench_run();
+	}
+
+	bench_add("crypto/e", bench_e, NULL);
+	bench_add("crypto/ah", bench_ah, NULL);
+	bench_add("crypto/sign_att", bench_sign_att, NULL);
+
+	ret = bench_run();
+
+	bt_crypto_unref(crypto);
+
+	return ret;
+}
@@ -0,0 +1,95 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/hci.h"
+#include "lib/sdp.h"
+
+#include "src/eir.h"
+#include "unit/bench.h"
+
+static const uint8_t adv_data[] = {
+	0x02, 0x01, 0x06,
+	0x0b, 0x09, 'B', 'l', 'u', 'e', 'Z', ' ', 'B', 'e', 'n', 'c',
+	0x07, 0x03, 0x0d, 0x18, 0x0f, 0x18, 0x0a, 0x18,
+	0x02, 0x0a, 0x04,
+	0x07, 0xff, 0x4c, 0x00, 0x01, 0x02, 0x03, 0x04,
+};
+
+static const uint8_t eir_data[] = {
+	0x17, 0x09, 0x4d, 0x61, 0x72, 0x63, 0x65, 0x6c,
+	0xe2, 0x80, 0x99, 0x73, 0x20, 0x4d, 0x61, 0x63,
+	0x42, 0x6f, 0x6f, 0x6b, 0x20, 0x41, 0x69, 0x72,
+	0x11, 0x03, 0x12, 0x11, 0x0c, 0x11, 0x0a, 0x11,
+	0x1f, 0x11, 0x01, 0x11, 0x00, 0x10, 0x0a, 0x11,
+	0x17, 0x11, 0x11, 0xff, 0x4c, 0x00, 0x01, 0x4d,
+	0x61, 0x63, 0x42, 0x6f, 0x6f, 0x6b, 0x41, 0x69,
+	0x72, 0x33, 0x2c, 0x31, 0x00, 0x00, 0x00, 0x00,
+};
+
+struct eir_fixture {
+	const uint8_t *data;
+	uint8_t len;
+};
+
+static const struct eir_fixture adv_fixture = {
+	.data = adv_data,
+	.len = sizeof(adv_data),
+};
+
+static const struct eir_fixture eir_fixture = {
+	.data = eir_data,
+	.len = sizeof(eir_data),
+};
+
+static void bench_parse(unsigned int iterations, const void *data)
+{
+	const struct eir_fixture *fixture = data;
+	struct eir_data eir;
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		memset(&eir, 0, sizeof(eir));
+		eir_parse(&eir, fixture->data, fixture->len);
+		eir_data_free(&eir);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	bench_init(&argc, &argv);
+
+	bench_add("eir/parse_adv", bench_parse, &adv_fixture);
+	bench_add("eir/parse_eir", bench_parse, &eir_fixture);
+
+	return bench_run();
+}
@@ -0,0 +1,187 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "src/shared/att.h"
+#include "src/shared/queue.h"
+#include "src/shared/gatt-db.h"
+#include "unit/bench.h"
+
+#define NUM_SERVICES	100
+#define NUM_CHRCS	4
+
+static struct gatt_db *db;
+static uint16_t last_handle;
+
+static struct gatt_db *create_db(void)
+{
+	struct gatt_db *db;
+	bt_uuid_t uuid, ccc;
+	unsigned int i, j;
+
+	db = gatt_db_new();
+	if (!db)
+		return NULL;
+
+	bt_uuid16_create(&ccc, GATT_CLIENT_CHARAC_CFG_UUID);
+
+	for (i = 0; i < NUM_SERVICES; i++) {
+		struct gatt_db_attribute *service;
+
+		bt_uuid16_create(&uuid, 0x1800 + i);
+		service = gatt_db_add_service(db, &uuid, true,
+							1 + NUM_CHRCS * 3);
+		if (!service)
+			break;
+
+		for (j = 0; j < NUM_CHRCS; j++) {
+			struct gatt_db_attribute *attr;
+
+			bt_uuid16_create(&uuid, 0x2a00 + j);
+			attr = gatt_db_service_add_characteristic(service,
+						&uuid, BT_ATT_PERM_READ,
+						BT_GATT_CHRC_PROP_READ |
+						BT_GATT_CHRC_PROP_NOTIFY,
+						NULL, NULL, NULL);
+			gatt_db_service_add_descriptor(service, &ccc,
+						BT_ATT_PERM_READ |
+						BT_ATT_PERM_WRITE,
+						NULL, NULL, NULL);
+
+			last_handle = gatt_db_attribute_get_handle(attr) + 1;
+		}
+
+		gatt_db_service_set_active(service, true);
+	}
+
+	return db;
+}
+
+static void bench_get_attribute(unsigned int iterations, const void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++)
+		gatt_db_get_attribute(db, i % last_handle + 1);
+}
+
+static void bench_read_by_group_type(unsigned int iterations,
+							const void *data)
+{
+	struct queue *q = queue_new();
+	bt_uuid_t uuid;
+	unsigned int i;
+
+	bt_uuid16_create(&uuid, GATT_PRIM_SVC_UUID);
+
+	for (i = 0; i < iterations; i++) {
+		gatt_db_read_by_group_type(db, 0x0001, 0xffff, uuid, q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+
+	queue_destroy(q, NULL);
+}
+
+static void bench_read_by_type(unsigned int iterations, const void *data)
+{
+	struct queue *q = queue_new();
+	bt_uuid_t uuid;
+	unsigned int i;
+
+	bt_uuid16_create(&uuid, GATT_CHARAC_UUID);
+
+	for (i = 0; i < iterations; i++) {
+		gatt_db_read_by_type(db, 0x0001, 0xffff, uuid, q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+
+	queue_destroy(q, NULL);
+}
+
+static void count_attribute(struct gatt_db_attribute *attrib,
+							void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static void bench_find_by_type(unsigned int iterations, const void *data)
+{
+	unsigned int i, count = 0;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+
+	for (i = 0; i < iterations; i++)
+		gatt_db_find_by_type(db, 0x0001, 0xffff, &uuid,
+						count_attribute, &count);
+}
+
+static void bench_find_information(unsigned int iterations, const void *data)
+{
+	struct queue *q = queue_new();
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		uint16_t start = i % last_handle + 1;
+
+		gatt_db_find_information(db, start, start + 8, q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+
+	queue_destroy(q, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	bench_init(&argc, &argv);
+
+	db = create_db();
+	if (!db)
+		return EXIT_FAILURE;
+
+	bench_add("gatt-db/get_attribute", bench_get_attribute, NULL);
+	bench_add("gatt-db/read_by_group_type", bench_read_by_group_type,
+									NULL);
+	bench_add("gatt-db/read_by_type", bench_read_by_type, NULL);
+	bench_add("gatt-db/find_by_type", bench_find_by_type, NULL);
+	bench_add("gatt-db/find_information", bench_find_information, NULL);
+
+	ret = bench_run();
+
+	gatt_db_unref(db);
+
+	return ret;
+}
@@ -0,0 +1,151 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "unit/bench.h"
+
+#define QUEUE_DEPTH 64
+
+static bool match_uint(const void *a, const void *b)
+{
+	return PTR_TO_UINT(a) == PTR_TO_UINT(b);
+}
+
+static void bench_push_pop(unsigned int iterations, const void *data)
+{
+	struct queue *queue = queue_new();
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		queue_push_tail(queue, UINT_TO_PTR(i + 1));
+		queue_pop_head(queue);
+	}
+
+	queue_destroy(queue, NULL);
+}
+
+static void bench_push_pop_burst(unsigned int iterations, const void *data)
+{
+	struct queue *queue = queue_new();
+	unsigned int i, n;
+
+	for (i = 0; i < iterations; i += QUEUE_DEPTH) {
+		for (n = 0; n < QUEUE_DEPTH; n++)
+			queue_push_tail(queue, UINT_TO_PTR(n + 1));
+
+		for (n = 0; n < QUEUE_DEPTH; n++)
+			queue_pop_head(queue);
+	}
+
+	queue_destroy(queue, NULL);
+}
+
+static void bench_find(unsigned int iterations, const void *data)
+{
+	struct queue *queue = queue_new();
+	unsigned int i;
+
+	bench_pause();
+
+	for (i = 0; i < QUEUE_DEPTH; i++)
+		queue_push_tail(queue, UINT_TO_PTR(i + 1));
+
+	bench_resume();
+
+	for (i = 0; i < iterations; i++)
+		queue_find(queue, match_uint, UINT_TO_PTR(i % QUEUE_DEPTH + 1));
+
+	bench_pause();
+	queue_destroy(queue, NULL);
+	bench_resume();
+}
+
+static void count_entry(void *data, void *user_data)
+{
+	unsigned int *count = user_data;
+
+	(*count)++;
+}
+
+static void bench_foreach(unsigned int iterations, const void *data)
+{
+	struct queue *queue = queue_new();
+	unsigned int i, count = 0;
+
+	bench_pause();
+
+	for (i = 0; i < QUEUE_DEPTH; i++)
+		queue_push_tail(queue, UINT_TO_PTR(i + 1));
+
+	bench_resume();
+
+	for (i = 0; i < iterations; i++)
+		queue_foreach(queue, count_entry, &count);
+
+	bench_pause();
+	queue_destroy(queue, NULL);
+	bench_resume();
+}
+
+struct list_item {
+	unsigned int value;
+	struct queue_link link;
+};
+
+static void bench_list_push_pop(unsigned int iterations, const void *data)
+{
+	struct list_item items[QUEUE_DEPTH];
+	struct queue_list list;
+	unsigned int i, n;
+
+	queue_list_init(&list);
+
+	for (i = 0; i < iterations; i += QUEUE_DEPTH) {
+		for (n = 0; n < QUEUE_DEPTH; n++)
+			queue_list_push_tail(&list, &items[n].link);
+
+		for (n = 0; n < QUEUE_DEPTH; n++)
+			queue_list_pop_head(&list);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	bench_init(&argc, &argv);
+
+	bench_add("queue/push_pop", bench_push_pop, NULL);
+	bench_add("queue/push_pop_burst", bench_push_pop_burst, NULL);
+	bench_add("queue/find", bench_find, NULL);
+	bench_add("queue/foreach", bench_foreach, NULL);
+	bench_add("queue/list_push_pop", bench_list_push_pop, NULL);
+
+	return bench_run();
+}
@@ -0,0 +1,89 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "src/shared/ringbuf.h"
+#include "unit/bench.h"
+
+#define RINGBUF_SIZE 4096
+
+static void bench_printf_drain(unsigned int iterations, const void *data)
+{
+	struct ringbuf *ringbuf = ringbuf_new(RINGBUF_SIZE);
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		int len;
+
+		len = ringbuf_printf(ringbuf, "AT+CIND=%u,%u\r\n", i, i % 7);
+		ringbuf_drain(ringbuf, len);
+	}
+
+	ringbuf_free(ringbuf);
+}
+
+static void bench_read_write(unsigned int iterations, const void *data)
+{
+	struct ringbuf *ringbuf = ringbuf_new(RINGBUF_SIZE);
+	int in, out;
+	unsigned int i;
+
+	bench_pause();
+
+	in = open("/dev/zero", O_RDONLY | O_CLOEXEC);
+	out = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	bench_resume();
+
+	for (i = 0; i < iterations; i++) {
+		ringbuf_read(ringbuf, in);
+		ringbuf_write(ringbuf, out);
+	}
+
+	bench_pause();
+
+	close(in);
+	close(out);
+
+	bench_resume();
+
+	ringbuf_free(ringbuf);
+}
+
+int main(int argc, char *argv[])
+{
+	bench_init(&argc, &argv);
+
+	bench_add("ringbuf/printf_drain", bench_printf_drain, NULL);
+	bench_add("ringbuf/read_write", bench_read_write, NULL);
+
+	return bench_run();
+}
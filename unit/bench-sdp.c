@@ -0,0 +1,140 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lib/bluetooth.h"
+#include "lib/sdp.h"
+#include "lib/sdp_lib.h"
+
+#include "unit/bench.h"
+
+static sdp_record_t *record;
+static sdp_buf_t pdu;
+
+static sdp_record_t *create_serial_record(void)
+{
+	sdp_list_t *svclass, *pfseq, *apseq, *root, *aproto;
+	sdp_list_t *proto[2];
+	uuid_t root_uuid, l2cap, rfcomm, svc;
+	sdp_profile_desc_t profile;
+	sdp_data_t *channel;
+	sdp_record_t *rec;
+	uint8_t ch = 1;
+
+	rec = sdp_record_alloc();
+	if (!rec)
+		return NULL;
+
+	sdp_uuid16_create(&root_uuid, PUBLIC_BROWSE_GROUP);
+	root = sdp_list_append(NULL, &root_uuid);
+	sdp_set_browse_groups(rec, root);
+
+	sdp_uuid16_create(&svc, SERIAL_PORT_SVCLASS_ID);
+	svclass = sdp_list_append(NULL, &svc);
+	sdp_set_service_classes(rec, svclass);
+
+	sdp_uuid16_create(&profile.uuid, SERIAL_PORT_PROFILE_ID);
+	profile.version = 0x0100;
+	pfseq = sdp_list_append(NULL, &profile);
+	sdp_set_profile_descs(rec, pfseq);
+
+	sdp_uuid16_create(&l2cap, L2CAP_UUID);
+	proto[0] = sdp_list_append(NULL, &l2cap);
+	apseq = sdp_list_append(NULL, proto[0]);
+
+	sdp_uuid16_create(&rfcomm, RFCOMM_UUID);
+	proto[1] = sdp_list_append(NULL, &rfcomm);
+	channel = sdp_data_alloc(SDP_UINT8, &ch);
+	proto[1] = sdp_list_append(proto[1], channel);
+	apseq = sdp_list_append(apseq, proto[1]);
+
+	aproto = sdp_list_append(NULL, apseq);
+	sdp_set_access_protos(rec, aproto);
+
+	sdp_add_lang_attr(rec);
+	sdp_set_info_attr(rec, "Serial Port", "BlueZ", "COM Port");
+
+	sdp_data_free(channel);
+	sdp_list_free(proto[0], NULL);
+	sdp_list_free(proto[1], NULL);
+	sdp_list_free(apseq, NULL);
+	sdp_list_free(aproto, NULL);
+	sdp_list_free(pfseq, NULL);
+	sdp_list_free(svclass, NULL);
+	sdp_list_free(root, NULL);
+
+	return rec;
+}
+
+static void bench_extract_pdu(unsigned int iterations, const void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		sdp_record_t *rec;
+		int scanned;
+
+		rec = sdp_extract_pdu(pdu.data, pdu.data_size, &scanned);
+		sdp_record_free(rec);
+	}
+}
+
+static void bench_gen_record_pdu(unsigned int iterations, const void *data)
+{
+	unsigned int i;
+
+	for (i = 0; i < iterations; i++) {
+		sdp_buf_t buf;
+
+		sdp_gen_record_pdu(record, &buf);
+		free(buf.data);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int ret;
+
+	bench_init(&argc, &argv);
+
+	record = create_serial_record();
+	if (!record || sdp_gen_record_pdu(record, &pdu) < 0)
+		return EXIT_FAILURE;
+
+	bench_add("sdp/extract_pdu", bench_extract_pdu, NULL);
+	bench_add("sdp/gen_record_pdu", bench_gen_record_pdu, NULL);
+
+	ret = bench_run();
+
+	free(pdu.data);
+	sdp_record_free(record);
+
+	return ret;
+}
@@ -0,0 +1,261 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "unit/bench.h"
+
+#define DEFAULT_MIN_TIME_MS	200
+#define MAX_ITERATIONS		(1U << 30)
+
+struct bench {
+	const char *name;
+	bench_func_t func;
+	const void *data;
+	const char *skip;
+};
+
+static struct queue *bench_list;
+static const char *filter;
+static unsigned int min_time_ms = DEFAULT_MIN_TIME_MS;
+static bool csv;
+
+/*
+ * Allocation accounting: the program wide allocator entry points are
+ * wrapped so that every allocation done by the code under test while a
+ * run is being timed gets counted.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static bool counting;
+static uint64_t alloc_count;
+
+void *malloc(size_t size)
+{
+	if (counting)
+		alloc_count++;
+
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (counting)
+		alloc_count++;
+
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (counting)
+		alloc_count++;
+
+	return __libc_realloc(ptr, size);
+}
+
+static uint64_t paused_ns;
+static uint64_t pause_start;
+
+static uint64_t get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void bench_pause(void)
+{
+	counting = false;
+	pause_start = get_ns();
+}
+
+void bench_resume(void)
+{
+	paused_ns += get_ns() - pause_start;
+	counting = true;
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+		"Options:\n"
+		"\t-c, --csv              Print machine readable output\n"
+		"\t-t, --time <ms>        Minimum run time per benchmark\n"
+		"\t-f, --filter <string>  Only run matching benchmarks\n"
+		"\t-h, --help             Show help options\n", prog);
+}
+
+static const struct option options[] = {
+	{ "csv",	no_argument,		NULL, 'c' },
+	{ "time",	required_argument,	NULL, 't' },
+	{ "filter",	required_argument,	NULL, 'f' },
+	{ "help",	no_argument,		NULL, 'h' },
+	{ }
+};
+
+void bench_init(int *argc, char ***argv)
+{
+	for (;;) {
+		int opt;
+
+		opt = getopt_long(*argc, *argv, "ct:f:h", options, NULL);
+		if (opt < 0)
+			break;
+
+		switch (opt) {
+		case 'c':
+			csv = true;
+			break;
+		case 't':
+			min_time_ms = atoi(optarg);
+			if (!min_time_ms)
+				min_time_ms = DEFAULT_MIN_TIME_MS;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'h':
+			usage((*argv)[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage((*argv)[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bench_list = queue_new();
+}
+
+static void add_bench(const char *name, bench_func_t func, const void *data,
+							const char *skip)
+{
+	struct bench *bench;
+
+	if (filter && !strstr(name, filter))
+		return;
+
+	bench = new0(struct bench, 1);
+	if (!bench)
+		return;
+
+	bench->name = name;
+	bench->func = func;
+	bench->data = data;
+	bench->skip = skip;
+
+	queue_push_tail(bench_list, bench);
+}
+
+void bench_add(const char *name, bench_func_t func, const void *data)
+{
+	add_bench(name, func, data, NULL);
+}
+
+void bench_skip(const char *name, const char *reason)
+{
+	add_bench(name, NULL, NULL, reason);
+}
+
+static uint64_t run_once(struct bench *bench, unsigned int iterations,
+							uint64_t *allocs)
+{
+	uint64_t start, elapsed;
+
+	alloc_count = 0;
+	paused_ns = 0;
+
+	counting = true;
+	start = get_ns();
+
+	bench->func(iterations, bench->data);
+
+	elapsed = get_ns() - start;
+	counting = false;
+
+	*allocs = alloc_count;
+
+	return elapsed - paused_ns;
+}
+
+static void run_bench(void *data, void *user_data)
+{
+	struct bench *bench = data;
+	unsigned int iterations = 1;
+	uint64_t elapsed, allocs;
+	double ns_per_op, allocs_per_op, ops_per_sec;
+
+	if (bench->skip) {
+		if (!csv)
+			printf("%-40s skipped (%s)\n", bench->name, bench->skip);
+		return;
+	}
+
+	for (;;) {
+		elapsed = run_once(bench, iterations, &allocs);
+
+		if (elapsed >= (uint64_t) min_time_ms * 1000000 ||
+						iterations >= MAX_ITERATIONS)
+			break;
+
+		iterations *= 2;
+	}
+
+	ns_per_op = (double) elapsed / iterations;
+	allocs_per_op = (double) allocs / iterations;
+	ops_per_sec = ns_per_op > 0 ? 1000000000.0 / ns_per_op : 0;
+
+	if (csv)
+		printf("%s,%u,%.1f,%.2f,%.0f\n", bench->name, iterations,
+					ns_per_op, allocs_per_op, ops_per_sec);
+	else
+		printf("%-40s %12.1f ns/op %8.2f allocs/op %14.0f ops/s\n",
+					bench->name, ns_per_op, allocs_per_op,
+					ops_per_sec);
+
+	fflush(stdout);
+}
+
+int bench_run(void)
+{
+	queue_foreach(bench_list, run_bench, NULL);
+	queue_destroy(bench_list, free);
+	bench_list = NULL;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+
+/*
+ * A benchmark function has to perform the measured operation exactly
+ * iterations times. The harness keeps doubling iterations until a run
+ * takes at least the configured minimum time and reports that run.
+ *
+ * With --csv every result is printed as one line of
+ *   name,iterations,ns_per_op,allocs_per_op,ops_per_sec
+ */
+typedef void (*bench_func_t)(unsigned int iterations, const void *data);
+
+void bench_init(int *argc, char ***argv);
+void bench_add(const char *name, bench_func_t func, const void *data);
+void bench_skip(const char *name, const char *reason);
+int bench_run(void);
+
+void bench_pause(void);
+void bench_resume(void);
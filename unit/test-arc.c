@@ -0,0 +1,428 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2026  Morse Project. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "profiles/arc/arc.h"
+
+struct id_data {
+	const char *header;
+	int result;
+	uint32_t reqid;
+};
+
+static const struct id_data id_none = {
+	.header = "hello",
+	.result = 0,
+};
+
+static const struct id_data id_empty = {
+	.header = "",
+	.result = 0,
+};
+
+static const struct id_data id_valid = {
+	.header = "\xfd" "42:hello",
+	.result = 4,
+	.reqid = 42,
+};
+
+static const struct id_data id_max = {
+	.header = "\xfd" "4294967295:",
+	.result = 12,
+	.reqid = 4294967295U,
+};
+
+static const struct id_data id_overflow = {
+	.header = "\xfd" "4294967296:",
+	.result = -1,
+};
+
+static const struct id_data id_overflow_long = {
+	.header = "\xfd" "99999999999999999999999:",
+	.result = -1,
+};
+
+static const struct id_data id_zero = {
+	.header = "\xfd" "0:",
+	.result = -1,
+};
+
+static const struct id_data id_no_digits = {
+	.header = "\xfd" ":hello",
+	.result = -1,
+};
+
+static const struct id_data id_no_colon = {
+	.header = "\xfd" "42hello",
+	.result = -1,
+};
+
+static const struct id_data id_truncated = {
+	.header = "\xfd" "42",
+	.result = -1,
+};
+
+static const struct id_data id_marker_only = {
+	.header = "\xfd",
+	.result = -1,
+};
+
+static void test_parse_id(gconstpointer data)
+{
+	const struct id_data *test_data = data;
+	uint32_t reqid = 1;
+	int result;
+
+	result = arc_blurb_parse_id((const uint8_t *) test_data->header,
+					strlen(test_data->header), &reqid);
+
+	if (g_test_verbose())
+		g_print("Result: %d, request-id: %u\n", result, reqid);
+
+	g_assert_cmpint(result, ==, test_data->result);
+	g_assert_cmpuint(reqid, ==, test_data->reqid);
+}
+
+static void test_append_id(void)
+{
+	static const uint32_t ids[] = { 1, 42, 4294967295U };
+	GByteArray *buf;
+	uint32_t reqid;
+	unsigned int i;
+	int len;
+
+	buf = g_byte_array_new();
+
+	arc_blurb_append_id(buf, 0);
+	g_assert_cmpuint(buf->len, ==, 0);
+
+	for (i = 0; i < G_N_ELEMENTS(ids); i++) {
+		g_byte_array_set_size(buf, 0);
+		arc_blurb_append_id(buf, ids[i]);
+		g_byte_array_append(buf, (const uint8_t *) "x", 1);
+
+		len = arc_blurb_parse_id(buf->data, buf->len, &reqid);
+		g_assert_cmpint(len, ==, (int) buf->len - 1);
+		g_assert_cmpuint(reqid, ==, ids[i]);
+	}
+
+	g_byte_array_unref(buf);
+}
+
+static void check_roundtrip(const uint8_t *data, size_t len)
+{
+	GByteArray *packed, *unpacked;
+
+	packed = arc_compress(data, len);
+	g_assert(packed);
+
+	if (g_test_verbose())
+		g_print("Compressed %zu bytes to %u\n", len, packed->len);
+
+	unpacked = arc_decompress(packed->data, packed->len, len);
+	g_assert(unpacked);
+	g_assert_cmpuint(unpacked->len, ==, len);
+	g_assert(len == 0 || memcmp(unpacked->data, data, len) == 0);
+
+	/* one byte less room than needed is not enough */
+	if (len > 0)
+		g_assert(!arc_decompress(packed->data, packed->len, len - 1));
+
+	g_byte_array_unref(unpacked);
+	g_byte_array_unref(packed);
+}
+
+static void test_roundtrip_empty(void)
+{
+	GByteArray *packed;
+
+	packed = arc_compress(NULL, 0);
+	g_assert_cmpuint(packed->len, ==, 0);
+	g_byte_array_unref(packed);
+
+	check_roundtrip(NULL, 0);
+}
+
+static void test_roundtrip_text(void)
+{
+	static const char text[] = "{\"method\":\"GetStatus\",\"params\":"
+				"{\"player\":\"main\",\"status\":\"main\"}}";
+
+	check_roundtrip((const uint8_t *) text, 2);
+	check_roundtrip((const uint8_t *) text, 3);
+	check_roundtrip((const uint8_t *) text, strlen(text));
+}
+
+static void test_roundtrip_runs(void)
+{
+	uint8_t buf[1000];
+	GByteArray *packed;
+
+	/* longer than a single match can be */
+	memset(buf, 'a', sizeof(buf));
+
+	packed = arc_compress(buf, sizeof(buf));
+	g_assert_cmpuint(packed->len, <, sizeof(buf) / 10);
+	g_byte_array_unref(packed);
+
+	check_roundtrip(buf, sizeof(buf));
+	check_roundtrip(buf, 4);
+}
+
+static void test_roundtrip_random(void)
+{
+	uint8_t buf[70000];
+	uint32_t seed = 1;
+	unsigned int i;
+
+	/* more literals than fit behind one control, and matches that
+	 * are too far back */
+	for (i = 0; i < sizeof(buf); i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+
+	check_roundtrip(buf, 200);
+	check_roundtrip(buf, sizeof(buf));
+
+	/* the same data twice, further apart than a distance can be */
+	memcpy(buf + 66000, buf, 4000);
+	check_roundtrip(buf, sizeof(buf));
+
+	/* a small alphabet, with lots of short matches */
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = 'a' + buf[i] % 4;
+
+	check_roundtrip(buf, sizeof(buf));
+}
+
+struct decompress_data {
+	const uint8_t *data;
+	size_t len;
+	size_t maxlen;
+	const char *result;	/* NULL if it must fail */
+};
+
+#define decompress_test(name, max, res, args...)			\
+	static const uint8_t name##_data[] = { args };			\
+	static const struct decompress_data name = {			\
+		.data = name##_data,					\
+		.len = sizeof(name##_data),				\
+		.maxlen = max,						\
+		.result = res,						\
+	}
+
+/* distance 1, copying what it writes */
+decompress_test(overlap_1, 16, "aaaaaa", 0x00, 'a', 0x82, 0x01, 0x00);
+
+/* distance 2, a longer match than there is data behind it */
+decompress_test(overlap_2, 16, "abababa", 0x01, 'a', 'b', 0x82, 0x02, 0x00);
+
+/* the distance is exactly the length of the output */
+decompress_test(dist_all, 16, "abcabc", 0x02, 'a', 'b', 'c',
+							0x80, 0x03, 0x00);
+
+decompress_test(dist_zero, 16, NULL, 0x00, 'a', 0x80, 0x00, 0x00);
+
+decompress_test(dist_past_end, 16, NULL, 0x01, 'a', 'b', 0x80, 0x03, 0x00);
+
+decompress_test(dist_far, 16, NULL, 0x00, 'a', 0x80, 0xff, 0xff);
+
+decompress_test(dist_first, 16, NULL, 0x80, 0x01, 0x00);
+
+decompress_test(literal_max, 3, "abc", 0x02, 'a', 'b', 'c');
+
+decompress_test(literal_over_max, 2, NULL, 0x02, 'a', 'b', 'c');
+
+decompress_test(match_max, 4, "aaaa", 0x00, 'a', 0x80, 0x01, 0x00);
+
+decompress_test(match_over_max, 3, NULL, 0x00, 'a', 0x80, 0x01, 0x00);
+
+decompress_test(literal_truncated, 16, NULL, 0x02, 'a', 'b');
+
+decompress_test(match_no_dist, 16, NULL, 0x00, 'a', 0x80);
+
+decompress_test(match_half_dist, 16, NULL, 0x00, 'a', 0x80, 0x01);
+
+decompress_test(ctl_only, 16, NULL, 0x00);
+
+static void test_decompress(gconstpointer data)
+{
+	const struct decompress_data *test_data = data;
+	GByteArray *out;
+
+	out = arc_decompress(test_data->data, test_data->len,
+							test_data->maxlen);
+
+	if (!test_data->result) {
+		g_assert(!out);
+		return;
+	}
+
+	g_assert(out);
+	g_assert_cmpuint(out->len, ==, strlen(test_data->result));
+	g_assert(memcmp(out->data, test_data->result, out->len) == 0);
+
+	g_byte_array_unref(out);
+}
+
+static void test_decompress_garbage(void)
+{
+	uint8_t buf[64];
+	uint32_t seed = 7;
+	GByteArray *out;
+	unsigned int i, j;
+
+	/* whatever comes in, the result stays within maxlen */
+	for (i = 0; i < 10000; i++) {
+		for (j = 0; j < sizeof(buf); j++) {
+			seed = seed * 1103515245 + 12345;
+			buf[j] = seed >> 16;
+		}
+
+		out = arc_decompress(buf, (seed >> 8) % sizeof(buf), 256);
+		if (!out)
+			continue;
+
+		g_assert_cmpuint(out->len, <=, 256);
+		g_byte_array_unref(out);
+	}
+}
+
+static void test_frame(void)
+{
+	static const uint8_t modes[] = { 0, ARC_MODE_BINARY,
+					ARC_MODE_BINARY | ARC_MODE_COMPRESS };
+	uint8_t blurb[300];
+	GByteArray *frame, *out;
+	unsigned int i;
+	size_t len;
+
+	memset(blurb, 'x', sizeof(blurb));
+
+	for (i = 0; i < G_N_ELEMENTS(modes); i++) {
+		frame = arc_blurb_frame(blurb, sizeof(blurb), modes[i]);
+
+		if (!modes[i]) {
+			g_assert_cmpuint(frame->len, ==, sizeof(blurb) + 2);
+			g_assert_cmpuint(frame->data[0], ==,
+							ARC_GATT_BLURB_PRE);
+			g_assert_cmpuint(frame->data[frame->len - 1], ==,
+							ARC_GATT_BLURB_POST);
+			g_byte_array_unref(frame);
+			continue;
+		}
+
+		g_assert_cmpuint(frame->data[0], ==, ARC_GATT_BLURB_BIN);
+
+		len = frame->data[2] | frame->data[3] << 8;
+		g_assert_cmpuint(len, ==, frame->len - ARC_BIN_HDR_LEN);
+
+		out = arc_blurb_unpack(frame->data[1],
+					frame->data + ARC_BIN_HDR_LEN, len,
+					sizeof(blurb));
+		g_assert(out);
+		g_assert_cmpuint(out->len, ==, sizeof(blurb));
+		g_assert(memcmp(out->data, blurb, sizeof(blurb)) == 0);
+		g_byte_array_unref(out);
+
+		/* flags we don't know about */
+		g_assert(!arc_blurb_unpack(frame->data[1] | 0x80,
+					frame->data + ARC_BIN_HDR_LEN, len,
+					sizeof(blurb)));
+
+		g_byte_array_unref(frame);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_data_func("/arc/id/none", &id_none, test_parse_id);
+	g_test_add_data_func("/arc/id/empty", &id_empty, test_parse_id);
+	g_test_add_data_func("/arc/id/valid", &id_valid, test_parse_id);
+	g_test_add_data_func("/arc/id/max", &id_max, test_parse_id);
+	g_test_add_data_func("/arc/id/overflow", &id_overflow, test_parse_id);
+	g_test_add_data_func("/arc/id/overflow-long", &id_overflow_long,
+								test_parse_id);
+	g_test_add_data_func("/arc/id/zero", &id_zero, test_parse_id);
+	g_test_add_data_func("/arc/id/no-digits", &id_no_digits,
+								test_parse_id);
+	g_test_add_data_func("/arc/id/no-colon", &id_no_colon, test_parse_id);
+	g_test_add_data_func("/arc/id/truncated", &id_truncated,
+								test_parse_id);
+	g_test_add_data_func("/arc/id/marker-only", &id_marker_only,
+								test_parse_id);
+	g_test_add_func("/arc/id/append", test_append_id);
+
+	g_test_add_func("/arc/compress/empty", test_roundtrip_empty);
+	g_test_add_func("/arc/compress/text", test_roundtrip_text);
+	g_test_add_func("/arc/compress/runs", test_roundtrip_runs);
+	g_test_add_func("/arc/compress/random", test_roundtrip_random);
+
+	g_test_add_data_func("/arc/decompress/overlap-1", &overlap_1,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/overlap-2", &overlap_2,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/dist-all", &dist_all,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/dist-zero", &dist_zero,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/dist-past-end", &dist_past_end,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/dist-far", &dist_far,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/dist-first", &dist_first,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/literal-max", &literal_max,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/literal-over-max",
+					&literal_over_max, test_decompress);
+	g_test_add_data_func("/arc/decompress/match-max", &match_max,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/match-over-max",
+					&match_over_max, test_decompress);
+	g_test_add_data_func("/arc/decompress/literal-truncated",
+					&literal_truncated, test_decompress);
+	g_test_add_data_func("/arc/decompress/match-no-dist", &match_no_dist,
+							test_decompress);
+	g_test_add_data_func("/arc/decompress/match-half-dist",
+					&match_half_dist, test_decompress);
+	g_test_add_data_func("/arc/decompress/ctl-only", &ctl_only,
+							test_decompress);
+	g_test_add_func("/arc/decompress/garbage", test_decompress_garbage);
+
+	g_test_add_func("/arc/frame", test_frame);
+
+	return g_test_run();
+}
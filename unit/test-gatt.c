@@ -70,6 +70,7 @@ struct test_data {
 struct context {
 	struct bt_gatt_client *client;
 	struct bt_gatt_server *server;
+	struct bt_gatt_server *prev_server;
 	struct bt_att *att;
 	struct gatt_db *client_db;
 	struct gatt_db *server_db;
@@ -79,6 +80,7 @@ struct context {
 	unsigned int pdu_offset;
 	const struct test_data *data;
 	struct bt_gatt_request *req;
+	struct peer *peer;
 };
 
 #define data(args...) ((const unsigned char[]) { args })
@@ -90,6 +92,21 @@ struct context {
 		.size = sizeof(data(args)),			\
 	}
 
+/*
+ * The PDU data are compound literals that only live as long as the block of
+ * define_test, so copy them too.
+ */
+static struct test_pdu *test_pdus_dup(const struct test_pdu *pdus, size_t size)
+{
+	struct test_pdu *copy = g_memdup(pdus, size);
+	struct test_pdu *pdu;
+
+	for (pdu = copy; pdu->valid; pdu++)
+		pdu->data = g_memdup(pdu->data, pdu->size);
+
+	return copy;
+}
+
 #define define_test(name, function, type, bt_uuid, db,			\
 		test_step, args...)					\
 	do {								\
@@ -102,7 +119,7 @@ struct context {
 		data.uuid = bt_uuid;					\
 		data.step = test_step;					\
 		data.source_db = db;					\
-		data.pdu_list = g_memdup(pdus, sizeof(pdus));		\
+		data.pdu_list = test_pdus_dup(pdus, sizeof(pdus));	\
 		tester_add(name, &data, NULL, function, NULL);		\
 	} while (0)
 
@@ -119,8 +136,13 @@ struct context {
 		raw_pdu(0x02, 0x00, 0x02),				\
 		raw_pdu(0x03, 0x00, 0x02)
 
+#define DB_HASH_CLIENT_PDUS						\
+		raw_pdu(0x08, 0x01, 0x00, 0xff, 0xff, 0x2a, 0x2b),	\
+		raw_pdu(0x01, 0x08, 0x01, 0x00, 0x0a)
+
 #define SERVICE_DATA_1_PDUS						\
 		MTU_EXCHANGE_CLIENT_PDUS,				\
+		DB_HASH_CLIENT_PDUS,					\
 		raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),	\
 		raw_pdu(0x11, 0x06, 0x01, 0x00, 0x04, 0x00, 0x01, 0x18),\
 		raw_pdu(0x10, 0x05, 0x00, 0xff, 0xff, 0x00, 0x28),	\
@@ -150,6 +172,7 @@ struct context {
 
 #define SERVICE_DATA_2_PDUS						\
 		MTU_EXCHANGE_CLIENT_PDUS,				\
+		DB_HASH_CLIENT_PDUS,					\
 		raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),	\
 		raw_pdu(0x11, 0x06, 0x01, 0x00, 0x04, 0x00, 0x01, 0x18),\
 		raw_pdu(0x10, 0x05, 0x00, 0xff, 0xff, 0x00, 0x28),	\
@@ -179,6 +202,7 @@ struct context {
 
 #define SERVICE_DATA_3_PDUS						\
 		MTU_EXCHANGE_CLIENT_PDUS,				\
+		DB_HASH_CLIENT_PDUS,					\
 		raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),	\
 		raw_pdu(0x11, 0x06, 0x00, 0x01, 0x21, 0x01, 0x00, 0x18, \
 			0x00, 0x02, 0x00, 0x02, 0x01, 0x18),		\
@@ -288,6 +312,10 @@ struct context {
 
 #define SERVER_MTU_EXCHANGE_PDU raw_pdu(0x02, 0x17, 0x00)
 
+#define PREP_WRITE_FRAGMENT_PDUS(offset)				\
+		raw_pdu(0x16, 0x03, 0x00, offset, 0x00, offset),	\
+		raw_pdu(0x17, 0x03, 0x00, offset, 0x00, offset)
+
 static bt_uuid_t uuid_16 = {
 	.type = BT_UUID16,
 	.value.u16 = 0x1800
@@ -313,8 +341,13 @@ static bt_uuid_t uuid_char_128 = {
 static void test_free(gconstpointer user_data)
 {
 	const struct test_data *data = user_data;
+	struct test_pdu *pdu;
 
 	g_free(data->test_name);
+
+	for (pdu = data->pdu_list; pdu->valid; pdu++)
+		g_free((void *) pdu->data);
+
 	g_free(data->pdu_list);
 }
 
@@ -329,8 +362,12 @@ struct test_step {
 	uint8_t expected_att_ecode;
 	const uint8_t *value;
 	uint16_t length;
+	unsigned int cache_hits;
+	struct gatt_db *(*client_db)(void);
 };
 
+static void peer_free(struct peer *peer);
+
 static void destroy_context(struct context *context)
 {
 	if (context->source > 0)
@@ -339,8 +376,11 @@ static void destroy_context(struct context *context)
 	if (context->req)
 		bt_gatt_request_unref(context->req);
 
+	peer_free(context->peer);
+
 	bt_gatt_client_unref(context->client);
 	bt_gatt_server_unref(context->server);
+	bt_gatt_server_unref(context->prev_server);
 	gatt_db_unref(context->client_db);
 	gatt_db_unref(context->server_db);
 
@@ -416,6 +456,125 @@ static void context_process(struct context *context)
 	context->process = g_idle_add(send_pdu, context);
 }
 
+/*
+ * Fake peer for clients using more than one ATT bearer. The PDU list is read
+ * as request/response pairs which are matched regardless of their order, as
+ * the bearer a request goes out on isn't fixed. A request is held back until
+ * one on another bearer overtakes it, so that responses to concurrent
+ * requests arrive interleaved.
+ */
+struct peer {
+	guint source;
+	guint release;
+	int held_fd;
+	unsigned int held;
+	unsigned int overtaken;
+	bool *answered;
+};
+
+static void peer_free(struct peer *peer)
+{
+	if (!peer)
+		return;
+
+	if (peer->source > 0)
+		g_source_remove(peer->source);
+
+	if (peer->release > 0)
+		g_source_remove(peer->release);
+
+	g_free(peer->answered);
+	g_free(peer);
+}
+
+static void peer_respond(struct context *context, int fd, unsigned int i)
+{
+	const struct test_pdu *pdu = &context->data->pdu_list[i + 1];
+	ssize_t len;
+
+	len = write(fd, pdu->data, pdu->size);
+
+	util_hexdump('<', pdu->data, len, test_debug, "GATT: ");
+
+	g_assert_cmpint(len, ==, pdu->size);
+
+	/* Keeps context_quit from failing once every request is answered */
+	context->pdu_offset += 2;
+}
+
+static gboolean peer_release(gpointer user_data)
+{
+	struct context *context = user_data;
+	struct peer *peer = context->peer;
+
+	peer->release = 0;
+
+	peer_respond(context, peer->held_fd, peer->held);
+	peer->held_fd = -1;
+
+	return FALSE;
+}
+
+static gboolean peer_handler(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct context *context = user_data;
+	struct peer *peer = context->peer;
+	const struct test_pdu *pdu;
+	unsigned char buf[512];
+	unsigned int i;
+	ssize_t len;
+	int fd;
+
+	fd = g_io_channel_unix_get_fd(channel);
+
+	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		if (fd == context->fd)
+			context->source = 0;
+		else
+			peer->source = 0;
+		g_print("%s: cond %x\n", __func__, cond);
+		return FALSE;
+	}
+
+	len = read(fd, buf, sizeof(buf));
+
+	g_assert(len > 0);
+
+	util_hexdump('>', buf, len, test_debug, "GATT: ");
+
+	for (i = 0; context->data->pdu_list[i].valid; i += 2) {
+		pdu = &context->data->pdu_list[i];
+
+		if (!peer->answered[i / 2] && pdu->size == (size_t) len &&
+					!memcmp(buf, pdu->data, pdu->size))
+			break;
+	}
+
+	/* Not expected, or sent more often than expected */
+	g_assert(context->data->pdu_list[i].valid);
+
+	peer->answered[i / 2] = true;
+
+	if (peer->held_fd < 0) {
+		peer->held_fd = fd;
+		peer->held = i;
+		peer->release = g_idle_add(peer_release, context);
+		return TRUE;
+	}
+
+	/* At most one request is outstanding per bearer */
+	g_assert(peer->held_fd != fd);
+
+	peer_respond(context, fd, i);
+	peer->overtaken++;
+
+	g_source_remove(peer->release);
+	peer_release(context);
+
+	return TRUE;
+}
+
 static gboolean test_handler(GIOChannel *channel, GIOCondition cond,
 							gpointer user_data)
 {
@@ -426,6 +585,9 @@ static gboolean test_handler(GIOChannel *channel, GIOCondition cond,
 	ssize_t len;
 	int fd;
 
+	if (context->peer)
+		return peer_handler(channel, cond, user_data);
+
 	pdu = &context->data->pdu_list[context->pdu_offset++];
 
 	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
@@ -641,6 +803,7 @@ static struct context *create_context(uint16_t mtu, gconstpointer data)
 {
 	struct context *context = g_new0(struct context, 1);
 	const struct test_data *test_data = data;
+	const struct test_step *step;
 	GIOChannel *channel;
 	int err, sv[2];
 
@@ -668,7 +831,11 @@ static struct context *create_context(uint16_t mtu, gconstpointer data)
 						"bt_gatt_server:", NULL);
 		break;
 	case CLIENT:
-		context->client_db = gatt_db_new();
+		step = test_data->step;
+		if (step && step->client_db)
+			context->client_db = step->client_db();
+		else
+			context->client_db = gatt_db_new();
 		g_assert(context->client_db);
 
 		context->client = bt_gatt_client_new(context->client_db,
@@ -1335,6 +1502,48 @@ static struct gatt_db *make_service_data_1_db(void)
 		.len = strlen(string),					\
 	}
 
+#define DB_HASH_1 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,	\
+		0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10
+
+#define DB_HASH_2 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,	\
+		0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff, 0x00
+
+static const uint8_t db_hash_1[] = { DB_HASH_1 };
+
+static struct gatt_db *make_db_hash_db(void)
+{
+	const struct att_handle_spec specs[] = {
+		PRIMARY_SERVICE(0x0001, GATT_UUID, 3),
+		CHARACTERISTIC(0x2B2A, BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, DB_HASH_1),
+		PRIMARY_SERVICE(0x0004, HEART_RATE_UUID, 3),
+		CHARACTERISTIC_STR(GATT_CHARAC_MANUFACTURER_NAME_STRING,
+					BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, "BlueZ"),
+		{ }
+	};
+
+	return make_db(specs);
+}
+
+/* Cached copy of an older version of the above */
+static struct gatt_db *make_db_hash_stale_db(void)
+{
+	const struct att_handle_spec specs[] = {
+		PRIMARY_SERVICE(0x0001, GATT_UUID, 3),
+		CHARACTERISTIC(0x2B2A, BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, DB_HASH_2),
+		PRIMARY_SERVICE(0x0004, HEART_RATE_UUID, 3),
+		CHARACTERISTIC_STR(GATT_CHARAC_MANUFACTURER_NAME_STRING,
+					BT_ATT_PERM_READ,
+					BT_GATT_CHRC_PROP_READ, "BlueZ"),
+		PRIMARY_SERVICE(0x0007, BATTERY_UUID, 1),
+		{ }
+	};
+
+	return make_db(specs);
+}
+
 static struct gatt_db *make_service_data_2_db(void)
 {
 	const struct att_handle_spec specs[] = {
@@ -1765,6 +1974,68 @@ static void test_client(gconstpointer data)
 	create_context(512, data);
 }
 
+static void peer_ready_cb(bool success, uint8_t att_ecode, void *user_data)
+{
+	struct context *context = user_data;
+	const struct test_step *step = context->data->step;
+
+	/* Otherwise the requests were never outstanding concurrently */
+	g_assert(context->peer->overtaken > 0);
+
+	if (!step || !step->expected_att_ecode) {
+		client_ready_cb(success, att_ecode, user_data);
+		return;
+	}
+
+	g_assert(!success);
+	g_assert_cmpint(att_ecode, ==, step->expected_att_ecode);
+
+	context_quit(context);
+}
+
+static void test_client_bearers(gconstpointer data)
+{
+	struct context *context = create_context(512, data);
+	const struct test_pdu *pdu;
+	struct peer *peer;
+	GIOChannel *channel;
+	unsigned int count = 0;
+	int err, sv[2];
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+	g_assert(err == 0);
+
+	g_assert(bt_att_attach_fd(context->att, sv[0]) == 0);
+	g_assert_cmpint(bt_att_get_channels(context->att), ==, 2);
+
+	for (pdu = context->data->pdu_list; pdu->valid; pdu++)
+		count++;
+
+	g_assert(count % 2 == 0);
+
+	peer = g_new0(struct peer, 1);
+	peer->held_fd = -1;
+	peer->answered = g_new0(bool, count / 2);
+
+	channel = g_io_channel_unix_new(sv[1]);
+
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	peer->source = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				test_handler, context);
+	g_assert(peer->source > 0);
+
+	g_io_channel_unref(channel);
+
+	context->peer = peer;
+
+	bt_gatt_client_set_ready_handler(context->client, peer_ready_cb,
+								context, NULL);
+}
+
 static void test_server(gconstpointer data)
 {
 	struct context *context = create_context(512, data);
@@ -1778,6 +2049,49 @@ static void test_server(gconstpointer data)
 	util_hexdump('<', pdu.data, len, test_debug, "GATT: ");
 }
 
+static void test_server_prep_queue_size(gconstpointer data)
+{
+	struct context *context = create_context(512, data);
+	ssize_t len;
+	const struct test_pdu pdu = SERVER_MTU_EXCHANGE_PDU;
+
+	g_assert(bt_gatt_server_set_prep_queue_size(context->server, 8));
+
+	len = write(context->fd, pdu.data, pdu.size);
+
+	g_assert_cmpint(len, ==, pdu.size);
+
+	util_hexdump('<', pdu.data, len, test_debug, "GATT: ");
+}
+
+static unsigned int discovery_cache_hits;
+
+static void count_cache_hits(const char *str, void *user_data)
+{
+	if (g_str_has_prefix(str, "Using cached response"))
+		discovery_cache_hits++;
+
+	print_debug(str, user_data);
+}
+
+static void test_server_cache(gconstpointer data)
+{
+	struct context *context = create_context(512, data);
+	ssize_t len;
+	const struct test_pdu pdu = SERVER_MTU_EXCHANGE_PDU;
+
+	discovery_cache_hits = 0;
+
+	bt_gatt_server_set_debug(context->server, count_cache_hits,
+						"bt_gatt_server:", NULL);
+
+	len = write(context->fd, pdu.data, pdu.size);
+
+	g_assert_cmpint(len, ==, pdu.size);
+
+	util_hexdump('<', pdu.data, len, test_debug, "GATT: ");
+}
+
 static void test_search_primary(gconstpointer data)
 {
 	struct context *context = create_context(512, data);
@@ -2195,10 +2509,163 @@ static const struct test_step test_indication_server_1 = {
 	.length = 0x03,
 };
 
+static void db_hash_read_cb(struct gatt_db_attribute *attrib, int err,
+					const uint8_t *value, size_t length,
+					void *user_data)
+{
+	g_assert(!err);
+	g_assert_cmpint(length, ==, sizeof(db_hash_1));
+	g_assert(memcmp(value, db_hash_1, length) == 0);
+}
+
+/* The client database must hold the hash of the peer once ready */
+static void test_client_db_hash(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_get_attribute(context->client_db, 0x0003);
+	g_assert(attr);
+
+	gatt_db_attribute_read(attr, 0, 0, NULL, db_hash_read_cb, NULL);
+
+	context_quit(context);
+}
+
+static const struct test_step test_db_hash_cached = {
+	.func = test_client_db_hash,
+	.client_db = make_db_hash_db,
+};
+
+static const struct test_step test_db_hash_stale = {
+	.func = test_client_db_hash,
+	.client_db = make_db_hash_stale_db,
+};
+
+static const struct test_step test_bearers_error = {
+	.expected_att_ecode = 0x0e,
+};
+
+static void test_server_cache_check(struct context *context)
+{
+	const struct test_step *step = context->data->step;
+
+	g_assert_cmpint(discovery_cache_hits, ==, step->cache_hits);
+}
+
+/*
+ * Replaces the bearer with a new one to the same database, the previous
+ * server is kept so that the discovery cache is too.
+ */
+static void test_server_cache_reconnect(struct context *context)
+{
+	GIOChannel *channel;
+	int err, sv[2];
+
+	err = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+	g_assert(err == 0);
+
+	g_source_remove(context->source);
+	bt_att_unref(context->att);
+	context->prev_server = context->server;
+
+	context->att = bt_att_new(sv[0]);
+	g_assert(context->att);
+
+	context->server = bt_gatt_server_new(context->server_db,
+							context->att, 512);
+	g_assert(context->server);
+
+	bt_gatt_server_set_debug(context->server, count_cache_hits,
+						"bt_gatt_server:", NULL);
+
+	channel = g_io_channel_unix_new(sv[1]);
+
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_set_encoding(channel, NULL, NULL);
+	g_io_channel_set_buffered(channel, FALSE);
+
+	context->source = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				test_handler, context);
+	g_assert(context->source > 0);
+
+	g_io_channel_unref(channel);
+
+	context->fd = sv[1];
+
+	context_process(context);
+}
+
+static void test_server_cache_add(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, 0x180f);
+	attr = gatt_db_insert_service(context->server_db, 0x0100, &uuid,
+								true, 1);
+	g_assert(attr);
+	g_assert(gatt_db_service_set_active(attr, true));
+
+	context_process(context);
+}
+
+static void test_server_cache_remove(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_get_attribute(context->server_db, 0xf010);
+	g_assert(attr);
+	g_assert(gatt_db_remove_service(context->server_db, attr));
+
+	context_process(context);
+}
+
+static void test_server_cache_deactivate(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_get_attribute(context->server_db, 0xf010);
+	g_assert(attr);
+	g_assert(gatt_db_service_set_active(attr, false));
+
+	context_process(context);
+}
+
+static const struct test_step test_cache_hit = {
+	.post_func = test_server_cache_check,
+	.cache_hits = 2,
+};
+
+static const struct test_step test_cache_reconnect = {
+	.func = test_server_cache_reconnect,
+	.post_func = test_server_cache_check,
+	.cache_hits = 2,
+};
+
+static const struct test_step test_cache_add = {
+	.func = test_server_cache_add,
+	.post_func = test_server_cache_check,
+	.cache_hits = 0,
+};
+
+static const struct test_step test_cache_remove = {
+	.func = test_server_cache_remove,
+	.post_func = test_server_cache_check,
+	.cache_hits = 0,
+};
+
+static const struct test_step test_cache_deactivate = {
+	.func = test_server_cache_deactivate,
+	.post_func = test_server_cache_check,
+	.cache_hits = 0,
+};
+
 int main(int argc, char *argv[])
 {
 	struct gatt_db *service_db_1, *service_db_2, *service_db_3;
 	struct gatt_db *ts_small_db, *ts_large_db_1;
+	struct gatt_db *db_hash_db;
 
 	tester_init(&argc, &argv);
 
@@ -2207,6 +2674,7 @@ int main(int argc, char *argv[])
 	service_db_3 = make_service_data_3_db();
 	ts_small_db = make_test_spec_small_db();
 	ts_large_db_1 = make_test_spec_large_db_1();
+	db_hash_db = make_db_hash_db();
 
 	/*
 	 * Server Configuration
@@ -3072,6 +3540,7 @@ int main(int argc, char *argv[])
 	define_test_client("/TP/GAN/CL/BV-01-C", test_client, ts_small_db,
 			&test_notification_1,
 			MTU_EXCHANGE_CLIENT_PDUS,
+			DB_HASH_CLIENT_PDUS,
 			SMALL_DB_DISCOVERY_PDUS,
 			raw_pdu(0x12, 0x04, 0x00, 0x03, 0x00),
 			raw_pdu(0x13),
@@ -3098,6 +3567,7 @@ int main(int argc, char *argv[])
 	define_test_client("/TP/GAI/CL/BV-01-C", test_client, ts_small_db,
 			&test_indication_1,
 			MTU_EXCHANGE_CLIENT_PDUS,
+			DB_HASH_CLIENT_PDUS,
 			SMALL_DB_DISCOVERY_PDUS,
 			raw_pdu(0x12, 0x04, 0x00, 0x03, 0x00),
 			raw_pdu(0x13),
@@ -3700,6 +4170,261 @@ int main(int argc, char *argv[])
 			raw_pdu(0x18, 0x01),
 			raw_pdu(0x19));
 
+	/* A cached database with the same hash is used as is */
+	define_test_client("/gatt/client/db-hash/match", test_client,
+			db_hash_db, &test_db_hash_cached,
+			MTU_EXCHANGE_CLIENT_PDUS,
+			raw_pdu(0x08, 0x01, 0x00, 0xff, 0xff, 0x2a, 0x2b),
+			raw_pdu(0x09, 0x12, 0x03, 0x00, DB_HASH_1));
+
+	/* Otherwise it is dropped and the peer is discovered again */
+	define_test_client("/gatt/client/db-hash/mismatch", test_client,
+			db_hash_db, &test_db_hash_stale,
+			MTU_EXCHANGE_CLIENT_PDUS,
+			raw_pdu(0x08, 0x01, 0x00, 0xff, 0xff, 0x2a, 0x2b),
+			raw_pdu(0x09, 0x12, 0x03, 0x00, DB_HASH_1),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x01, 0x00, 0x03, 0x00, 0x01, 0x18,
+				0x04, 0x00, 0x06, 0x00, 0x0d, 0x18),
+			raw_pdu(0x10, 0x07, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x01, 0x10, 0x07, 0x00, 0x0a),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x01, 0x28),
+			raw_pdu(0x01, 0x10, 0x01, 0x00, 0x0a),
+			raw_pdu(0x08, 0x01, 0x00, 0x03, 0x00, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x01, 0x00, 0x0a),
+			raw_pdu(0x08, 0x04, 0x00, 0x06, 0x00, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x04, 0x00, 0x0a),
+			raw_pdu(0x08, 0x01, 0x00, 0x03, 0x00, 0x03, 0x28),
+			raw_pdu(0x09, 0x07, 0x02, 0x00, 0x02, 0x03, 0x00, 0x2a,
+				0x2b),
+			raw_pdu(0x08, 0x03, 0x00, 0x03, 0x00, 0x03, 0x28),
+			raw_pdu(0x01, 0x08, 0x03, 0x00, 0x0a),
+			raw_pdu(0x08, 0x04, 0x00, 0x06, 0x00, 0x03, 0x28),
+			raw_pdu(0x09, 0x07, 0x05, 0x00, 0x02, 0x06, 0x00, 0x29,
+				0x2a),
+			raw_pdu(0x08, 0x06, 0x00, 0x06, 0x00, 0x03, 0x28),
+			raw_pdu(0x01, 0x08, 0x06, 0x00, 0x0a));
+
+	/*
+	 * Two ATT bearers: the include, characteristic and descriptor requests
+	 * of different services are outstanding at the same time and their
+	 * responses come back interleaved.
+	 */
+	define_test_client("/gatt/client/bearers/discovery", test_client_bearers,
+			service_db_1, NULL,
+			SERVICE_DATA_1_PDUS);
+
+	define_test_client("/gatt/client/bearers/discovery-included",
+			test_client_bearers, ts_small_db, NULL,
+			MTU_EXCHANGE_CLIENT_PDUS,
+			DB_HASH_CLIENT_PDUS,
+			SMALL_DB_DISCOVERY_PDUS);
+
+	/*
+	 * An error on one of them fails the discovery once the other request
+	 * completes, and no further requests are sent.
+	 */
+	define_test_client("/gatt/client/bearers/discovery-error",
+			test_client_bearers, service_db_1,
+			&test_bearers_error,
+			MTU_EXCHANGE_CLIENT_PDUS,
+			DB_HASH_CLIENT_PDUS,
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x01, 0x00, 0x04, 0x00, 0x01, 0x18,
+				0x05, 0x00, 0x08, 0x00, 0x0d, 0x18),
+			raw_pdu(0x10, 0x09, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x01, 0x10, 0x09, 0x00, 0x0a),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x01, 0x28),
+			raw_pdu(0x01, 0x10, 0x01, 0x00, 0x0a),
+			raw_pdu(0x08, 0x01, 0x00, 0x04, 0x00, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x01, 0x00, 0x0a),
+			raw_pdu(0x08, 0x05, 0x00, 0x08, 0x00, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x05, 0x00, 0x0a),
+			raw_pdu(0x08, 0x01, 0x00, 0x04, 0x00, 0x03, 0x28),
+			raw_pdu(0x09, 0x07, 0x02, 0x00, 0x02, 0x03, 0x00, 0x00,
+				0x2a),
+			raw_pdu(0x08, 0x03, 0x00, 0x04, 0x00, 0x03, 0x28),
+			raw_pdu(0x01, 0x08, 0x03, 0x00, 0x0a),
+			raw_pdu(0x08, 0x05, 0x00, 0x08, 0x00, 0x03, 0x28),
+			raw_pdu(0x01, 0x08, 0x05, 0x00, 0x0e));
+
+	define_test_client("/gatt/client/bearers/discovery-included-error",
+			test_client_bearers, ts_small_db,
+			&test_bearers_error,
+			MTU_EXCHANGE_CLIENT_PDUS,
+			DB_HASH_CLIENT_PDUS,
+			PRIMARY_DISC_SMALL_DB,
+			SECONDARY_DISC_SMALL_DB,
+			raw_pdu(0x08, 0x10, 0xf0, 0x17, 0xf0, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x10, 0xf0, 0x0e),
+			raw_pdu(0x08, 0x01, 0x00, 0x10, 0x00, 0x02, 0x28),
+			raw_pdu(0x01, 0x08, 0x01, 0x00, 0x0a));
+
+	define_test_server("/gatt/server/discovery-cache/hit",
+			test_server_cache, ts_small_db, &test_cache_hit,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18,
+				0xff, 0xff, 0xff, 0xff, 0x0a, 0x18),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18,
+				0xff, 0xff, 0xff, 0xff, 0x0a, 0x18),
+			raw_pdu(0x08, 0x01, 0x00, 0xff, 0xff, 0x03, 0x28),
+			raw_pdu(0x09, 0x07, 0x02, 0x00, 0x32, 0x03, 0x00, 0x29,
+				0x2a, 0x12, 0xf0, 0x02, 0x13, 0xf0, 0x00, 0x2a),
+			raw_pdu(0x08, 0x01, 0x00, 0xff, 0xff, 0x03, 0x28),
+			raw_pdu(0x09, 0x07, 0x02, 0x00, 0x32, 0x03, 0x00, 0x29,
+				0x2a, 0x12, 0xf0, 0x02, 0x13, 0xf0, 0x00, 0x2a));
+
+	define_test_server("/gatt/server/discovery-cache/reconnect",
+			test_server_cache, ts_large_db_1,
+			&test_cache_reconnect,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0x00, 0x13, 0x00, 0x01, 0x18,
+				0x20, 0x00, 0x29, 0x00, 0x0a, 0xa0, 0x30, 0x00,
+				0x32, 0x00, 0x0b, 0xa0),
+			raw_pdu(),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0x00, 0x13, 0x00, 0x01, 0x18,
+				0x20, 0x00, 0x29, 0x00, 0x0a, 0xa0, 0x30, 0x00,
+				0x32, 0x00, 0x0b, 0xa0),
+			raw_pdu(0x02, 0x00, 0x02),
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0x00, 0x13, 0x00, 0x01, 0x18,
+				0x20, 0x00, 0x29, 0x00, 0x0a, 0xa0, 0x30, 0x00,
+				0x32, 0x00, 0x0b, 0xa0, 0x40, 0x00, 0x46, 0x00,
+				0x00, 0x18, 0x50, 0x00, 0x52, 0x00, 0x0b, 0xa0,
+				0x60, 0x00, 0x6b, 0x00, 0x0b, 0xa0, 0x70, 0x00,
+				0x76, 0x00, 0x0b, 0xa0, 0x80, 0x00, 0x85, 0x00,
+				0x0b, 0xa0),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0x00, 0x13, 0x00, 0x01, 0x18,
+				0x20, 0x00, 0x29, 0x00, 0x0a, 0xa0, 0x30, 0x00,
+				0x32, 0x00, 0x0b, 0xa0, 0x40, 0x00, 0x46, 0x00,
+				0x00, 0x18, 0x50, 0x00, 0x52, 0x00, 0x0b, 0xa0,
+				0x60, 0x00, 0x6b, 0x00, 0x0b, 0xa0, 0x70, 0x00,
+				0x76, 0x00, 0x0b, 0xa0, 0x80, 0x00, 0x85, 0x00,
+				0x0b, 0xa0));
+
+	/* These change the database, so each gets its own */
+	define_test_server("/gatt/server/discovery-cache/add",
+			test_server_cache, make_test_spec_small_db(),
+			&test_cache_add,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18,
+				0xff, 0xff, 0xff, 0xff, 0x0a, 0x18),
+			raw_pdu(),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x00, 0x01, 0x00, 0x01, 0x0f, 0x18,
+				0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18, 0xff, 0xff,
+				0xff, 0xff, 0x0a, 0x18));
+
+	define_test_server("/gatt/server/discovery-cache/remove",
+			test_server_cache, make_test_spec_small_db(),
+			&test_cache_remove,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18,
+				0xff, 0xff, 0xff, 0xff, 0x0a, 0x18),
+			raw_pdu(),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0xff, 0xff, 0xff, 0xff, 0x0a, 0x18));
+
+	define_test_server("/gatt/server/discovery-cache/deactivate",
+			test_server_cache, make_test_spec_small_db(),
+			&test_cache_deactivate,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x17, 0xf0, 0x00, 0x18,
+				0xff, 0xff, 0xff, 0xff, 0x0a, 0x18),
+			raw_pdu(),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0xff, 0xff, 0xff, 0xff, 0x0a, 0x18));
+
+	/* These execute their writes, so each gets its own database */
+	define_test_server("/gatt/server/prep-write/queue-full",
+			test_server_prep_queue_size,
+			make_test_spec_small_db(), NULL,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x16, 0x03, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03,
+				0x04, 0x05),
+			raw_pdu(0x17, 0x03, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03,
+				0x04, 0x05),
+			raw_pdu(0x16, 0x03, 0x00, 0x05, 0x00, 0x06, 0x07, 0x08,
+				0x09),
+			raw_pdu(0x01, 0x16, 0x03, 0x00, 0x09),
+			raw_pdu(0x18, 0x01),
+			raw_pdu(0x19),
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03, 0x04, 0x05));
+
+	/*
+	 * More adjacent fragments than the queue has entries for: they are
+	 * merged into one entry, and executed as a single write.
+	 */
+	define_test_server("/gatt/server/prep-write/merge", test_server,
+			make_test_spec_small_db(), NULL,
+			raw_pdu(0x03, 0x00, 0x02),
+			PREP_WRITE_FRAGMENT_PDUS(0x00),
+			PREP_WRITE_FRAGMENT_PDUS(0x01),
+			PREP_WRITE_FRAGMENT_PDUS(0x02),
+			PREP_WRITE_FRAGMENT_PDUS(0x03),
+			PREP_WRITE_FRAGMENT_PDUS(0x04),
+			PREP_WRITE_FRAGMENT_PDUS(0x05),
+			PREP_WRITE_FRAGMENT_PDUS(0x06),
+			PREP_WRITE_FRAGMENT_PDUS(0x07),
+			PREP_WRITE_FRAGMENT_PDUS(0x08),
+			PREP_WRITE_FRAGMENT_PDUS(0x09),
+			PREP_WRITE_FRAGMENT_PDUS(0x0a),
+			PREP_WRITE_FRAGMENT_PDUS(0x0b),
+			PREP_WRITE_FRAGMENT_PDUS(0x0c),
+			PREP_WRITE_FRAGMENT_PDUS(0x0d),
+			PREP_WRITE_FRAGMENT_PDUS(0x0e),
+			PREP_WRITE_FRAGMENT_PDUS(0x0f),
+			PREP_WRITE_FRAGMENT_PDUS(0x10),
+			PREP_WRITE_FRAGMENT_PDUS(0x11),
+			PREP_WRITE_FRAGMENT_PDUS(0x12),
+			PREP_WRITE_FRAGMENT_PDUS(0x13),
+			PREP_WRITE_FRAGMENT_PDUS(0x14),
+			PREP_WRITE_FRAGMENT_PDUS(0x15),
+			PREP_WRITE_FRAGMENT_PDUS(0x16),
+			PREP_WRITE_FRAGMENT_PDUS(0x17),
+			PREP_WRITE_FRAGMENT_PDUS(0x18),
+			PREP_WRITE_FRAGMENT_PDUS(0x19),
+			PREP_WRITE_FRAGMENT_PDUS(0x1a),
+			PREP_WRITE_FRAGMENT_PDUS(0x1b),
+			PREP_WRITE_FRAGMENT_PDUS(0x1c),
+			PREP_WRITE_FRAGMENT_PDUS(0x1d),
+			PREP_WRITE_FRAGMENT_PDUS(0x1e),
+			PREP_WRITE_FRAGMENT_PDUS(0x1f),
+			raw_pdu(0x18, 0x01),
+			raw_pdu(0x19),
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+				0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+				0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15),
+			raw_pdu(0x0c, 0x03, 0x00, 0x16, 0x00),
+			raw_pdu(0x0d, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c,
+				0x1d, 0x1e, 0x1f));
+
+	/* Fragments of another handle or offset start a new entry */
+	define_test_server("/gatt/server/prep-write/no-merge", test_server,
+			make_test_spec_small_db(), NULL,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x16, 0x03, 0x00, 0x00, 0x00, 0x01, 0x02),
+			raw_pdu(0x17, 0x03, 0x00, 0x00, 0x00, 0x01, 0x02),
+			raw_pdu(0x16, 0x03, 0x00, 0x03, 0x00, 0x04),
+			raw_pdu(0x17, 0x03, 0x00, 0x03, 0x00, 0x04),
+			raw_pdu(0x16, 0x03, 0x00, 0x02, 0x00, 0x03),
+			raw_pdu(0x17, 0x03, 0x00, 0x02, 0x00, 0x03),
+			raw_pdu(0x18, 0x01),
+			raw_pdu(0x19),
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03, 0x04, 0x5a));
+
 	define_test_server("/TP/GAW/SR/BI-07-C/small", test_server,
 			ts_small_db, NULL,
 			raw_pdu(0x03, 0x00, 0x02),
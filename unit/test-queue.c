@@ -250,6 +250,100 @@ static void test_remove_all(void)
 	queue_destroy(queue, NULL);
 }
 
+static void test_entry_reuse(void)
+{
+	const struct queue_entry *entries[256];
+	const struct queue_entry *entry;
+	gpointer blocks[256];
+	struct queue *queue;
+	unsigned int n, i, j;
+
+	queue = queue_new();
+	g_assert(queue != NULL);
+
+	for (i = 0; i < 256; i++) {
+		g_assert(queue_push_head(queue, UINT_TO_PTR(i + 1)));
+		entries[i] = queue_get_entries(queue);
+	}
+
+	for (n = 0; n < 4; n++) {
+		for (i = 0; i < 256; i++)
+			g_assert(queue_pop_head(queue) != NULL);
+
+		g_assert(queue_isempty(queue));
+
+		/*
+		 * Released entries stay with the queue code, so allocations of
+		 * the same size can't get them
+		 */
+		for (i = 0; i < 256; i++)
+			blocks[i] = g_malloc(sizeof(struct queue_entry));
+
+		/* Every new entry must come from the ones just released */
+		for (i = 0; i < 256; i++) {
+			g_assert(queue_push_head(queue, UINT_TO_PTR(i + 1)));
+			entry = queue_get_entries(queue);
+
+			for (j = 0; j < 256; j++)
+				if (entries[j] == entry)
+					break;
+
+			g_assert(j < 256);
+		}
+
+		for (i = 0; i < 256; i++)
+			g_free(blocks[i]);
+	}
+
+	queue_destroy(queue, NULL);
+}
+
+struct list_item {
+	unsigned int value;
+	struct queue_link link;
+};
+
+static void test_list(void)
+{
+	struct queue_list list;
+	struct list_item items[4];
+	struct queue_link *link;
+	unsigned int i;
+
+	queue_list_init(&list);
+	g_assert(queue_list_isempty(&list));
+	g_assert(queue_list_pop_head(&list) == NULL);
+
+	for (i = 0; i < 4; i++) {
+		items[i].value = i;
+		queue_list_push_tail(&list, &items[i].link);
+	}
+
+	g_assert(queue_list_length(&list) == 4);
+
+	g_assert(queue_list_remove(&list, &items[3].link));
+	g_assert(!queue_list_remove(&list, &items[3].link));
+	g_assert(list.tail == &items[2].link);
+
+	queue_list_push_head(&list, &items[3].link);
+
+	link = queue_list_peek_head(&list);
+	g_assert(queue_link_data(link, struct list_item, link) == &items[3]);
+
+	for (i = 0; i < 4; i++) {
+		struct list_item *item;
+
+		link = queue_list_pop_head(&list);
+		g_assert(link != NULL);
+
+		item = queue_link_data(link, struct list_item, link);
+		g_assert(item->value == (i + 3) % 4);
+	}
+
+	g_assert(queue_list_isempty(&list));
+	g_assert(list.tail == NULL);
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -263,6 +357,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/queue/destroy_remove", test_destroy_remove);
 	g_test_add_func("/queue/push_after", test_push_after);
 	g_test_add_func("/queue/remove_all", test_remove_all);
+	g_test_add_func("/queue/entry_reuse", test_entry_reuse);
+	g_test_add_func("/queue/list", test_list);
 
 	return g_test_run();
 }